@@ -1,16 +1,15 @@
 #include "agent-loop.h"
 #include "console.h"
+#include "agent-turn.h"
+#include "tool-executor.h"
 #include "mtmd.h"
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
-#include <mutex>
+#include <memory>
 #include <sstream>
 
-// Protect the shared prompt-formatting + task-posting path without serializing
-// the full generation loop.
-static std::mutex g_completion_mutex;
-
 #if defined(_WIN32)
 #include <conio.h>
 #else
@@ -49,8 +48,11 @@ static bool check_escape_key() {
 agent_loop::agent_loop(server_context &server_ctx, const common_params &params,
                        const agent_config &config,
                        std::atomic<bool> &is_interrupted)
-    : server_ctx_(server_ctx), params_(&params), config_(config),
-      is_interrupted_(is_interrupted), messages_(json::array()) {
+    : server_ctx_(server_ctx),
+      backend_(config.backend ? config.backend
+                              : std::make_shared<server_completion_backend>(
+                                    server_ctx)),
+      params_(&params), config_(config), is_interrupted_(is_interrupted) {
   // Initialize task defaults from params
   task_defaults_.sampling = params.sampling;
   task_defaults_.speculative = params.speculative;
@@ -63,6 +65,9 @@ agent_loop::agent_loop(server_context &server_ctx, const common_params &params,
       COMMON_REASONING_FORMAT_DEEPSEEK;
   task_defaults_.chat_parser_params.parse_tool_calls = true;
 
+  lookup_ = prompt_lookup_index(config.prompt_lookup_ngram,
+                                config.prompt_lookup_max_tokens);
+
   // Initialize tool context
   tool_ctx_.working_dir = config.working_dir.empty() ? "." : config.working_dir;
   tool_ctx_.is_interrupted = &is_interrupted_;
@@ -247,7 +252,7 @@ If a skill has `<allowed_tools>`, it declares which tools it needs. This helps y
     system_prompt += config.skills_prompt_section;
   }
 
-  messages_.push_back({{"role", "system"}, {"content", system_prompt}});
+  messages_.push_text("system", std::move(system_prompt));
 }
 
 // Constructor for subagents with filtered tools and custom system prompt
@@ -258,8 +263,11 @@ agent_loop::agent_loop(server_context &server_ctx, const common_params &params,
                        const std::vector<std::string> &bash_patterns,
                        const std::string &custom_system_prompt,
                        int subagent_depth, tool_call_callback on_tool_call)
-    : server_ctx_(server_ctx), params_(&params), config_(config),
-      is_interrupted_(is_interrupted), messages_(json::array()),
+    : server_ctx_(server_ctx),
+      backend_(config.backend ? config.backend
+                              : std::make_shared<server_completion_backend>(
+                                    server_ctx)),
+      params_(&params), config_(config), is_interrupted_(is_interrupted),
       allowed_tools_(allowed_tools), bash_patterns_(bash_patterns.begin(), bash_patterns.end()),
       on_tool_call_(on_tool_call), is_subagent_(true) {
   // Initialize task defaults from params
@@ -274,6 +282,9 @@ agent_loop::agent_loop(server_context &server_ctx, const common_params &params,
       COMMON_REASONING_FORMAT_DEEPSEEK;
   task_defaults_.chat_parser_params.parse_tool_calls = true;
 
+  lookup_ = prompt_lookup_index(config.prompt_lookup_ngram,
+                                config.prompt_lookup_max_tokens);
+
   // Initialize tool context
   tool_ctx_.working_dir = config.working_dir.empty() ? "." : config.working_dir;
   tool_ctx_.is_interrupted = &is_interrupted_;
@@ -292,78 +303,424 @@ agent_loop::agent_loop(server_context &server_ctx, const common_params &params,
   permission_mgr_.set_yolo_mode(config.yolo_mode);
 
   // Use custom system prompt provided by caller
-  messages_.push_back({{"role", "system"}, {"content", custom_system_prompt}});
+  messages_.push_text("system", custom_system_prompt);
+}
+
+agent_loop::~agent_loop() {
+  // Early tool jobs reference this loop
+  drop_early_tool_calls();
 }
 
 void agent_loop::clear() {
   // Keep system prompt, clear rest
   if (messages_.size() > 1) {
-    json system_msg = messages_[0];
-    messages_ = json::array();
-    messages_.push_back(system_msg);
+    message_store kept;
+    kept.append_from(messages_, 0);
+    messages_ = std::move(kept);
   }
+  prompt_.reset();
+  lookup_.clear();
+  lookup_synced_ = 0;
+  context_.reset();
+  history_version_++;
   permission_mgr_.clear_session();
 
   // Reset stats when conversation is cleared
   stats_ = session_stats{};
 }
 
-common_chat_params agent_loop::format_chat_with_tools(
-    const std::vector<common_chat_tool> &chat_tools) {
-  auto meta = server_ctx_.get_meta();
-  auto &chat_params = meta.chat_params;
+void agent_loop::restore(const json &messages, const session_stats &stats) {
+  drop_early_tool_calls();
+  messages_.assign(messages);
+  prompt_.reset();
+  lookup_.clear();
+  lookup_synced_ = 0;
+  context_.reset();
+  history_version_++;
+  stats_ = stats;
+}
+
+prompt_render_options
+agent_loop::render_options(const server_chat_params &chat_params) const {
+  prompt_render_options opts;
+  opts.tmpls = chat_params.tmpls.get();
+  opts.use_jinja = chat_params.use_jinja;
+  opts.reasoning_format = chat_params.reasoning_format;
+  opts.enable_thinking = chat_params.enable_thinking;
+  opts.chat_template_kwargs = chat_params.chat_template_kwargs;
+  opts.parallel_tool_calls = config_.parallel_tool_calls;
+  return opts;
+}
+
+incremental_prompt_result agent_loop::format_chat_with_tools(
+    const tool_schema_snapshot_ptr &tools) {
+  return prompt_.build(messages_, tools,
+                       render_options(backend_->chat_params()),
+                       backend_->llama_ctx());
+}
+
+const llama_tokens &agent_loop::prompt_prefix_tokens() {
+  auto &registry = tool_registry::instance();
+  if (!tools_ || tools_->version != registry.version()) {
+    tools_ = registry.snapshot(allowed_tools_);
+  }
+  if (prefix_tools_version_ == tools_->version && !prefix_tokens_.empty()) {
+    return prefix_tokens_;
+  }
+  prefix_tokens_.clear();
+  prefix_tools_version_ = tools_->version;
+  if (messages_.empty() || messages_.role(0) != "system") {
+    return prefix_tokens_;
+  }
+
+  // The system prompt and an empty user turn: shares every token with the
+  // first real prompt up to the user's text
+  message_store probe;
+  probe.append_from(messages_, 0);
+  probe.push_text("user", "");
+  incremental_prompt builder;
+  try {
+    prefix_tokens_ = builder
+                         .build(probe, tools_,
+                                render_options(backend_->chat_params()),
+                                backend_->llama_ctx())
+                         .tokens;
+  } catch (const std::exception &) {
+    prefix_tokens_.clear();
+  }
+  return prefix_tokens_;
+}
+
+server_task agent_loop::build_completion_task() {
+  server_task task = server_task(SERVER_TASK_TYPE_COMPLETION);
+  task.index = 0;
+  task.params = task_defaults_;
+
+  // Subagents use filtered tools, main agent uses all tools. The snapshot
+  // (and the tool section rendered from it) is reused until a tool is
+  // registered or removed.
+  auto &registry = tool_registry::instance();
+  if (!tools_ || tools_->version != registry.version()) {
+    tools_ = registry.snapshot(allowed_tools_);
+  }
+
+  trace_span render_span("render", "prompt");
+  auto built = format_chat_with_tools(tools_);
+  auto &chat_params = built.chat_params;
+
+  if (!built.tokens.empty() && media_files_.empty()) {
+    // Already tokenized incrementally, skip server-side tokenization
+    task.cli = false;
+    task.tokens = server_tokens(built.tokens, false);
+  } else {
+    task.cli = true;
+    task.cli_prompt = std::move(chat_params.prompt);
+    task.cli_files = media_files_; // Pass media files for multimodal support
+  }
+
+  task.params.chat_parser_params = common_chat_parser_params(chat_params);
+  task.params.chat_parser_params.reasoning_format =
+      COMMON_REASONING_FORMAT_DEEPSEEK;
+  task.params.chat_parser_params.parse_tool_calls = !tools_->chat_tools.empty();
+  if (!chat_params.parser.empty()) {
+    task.params.chat_parser_params.parser.load(chat_params.parser);
+  }
+
+  return task;
+}
+
+slot_pool::lease agent_loop::acquire_slot() {
+  stats_.completions++;
+  if (!config_.slots) {
+    return slot_pool::lease();
+  }
+  // Another session may have used the preferred slot since; getting the
+  // same id back then still means the KV no longer holds this history
+  bool held = preferred_slot_ >= 0 &&
+              config_.slots->holds(preferred_slot_, slot_epoch_);
+  slot_pool::lease slot = config_.slots->acquire(preferred_slot_);
+  bool moved = !held || slot.id() != preferred_slot_;
+  if (slot.id() < 0 || (preferred_slot_ >= 0 && moved)) {
+    stats_.slot_switches++;
+  }
+  if (slot.id() < 0) {
+    return slot;
+  }
+
+  // A slot that does not hold this loop's history (first completion, the
+  // preferred slot was busy or reused) at least gets the shared prompt
+  // prefix
+  adopt_slot(slot);
+  if (config_.prefix_cache) {
+    const llama_tokens &prefix = prompt_prefix_tokens();
+    if (!prefix.empty()) {
+      if (moved) {
+        config_.prefix_cache->seed(prefix, slot.id());
+      }
+      config_.slots->set_prefix(slot.id(), kv_prefix_cache::key(prefix));
+    }
+  }
+  return slot;
+}
+
+bool agent_loop::preload_prompt_prefix() {
+  if (!config_.slots || !config_.prefix_cache) {
+    return false;
+  }
+  const llama_tokens &prefix = prompt_prefix_tokens();
+  if (prefix.empty()) {
+    return false;
+  }
+  slot_pool::lease slot = config_.slots->acquire(preferred_slot_);
+  if (slot.id() < 0) {
+    return false;
+  }
+  adopt_slot(slot);
+  return config_.prefix_cache->seed(prefix, slot.id());
+}
+
+void agent_loop::adopt_slot(const slot_pool::lease &lease) {
+  preferred_slot_ = lease.id();
+  slot_epoch_ = lease.epoch();
+}
+
+void agent_loop::compact_context_if_needed() {
+  if (config_.compact_high_water <= 0.0f) {
+    return;
+  }
+  llama_context *lctx = backend_->llama_ctx();
+  if (!lctx) {
+    return;
+  }
+  const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(lctx));
+
+  // Each slot gets an equal share of the context unless the KV is unified
+  int32_t n_ctx_slot = static_cast<int32_t>(llama_n_ctx(lctx));
+  if (params_ && params_->n_parallel > 1 && !params_->kv_unified) {
+    n_ctx_slot /= params_->n_parallel;
+  }
+
+  context_.sync(messages_, vocab);
+  const int32_t n_tools = prompt_.tool_section_tokens();
+  if (context_.total() + n_tools < config_.compact_high_water * n_ctx_slot) {
+    return;
+  }
+
+  size_t keep_from =
+      context_manager::recent_start(messages_, config_.compact_keep_recent);
+  if (keep_from <= 1) {
+    return; // Nothing old enough to compact
+  }
+
+  const int32_t n_before = context_.total();
+  const int32_t n_target =
+      static_cast<int32_t>(config_.compact_target * n_ctx_slot);
+
+  // Keep the untouched history for the summarizer (large tool outputs are
+  // shared, not copied)
+  message_store old_messages;
+  for (size_t i = 0; i < keep_from; i++) {
+    old_messages.append_from(messages_, i);
+  }
+
+  // 1. Stale tool outputs are the cheapest thing to drop
+  context_.elide_tool_outputs(messages_, 1, keep_from, 64);
+
+  // 2. Collapse the old messages into a summary if that was not enough
+  if (context_.total() + n_tools > n_target) {
+    std::swap(messages_, old_messages);
+    trace_span span("compaction", "prompt");
+    std::string summary = summarize_history(1, keep_from, n_ctx_slot);
+    std::swap(messages_, old_messages);
+
+    if (!summary.empty()) {
+      message_store compacted;
+      compacted.append_from(messages_, 0);
+      compacted.push_text("user",
+                          "[Summary of the earlier conversation]\n" + summary);
+      // Keep user/assistant alternation in front of the recent messages
+      if (messages_.role(keep_from) != "assistant") {
+        compacted.push_text("assistant",
+                            "Understood. I will continue from this summary.");
+      }
+      for (size_t i = keep_from; i < messages_.size(); i++) {
+        compacted.append_from(messages_, i);
+      }
+      messages_ = std::move(compacted);
+    }
+  }
+  // Drop the elided outputs from the arena
+  messages_.shrink_to_fit();
+
+  // The history was rewritten, drop everything derived from it
+  history_version_++;
+  context_.reset();
+  context_.sync(messages_, vocab);
+  prompt_.reset();
+  // Index contents stay useful, only the message positions moved
+  lookup_synced_ = messages_.size();
+
+  stats_.compactions++;
+  stats_.compaction_tokens_saved += n_before - context_.total();
+
+  if (config_.verbose && !is_subagent_) {
+    console::log("\n[Context compacted: %d -> %d tokens]\n", n_before,
+                 context_.total());
+  }
+}
+
+std::string agent_loop::summarize_history(size_t begin, size_t end,
+                                          int32_t n_ctx_slot) {
+  // Keep the summarizer input well inside one slot (~3 chars per token)
+  size_t max_chars = static_cast<size_t>(std::max(n_ctx_slot / 2, 512)) * 3;
+  std::string transcript =
+      context_manager::transcript(messages_, begin, end, 2000, max_chars);
+  if (transcript.empty()) {
+    return "";
+  }
+
+  const auto &chat_params = backend_->chat_params();
+
+  common_chat_msg sys;
+  sys.role = "system";
+  sys.content =
+      "You compress the history of a coding agent session. Summarize the "
+      "conversation below in at most a few short paragraphs: the user's "
+      "goals, decisions made, files read or changed (with paths), commands "
+      "run and their outcome, and open problems. Output only the summary.";
+  common_chat_msg user;
+  user.role = "user";
+  user.content = transcript;
 
   common_chat_templates_inputs inputs;
-  inputs.messages = common_chat_msgs_parse_oaicompat(messages_);
-  inputs.tools = chat_tools;
-  inputs.tool_choice = chat_tools.empty() ? COMMON_CHAT_TOOL_CHOICE_NONE
-                                          : COMMON_CHAT_TOOL_CHOICE_AUTO;
-  inputs.json_schema = ""; // TODO
-  inputs.grammar = "";     // TODO
+  inputs.messages = {sys, user};
+  inputs.tool_choice = COMMON_CHAT_TOOL_CHOICE_NONE;
   inputs.use_jinja = chat_params.use_jinja;
-  inputs.parallel_tool_calls = false;
   inputs.add_generation_prompt = true;
   inputs.reasoning_format = chat_params.reasoning_format;
-  inputs.enable_thinking = chat_params.enable_thinking;
+  inputs.enable_thinking = false; // Keep the summary call cheap
   inputs.chat_template_kwargs = chat_params.chat_template_kwargs;
 
-  return common_chat_templates_apply(chat_params.tmpls.get(), inputs);
-}
+  common_chat_params summary_params;
+  try {
+    summary_params =
+        common_chat_templates_apply(chat_params.tmpls.get(), inputs);
+  } catch (const std::exception &) {
+    return "";
+  }
 
-common_chat_msg agent_loop::generate_completion(result_timings &out_timings) {
-  server_response_reader rd = server_ctx_.get_response_reader();
-  {
-    // Keep formatting + posting atomic across agent/subagent threads.
-    std::lock_guard<std::mutex> lock(g_completion_mutex);
+  server_task task = server_task(SERVER_TASK_TYPE_COMPLETION);
+  task.index = 0;
+  task.params = task_defaults_;
+  task.params.n_predict = config_.compact_summary_tokens;
+  // Asks for this loop's own slot, whose cache the compaction invalidates
+  // anyway. Leased directly: the summary is not a conversation completion
+  // and stays out of the completion and slot-switch stats. The next
+  // completion sees the slot's new epoch and reseeds the prefix.
+  slot_pool::lease slot = config_.slots ? config_.slots->acquire(preferred_slot_)
+                                        : slot_pool::lease();
+  task.id_slot = slot.id();
+  task.cli = true;
+  task.cli_prompt = std::move(summary_params.prompt);
+  task.params.chat_parser_params = common_chat_parser_params(summary_params);
+  task.params.chat_parser_params.reasoning_format =
+      COMMON_REASONING_FORMAT_DEEPSEEK;
+  task.params.chat_parser_params.parse_tool_calls = false;
+  if (!summary_params.parser.empty()) {
+    task.params.chat_parser_params.parser.load(summary_params.parser);
+  }
+
+  auto rd = backend_->open();
+  completion_posted_ = turn_trace::clock::now();
+  rd->post(std::move(task));
 
-    server_task task = server_task(SERVER_TASK_TYPE_COMPLETION);
-    task.id = rd.get_new_id();
-    task.index = 0;
-    task.params = task_defaults_;
+  auto should_stop = [this]() { return is_interrupted_.load(); };
+  std::string summary;
+  for (auto result = rd->next(should_stop); result; result = rd->next(should_stop)) {
+    if (result->is_error()) {
+      return "";
+    }
+    auto res_partial =
+        dynamic_cast<server_task_result_cmpl_partial *>(result.get());
+    if (res_partial) {
+      for (const auto &diff : res_partial->oaicompat_msg_diffs) {
+        summary += diff.content_delta;
+      }
+    }
+    auto res_final =
+        dynamic_cast<server_task_result_cmpl_final *>(result.get());
+    if (res_final) {
+      if (!res_final->oaicompat_msg.content.empty()) {
+        summary = res_final->oaicompat_msg.content;
+      }
+      // The summary call is part of this session's token usage
+      record_timings(res_final->timings);
+      return string_strip(summary);
+    }
+  }
+  return ""; // Interrupted
+}
 
-    // Build tools JSON in OAI-compatible format
-    // Subagents use filtered tools, main agent uses all tools
-    auto chat_tools =
-        allowed_tools_.empty()
-            ? tool_registry::instance().to_chat_tools()
-            : tool_registry::instance().to_chat_tools_filtered(allowed_tools_);
+void agent_loop::sync_lookup_index() {
+  if (!config_.prompt_lookup) {
+    return;
+  }
+  llama_context *lctx = backend_->llama_ctx();
+  if (!lctx) {
+    return;
+  }
+  const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(lctx));
+
+  for (size_t i = lookup_synced_; i < messages_.size(); i++) {
+    llama_tokens tokens = common_tokenize(
+        vocab, context_manager::message_text(messages_, i), false, false);
+    if (messages_.role(i) == "assistant") {
+      int64_t n_drafted = 0;
+      stats_.lookup_est_accepted +=
+          lookup_.replay(tokens, task_defaults_.speculative.n_max,
+                         task_defaults_.speculative.n_min, n_drafted);
+      stats_.lookup_est_drafted += n_drafted;
+    } else {
+      lookup_.add(tokens);
+    }
+  }
+  lookup_synced_ = messages_.size();
+}
 
-    auto chat_params = format_chat_with_tools(chat_tools);
+// Gives back a completion admission (agent_config::admission_leave) when the
+// completion returns
+struct admission_hold {
+  const std::function<void(double)> &leave;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
 
-    task.cli = true;
-    task.cli_prompt = std::move(chat_params.prompt);
-    task.cli_files = media_files_; // Pass media files for multimodal support
-    
-    task.params.chat_parser_params = common_chat_parser_params(chat_params);
-    task.params.chat_parser_params.reasoning_format =
-        COMMON_REASONING_FORMAT_DEEPSEEK;
-    task.params.chat_parser_params.parse_tool_calls = !chat_tools.empty();
-    if (!chat_params.parser.empty()) {
-      task.params.chat_parser_params.parser.load(chat_params.parser);
+  ~admission_hold() {
+    if (leave) {
+      leave(std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count());
     }
+  }
+};
 
-    rd.post_task(std::move(task));
+common_chat_msg agent_loop::generate_completion(result_timings &out_timings) {
+  if (config_.admission_enter && !config_.admission_enter()) {
+    return common_chat_msg(); // Interrupted while queued
   }
+  admission_hold admitted{config_.admission_leave};
+
+  sync_lookup_index();
+  compact_context_if_needed();
+
+  // Prompt preparation only touches this loop's state and runs in parallel
+  // with other sessions. Task ids come from an atomic counter and the task
+  // queue is internally synchronized, so posting needs no extra lock.
+  server_task task = build_completion_task();
+  slot_pool::lease slot = acquire_slot();
+  task.id_slot = slot.id();
+  auto rd = backend_->open();
+  completion_posted_ = turn_trace::clock::now();
+  rd->post(std::move(task));
 
   auto should_stop = [this]() {
     if (is_interrupted_.load()) {
@@ -381,7 +738,7 @@ common_chat_msg agent_loop::generate_completion(result_timings &out_timings) {
   if (!is_subagent_) {
     console::spinner::start();
   }
-  server_task_result_ptr result = rd.next(should_stop);
+  server_task_result_ptr result = rd->next(should_stop);
 
   if (!is_subagent_) {
     console::spinner::stop();
@@ -454,7 +811,7 @@ common_chat_msg agent_loop::generate_completion(result_timings &out_timings) {
       break;
     }
 
-    result = rd.next(should_stop);
+    result = rd->next(should_stop);
   }
 
   // Reset interrupted flag for next interaction
@@ -479,37 +836,44 @@ common_chat_msg agent_loop::generate_completion(result_timings &out_timings) {
   return msg;
 }
 
-tool_result agent_loop::execute_tool_call(const common_chat_tool_call &call) {
+static permission_type permission_type_for(const std::string &tool_name) {
+  if (tool_name == "read") {
+    return permission_type::FILE_READ;
+  }
+  if (tool_name == "write") {
+    return permission_type::FILE_WRITE;
+  }
+  if (tool_name == "edit") {
+    return permission_type::FILE_EDIT;
+  }
+  if (tool_name == "glob") {
+    return permission_type::GLOB;
+  }
+  return permission_type::BASH;
+}
+
+bool agent_loop::authorize_tool_call(const common_chat_tool_call &call,
+                                     json &args, tool_result &denied) {
   auto &registry = tool_registry::instance();
 
   // Check if tool exists
-  const tool_def *tool = registry.get_tool(call.name);
+  tool_def_ptr tool = registry.get_tool(call.name);
   if (!tool) {
-    return {false, "", "Unknown tool: " + call.name};
+    denied = {false, "", "Unknown tool: " + call.name};
+    return false;
   }
 
   // Parse arguments
-  json args;
   try {
     args = json::parse(call.arguments);
   } catch (const json::parse_error &e) {
-    return {false, "", std::string("Invalid JSON arguments: ") + e.what()};
+    denied = {false, "", std::string("Invalid JSON arguments: ") + e.what()};
+    return false;
   }
 
-  // Determine permission type
-  permission_type ptype = permission_type::BASH;
-  if (call.name == "read")
-    ptype = permission_type::FILE_READ;
-  else if (call.name == "write")
-    ptype = permission_type::FILE_WRITE;
-  else if (call.name == "edit")
-    ptype = permission_type::FILE_EDIT;
-  else if (call.name == "glob")
-    ptype = permission_type::GLOB;
-
   // Build permission request
   permission_request req;
-  req.type = ptype;
+  req.type = permission_type_for(call.name);
   req.tool_name = call.name;
   req.details = call.arguments;
 
@@ -533,7 +897,8 @@ tool_result agent_loop::execute_tool_call(const common_chat_tool_call &call) {
         auto response = permission_mgr_.prompt_user(ext_req);
         if (response == permission_response::DENY_ONCE ||
             response == permission_response::DENY_ALWAYS) {
-          return {false, "", "Blocked: File is outside working directory"};
+          denied = {false, "", "Blocked: File is outside working directory"};
+          return false;
         }
       }
     }
@@ -556,11 +921,13 @@ tool_result agent_loop::execute_tool_call(const common_chat_tool_call &call) {
   std::hash<std::string> hasher;
   std::string args_hash = std::to_string(hasher(call.arguments));
   if (permission_mgr_.is_doom_loop(call.name, args_hash)) {
+    stats_.doom_loops++;
     req.description = "Detected repeated identical tool calls (doom loop)";
     auto response = permission_mgr_.prompt_user(req);
     if (response == permission_response::DENY_ONCE ||
         response == permission_response::DENY_ALWAYS) {
-      return {false, "", "Blocked: Detected repeated identical tool calls"};
+      denied = {false, "", "Blocked: Detected repeated identical tool calls"};
+      return false;
     }
   }
 
@@ -568,136 +935,321 @@ tool_result agent_loop::execute_tool_call(const common_chat_tool_call &call) {
   permission_state state = permission_mgr_.check_permission(req);
   if (state == permission_state::DENY ||
       state == permission_state::DENY_SESSION) {
-    return {false, "", "Permission denied for " + call.name};
+    denied = {false, "", "Permission denied for " + call.name};
+    return false;
   }
 
   if (state == permission_state::ASK) {
     auto response = permission_mgr_.prompt_user(req);
     if (response == permission_response::DENY_ONCE ||
         response == permission_response::DENY_ALWAYS) {
-      return {false, "", "User denied permission for " + call.name};
+      denied = {false, "", "User denied permission for " + call.name};
+      return false;
     }
   }
 
   // Record this call
   permission_mgr_.record_tool_call(call.name, args_hash);
 
-  // Display tool execution (only for main agent)
-  if (!is_subagent_) {
-    console::set_display(DISPLAY_TYPE_INFO);
-    // Show tool name with relevant details
-    if (call.name == "bash") {
-      std::string cmd = args.value("command", "");
-      // Truncate long commands for display
-      if (cmd.length() > 100) {
-        cmd = cmd.substr(0, 100) + "...";
-      }
-      console::log("\n› %s %s", call.name.c_str(), cmd.c_str());
-    } else if (call.name == "read" || call.name == "write" ||
-               call.name == "edit") {
-      std::string path = args.value("path", args.value("file_path", ""));
-      console::log("\n› %s %s", call.name.c_str(), path.c_str());
-    } else {
-      console::log("\n› %s ", call.name.c_str());
-    }
-    console::spinner::start();
-    console::set_display(DISPLAY_TYPE_RESET);
-  }
+  return true;
+}
+
+tool_result agent_loop::run_tool(const std::string &name,
+                                 const json &args) const {
+  trace_span span("tool:" + name, "tool");
 
-  // Execute the tool with timing
   // Use filtered execution for subagents with bash restrictions (e.g.,
   // read-only explore)
-  auto start_time = std::chrono::steady_clock::now();
-  tool_result result = bash_patterns_.empty()
-                           ? registry.execute(call.name, args, tool_ctx_)
-                           : registry.execute_filtered(
-                                 call.name, args, tool_ctx_, bash_patterns_);
-  auto end_time = std::chrono::steady_clock::now();
-  auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                        end_time - start_time)
-                        .count();
+  auto &registry = tool_registry::instance();
+  return bash_patterns_.empty()
+             ? registry.execute(name, args, tool_ctx_)
+             : registry.execute_filtered(name, args, tool_ctx_, bash_patterns_);
+}
 
-  if (!is_subagent_) {
-    console::spinner::stop();
+// Fallback ids must stay unique when one message carries several calls
+std::string agent_loop::tool_call_id(const common_chat_tool_call &call,
+                                     int iteration, size_t index) {
+  if (!call.id.empty()) {
+    return call.id;
+  }
+  return "call_" + std::to_string(iteration) + "_" + std::to_string(index);
+}
+
+std::vector<tool_access>
+agent_loop::tool_accesses(const std::vector<common_chat_tool_call> &calls,
+                          const std::vector<json> &args,
+                          const std::vector<size_t> &runnable) const {
+  auto &registry = tool_registry::instance();
 
-    // Display result summary
-    if (result.success) {
-      // Truncate long output for display
+  // Independent calls overlap, conflicting ones keep their relative order
+  std::vector<tool_access> accesses;
+  for (size_t i : runnable) {
+    tool_def_ptr tool = registry.get_tool(calls[i].name);
+    accesses.push_back(config_.parallel_tool_calls && tool
+                           ? tool_access::of(*tool, args[i], tool_ctx_.working_dir)
+                           : tool_access{});
+  }
+  return accesses;
+}
+
+std::vector<tool_result>
+agent_loop::run_tool_calls(const std::vector<common_chat_tool_call> &calls,
+                           const std::vector<json> &args,
+                           const std::vector<size_t> &runnable,
+                           std::vector<int64_t> &elapsed_ms) {
+  return run_tool_batch(tool_accesses(calls, args, runnable), [&](size_t k) {
+    size_t i = runnable[k];
+    auto start_time = std::chrono::steady_clock::now();
+    tool_result res = run_tool(calls[i].name, args[i]);
+    elapsed_ms[i] += std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now() - start_time)
+                         .count();
+    return res;
+  });
+}
+
+// Show tool name with relevant details
+static void display_tool_header(const common_chat_tool_call &call,
+                                const json &args) {
+  console::set_display(DISPLAY_TYPE_INFO);
+  if (call.name == "bash") {
+    std::string cmd = args.value("command", "");
+    // Truncate long commands for display
+    if (cmd.length() > 100) {
+      cmd = cmd.substr(0, 100) + "...";
+    }
+    console::log("\n› %s %s", call.name.c_str(), cmd.c_str());
+  } else if (call.name == "read" || call.name == "write" ||
+             call.name == "edit") {
+    std::string path = args.value("path", args.value("file_path", ""));
+    console::log("\n› %s %s", call.name.c_str(), path.c_str());
+  } else {
+    console::log("\n› %s ", call.name.c_str());
+  }
+  console::set_display(DISPLAY_TYPE_RESET);
+}
+
+static void display_tool_result(const tool_result &result, int64_t elapsed_ms) {
+  // Display result summary
+  if (result.success) {
+    // Truncate long output for display
+    std::string display_output = result.output;
+    if (display_output.length() > 500) {
+      display_output = display_output.substr(0, 500) + "\n... (truncated)";
+    }
+    console::log("%s\n", display_output.c_str());
+  } else {
+    // Show output if available (e.g., bash stderr), plus error if set
+    if (!result.output.empty()) {
       std::string display_output = result.output;
       if (display_output.length() > 500) {
         display_output = display_output.substr(0, 500) + "\n... (truncated)";
       }
-      console::log("%s\n", display_output.c_str());
-    } else {
-      // Show output if available (e.g., bash stderr), plus error if set
-      if (!result.output.empty()) {
-        std::string display_output = result.output;
-        if (display_output.length() > 500) {
-          display_output = display_output.substr(0, 500) + "\n... (truncated)";
-        }
-        console::error("%s\n", display_output.c_str());
-      }
-      if (!result.error.empty()) {
-        console::error("Error: %s\n", result.error.c_str());
+      console::error("%s\n", display_output.c_str());
+    }
+    if (!result.error.empty()) {
+      console::error("Error: %s\n", result.error.c_str());
+    }
+    if (result.output.empty() && result.error.empty()) {
+      console::error("Error: Tool failed with no output\n");
+    }
+  }
+
+  // Display elapsed time
+  console::set_display(DISPLAY_TYPE_INFO);
+  if (elapsed_ms < 1000) {
+    console::log("└─ %lldms\n", (long long)elapsed_ms);
+  } else {
+    console::log("└─ %.1fs\n", elapsed_ms / 1000.0);
+  }
+  console::set_display(DISPLAY_TYPE_RESET);
+}
+
+bool agent_loop::execute_tool_calls(
+    const std::vector<common_chat_tool_call> &calls, int iteration) {
+  const size_t n = calls.size();
+  std::vector<json> args(n);
+  std::vector<tool_result> results(n);
+  std::vector<int64_t> elapsed_ms(n, 0);
+  std::vector<size_t> runnable; // Calls that passed the permission checks
+
+  // Permission prompts are sequential, execution is batched afterwards
+  for (size_t i = 0; i < n; i++) {
+    if (is_interrupted_.load()) {
+      return false;
+    }
+    trace_span span("authorize:" + calls[i].name, "permission");
+    if (authorize_tool_call(calls[i], args[i], results[i])) {
+      runnable.push_back(i);
+    }
+  }
+
+  // Display tool execution (only for main agent)
+  if (!is_subagent_ && !runnable.empty()) {
+    for (size_t i : runnable) {
+      display_tool_header(calls[i], args[i]);
+    }
+    console::spinner::start();
+  }
+
+  auto batch = run_tool_calls(calls, args, runnable, elapsed_ms);
+  for (size_t k = 0; k < runnable.size(); k++) {
+    results[runnable[k]] = std::move(batch[k]);
+  }
+
+  if (!is_subagent_ && !runnable.empty()) {
+    console::spinner::stop();
+  }
+
+  for (size_t k = 0; k < runnable.size(); k++) {
+    size_t i = runnable[k];
+    if (!is_subagent_) {
+      // Repeat the header when several results are printed together
+      if (runnable.size() > 1) {
+        display_tool_header(calls[i], args[i]);
       }
-      if (result.output.empty() && result.error.empty()) {
-        console::error("Error: Tool failed with no output\n");
+      display_tool_result(results[i], elapsed_ms[i]);
+    } else if (on_tool_call_) {
+      // Report to parent via callback for subagents
+      std::string args_summary = calls[i].arguments;
+      if (args_summary.length() > 60) {
+        args_summary = args_summary.substr(0, 60) + "...";
       }
+      on_tool_call_(calls[i].name, args_summary,
+                    static_cast<int>(elapsed_ms[i]));
     }
+  }
 
-    // Display elapsed time
-    console::set_display(DISPLAY_TYPE_INFO);
-    if (elapsed_ms < 1000) {
-      console::log("└─ %lldms\n", (long long)elapsed_ms);
-    } else {
-      console::log("└─ %.1fs\n", elapsed_ms / 1000.0);
+  // Results go back in the original call order
+  for (size_t i = 0; i < n; i++) {
+    add_tool_result_message(calls[i].name, tool_call_id(calls[i], iteration, i),
+                            std::move(results[i]));
+  }
+  return true;
+}
+
+void agent_loop::start_tool_early(
+    size_t index, const std::vector<common_chat_tool_call> &calls,
+    permission_manager_async *async_perms) {
+  if (!config_.parallel_tool_calls || early_calls_.count(index) ||
+      index >= calls.size()) {
+    return;
+  }
+  const common_chat_tool_call &call = calls[index];
+  auto &registry = tool_registry::instance();
+  tool_def_ptr tool = registry.get_tool(call.name);
+  if (!tool || !tool->read_only) {
+    return;
+  }
+  json args = json::parse(call.arguments, nullptr, false);
+  if (!args.is_object()) {
+    return;
+  }
+
+  // Must not overtake an earlier call of this message it depends on
+  tool_access access = tool_access::of(*tool, args, tool_ctx_.working_dir);
+  for (size_t j = 0; j < index; j++) {
+    tool_def_ptr prev_tool = registry.get_tool(calls[j].name);
+    json prev_args = json::parse(calls[j].arguments, nullptr, false);
+    tool_access prev = prev_tool && prev_args.is_object()
+                           ? tool_access::of(*prev_tool, prev_args,
+                                             tool_ctx_.working_dir)
+                           : tool_access{};
+    if (prev.conflicts_with(access)) {
+      return;
     }
-    console::set_display(DISPLAY_TYPE_RESET);
-  } else if (on_tool_call_) {
-    // Report to parent via callback for subagents
-    std::string args_summary = call.arguments;
-    if (args_summary.length() > 60) {
-      args_summary = args_summary.substr(0, 60) + "...";
+  }
+
+  // Only calls that are allowed without asking; anything that would prompt
+  // waits for execute_tool_calls_streaming
+  if (call.name == "read") {
+    std::string file_path = args.value("file_path", "");
+    if (!file_path.empty()) {
+      std::filesystem::path path(file_path);
+      if (path.is_relative()) {
+        path = std::filesystem::path(tool_ctx_.working_dir) / path;
+      }
+      if (async_perms ? async_perms->is_external_path(path.string())
+                      : permission_mgr_.is_external_path(path.string())) {
+        return;
+      }
     }
-    on_tool_call_(call.name, args_summary, static_cast<int>(elapsed_ms));
+  }
+  std::string args_hash =
+      std::to_string(std::hash<std::string>{}(call.arguments));
+  permission_request req;
+  req.type = permission_type_for(call.name);
+  req.tool_name = call.name;
+  req.details = call.arguments;
+  bool doom_loop = async_perms ? async_perms->is_doom_loop(call.name, args_hash)
+                               : permission_mgr_.is_doom_loop(call.name, args_hash);
+  permission_state state = async_perms ? async_perms->check_permission(req)
+                                       : permission_mgr_.check_permission(req);
+  if (doom_loop || (state != permission_state::ALLOW &&
+                    state != permission_state::ALLOW_SESSION)) {
+    return;
   }
 
-  return result;
+  auto promise = std::make_shared<std::promise<early_tool_result>>();
+  early_calls_[index] = {call, promise->get_future()};
+  tool_worker_pool::instance().submit(
+      [this, promise, name = call.name, args = std::move(args)]() {
+        early_tool_result early;
+        auto start_time = std::chrono::steady_clock::now();
+        try {
+          early.result = run_tool(name, args);
+        } catch (const std::exception &e) {
+          early.result = {false, "",
+                          std::string("Tool execution error: ") + e.what()};
+        }
+        early.elapsed_ms =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start_time)
+                .count();
+        promise->set_value(std::move(early));
+      });
+}
+
+void agent_loop::drop_early_tool_calls() {
+  for (auto &entry : early_calls_) {
+    if (entry.second.result.valid()) {
+      entry.second.result.wait();
+    }
+  }
+  early_calls_.clear();
 }
 
 void agent_loop::add_tool_result_message(const std::string &tool_name,
                                          const std::string &call_id,
-                                         const tool_result &result) {
-  json msg;
-  msg["role"] = "tool";
-  msg["tool_call_id"] = call_id;
-  msg["name"] = tool_name;
-
+                                         tool_result &&result) {
+  std::string content;
   if (result.success) {
-    msg["content"] = result.output;
+    content = std::move(result.output);
   } else {
     // Include output if available (e.g., bash stderr), plus error message if
     // set
     if (!result.output.empty() && !result.error.empty()) {
-      msg["content"] = result.output + "\nError: " + result.error;
+      content = std::move(result.output) + "\nError: " + result.error;
     } else if (!result.output.empty()) {
-      msg["content"] = result.output;
+      content = std::move(result.output);
     } else if (!result.error.empty()) {
-      msg["content"] = "Error: " + result.error;
+      content = "Error: " + result.error;
     } else {
-      msg["content"] = "Error: Tool failed with no output";
+      content = "Error: Tool failed with no output";
     }
   }
 
-  messages_.push_back(msg);
+  messages_.push_tool_result(call_id, tool_name, std::move(content));
 }
 
 agent_loop_result agent_loop::run(const std::string &user_prompt) {
+  trace_scope scope(trace_);
+  trace_span span("turn", "turn");
   agent_loop_result result;
   result.iterations = 0;
 
   // Add user message
-  messages_.push_back({{"role", "user"}, {"content", user_prompt}});
+  messages_.push_text("user", user_prompt);
 
   while (result.iterations < config_.max_iterations) {
     if (is_interrupted_.load()) {
@@ -717,17 +1269,7 @@ agent_loop_result agent_loop::run(const std::string &user_prompt) {
     common_chat_msg parsed = generate_completion(timings);
 
     // Accumulate session statistics
-    if (timings.prompt_n > 0) {
-      stats_.total_input += timings.prompt_n;
-      stats_.total_prompt_ms += timings.prompt_ms;
-    }
-    if (timings.predicted_n > 0) {
-      stats_.total_output += timings.predicted_n;
-      stats_.total_predicted_ms += timings.predicted_ms;
-    }
-    if (timings.cache_n > 0) {
-      stats_.total_cached += timings.cache_n;
-    }
+    record_timings(timings);
 
     if (parsed.content.empty() && parsed.tool_calls.empty() &&
         is_interrupted_.load()) {
@@ -736,24 +1278,7 @@ agent_loop_result agent_loop::run(const std::string &user_prompt) {
     }
 
     // Add assistant message to history
-    json assistant_msg;
-    assistant_msg["role"] = "assistant";
-    assistant_msg["content"] = parsed.content;
-
-    if (!parsed.tool_calls.empty()) {
-      assistant_msg["tool_calls"] = json::array();
-      for (const auto &call : parsed.tool_calls) {
-        json tc;
-        tc["id"] = call.id.empty()
-                       ? ("call_" + std::to_string(result.iterations))
-                       : call.id;
-        tc["type"] = "function";
-        tc["function"] = {{"name", call.name}, {"arguments", call.arguments}};
-        assistant_msg["tool_calls"].push_back(tc);
-      }
-    }
-
-    messages_.push_back(assistant_msg);
+    add_assistant_message(parsed, result.iterations);
 
     // If no tool calls, we're done
     if (parsed.tool_calls.empty()) {
@@ -766,18 +1291,10 @@ agent_loop_result agent_loop::run(const std::string &user_prompt) {
       console::log("\n");
     }
 
-    // Execute each tool call
-    for (const auto &call : parsed.tool_calls) {
-      if (is_interrupted_.load()) {
-        result.stop_reason = agent_stop_reason::USER_CANCELLED;
-        return result;
-      }
-
-      tool_result tool_res = execute_tool_call(call);
-      std::string call_id = call.id.empty()
-                                ? ("call_" + std::to_string(result.iterations))
-                                : call.id;
-      add_tool_result_message(call.name, call_id, tool_res);
+    // Execute the tool calls (independent ones in parallel)
+    if (!execute_tool_calls(parsed.tool_calls, result.iterations)) {
+      result.stop_reason = agent_stop_reason::USER_CANCELLED;
+      return result;
     }
   }
 
@@ -789,6 +1306,8 @@ agent_loop_result agent_loop::run(const std::string &user_prompt) {
 
 // Multimodal version of run() - accepts JSON message with images/audio
 agent_loop_result agent_loop::run_multimodal(const json &user_message) {
+  trace_scope scope(trace_);
+  trace_span span("turn", "turn");
   agent_loop_result result;
   result.iterations = 0;
 
@@ -813,17 +1332,7 @@ agent_loop_result agent_loop::run_multimodal(const json &user_message) {
     common_chat_msg parsed = generate_completion(timings);
 
     // Accumulate session statistics
-    if (timings.prompt_n > 0) {
-      stats_.total_input += timings.prompt_n;
-      stats_.total_prompt_ms += timings.prompt_ms;
-    }
-    if (timings.predicted_n > 0) {
-      stats_.total_output += timings.predicted_n;
-      stats_.total_predicted_ms += timings.predicted_ms;
-    }
-    if (timings.cache_n > 0) {
-      stats_.total_cached += timings.cache_n;
-    }
+    record_timings(timings);
 
     if (parsed.content.empty() && parsed.tool_calls.empty() &&
         is_interrupted_.load()) {
@@ -832,24 +1341,7 @@ agent_loop_result agent_loop::run_multimodal(const json &user_message) {
     }
 
     // Add assistant message to history
-    json assistant_msg;
-    assistant_msg["role"] = "assistant";
-    assistant_msg["content"] = parsed.content;
-
-    if (!parsed.tool_calls.empty()) {
-      assistant_msg["tool_calls"] = json::array();
-      for (const auto &call : parsed.tool_calls) {
-        json tc;
-        tc["id"] = call.id.empty()
-                       ? ("call_" + std::to_string(result.iterations))
-                       : call.id;
-        tc["type"] = "function";
-        tc["function"] = {{"name", call.name}, {"arguments", call.arguments}};
-        assistant_msg["tool_calls"].push_back(tc);
-      }
-    }
-
-    messages_.push_back(assistant_msg);
+    add_assistant_message(parsed, result.iterations);
 
     // If no tool calls, we're done
     if (parsed.tool_calls.empty()) {
@@ -862,18 +1354,10 @@ agent_loop_result agent_loop::run_multimodal(const json &user_message) {
       console::log("\n");
     }
 
-    // Execute each tool call
-    for (const auto &call : parsed.tool_calls) {
-      if (is_interrupted_.load()) {
-        result.stop_reason = agent_stop_reason::USER_CANCELLED;
-        return result;
-      }
-
-      tool_result tool_res = execute_tool_call(call);
-      std::string call_id = call.id.empty()
-                                ? ("call_" + std::to_string(result.iterations))
-                                : call.id;
-      add_tool_result_message(call.name, call_id, tool_res);
+    // Execute the tool calls (independent ones in parallel)
+    if (!execute_tool_calls(parsed.tool_calls, result.iterations)) {
+      result.stop_reason = agent_stop_reason::USER_CANCELLED;
+      return result;
     }
   }
 
@@ -883,305 +1367,117 @@ agent_loop_result agent_loop::run_multimodal(const json &user_message) {
   return result;
 }
 
-// Streaming version of run() for API use
-agent_loop_result agent_loop::run_streaming(
-    const std::string &user_prompt, agent_event_callback on_event,
-    std::function<bool()> should_stop, permission_manager_async *async_perms) {
-
-  agent_loop_result result;
-  result.iterations = 0;
-
-  // Default should_stop to check is_interrupted_
-  if (!should_stop) {
-    should_stop = [this]() { return is_interrupted_.load(); };
+void agent_loop::record_timings(const result_timings &timings) {
+  // Split the completion into server-side wait, prefill and decode
+  if (auto trace = turn_trace::current()) {
+    using clock = turn_trace::clock;
+    auto ms = [](double v) {
+      return std::chrono::duration_cast<clock::duration>(
+          std::chrono::duration<double, std::milli>(std::max(v, 0.0)));
+    };
+    const int lane = turn_trace::current_lane();
+    const clock::time_point end = clock::now();
+    clock::time_point decode_start =
+        std::max(completion_posted_, end - ms(timings.predicted_ms));
+    clock::time_point prefill_start =
+        std::max(completion_posted_, decode_start - ms(timings.prompt_ms));
+    trace->add_span("completion", "llm", lane, completion_posted_, end,
+                    {{"prompt_tokens", timings.prompt_n},
+                     {"cached_tokens", timings.cache_n},
+                     {"output_tokens", timings.predicted_n}});
+    if (prefill_start > completion_posted_) {
+      trace->add_span("server_wait", "llm", lane, completion_posted_,
+                      prefill_start);
+    }
+    trace->add_span("prefill", "llm", lane, prefill_start, decode_start);
+    trace->add_span("decode", "llm", lane, decode_start, end);
   }
 
-  // Add user message
-  messages_.push_back({{"role", "user"}, {"content", user_prompt}});
-
-  while (result.iterations < config_.max_iterations) {
-    if (should_stop()) {
-      result.stop_reason = agent_stop_reason::USER_CANCELLED;
-      on_event(agent_event::completed(result.stop_reason, stats_));
-      return result;
-    }
-
-    result.iterations++;
-
-    // Emit iteration start event
-    on_event(agent_event::iteration_start(result.iterations,
-                                          config_.max_iterations));
-
-    // Generate completion with streaming
-    result_timings timings;
-    common_chat_msg parsed =
-        generate_completion_streaming(timings, on_event, should_stop);
-
-    // Accumulate session statistics
-    if (timings.prompt_n > 0) {
-      stats_.total_input += timings.prompt_n;
-      stats_.total_prompt_ms += timings.prompt_ms;
-    }
-    if (timings.predicted_n > 0) {
-      stats_.total_output += timings.predicted_n;
-      stats_.total_predicted_ms += timings.predicted_ms;
-    }
-    if (timings.cache_n > 0) {
-      stats_.total_cached += timings.cache_n;
-    }
-
-    if (parsed.content.empty() && parsed.tool_calls.empty() && should_stop()) {
-      result.stop_reason = agent_stop_reason::USER_CANCELLED;
-      on_event(agent_event::completed(result.stop_reason, stats_));
-      return result;
-    }
-
-    // Add assistant message to history
-    json assistant_msg;
-    assistant_msg["role"] = "assistant";
-    assistant_msg["content"] = parsed.content;
-
-    if (!parsed.tool_calls.empty()) {
-      assistant_msg["tool_calls"] = json::array();
-      for (const auto &call : parsed.tool_calls) {
-        json tc;
-        tc["id"] = call.id.empty()
-                       ? ("call_" + std::to_string(result.iterations))
-                       : call.id;
-        tc["type"] = "function";
-        tc["function"] = {{"name", call.name}, {"arguments", call.arguments}};
-        assistant_msg["tool_calls"].push_back(tc);
-      }
-    }
-
-    messages_.push_back(assistant_msg);
-
-    // If no tool calls, we're done
-    if (parsed.tool_calls.empty()) {
-      result.stop_reason = agent_stop_reason::COMPLETED;
-      result.final_response = parsed.content;
-      on_event(agent_event::completed(result.stop_reason, stats_));
-      return result;
-    }
-
-    // Execute each tool call
-    for (const auto &call : parsed.tool_calls) {
-      if (should_stop()) {
-        result.stop_reason = agent_stop_reason::USER_CANCELLED;
-        on_event(agent_event::completed(result.stop_reason, stats_));
-        return result;
-      }
-
-      // Emit tool start event
-      on_event(agent_event::tool_start(call.name, call.arguments));
-
-      auto start_time = std::chrono::steady_clock::now();
-
-      // Use async permission handling if async_perms is provided
-      tool_result tool_res =
-          async_perms ? execute_tool_call_async(call, on_event, async_perms,
-                                                should_stop)
-                      : execute_tool_call(call);
-
-      auto end_time = std::chrono::steady_clock::now();
-      auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                            end_time - start_time)
-                            .count();
-
-      // Emit tool result event
-      on_event(agent_event::tool_result(call.name, tool_res.success,
-                                        tool_res.output, elapsed_ms));
-
-      std::string call_id = call.id.empty()
-                                ? ("call_" + std::to_string(result.iterations))
-                                : call.id;
-      add_tool_result_message(call.name, call_id, tool_res);
-    }
+  if (timings.prompt_n > 0) {
+    stats_.total_input += timings.prompt_n;
+    stats_.total_prompt_ms += timings.prompt_ms;
+  }
+  if (timings.predicted_n > 0) {
+    stats_.total_output += timings.predicted_n;
+    stats_.total_predicted_ms += timings.predicted_ms;
+  }
+  if (timings.cache_n > 0) {
+    stats_.total_cached += timings.cache_n;
   }
+  stats_.draft_n += timings.draft_n;
+  stats_.draft_accepted += timings.draft_n_accepted;
+}
 
-  result.stop_reason = agent_stop_reason::MAX_ITERATIONS;
-  result.final_response = "Reached maximum iterations (" +
-                          std::to_string(config_.max_iterations) + ")";
-  on_event(agent_event::completed(result.stop_reason, stats_));
-  return result;
+void agent_loop::add_assistant_message(const common_chat_msg &parsed,
+                                       int iteration) {
+  messages_.push_text("assistant", parsed.content);
+  for (size_t i = 0; i < parsed.tool_calls.size(); i++) {
+    const auto &call = parsed.tool_calls[i];
+    messages_.add_tool_call(tool_call_id(call, iteration, i), call.name,
+                            call.arguments);
+  }
+  sync_lookup_index();
 }
 
-// Multimodal streaming version - accepts JSON message with images/audio
-agent_loop_result agent_loop::run_streaming_multimodal(
+std::shared_ptr<agent_turn> agent_loop::start_turn(
     const json &user_message, agent_event_callback on_event,
     std::function<bool()> should_stop, permission_manager_async *async_perms,
     std::vector<raw_buffer> media_files) {
-
-  agent_loop_result result;
-  result.iterations = 0;
-
-  // Store media files for use in generate_completion
-  // These will be consumed on first generation
-  media_files_ = std::move(media_files);
-  
-  // Scope guard to clear media files on function exit
-  struct MediaGuard {
-    std::vector<raw_buffer>& files;
-    ~MediaGuard() { files.clear(); }
-  } media_guard{media_files_};
-
   // Default should_stop to check is_interrupted_
   if (!should_stop) {
     should_stop = [this]() { return is_interrupted_.load(); };
   }
+  return std::make_shared<agent_turn>(*this, user_message, std::move(on_event),
+                                      std::move(should_stop), async_perms,
+                                      std::move(media_files));
+}
 
-  // Add user message (can contain multimodal content)
-  messages_.push_back(user_message);
-
-  while (result.iterations < config_.max_iterations) {
-    if (should_stop()) {
-      result.stop_reason = agent_stop_reason::USER_CANCELLED;
-      on_event(agent_event::completed(result.stop_reason, stats_));
-      return result;
-    }
-
-    result.iterations++;
-
-    // Emit iteration start event
-    on_event(agent_event::iteration_start(result.iterations,
-                                          config_.max_iterations));
-
-    // Generate completion with streaming
-    result_timings timings;
-    common_chat_msg parsed =
-        generate_completion_streaming(timings, on_event, should_stop);
-
-    // Accumulate session statistics
-    if (timings.prompt_n > 0) {
-      stats_.total_input += timings.prompt_n;
-      stats_.total_prompt_ms += timings.prompt_ms;
-    }
-    if (timings.predicted_n > 0) {
-      stats_.total_output += timings.predicted_n;
-      stats_.total_predicted_ms += timings.predicted_ms;
-    }
-    if (timings.cache_n > 0) {
-      stats_.total_cached += timings.cache_n;
-    }
-
-    if (parsed.content.empty() && parsed.tool_calls.empty() && should_stop()) {
-      result.stop_reason = agent_stop_reason::USER_CANCELLED;
-      on_event(agent_event::completed(result.stop_reason, stats_));
-      return result;
-    }
-
-    // Add assistant message to history
-    json assistant_msg;
-    assistant_msg["role"] = "assistant";
-    assistant_msg["content"] = parsed.content;
-
-    if (!parsed.tool_calls.empty()) {
-      assistant_msg["tool_calls"] = json::array();
-      for (const auto &call : parsed.tool_calls) {
-        json tc;
-        tc["id"] = call.id.empty()
-                       ? ("call_" + std::to_string(result.iterations))
-                       : call.id;
-        tc["type"] = "function";
-        tc["function"] = {{"name", call.name}, {"arguments", call.arguments}};
-        assistant_msg["tool_calls"].push_back(tc);
-      }
-    }
-
-    messages_.push_back(assistant_msg);
-
-    // If no tool calls, we're done
-    if (parsed.tool_calls.empty()) {
-      result.stop_reason = agent_stop_reason::COMPLETED;
-      result.final_response = parsed.content;
-      on_event(agent_event::completed(result.stop_reason, stats_));
-      return result;
-    }
-
-    // Execute each tool call
-    for (const auto &call : parsed.tool_calls) {
-      if (should_stop()) {
-        result.stop_reason = agent_stop_reason::USER_CANCELLED;
-        on_event(agent_event::completed(result.stop_reason, stats_));
-        return result;
-      }
-
-      // Emit tool start event
-      on_event(agent_event::tool_start(call.name, call.arguments));
-
-      auto start_time = std::chrono::steady_clock::now();
-
-      // Use async permission handling if async_perms is provided
-      tool_result tool_res =
-          async_perms ? execute_tool_call_async(call, on_event, async_perms,
-                                                should_stop)
-                      : execute_tool_call(call);
-
-      auto end_time = std::chrono::steady_clock::now();
-      auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                            end_time - start_time)
-                            .count();
-
-      // Emit tool result event
-      on_event(agent_event::tool_result(call.name, tool_res.success,
-                                        tool_res.output, elapsed_ms));
-
-      std::string call_id = call.id.empty()
-                                ? ("call_" + std::to_string(result.iterations))
-                                : call.id;
-      add_tool_result_message(call.name, call_id, tool_res);
-    }
-  }
+// Streaming version of run() for API use
+agent_loop_result agent_loop::run_streaming(
+    const std::string &user_prompt, agent_event_callback on_event,
+    std::function<bool()> should_stop, permission_manager_async *async_perms) {
+  return start_turn({{"role", "user"}, {"content", user_prompt}}, on_event,
+                    should_stop, async_perms)
+      ->run_blocking();
+}
 
-  result.stop_reason = agent_stop_reason::MAX_ITERATIONS;
-  result.final_response = "Reached maximum iterations (" +
-                          std::to_string(config_.max_iterations) + ")";
-  on_event(agent_event::completed(result.stop_reason, stats_));
-  return result;
+// Multimodal streaming version - accepts JSON message with images/audio
+agent_loop_result agent_loop::run_streaming_multimodal(
+    const json &user_message, agent_event_callback on_event,
+    std::function<bool()> should_stop, permission_manager_async *async_perms,
+    std::vector<raw_buffer> media_files) {
+  return start_turn(user_message, on_event, should_stop, async_perms,
+                    std::move(media_files))
+      ->run_blocking();
 }
 
 // Streaming version of generate_completion
 common_chat_msg
 agent_loop::generate_completion_streaming(result_timings &out_timings,
                                           agent_event_callback on_event,
-                                          std::function<bool()> should_stop) {
-
-  server_response_reader rd = server_ctx_.get_response_reader();
-  {
-    std::lock_guard<std::mutex> lock(g_completion_mutex);
+                                          std::function<bool()> should_stop,
+                                          permission_manager_async *async_perms) {
 
-    server_task task = server_task(SERVER_TASK_TYPE_COMPLETION);
-    task.id = rd.get_new_id();
-    task.index = 0;
-    task.params = task_defaults_;
+  drop_early_tool_calls();
+  sync_lookup_index();
+  compact_context_if_needed();
 
-    auto chat_tools =
-        allowed_tools_.empty()
-            ? tool_registry::instance().to_chat_tools()
-            : tool_registry::instance().to_chat_tools_filtered(allowed_tools_);
+  server_task task = build_completion_task();
+  slot_pool::lease slot = acquire_slot();
+  task.id_slot = slot.id();
+  auto rd = backend_->open();
+  completion_posted_ = turn_trace::clock::now();
+  rd->post(std::move(task));
 
-    auto chat_params = format_chat_with_tools(chat_tools);
-
-    task.cli = true;
-    task.cli_prompt = std::move(chat_params.prompt);
-    task.cli_files = media_files_; // Pass media files for multimodal support
-    
-    task.params.chat_parser_params = common_chat_parser_params(chat_params);
-    task.params.chat_parser_params.reasoning_format =
-        COMMON_REASONING_FORMAT_DEEPSEEK;
-    task.params.chat_parser_params.parse_tool_calls = !chat_tools.empty();
-    if (!chat_params.parser.empty()) {
-      task.params.chat_parser_params.parser.load(chat_params.parser);
-    }
-
-    rd.post_task(std::move(task));
-  }
-
-  server_task_result_ptr result = rd.next(should_stop);
+  server_task_result_ptr result = rd->next(should_stop);
 
   std::string full_content;
   bool was_aborted = false;
 
+  // Tool calls as streamed so far; a call is complete once the next one
+  // starts or its arguments already form a JSON object
+  std::vector<common_chat_tool_call> streamed_calls;
+
   while (result) {
     if (should_stop()) {
       was_aborted = true;
@@ -1207,6 +1503,23 @@ agent_loop::generate_completion_streaming(result_timings &out_timings,
         if (!diff.reasoning_content_delta.empty()) {
           on_event(agent_event::reasoning_delta(diff.reasoning_content_delta));
         }
+        if (diff.tool_call_index != std::string::npos) {
+          size_t k = diff.tool_call_index;
+          if (k >= streamed_calls.size()) {
+            for (size_t j = 0; j < streamed_calls.size(); j++) {
+              start_tool_early(j, streamed_calls, async_perms);
+            }
+            streamed_calls.resize(k + 1);
+          }
+          auto &call = streamed_calls[k];
+          call.name += diff.tool_call_delta.name;
+          call.id += diff.tool_call_delta.id;
+          call.arguments += diff.tool_call_delta.arguments;
+          if (!diff.tool_call_delta.arguments.empty() &&
+              json::accept(call.arguments)) {
+            start_tool_early(k, streamed_calls, async_perms);
+          }
+        }
       }
     }
 
@@ -1223,7 +1536,7 @@ agent_loop::generate_completion_streaming(result_timings &out_timings,
       break;
     }
 
-    result = rd.next(should_stop);
+    result = rd->next(should_stop);
   }
 
   if (was_aborted) {
@@ -1239,152 +1552,153 @@ agent_loop::generate_completion_streaming(result_timings &out_timings,
   return msg;
 }
 
-// Async version of execute_tool_call for API use
-// Uses async permission manager and emits events instead of blocking on console
-tool_result agent_loop::execute_tool_call_async(
-    const common_chat_tool_call &call, agent_event_callback on_event,
-    permission_manager_async *async_perms, std::function<bool()> should_stop) {
-
-  auto &registry = tool_registry::instance();
-
-  // Check if tool exists
-  const tool_def *tool = registry.get_tool(call.name);
-  if (!tool) {
-    return {false, "", "Unknown tool: " + call.name};
-  }
+// Permission requests time out after 5 minutes without an answer
+static constexpr int PERMISSION_TIMEOUT_MS = 300000;
+
+// Async version of authorize_tool_call for API use. Never blocks: questions
+// are sent as PERMISSION_REQUIRED events and answered via
+// answer_authorization().
+tool_authorization_status agent_loop::advance_authorization(
+    const common_chat_tool_call &call, tool_authorization &auth,
+    agent_event_callback on_event, permission_manager_async *async_perms,
+    tool_result &denied) {
+
+  // Ask the user with `req`, checks continue at next_stage once answered
+  auto ask = [&](const permission_request &req, int next_stage) {
+    auth.pending_id = async_perms->request_permission(req);
+    auth.deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(PERMISSION_TIMEOUT_MS);
+    auth.stage = next_stage;
+    on_event(agent_event::permission_required(auth.pending_id, call.name,
+                                              req.details, req.is_dangerous));
+    return tool_authorization_status::WAITING;
+  };
 
-  // Parse arguments
-  json args;
-  try {
-    args = json::parse(call.arguments);
-  } catch (const json::parse_error &e) {
-    return {false, "", std::string("Invalid JSON arguments: ") + e.what()};
-  }
+  if (auth.stage == 0) {
+    auto &registry = tool_registry::instance();
 
-  // Determine permission type
-  permission_type ptype = permission_type::BASH;
-  if (call.name == "read") {
-    ptype = permission_type::FILE_READ;
-  } else if (call.name == "write") {
-    ptype = permission_type::FILE_WRITE;
-  } else if (call.name == "edit") {
-    ptype = permission_type::FILE_EDIT;
-  } else if (call.name == "glob") {
-    ptype = permission_type::GLOB;
-  }
+    // Check if tool exists
+    tool_def_ptr tool = registry.get_tool(call.name);
+    if (!tool) {
+      denied = {false, "", "Unknown tool: " + call.name};
+      return tool_authorization_status::DENIED;
+    }
 
-  // Build permission request
-  permission_request req;
-  req.type = ptype;
-  req.tool_name = call.name;
-  req.details = call.arguments;
+    // Parse arguments
+    try {
+      auth.args = json::parse(call.arguments);
+    } catch (const json::parse_error &e) {
+      denied = {false, "", std::string("Invalid JSON arguments: ") + e.what()};
+      return tool_authorization_status::DENIED;
+    }
 
-  // Check for external directory access on file operations
-  if (call.name == "read" || call.name == "write" || call.name == "edit") {
-    std::string file_path = args.value("file_path", "");
-    if (!file_path.empty()) {
-      std::filesystem::path path(file_path);
-      if (path.is_relative()) {
-        path = std::filesystem::path(tool_ctx_.working_dir) / path;
-      }
-      if (async_perms && async_perms->is_external_path(path.string())) {
-        permission_request ext_req;
-        ext_req.type = permission_type::EXTERNAL_DIR;
-        ext_req.tool_name = call.name;
-        ext_req.details = "External file: " + path.string();
-        ext_req.is_dangerous = true;
-        ext_req.description = "Operation outside working directory";
+    // Build permission request
+    auth.req.type = permission_type_for(call.name);
+    auth.req.tool_name = call.name;
+    auth.req.details = call.arguments;
 
-        // Request permission asynchronously
-        std::string req_id = async_perms->request_permission(ext_req);
-        on_event(agent_event::permission_required(req_id, call.name,
-                                                  ext_req.details, true));
-
-        // Wait for response
-        auto response =
-            async_perms->wait_for_response(req_id, 300000); // 5 min timeout
-        if (!response || !response->allowed) {
-          on_event(agent_event::permission_resolved(req_id, false));
-          return {false, "", "Blocked: File is outside working directory"};
+    // Check for dangerous commands
+    if (call.name == "bash") {
+      std::string cmd = auth.args.value("command", "");
+      auth.req.details = cmd;
+      for (const auto &pattern : {"rm -rf", "sudo ", "chmod 777"}) {
+        if (cmd.find(pattern) != std::string::npos) {
+          auth.req.is_dangerous = true;
+          break;
         }
-        on_event(agent_event::permission_resolved(req_id, true));
       }
     }
+
+    std::hash<std::string> hasher;
+    auth.args_hash = std::to_string(hasher(call.arguments));
+    auth.stage = 1;
   }
 
-  // Check for dangerous commands
-  if (call.name == "bash") {
-    std::string cmd = args.value("command", "");
-    req.details = cmd;
-    for (const auto &pattern : {"rm -rf", "sudo ", "chmod 777"}) {
-      if (cmd.find(pattern) != std::string::npos) {
-        req.is_dangerous = true;
-        break;
+  // Check for external directory access on file operations
+  if (auth.stage == 1) {
+    auth.stage = 2;
+    if (call.name == "read" || call.name == "write" || call.name == "edit") {
+      std::string file_path = auth.args.value("file_path", "");
+      if (!file_path.empty()) {
+        std::filesystem::path path(file_path);
+        if (path.is_relative()) {
+          path = std::filesystem::path(tool_ctx_.working_dir) / path;
+        }
+        if (async_perms && async_perms->is_external_path(path.string())) {
+          permission_request ext_req;
+          ext_req.type = permission_type::EXTERNAL_DIR;
+          ext_req.tool_name = call.name;
+          ext_req.details = "External file: " + path.string();
+          ext_req.is_dangerous = true;
+          ext_req.description = "Operation outside working directory";
+          return ask(ext_req, 2);
+        }
       }
     }
   }
 
   // Check doom loop
-  std::hash<std::string> hasher;
-  std::string args_hash = std::to_string(hasher(call.arguments));
-  if (async_perms && async_perms->is_doom_loop(call.name, args_hash)) {
-    req.description = "Detected repeated identical tool calls (doom loop)";
-
-    std::string req_id = async_perms->request_permission(req);
-    on_event(
-        agent_event::permission_required(req_id, call.name, req.details, true));
-
-    auto response = async_perms->wait_for_response(req_id, 300000);
-    if (!response || !response->allowed) {
-      on_event(agent_event::permission_resolved(req_id, false));
-      return {false, "", "Blocked: Detected repeated identical tool calls"};
+  if (auth.stage == 2) {
+    auth.stage = 3;
+    if (async_perms && async_perms->is_doom_loop(call.name, auth.args_hash)) {
+      stats_.doom_loops++;
+      permission_request loop_req = auth.req;
+      loop_req.description = "Detected repeated identical tool calls (doom loop)";
+      loop_req.is_dangerous = true;
+      return ask(loop_req, 3);
     }
-    on_event(agent_event::permission_resolved(req_id, true));
   }
 
   // Check permission
-  permission_state state = async_perms ? async_perms->check_permission(req)
-                                       : permission_state::ASK;
-  if (state == permission_state::DENY ||
-      state == permission_state::DENY_SESSION) {
-    return {false, "", "Permission denied for " + call.name};
+  if (auth.stage == 3) {
+    auth.stage = 4;
+    permission_state state = async_perms ? async_perms->check_permission(auth.req)
+                                         : permission_state::ASK;
+    if (state == permission_state::DENY ||
+        state == permission_state::DENY_SESSION) {
+      denied = {false, "", "Permission denied for " + call.name};
+      return tool_authorization_status::DENIED;
+    }
+    if (state == permission_state::ASK) {
+      return ask(auth.req, 4);
+    }
   }
 
-  if (state == permission_state::ASK) {
-    // Request permission asynchronously
-    std::string req_id = async_perms->request_permission(req);
-    on_event(agent_event::permission_required(req_id, call.name, req.details,
-                                              req.is_dangerous));
-
-    // Wait for response (with timeout)
-    auto response =
-        async_perms->wait_for_response(req_id, 300000); // 5 min timeout
-
-    if (should_stop()) {
-      async_perms->cancel(req_id);
-      return {false, "", "Operation cancelled"};
-    }
+  // Record this call
+  async_perms->record_tool_call(call.name, auth.args_hash);
 
-    if (!response) {
-      on_event(agent_event::permission_resolved(req_id, false));
-      return {false, "", "Permission request timed out"};
-    }
+  return tool_authorization_status::ALLOWED;
+}
 
-    on_event(agent_event::permission_resolved(req_id, response->allowed));
+tool_authorization_status agent_loop::answer_authorization(
+    const common_chat_tool_call &call, tool_authorization &auth,
+    const std::optional<permission_response_async> &response, bool cancelled,
+    agent_event_callback on_event, permission_manager_async *async_perms,
+    tool_result &denied) {
+  std::string req_id = std::move(auth.pending_id);
+  auth.pending_id.clear();
+
+  if (cancelled) {
+    async_perms->cancel(req_id);
+    denied = {false, "", "Operation cancelled"};
+    return tool_authorization_status::DENIED;
+  }
 
-    if (!response->allowed) {
-      return {false, "", "User denied permission for " + call.name};
+  bool allowed = response && response->allowed;
+  on_event(agent_event::permission_resolved(req_id, allowed));
+  if (!allowed) {
+    // auth.stage is the check after the one that asked
+    if (auth.stage == 2) {
+      denied = {false, "", "Blocked: File is outside working directory"};
+    } else if (auth.stage == 3) {
+      denied = {false, "", "Blocked: Detected repeated identical tool calls"};
+    } else if (!response) {
+      denied = {false, "", "Permission request timed out"};
+    } else {
+      denied = {false, "", "User denied permission for " + call.name};
     }
+    return tool_authorization_status::DENIED;
   }
 
-  // Record this call
-  async_perms->record_tool_call(call.name, args_hash);
-
-  // Execute the tool
-  tool_result result = bash_patterns_.empty()
-                           ? registry.execute(call.name, args, tool_ctx_)
-                           : registry.execute_filtered(
-                                 call.name, args, tool_ctx_, bash_patterns_);
-
-  return result;
+  return advance_authorization(call, auth, on_event, async_perms, denied);
 }
@@ -1,8 +1,17 @@
 #pragma once
 
 #include "common.h"
+#include "completion-backend.h"
+#include "context-manager.h"
+#include "prefix-cache.h"
+#include "prompt-lookup.h"
+#include "slot-pool.h"
+#include "incremental-prompt.h"
+#include "message-store.h"
 #include "nlohmann/json_fwd.hpp"
 #include "tool-registry.h"
+#include "tool-executor.h"
+#include "turn-trace.h"
 #include "permission.h"
 #include "permission-async.h"
 #include "chat.h"
@@ -15,9 +24,15 @@
 #include <nlohmann/json.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using json = nlohmann::ordered_json;
@@ -55,6 +70,48 @@ struct agent_config {
 
   // Subagent configuration
   int max_subagent_depth = 0; // 0 = disabled, 1-5 = allowed nesting depth
+
+  // Let the model emit several tool calls per turn and run independent
+  // calls (reads, globs, read-only MCP tools) concurrently
+  bool parallel_tool_calls = true;
+
+  // Context compaction. Once the history reaches compact_high_water of the
+  // slot context, old tool outputs are elided and older messages are
+  // summarized until it fits in compact_target. The system prompt and the
+  // most recent messages are kept byte-identical. 0 disables compaction.
+  float compact_high_water = 0.8f;
+  float compact_target = 0.5f;
+  int compact_keep_recent = 6;      // Recent user/assistant messages kept verbatim
+  int compact_summary_tokens = 512; // Max tokens of the summary completion
+
+  // Prompt-lookup drafting: index messages and tool outputs by n-gram and
+  // estimate how much of each reply it would have predicted. The drafts are
+  // not sent to the server, so this only measures; off by default since it
+  // tokenizes every message. Draft lengths follow the speculative params
+  // (n_max/n_min).
+  bool prompt_lookup = false;
+  int prompt_lookup_ngram = 3;               // Longest n-gram matched
+  int prompt_lookup_max_tokens = 1 << 16;    // Tokens kept in the index
+
+  // Server slots shared with other loops (sessions, subagents). When set,
+  // every completion asks for the slot holding this loop's cached history.
+  // Null = let the server pick a slot.
+  std::shared_ptr<slot_pool> slots;
+
+  // Saved KV of system prompt + tools; loops that start on a slot without
+  // their history load it instead of prefilling it. Needs slots.
+  std::shared_ptr<kv_prefix_cache> prefix_cache;
+
+  // Where completions go. Null = the server_context the loop was built
+  // with; subagents inherit the parent's backend.
+  std::shared_ptr<completion_backend> backend;
+
+  // Admission of the completions of a blocking run() (subagents of a server
+  // session), so they queue for a slot like session turns. enter waits until
+  // one may start and returns false if the loop was interrupted meanwhile;
+  // leave gets the generation time in ms. Unset = no admission.
+  std::function<bool()> admission_enter;
+  std::function<void(double)> admission_leave;
 };
 
 
@@ -78,6 +135,30 @@ struct session_stats {
   int32_t subagent_output = 0;     // Output tokens from subagents
   int32_t subagent_cached = 0;     // Cached tokens from subagents
   int32_t subagent_count = 0;      // Number of subagent runs
+
+  // Context compaction
+  int32_t compactions = 0;             // Number of history compactions
+  int32_t compaction_tokens_saved = 0; // History tokens removed by compaction
+
+  // Speculative decoding
+  // Prompt-lookup estimate, replayed over finished replies (prompt_lookup)
+  int64_t lookup_est_drafted = 0;  // Tokens the index would have proposed
+  int64_t lookup_est_accepted = 0; // ... of which matched the actual reply
+  int64_t draft_n = 0;         // Tokens drafted by the server
+  int64_t draft_accepted = 0;  // ... of which the server accepted
+
+  // Slot affinity
+  int32_t completions = 0;   // Completions sent to the server
+  int32_t slot_switches = 0; // ... that could not use the preferred slot
+
+  // Repeated identical tool calls that had to be confirmed
+  int32_t doom_loops = 0;
+
+  // Share of prompt tokens served from the slot's KV cache
+  double cache_hit_ratio() const {
+    int64_t total = static_cast<int64_t>(total_cached) + total_input;
+    return total > 0 ? static_cast<double>(total_cached) / total : 0.0;
+  }
 };
 
 // Event types for streaming API
@@ -93,77 +174,131 @@ enum class agent_event_type {
   ERROR,               // Error occurred
 };
 
-// Event data for streaning API
+// Event of the streaming API
+//
+// Strings are views into buffers of the turn that emits the event and are
+// valid only during the callback; copy what has to outlive it. Building an
+// event allocates nothing, and event-encoder.h writes it straight into the
+// wire format. Which fields are set depends on the type:
+//   TEXT_DELTA, REASONING_DELTA  text = content
+//   TOOL_START                   name, text = JSON arguments
+//   TOOL_RESULT                  name, ok = success, text = output,
+//                                value = duration in ms
+//   PERMISSION_REQUIRED          id, name = tool, text = details,
+//                                ok = dangerous
+//   PERMISSION_RESOLVED          id, ok = allowed
+//   ITERATION_START              value = iteration, limit = max iterations
+//   COMPLETED                    reason, stats
+//   ERROR                        text = message
 struct agent_event {
   agent_event_type type;
-  json data; // Event-specific payload
+  std::string_view id;
+  std::string_view name;
+  std::string_view text;
+  bool ok = false;
+  int64_t value = 0;
+  int64_t limit = 0;
+  agent_stop_reason reason = agent_stop_reason::COMPLETED;
+  const session_stats *stats = nullptr;
+
+  explicit agent_event(agent_event_type type) : type(type) {}
 
   // Convenience constructors
-  static agent_event text_delta(const std::string &content) {
-    return {agent_event_type::TEXT_DELTA, {{"content", content}}};
+  static agent_event text_delta(std::string_view content) {
+    agent_event e(agent_event_type::TEXT_DELTA);
+    e.text = content;
+    return e;
   }
 
-  static agent_event reasoning_delta(const std::string &content) {
-    return {agent_event_type::REASONING_DELTA, {{"content", content}}};
+  static agent_event reasoning_delta(std::string_view content) {
+    agent_event e(agent_event_type::REASONING_DELTA);
+    e.text = content;
+    return e;
   }
 
-  static agent_event tool_start(const std::string &name,
-                                const std::string &args) {
-    return {agent_event_type::TOOL_START,
-            {{"name", name}, {"args", args}}};
+  static agent_event tool_start(std::string_view name, std::string_view args) {
+    agent_event e(agent_event_type::TOOL_START);
+    e.name = name;
+    e.text = args;
+    return e;
   }
 
-  static agent_event tool_result(const std::string &name, bool success,
-                                 const std::string &output,
+  static agent_event tool_result(std::string_view name, bool success,
+                                 std::string_view output,
                                  int64_t duration_ms) {
-    return {agent_event_type::TOOL_RESULT,
-            {{"name", name}, {"success", success}, {"output", output}, {"duration_ms", duration_ms}}};
+    agent_event e(agent_event_type::TOOL_RESULT);
+    e.name = name;
+    e.ok = success;
+    e.text = output;
+    e.value = duration_ms;
+    return e;
   }
 
-
-  static agent_event permission_required(const std::string & required_id, const std::string& tool_name, const std::string& details, bool is_dangerous) {
-    return {agent_event_type::PERMISSION_REQUIRED,
-            {{"required_id", required_id}, {"tool", tool_name}, {"details", details}, {"dangerous", is_dangerous}}};
+  static agent_event permission_required(std::string_view required_id,
+                                         std::string_view tool_name,
+                                         std::string_view details,
+                                         bool is_dangerous) {
+    agent_event e(agent_event_type::PERMISSION_REQUIRED);
+    e.id = required_id;
+    e.name = tool_name;
+    e.text = details;
+    e.ok = is_dangerous;
+    return e;
   }
 
-  static agent_event permission_resolved(const std::string &required_id,
+  static agent_event permission_resolved(std::string_view required_id,
                                          bool allowed) {
-    return {agent_event_type::PERMISSION_RESOLVED,
-            {{"required_id", required_id}, {"allowed", allowed}}};
+    agent_event e(agent_event_type::PERMISSION_RESOLVED);
+    e.id = required_id;
+    e.ok = allowed;
+    return e;
   }
 
   static agent_event iteration_start(int iteration, int max_iterations) {
-    return {agent_event_type::ITERATION_START,
-            {{"iteration", iteration}, {"max_iterations", max_iterations}}};
+    agent_event e(agent_event_type::ITERATION_START);
+    e.value = iteration;
+    e.limit = max_iterations;
+    return e;
   }
 
   static agent_event completed(agent_stop_reason reason,
-                               const session_stats& stats) {
-    std::string reason_str;
-    switch (reason) {
-        case agent_stop_reason::COMPLETED: reason_str = "completed"; break;
-        case agent_stop_reason::MAX_ITERATIONS: reason_str = "max_iterations"; break;
-        case agent_stop_reason::USER_CANCELLED: reason_str = "user_cancelled"; break;
-        case agent_stop_reason::AGENT_ERROR: reason_str =  "error"; break;
-        }
-        return {
-          agent_event_type::COMPLETED, {
-            {"reason", reason_str}, {
-              "stats", {
-                {"input_tokens", stats.total_input},
-                    {"output_tokens", stats.total_output},
-                    {"cached_tokens", stats.total_cached}
-            }}
-        }};
+                               const session_stats &stats) {
+    agent_event e(agent_event_type::COMPLETED);
+    e.reason = reason;
+    e.stats = &stats;
+    return e;
   }
-  static agent_event error(const std::string &message) {
-    return {agent_event_type::ERROR, {{"message", message}}};
+
+  static agent_event error(std::string_view message) {
+    agent_event e(agent_event_type::ERROR);
+    e.text = message;
+    return e;
   }
 };
 
 // Callback type for streaming events
 using agent_event_callback = std::function<void(const agent_event &)>;
 
+enum class tool_authorization_status {
+  ALLOWED,
+  DENIED,
+  WAITING, // A permission request needs an answer
+};
+
+// Progress of the async permission checks of one tool call. The checks that
+// can ask the user (external path, doom loop, permission rules) run in
+// order; each question suspends the authorization until it is answered.
+struct tool_authorization {
+  json args;
+  permission_request req;
+  std::string args_hash;
+  int stage = 0;          // Next check to run
+  std::string pending_id; // Permission request waiting for an answer
+  std::chrono::steady_clock::time_point deadline; // ... and its timeout
+};
+
+class agent_turn;
+
 class agent_loop {
 public:
   // Standard constructor for main agent
@@ -178,6 +313,9 @@ public:
              const std::string &custom_system_prompt, int subagent_depth,
              tool_call_callback on_tool_call = nullptr);
 
+  // Waits for tool calls still running in the background
+  ~agent_loop();
+
 
   // Run the agent loop with an initial prompt (text only)
   agent_loop_result run(const std::string &user_prompt);
@@ -210,50 +348,208 @@ public:
                            permission_manager_async *async_perms = nullptr,
                            std::vector<raw_buffer> media_files = {});
 
+  // Start a streaming turn without running it. The caller drives it with
+  // agent_turn::resume(), typically from an executor, so the turn holds no
+  // thread while it waits for a permission answer or a tool batch.
+  // Same arguments as run_streaming_multimodal.
+  std::shared_ptr<agent_turn>
+  start_turn(const json &user_message, agent_event_callback on_event,
+             std::function<bool()> should_stop = nullptr,
+             permission_manager_async *async_perms = nullptr,
+             std::vector<raw_buffer> media_files = {});
+
+  // Record the spans of the following turns into trace (null = stop)
+  void set_trace(std::shared_ptr<turn_trace> trace) { trace_ = std::move(trace); }
+  const std::shared_ptr<turn_trace> &trace() const { return trace_; }
+
   // Clear conversation history
   void clear();
 
-  // Get current messages (for debugging)
-  const json &get_messages() const { return messages_; }
+  // Get current messages (OpenAI format, built on each call)
+  json get_messages() const { return messages_.to_json(); }
+
+  size_t message_count() const { return messages_.size(); }
+
+  // Message i of get_messages()
+  json get_message(size_t i) const { return messages_.to_json(i); }
+
+  // Changes whenever messages already in the history are rewritten or
+  // dropped (compaction, clear, restore); appends keep it
+  uint64_t history_version() const { return history_version_; }
+
+  // Heap bytes held by the conversation history
+  size_t history_bytes() const { return messages_.bytes(); }
 
   // Get session statistics
   const session_stats &get_stats() const { return stats_; }
 
+  // Prompt tokens taken by the tool definitions (0 before the first request)
+  int32_t get_tool_prompt_tokens() const { return prompt_.tool_section_tokens(); }
+
+  // Slot that holds this loop's KV cache, -1 before the first completion
+  int preferred_slot() const { return preferred_slot_; }
+  uint64_t slot_epoch() const { return slot_epoch_; }
+
+  // This loop's KV cache now lives in the slot of lease (e.g. restored from
+  // disk); the next completion prefers it
+  void adopt_slot(const slot_pool::lease &lease);
+
+  // Replace history and stats, e.g. for a session restored from disk
+  void restore(const json &messages, const session_stats &stats);
+
+  // Tokens of the system prompt and tool definitions up to the first user
+  // message (what kv_prefix_cache stores). Empty if the model is not loaded.
+  const llama_tokens &prompt_prefix_tokens();
+
+  // Put the prompt prefix into a slot ahead of the first completion, from
+  // the prefix cache or by warming it in the background. True if the slot
+  // already holds it.
+  bool preload_prompt_prefix();
+
 private:
+  friend class agent_turn;
+
   // Build prompt + parser metadata using server chat template config.
-  common_chat_params
-  format_chat_with_tools(const std::vector<common_chat_tool> &chat_tools);
+  // Only messages appended since the previous call are rendered/tokenized.
+  incremental_prompt_result
+  format_chat_with_tools(const tool_schema_snapshot_ptr &tools);
+
+  prompt_render_options
+  render_options(const server_chat_params &chat_params) const;
+
+  // Build a completion task (without id) for the current conversation
+  server_task build_completion_task();
+
+  // Claim a slot for one completion (see agent_config::slots) and count it;
+  // the lease must outlive the response reader
+  slot_pool::lease acquire_slot();
+
+  // Compact messages_ if it grew past the high-water mark
+  void compact_context_if_needed();
+
+  // Add new messages to the prompt-lookup index. Assistant replies are
+  // replayed against it first to measure draft acceptance.
+  void sync_lookup_index();
+
+  // Summarize messages_[begin, end) with a short, tool-less completion.
+  // Returns an empty string on failure.
+  std::string summarize_history(size_t begin, size_t end, int32_t n_ctx_slot);
+
   // Generate a completion and get the parsed response with tool calls
   common_chat_msg generate_completion(result_timings &out_timings);
 
-  // Generate a completion with streaming events via callback
+  // Generate a completion with streaming events via callback. Read-only
+  // tool calls whose arguments are complete are started while decoding
+  // continues (see start_tool_early).
   common_chat_msg
   generate_completion_streaming(result_timings &out_timings,
                                 agent_event_callback on_event,
-                                std::function<bool()> should_stop);
-
-  // Execute a single tool call
-  tool_result execute_tool_call(const common_chat_tool_call &call);
-
-  // Execute tool call with async permission handling (for streaming API)
-  // Emits PERMISSION_REQUIRED event and waits for async responses
-  tool_result execute_tool_call_async(const common_chat_tool_call &call,
-                                      agent_event_callback on_event,
-                                      permission_manager_async *async_perms,
-                                      std::function<bool()> should_stop);
-
-  // Format tool result as message
+                                std::function<bool()> should_stop,
+                                permission_manager_async *async_perms = nullptr);
+
+  // Start streamed tool call `index` on the tool worker pool if it is
+  // read-only, needs no permission prompt and does not depend on an earlier
+  // call of the same message
+  void start_tool_early(size_t index,
+                        const std::vector<common_chat_tool_call> &calls,
+                        permission_manager_async *async_perms);
+
+  // Wait for and forget all early tool calls
+  void drop_early_tool_calls();
+
+  // Permission checks for a single tool call (may prompt on the console).
+  // Returns true with the parsed `args` if the call may run, otherwise
+  // fills `denied` with the result to report.
+  bool authorize_tool_call(const common_chat_tool_call &call, json &args,
+                           tool_result &denied);
+
+  // Permission checks with async permission handling (for streaming API).
+  // Runs the checks from auth.stage on; a check that needs an answer emits
+  // PERMISSION_REQUIRED and returns WAITING with auth.pending_id set.
+  tool_authorization_status
+  advance_authorization(const common_chat_tool_call &call,
+                        tool_authorization &auth, agent_event_callback on_event,
+                        permission_manager_async *async_perms,
+                        tool_result &denied);
+
+  // Apply the answer to auth.pending_id (empty = timed out or cancelled)
+  // and continue with the remaining checks
+  tool_authorization_status
+  answer_authorization(const common_chat_tool_call &call,
+                       tool_authorization &auth,
+                       const std::optional<permission_response_async> &response,
+                       bool cancelled, agent_event_callback on_event,
+                       permission_manager_async *async_perms,
+                       tool_result &denied);
+
+  // Execute an authorized tool call (safe to run concurrently)
+  tool_result run_tool(const std::string &name, const json &args) const;
+
+  // How the authorized calls (indices into `calls`) may overlap
+  std::vector<tool_access>
+  tool_accesses(const std::vector<common_chat_tool_call> &calls,
+                const std::vector<json> &args,
+                const std::vector<size_t> &runnable) const;
+
+  // Run the authorized calls (indices into `calls`) on the tool worker pool,
+  // adding each call's execution time to elapsed_ms
+  std::vector<tool_result>
+  run_tool_calls(const std::vector<common_chat_tool_call> &calls,
+                 const std::vector<json> &args,
+                 const std::vector<size_t> &runnable,
+                 std::vector<int64_t> &elapsed_ms);
+
+  // Add the timings of one completion to stats_
+  void record_timings(const result_timings &timings);
+
+  // Append the parsed assistant message to messages_
+  void add_assistant_message(const common_chat_msg &parsed, int iteration);
+
+  // Execute all tool calls of one assistant message and append the tool
+  // messages in call order. Permissions are checked one call at a time,
+  // then independent calls run in parallel. Returns false if interrupted.
+  bool execute_tool_calls(const std::vector<common_chat_tool_call> &calls,
+                          int iteration);
+
+  // Id of a tool call, "call_<iteration>_<index>" if the model gave none
+  static std::string tool_call_id(const common_chat_tool_call &call,
+                                  int iteration, size_t index);
+
+  // Format tool result as message (the output is moved into the history)
   void add_tool_result_message(const std::string &tool_name,
                                const std::string &call_id,
-                               const tool_result &result);
+                               tool_result &&result);
 
   server_context &server_ctx_;
+  std::shared_ptr<completion_backend> backend_; // See agent_config::backend
   const common_params *params_; // Stored for subagent construction
   agent_config config_;
   std::atomic<bool> &is_interrupted_;
 
-  json messages_;
+  message_store messages_;
+  incremental_prompt prompt_; // Rendered/tokenized prefix of messages_
+  context_manager context_;   // Token count per message of messages_
+  prompt_lookup_index lookup_; // N-gram draft source over messages_
+  size_t lookup_synced_ = 0;   // Messages already in lookup_
+  uint64_t history_version_ = 0;
+  tool_schema_snapshot_ptr tools_; // Reused until the registry changes
+
+  // Tool calls started while their completion was still streaming, by
+  // tool call index
+  struct early_tool_result {
+    tool_result result;
+    int64_t elapsed_ms = 0;
+  };
+  struct early_tool_call {
+    common_chat_tool_call call;
+    std::future<early_tool_result> result;
+  };
+  std::map<size_t, early_tool_call> early_calls_;
   task_params task_defaults_;
+  int preferred_slot_ = -1; // Last slot used, see agent_config::slots
+  uint64_t slot_epoch_ = 0; // Lease stamp of that use, see slot_pool::holds
+  llama_tokens prefix_tokens_;        // See prompt_prefix_tokens()
+  uint64_t prefix_tools_version_ = 0; // Tool registry version of it
   permission_manager permission_mgr_;
   tool_context tool_ctx_;
   session_stats stats_;
@@ -265,6 +561,10 @@ private:
   tool_call_callback on_tool_call_; // Optional callback for tool reporting
   bool is_subagent_ = false;        // True if this is a subagent
 
+  // Tracing (subagents record into their parent's trace)
+  std::shared_ptr<turn_trace> trace_;
+  turn_trace::clock::time_point completion_posted_; // See record_timings()
+
   // Multimodal support
   std::vector<raw_buffer> media_files_; // Media files (images/audio) for current request
 
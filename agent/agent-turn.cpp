@@ -0,0 +1,395 @@
+#include "agent-turn.h"
+#include "tool-executor.h"
+
+#include <condition_variable>
+
+agent_turn::agent_turn(agent_loop &loop, const json &user_message,
+                       agent_event_callback on_event,
+                       std::function<bool()> should_stop,
+                       permission_manager_async *async_perms,
+                       std::vector<raw_buffer> media_files)
+    : loop_(loop), user_message_(user_message), on_event_(std::move(on_event)),
+      should_stop_(std::move(should_stop)), async_perms_(async_perms),
+      media_files_(std::move(media_files)) {}
+
+void agent_turn::set_wake(std::function<void()> wake,
+                          std::function<void(time_point)> wake_at) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  wake_ = std::move(wake);
+  wake_at_ = std::move(wake_at);
+}
+
+void agent_turn::notify() {
+  std::function<void()> wake;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    notified_ = true;
+    // Only a suspended turn is handed back, so the driver never runs two
+    // resume() calls at once and never hears from a finished turn
+    if (suspended_) {
+      suspended_ = false;
+      wake = wake_;
+    }
+  }
+  if (wake) {
+    wake();
+  }
+}
+
+void agent_turn::set_gate(std::function<bool()> enter,
+                          std::function<void()> leave) {
+  gate_enter_ = std::move(enter);
+  gate_leave_ = std::move(leave);
+}
+
+agent_turn_status agent_turn::resume() {
+  trace_scope scope(loop_.trace_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    notified_ = false;
+  }
+  while (phase_.load() != phase::DONE) {
+    if (step()) {
+      continue;
+    }
+    // Suspend, unless the wait ended while we were checking
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (notified_) {
+      notified_ = false;
+      continue;
+    }
+    if (wake_at_ && phase_.load() == phase::WAIT_PERMISSION) {
+      wake_at_(auth_.deadline);
+    }
+    suspended_ = true;
+    return agent_turn_status::WAITING;
+  }
+  return agent_turn_status::DONE;
+}
+
+agent_loop_result agent_turn::run_blocking() {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool woken = false;
+  set_wake([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    woken = true;
+    cv.notify_one();
+  });
+
+  while (resume() == agent_turn_status::WAITING) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (phase_.load() == phase::WAIT_PERMISSION) {
+      cv.wait_until(lock, auth_.deadline, [&] { return woken; });
+    } else {
+      cv.wait(lock, [&] { return woken; });
+    }
+    if (!woken) {
+      // Permission timeout, let resume() notice it
+      lock.unlock();
+      notify();
+      lock.lock();
+    }
+    woken = false;
+  }
+
+  set_wake(nullptr);
+  return result_;
+}
+
+bool agent_turn::step() {
+  switch (phase_.load()) {
+  case phase::START:
+    started_ = std::chrono::steady_clock::now();
+    loop_.media_files_ = std::move(media_files_);
+    loop_.messages_.push_back(user_message_);
+    phase_ = phase::GENERATE;
+    return true;
+  case phase::GENERATE:
+    return generate();
+  case phase::AUTHORIZE:
+    return authorize();
+  case phase::WAIT_PERMISSION:
+    return wait_permission();
+  case phase::RUN_TOOLS:
+    return run_tools();
+  case phase::WAIT_TOOLS:
+    return wait_tools();
+  case phase::FINISH_TOOLS:
+    return finish_tools();
+  case phase::DONE:
+    break;
+  }
+  return true;
+}
+
+void agent_turn::finish(agent_stop_reason reason) {
+  result_.stop_reason = reason;
+  if (auto trace = turn_trace::current()) {
+    trace->add_span("turn", "turn", turn_trace::current_lane(), started_,
+                    std::chrono::steady_clock::now(),
+                    {{"iterations", result_.iterations}});
+  }
+  on_event_(agent_event::completed(reason, loop_.stats_));
+  loop_.media_files_.clear();
+  phase_ = phase::DONE;
+}
+
+bool agent_turn::generate() {
+  if (result_.iterations >= loop_.config_.max_iterations) {
+    result_.final_response = "Reached maximum iterations (" +
+                             std::to_string(loop_.config_.max_iterations) + ")";
+    finish(agent_stop_reason::MAX_ITERATIONS);
+    return true;
+  }
+  if (should_stop_()) {
+    finish(agent_stop_reason::USER_CANCELLED);
+    return true;
+  }
+  if (gate_enter_ && !gate_enter_()) {
+    if (!gate_waiting_) {
+      gate_waiting_ = true;
+      gate_wait_start_ = std::chrono::steady_clock::now();
+    }
+    return false; // Queued for a slot
+  }
+  if (gate_waiting_) {
+    gate_waiting_ = false;
+    if (auto trace = turn_trace::current()) {
+      trace->add_span("slot_queue", "queue", turn_trace::current_lane(),
+                      gate_wait_start_, std::chrono::steady_clock::now());
+    }
+  }
+
+  result_.iterations++;
+  on_event_(agent_event::iteration_start(result_.iterations,
+                                         loop_.config_.max_iterations));
+
+  result_timings timings;
+  common_chat_msg parsed = loop_.generate_completion_streaming(
+      timings, on_event_, should_stop_, async_perms_);
+  loop_.record_timings(timings);
+  if (gate_leave_) {
+    gate_leave_();
+  }
+
+  if (parsed.content.empty() && parsed.tool_calls.empty() && should_stop_()) {
+    finish(agent_stop_reason::USER_CANCELLED);
+    return true;
+  }
+
+  loop_.add_assistant_message(parsed, result_.iterations);
+
+  if (parsed.tool_calls.empty()) {
+    result_.final_response = parsed.content;
+    finish(agent_stop_reason::COMPLETED);
+    return true;
+  }
+
+  const size_t n = parsed.tool_calls.size();
+  calls_ = std::move(parsed.tool_calls);
+  args_.assign(n, json());
+  results_.assign(n, tool_result{});
+  elapsed_ms_.assign(n, 0);
+  runnable_.clear();
+  prestarted_.clear();
+  next_call_ = 0;
+  auth_ = tool_authorization{};
+  phase_ = phase::AUTHORIZE;
+  return true;
+}
+
+void agent_turn::finish_authorization(bool allowed) {
+  size_t i = next_call_;
+  auto now = std::chrono::steady_clock::now();
+  elapsed_ms_[i] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       now - auth_start_)
+                       .count();
+  if (auto trace = turn_trace::current()) {
+    trace->add_span((auth_waited_ ? "permission_wait:" : "authorize:") +
+                        calls_[i].name,
+                    "permission", turn_trace::current_lane(), auth_start_, now,
+                    {{"allowed", allowed}});
+  }
+  auth_waited_ = false;
+  if (allowed) {
+    if (async_perms_) {
+      args_[i] = std::move(auth_.args);
+    }
+    runnable_.push_back(i);
+  }
+  auth_ = tool_authorization{};
+  next_call_++;
+}
+
+bool agent_turn::authorize() {
+  while (next_call_ < calls_.size()) {
+    const size_t i = next_call_;
+    const auto &call = calls_[i];
+
+    if (should_stop_()) {
+      loop_.drop_early_tool_calls();
+      finish(agent_stop_reason::USER_CANCELLED);
+      return true;
+    }
+
+    on_event_(agent_event::tool_start(call.name, call.arguments));
+
+    // Already authorized and running if the final call matches what was
+    // streamed
+    auto early = loop_.early_calls_.find(i);
+    if (early != loop_.early_calls_.end() &&
+        early->second.call.name == call.name &&
+        early->second.call.arguments == call.arguments) {
+      std::string args_hash =
+          std::to_string(std::hash<std::string>{}(call.arguments));
+      if (async_perms_) {
+        async_perms_->record_tool_call(call.name, args_hash);
+      } else {
+        loop_.permission_mgr_.record_tool_call(call.name, args_hash);
+      }
+      prestarted_.push_back(i);
+      next_call_++;
+      continue;
+    }
+
+    auth_start_ = std::chrono::steady_clock::now();
+    if (!async_perms_) {
+      // Console prompts block, there is nothing to suspend on
+      finish_authorization(
+          loop_.authorize_tool_call(call, args_[i], results_[i]));
+      continue;
+    }
+
+    auto status = loop_.advance_authorization(call, auth_, on_event_,
+                                              async_perms_, results_[i]);
+    if (status == tool_authorization_status::WAITING) {
+      auth_waited_ = true;
+      phase_ = phase::WAIT_PERMISSION;
+      async_perms_->notify_when_settled(
+          auth_.pending_id, [self = shared_from_this()]() { self->notify(); });
+      return true;
+    }
+    finish_authorization(status == tool_authorization_status::ALLOWED);
+  }
+
+  // Early calls had no conflicting predecessor; finishing them first keeps
+  // later calls that touch the same files in order
+  for (size_t i : prestarted_) {
+    auto early = loop_.early_calls_[i].result.get();
+    results_[i] = std::move(early.result);
+    elapsed_ms_[i] = early.elapsed_ms;
+  }
+  loop_.drop_early_tool_calls();
+
+  phase_ = phase::RUN_TOOLS;
+  return true;
+}
+
+bool agent_turn::wait_permission() {
+  std::optional<permission_response_async> response;
+  bool settled = async_perms_->take_response(auth_.pending_id, response);
+  bool cancelled = should_stop_();
+  if (!settled && !cancelled) {
+    if (std::chrono::steady_clock::now() < auth_.deadline) {
+      return false;
+    }
+    async_perms_->cancel(auth_.pending_id); // Timed out
+  }
+
+  const size_t i = next_call_;
+  auto status = loop_.answer_authorization(calls_[i], auth_, response,
+                                           cancelled, on_event_, async_perms_,
+                                           results_[i]);
+  if (status == tool_authorization_status::WAITING) {
+    async_perms_->notify_when_settled(
+        auth_.pending_id, [self = shared_from_this()]() { self->notify(); });
+    return true;
+  }
+  finish_authorization(status == tool_authorization_status::ALLOWED);
+  phase_ = phase::AUTHORIZE;
+  return true;
+}
+
+bool agent_turn::run_tools() {
+  if (runnable_.empty()) {
+    phase_ = phase::FINISH_TOOLS;
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tools_done_ = false;
+  }
+  phase_ = phase::WAIT_TOOLS;
+
+  // Subagents run their own tool batches (exclusive calls inline, the rest
+  // on the shared workers); run the whole batch on a long worker so neither
+  // this executor thread nor a pool worker waits for it
+  bool nested = false;
+  for (size_t i : runnable_) {
+    nested = nested || calls_[i].name == "task";
+  }
+  if (nested) {
+    tool_worker_pool::instance().submit_long([self = shared_from_this()]() {
+      auto batch = self->loop_.run_tool_calls(self->calls_, self->args_,
+                                              self->runnable_,
+                                              self->elapsed_ms_);
+      {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        self->batch_results_ = std::move(batch);
+        self->tools_done_ = true;
+      }
+      self->notify();
+    });
+    return true;
+  }
+
+  run_tool_batch_async(
+      loop_.tool_accesses(calls_, args_, runnable_),
+      [this](size_t k) {
+        size_t i = runnable_[k];
+        auto start_time = std::chrono::steady_clock::now();
+        tool_result res = loop_.run_tool(calls_[i].name, args_[i]);
+        elapsed_ms_[i] += std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - start_time)
+                              .count();
+        return res;
+      },
+      [self = shared_from_this()](std::vector<tool_result> batch) {
+        {
+          std::lock_guard<std::mutex> lock(self->mutex_);
+          self->batch_results_ = std::move(batch);
+          self->tools_done_ = true;
+        }
+        self->notify();
+      });
+  return true;
+}
+
+bool agent_turn::wait_tools() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!tools_done_) {
+    return false;
+  }
+  for (size_t k = 0; k < runnable_.size(); k++) {
+    results_[runnable_[k]] = std::move(batch_results_[k]);
+  }
+  batch_results_.clear();
+  phase_ = phase::FINISH_TOOLS;
+  return true;
+}
+
+bool agent_turn::finish_tools() {
+  // Results go back in the original call order
+  for (size_t i = 0; i < calls_.size(); i++) {
+    on_event_(agent_event::tool_result(calls_[i].name, results_[i].success,
+                                       results_[i].output, elapsed_ms_[i]));
+    loop_.add_tool_result_message(
+        calls_[i].name,
+        agent_loop::tool_call_id(calls_[i], result_.iterations, i),
+        std::move(results_[i]));
+  }
+  phase_ = phase::GENERATE;
+  return true;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "agent-loop.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+enum class agent_turn_status {
+  DONE,    // result() is final
+  WAITING, // Suspended until notify()
+};
+
+// One streaming turn of an agent_loop (user message -> completions and tool
+// calls -> final answer) as a resumable state machine
+//
+// resume() runs the turn until it finishes or has to wait for something
+// that needs no thread: a permission answer or a tool batch on the tool
+// worker pool. It then returns WAITING. Whoever completes the wait calls
+// notify(), which hands the turn back to its driver through the wake
+// function (e.g. by posting resume() to an executor). Generation itself
+// runs on the thread that called resume().
+class agent_turn : public std::enable_shared_from_this<agent_turn> {
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  // Use agent_loop::start_turn()
+  agent_turn(agent_loop &loop, const json &user_message,
+             agent_event_callback on_event, std::function<bool()> should_stop,
+             permission_manager_async *async_perms,
+             std::vector<raw_buffer> media_files);
+
+  // wake: called from any thread once a suspended turn can continue.
+  // wake_at: optional, asked to call notify() at a deadline (permission
+  // timeouts).
+  void set_wake(std::function<void()> wake,
+                std::function<void(time_point)> wake_at = nullptr);
+
+  // Optional limit on concurrent generations (e.g. server slots). enter()
+  // returns false if the turn has to wait, the gate then calls notify()
+  // when it may retry. leave() follows every generation that entered.
+  void set_gate(std::function<bool()> enter, std::function<void()> leave);
+
+  // Run until the turn is done or has to wait. Not reentrant.
+  agent_turn_status resume();
+
+  // A wait may be over (also used to make a waiting turn see cancellation)
+  void notify();
+
+  // Drive the turn on the calling thread, blocking while it waits
+  agent_loop_result run_blocking();
+
+  // True while suspended on a permission answer
+  bool waiting_for_permission() const {
+    return phase_.load() == phase::WAIT_PERMISSION;
+  }
+
+  const agent_loop_result &result() const { return result_; }
+
+private:
+  enum class phase {
+    START,
+    GENERATE,        // Run a completion
+    AUTHORIZE,       // Permission checks, one call at a time
+    WAIT_PERMISSION, // Suspended on auth_.pending_id
+    RUN_TOOLS,       // Start the authorized calls
+    WAIT_TOOLS,      // Suspended on the tool batch
+    FINISH_TOOLS,    // Emit results, append tool messages
+    DONE,
+  };
+
+  agent_loop &loop_;
+  json user_message_;
+  agent_event_callback on_event_;
+  std::function<bool()> should_stop_;
+  permission_manager_async *async_perms_;
+  std::vector<raw_buffer> media_files_;
+
+  std::atomic<phase> phase_{phase::START};
+  agent_loop_result result_;
+
+  // Tool calls of the current assistant message
+  std::vector<common_chat_tool_call> calls_;
+  std::vector<json> args_;
+  std::vector<tool_result> results_;
+  std::vector<int64_t> elapsed_ms_;
+  std::vector<size_t> runnable_;   // Passed the permission checks
+  std::vector<size_t> prestarted_; // Started while streaming
+  size_t next_call_ = 0;           // Next call to authorize
+  tool_authorization auth_;        // Checks of calls_[next_call_]
+  time_point auth_start_;
+  bool auth_waited_ = false; // Checks of calls_[next_call_] asked the user
+
+  // Trace spans that outlive a single resume()
+  time_point started_;
+  time_point gate_wait_start_;
+  bool gate_waiting_ = false;
+
+  // Wake-up handshake, see notify()
+  std::mutex mutex_;
+  std::function<void()> wake_;
+  std::function<void(time_point)> wake_at_;
+  std::function<bool()> gate_enter_;
+  std::function<void()> gate_leave_;
+  bool notified_ = false;
+  bool suspended_ = false;
+  bool tools_done_ = false;
+  std::vector<tool_result> batch_results_;
+
+  // One state transition. Returns false if the turn has to wait.
+  bool step();
+
+  bool generate();
+  bool authorize();
+  bool wait_permission();
+  bool run_tools();
+  bool wait_tools();
+  bool finish_tools();
+
+  // Record the outcome of the checks of calls_[next_call_] and move on
+  void finish_authorization(bool allowed);
+
+  void finish(agent_stop_reason reason);
+};
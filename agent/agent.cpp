@@ -5,7 +5,10 @@
 #include "llama.h"
 
 #include "agent-loop.h"
+#include "prefix-cache.h"
+#include "slot-pool.h"
 #include "tool-registry.h"
+#include "tool-result-cache.h"
 #include "permission.h"
 #include "skills/skills-manager.h"
 #include "agents-md/agents-md-manager.h"
@@ -111,6 +114,10 @@ int main(int argc, char ** argv) {
     bool enable_agents_md = true;
     std::vector<std::string> extra_skills_paths;
     int max_subagent_depth = 0;  // Default: subagents disabled (use --subagents to enable)
+    bool parallel_tools = true;
+    bool prefix_cache = false;
+    std::string prefix_cache_dir;  // Default: <config dir>/prompt-cache
+    std::string trace_file;        // Chrome trace of all turns, empty = off
 
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
@@ -207,6 +214,49 @@ int main(int argc, char ** argv) {
             }
             argc--;
             i--;  // Re-check this position
+        } else if (arg == "--no-parallel-tools") {
+            parallel_tools = false;
+            // Remove from argv
+            for (int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+            i--;  // Re-check this position
+        } else if (arg == "--prefix-cache") {
+            prefix_cache = true;
+            // Remove from argv
+            for (int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+            i--;  // Re-check this position
+        } else if (arg == "--trace") {
+            if (i + 1 < argc) {
+                trace_file = argv[i + 1];
+                // Remove both the flag and its value
+                for (int j = i; j < argc - 2; j++) {
+                    argv[j] = argv[j + 2];
+                }
+                argc -= 2;
+                i--;  // Re-check this position
+            } else {
+                fprintf(stderr, "--trace requires a value\n");
+                return 1;
+            }
+        } else if (arg == "--prefix-cache-dir") {
+            if (i + 1 < argc) {
+                prefix_cache = true;
+                prefix_cache_dir = argv[i + 1];
+                // Remove both the flag and its value
+                for (int j = i; j < argc - 2; j++) {
+                    argv[j] = argv[j + 2];
+                }
+                argc -= 2;
+                i--;  // Re-check this position
+            } else {
+                fprintf(stderr, "--prefix-cache-dir requires a value\n");
+                return 1;
+            }
         }
     }
 
@@ -338,13 +388,51 @@ int main(int argc, char ** argv) {
     config.skills_prompt_section = skills_mgr.generate_prompt_section();
     config.enable_agents_md = enable_agents_md;
     config.agents_md_prompt_section = agents_md_mgr.generate_prompt_section();
+    config.parallel_tool_calls = parallel_tools;
 
     // Configure subagent support
     subagent_display::instance().set_max_depth(max_subagent_depth);
 
+    // Persistent prompt cache: the KV state of the system prompt and tool
+    // definitions, one file per working directory. The file name hashes the
+    // prompt tokens, so edited AGENTS.md files, skills or tools make a new
+    // one that replaces the old; files of another model are ignored.
+    if (prefix_cache) {
+        if (prefix_cache_dir.empty() && !get_config_dir().empty()) {
+            prefix_cache_dir = (fs::path(get_config_dir()) / "prompt-cache").string();
+        }
+        if (prefix_cache_dir.empty()) {
+            console::log("Warning: no config directory, prompt cache disabled\n");
+        } else {
+            char dir_name[32];
+            snprintf(dir_name, sizeof(dir_name), "%016llx",
+                     (unsigned long long) std::hash<std::string>{}(working_dir));
+
+            std::error_code ec;
+            std::string model_id = params.model.path;
+            model_id += ":" + std::to_string(fs::file_size(params.model.path, ec));
+            model_id += ":" + std::to_string(
+                fs::last_write_time(params.model.path, ec).time_since_epoch().count());
+            model_id += ":" + std::to_string(params.n_ctx);
+
+            config.slots = std::make_shared<slot_pool>(std::max(1, params.n_parallel));
+            config.prefix_cache = std::make_shared<kv_prefix_cache>(
+                ctx_server, config.slots, (fs::path(prefix_cache_dir) / dir_name).string(),
+                1, true, model_id);
+        }
+    }
+
     // Create agent loop
     agent_loop agent(ctx_server, params, config, g_is_interrupted);
 
+    // Load the cached prefix now so the first turn only prefills the message
+    bool prefix_preloaded = agent.preload_prompt_prefix();
+
+    // One trace for the whole session, rewritten after every turn
+    if (!trace_file.empty()) {
+        agent.set_trace(std::make_shared<turn_trace>());
+    }
+
     // Display startup info
     console::log("\n");
     console::log("%s\n", LLAMA_AGENT_LOGO);
@@ -365,6 +453,9 @@ int main(int argc, char ** argv) {
     if (agents_md_count > 0) {
         console::log("agents.md  : %d file(s)\n", agents_md_count);
     }
+    if (config.prefix_cache) {
+        console::log("prompt cache: %s\n", prefix_preloaded ? "loaded" : "warming");
+    }
     console::log("\n");
 
     // Resolve initial prompt from -p/--prompt flag or stdin
@@ -450,10 +541,13 @@ int main(int argc, char ** argv) {
             }
             if (buffer == "/tools") {
                 console::log("\nAvailable tools:\n");
-                for (const auto * tool : tool_registry::instance().get_all_tools()) {
+                for (const auto & tool : tool_registry::instance().get_all_tools()) {
                     console::log("  %s:\n", tool->name.c_str());
                     console::log("    %s\n", tool->description.c_str());
                 }
+                if (agent.get_tool_prompt_tokens() > 0) {
+                    console::log("\nTool definitions use %d prompt tokens\n", agent.get_tool_prompt_tokens());
+                }
                 continue;
             }
             if (buffer == "/stats") {
@@ -462,9 +556,24 @@ int main(int argc, char ** argv) {
                 console::log("  Prompt tokens:  %d\n", stats.total_input);
                 console::log("  Output tokens:  %d\n", stats.total_output);
                 if (stats.total_cached > 0) {
-                    console::log("  Cached tokens:  %d\n", stats.total_cached);
+                    console::log("  Cached tokens:  %d (%.0f%% of prompt)\n", stats.total_cached,
+                                 100.0 * stats.cache_hit_ratio());
                 }
                 console::log("  Total tokens:   %d\n", stats.total_input + stats.total_output);
+                tool_cache_stats tc = tool_result_cache::instance().stats();
+                if (tc.hits + tc.misses > 0) {
+                    console::log("  Tool cache:     %lld/%lld read/glob calls reused\n",
+                                 (long long) tc.hits, (long long) (tc.hits + tc.misses));
+                }
+                if (config.prefix_cache) {
+                    prefix_cache_stats pc = config.prefix_cache->stats();
+                    if (pc.seeded > 0) {
+                        console::log("  Prompt cache:   %lld tokens loaded from disk (%.0f ms)\n",
+                                     (long long) pc.seeded_tokens, pc.seed_ms);
+                    } else if (pc.warmed > 0) {
+                        console::log("  Prompt cache:   saved for the next run\n");
+                    }
+                }
 
                 // Show subagent breakdown if any subagents were used
                 if (stats.subagent_count > 0) {
@@ -486,6 +595,22 @@ int main(int argc, char ** argv) {
                     console::log("    Total tokens:   %d\n", main_input + main_output);
                 }
 
+                if (stats.compactions > 0) {
+                    console::log("\n  Context compactions: %d (%d tokens saved)\n",
+                        stats.compactions, stats.compaction_tokens_saved);
+                }
+
+                if (stats.lookup_est_drafted > 0) {
+                    console::log("  Prompt lookup:  %lld/%lld drafted tokens would match (%.1f%%, estimate)\n",
+                        (long long)stats.lookup_est_accepted, (long long)stats.lookup_est_drafted,
+                        100.0 * stats.lookup_est_accepted / stats.lookup_est_drafted);
+                }
+                if (stats.draft_n > 0) {
+                    console::log("  Speculative:    %lld/%lld draft tokens accepted (%.1f%%)\n",
+                        (long long)stats.draft_accepted, (long long)stats.draft_n,
+                        100.0 * stats.draft_accepted / stats.draft_n);
+                }
+
                 if (stats.total_prompt_ms > 0) {
                     console::log("  Prompt time:    %.2fs\n", stats.total_prompt_ms / 1000.0);
                 }
@@ -541,6 +666,14 @@ int main(int argc, char ** argv) {
 
         console::log("\n");
 
+        if (agent.trace()) {
+            std::ofstream out(trace_file, std::ios::trunc);
+            out << agent.trace()->to_json().dump();
+            if (!out.good()) {
+                console::error("Failed to write trace to %s\n", trace_file.c_str());
+            }
+        }
+
         // Display result
         switch (result.stop_reason) {
             case agent_stop_reason::COMPLETED:
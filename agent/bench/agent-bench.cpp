@@ -0,0 +1,317 @@
+// Agent-loop overhead with a scripted model
+//
+// Runs agent loops against a stand-in for server_context that replays a
+// fixed script: each turn makes --tool-iterations completions that call
+// read/glob on a generated workspace, then one that answers in text. Tokens
+// stream at --tps per session (0 = as fast as the loop takes them), so all
+// time beyond the simulated decode is the agent's own: prompt rendering,
+// message JSON, tool dispatch, event emission and SSE serialization.
+// No model is loaded, so it runs on any CPU with thousands of sessions.
+//
+// usage: llama-agent-bench [--sessions 1,16,256] [--turns 4] [--tool-iterations 3]
+//                          [--reply-tokens 64] [--tps 0] [--threads N]
+//                          [--chat-template-file FILE] [--no-tool-cache] [--breakdown]
+
+#include "chat.h"
+
+#include "agent-loop.h"
+#include "event-encoder.h"
+#include "scripted-backend.h"
+#include "tool-result-cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+using bench_clock = std::chrono::steady_clock;
+
+static const int WORKSPACE_FILES = 32;
+
+static std::vector<int> parse_session_counts(const std::string & value) {
+    std::vector<int> counts;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int n = std::stoi(item);
+        if (n > 0) {
+            counts.push_back(n);
+        }
+    }
+    return counts;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+// Source-like files for the scripted read/glob calls, returns their paths
+static std::vector<std::string> make_workspace(const fs::path & dir) {
+    std::vector<std::string> paths;
+    fs::create_directories(dir / "src");
+    for (int i = 0; i < WORKSPACE_FILES; i++) {
+        paths.push_back("src/module_" + std::to_string(i) + ".cpp");
+        std::ofstream out(dir / paths.back());
+        for (int line = 0; line < 200; line++) {
+            out << "int module_" << i << "_fn_" << line << "(int x) { return x * " << line << " + " << i << "; }\n";
+        }
+    }
+    return paths;
+}
+
+struct bench_session {
+    std::atomic<bool> interrupted{false};
+    std::shared_ptr<scripted_backend> backend;
+    std::unique_ptr<agent_loop> loop;
+};
+
+struct round_result {
+    std::vector<double> overhead_us; // Per iteration, one sample per turn
+    int64_t iterations = 0;
+    int64_t events     = 0;
+    int64_t sse_bytes  = 0;
+    int64_t failed     = 0;         // Turns that did not complete
+    double wall_s      = 0;
+    std::map<std::string, double> phase_us; // --breakdown: span time by name
+    double sse_us      = 0;
+};
+
+// Span name up to the first ':' ("tool:read" -> "tool")
+static std::string phase_of(const std::string & span) {
+    return span.substr(0, span.find(':'));
+}
+
+static round_result run_round(server_context & ctx_server, const common_params & params,
+                              const agent_config & base_config, const std::shared_ptr<const scripted_model> & model,
+                              int n_sessions, int n_turns, int n_threads, bool breakdown) {
+    round_result out;
+    std::mutex out_mutex;
+
+    bench_clock::time_point t_start = bench_clock::now();
+
+    std::vector<std::thread> workers;
+    n_threads = std::max(1, std::min(n_threads, n_sessions));
+    for (int w = 0; w < n_threads; w++) {
+        workers.emplace_back([&, w]() {
+            round_result local;
+            std::string sse; // Reused like the server's stream buffer
+
+            // Sessions stay resident and take turns, like server sessions
+            std::vector<std::unique_ptr<bench_session>> sessions;
+            for (int s = w; s < n_sessions; s += n_threads) {
+                auto sess = std::make_unique<bench_session>();
+                sess->backend = std::make_shared<scripted_backend>(model, s);
+                agent_config config = base_config;
+                config.backend = sess->backend;
+                sess->loop = std::make_unique<agent_loop>(ctx_server, params, config, sess->interrupted);
+                sessions.push_back(std::move(sess));
+            }
+
+            for (int t = 0; t < n_turns; t++) {
+                for (auto & sess : sessions) {
+                    std::shared_ptr<turn_trace> trace;
+                    if (breakdown) {
+                        trace = std::make_shared<turn_trace>();
+                        sess->loop->set_trace(trace);
+                    }
+
+                    int64_t simulated_before = sess->backend->simulated_us();
+                    auto on_event = [&](const agent_event & event) {
+                        auto t0 = bench_clock::now();
+                        sse.clear();
+                        append_event_sse(sse, event);
+                        local.sse_bytes += sse.size();
+                        local.events++;
+                        local.sse_us += std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count();
+                    };
+
+                    auto t0 = bench_clock::now();
+                    agent_loop_result res = sess->loop->run_streaming(
+                        "Turn " + std::to_string(t) + ": look through src/ and summarize the modules.", on_event);
+                    double turn_us = std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count();
+
+                    if (res.stop_reason != agent_stop_reason::COMPLETED || res.iterations <= 0) {
+                        local.failed++;
+                        continue;
+                    }
+                    double simulated = (double)(sess->backend->simulated_us() - simulated_before);
+                    local.overhead_us.push_back(std::max(0.0, turn_us - simulated) / res.iterations);
+                    local.iterations += res.iterations;
+
+                    if (trace) {
+                        for (const auto & e : trace->to_json()["traceEvents"]) {
+                            if (e.value("ph", "") == "X") {
+                                local.phase_us[phase_of(e.value("name", ""))] += e.value("dur", 0.0);
+                            }
+                        }
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(out_mutex);
+            out.overhead_us.insert(out.overhead_us.end(), local.overhead_us.begin(), local.overhead_us.end());
+            out.iterations += local.iterations;
+            out.events     += local.events;
+            out.sse_bytes  += local.sse_bytes;
+            out.failed     += local.failed;
+            out.sse_us     += local.sse_us;
+            for (const auto & [phase, us] : local.phase_us) {
+                out.phase_us[phase] += us;
+            }
+        });
+    }
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    out.wall_s = std::chrono::duration<double>(bench_clock::now() - t_start).count();
+    return out;
+}
+
+int main(int argc, char ** argv) {
+    std::vector<int> session_counts = {1, 16, 256};
+    int turns = 4;
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    scripted_model_params script;
+    std::string template_file;
+    bool tool_cache = true;
+    bool breakdown = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--no-tool-cache") {
+            tool_cache = false;
+            continue;
+        }
+        if (arg == "--breakdown") {
+            breakdown = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s requires a value\n", arg.c_str());
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--sessions") {
+                session_counts = parse_session_counts(value);
+            } else if (arg == "--turns") {
+                turns = std::max(1, std::stoi(value));
+            } else if (arg == "--tool-iterations") {
+                script.tool_iterations = std::max(0, std::stoi(value));
+            } else if (arg == "--reply-tokens") {
+                script.reply_tokens = std::max(1, std::stoi(value));
+            } else if (arg == "--tps") {
+                script.tokens_per_second = std::max(0.0, std::stod(value));
+            } else if (arg == "--threads") {
+                threads = std::max(1, std::stoi(value));
+            } else if (arg == "--chat-template-file") {
+                template_file = value;
+            } else {
+                fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+                return 1;
+            }
+        } catch (...) {
+            fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+            return 1;
+        }
+    }
+
+    if (session_counts.empty()) {
+        fprintf(stderr, "--sessions must contain at least one positive count\n");
+        return 1;
+    }
+
+    if (!template_file.empty()) {
+        std::ifstream in(template_file);
+        if (!in) {
+            fprintf(stderr, "Cannot read %s\n", template_file.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << in.rdbuf();
+        script.chat_template = ss.str();
+    }
+
+    fs::path workspace = fs::temp_directory_path() /
+                         ("llama-agent-bench-" + std::to_string(bench_clock::now().time_since_epoch().count()));
+    script.read_paths = make_workspace(workspace);
+    script.glob_patterns = {"src/*.cpp", "**/module_1*.cpp"};
+
+    std::shared_ptr<const scripted_model> model;
+    try {
+        model = std::make_shared<scripted_model>(script);
+    } catch (const std::exception & e) {
+        fprintf(stderr, "Invalid chat template: %s\n", e.what());
+        fs::remove_all(workspace);
+        return 1;
+    }
+
+    if (!tool_cache) {
+        tool_result_cache::instance().set_budget(0);
+    }
+
+    // The loop only needs the server for subagents and slot KV files, which
+    // the script never uses; no model is loaded
+    common_params params;
+    server_context ctx_server;
+
+    agent_config config;
+    config.working_dir = workspace.string();
+    config.max_iterations = script.tool_iterations + 1;
+    config.yolo_mode = true;
+    config.enable_skills = false;
+    config.enable_agents_md = false;
+
+    std::string pace = script.tokens_per_second > 0 ? std::to_string((int)script.tokens_per_second) + " tok/s"
+                                                   : "unpaced";
+    printf("turns/session %d, completions/turn %d, reply %d tokens, %s, %d threads\n",
+           turns, script.tool_iterations + 1, script.reply_tokens, pace.c_str(), threads);
+    printf("%8s %8s %9s %10s %10s %10s %10s %10s %10s\n",
+           "sessions", "failed", "wall_s", "iter/s", "mean_us", "p50_us", "p99_us", "events", "sse_kb");
+
+    for (int n_sessions : session_counts) {
+        round_result r = run_round(ctx_server, params, config, model, n_sessions, turns, threads, breakdown);
+
+        double mean = 0.0;
+        for (double us : r.overhead_us) {
+            mean += us;
+        }
+        mean = r.overhead_us.empty() ? 0.0 : mean / r.overhead_us.size();
+
+        printf("%8d %8lld %9.2f %10.0f %10.1f %10.1f %10.1f %10lld %10.1f\n",
+               n_sessions, (long long)r.failed, r.wall_s, r.iterations / std::max(r.wall_s, 1e-9), mean,
+               percentile(r.overhead_us, 0.50), percentile(r.overhead_us, 0.99), (long long)r.events,
+               r.sse_bytes / 1024.0);
+
+        if (breakdown && r.iterations > 0) {
+            // Per iteration; "completion" includes reading the stream
+            printf("         per iteration:");
+            for (const auto & [phase, us] : r.phase_us) {
+                printf(" %s %.1fus", phase.c_str(), us / r.iterations);
+            }
+            printf(" sse %.1fus\n", r.sse_us / r.iterations);
+        }
+        fflush(stdout);
+    }
+
+    std::error_code ec;
+    fs::remove_all(workspace, ec);
+
+    return 0;
+}
@@ -0,0 +1,293 @@
+// Load generator for llama-agent-server
+//
+// Opens N agent sessions at once, each sending --turns chat messages (or
+// for --duration seconds) and reading the SSE stream of every turn.
+// Permission requests are answered right away, so the permission routes
+// are part of the load. Reports time to first token, turn latency and
+// event throughput percentiles, plus the share of turns refused with 429
+// or failing otherwise.
+//
+// Against a model:     llama-agent-server -m tiny.gguf -np 4
+// Without one:         llama-agent-server --mock-model --mock-tps 200 --mock-bash-every 3 -np 4
+//
+// usage: llama-agent-loadgen [--url http://127.0.0.1:8080] [--sessions 16] [--turns 5]
+//                            [--duration SEC] [--prompts FILE] [--yolo] [--api-key KEY]
+
+#include "../../third_party/llama.cpp/common/http.h"
+
+#include <cpp-httplib/httplib.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+using bench_clock = std::chrono::steady_clock;
+
+static const int SSE_TIMEOUT_SEC = 600;
+
+struct loadgen_options {
+    std::string url = "http://127.0.0.1:8080";
+    std::string api_key;
+    int sessions = 16;
+    int turns = 5;
+    double duration_s = 0; // > 0: keep sending until then instead of --turns
+    bool yolo = false;
+    std::vector<std::string> prompts = {
+        "List the files in the current directory.",
+        "Find the build files and explain how the project is built.",
+        "Read the README and summarize it in three sentences.",
+        "Which source files are the largest? Run a command to check.",
+    };
+};
+
+// Measurements of all sessions
+struct loadgen_stats {
+    std::mutex mutex;
+    std::vector<double> ttft_ms;
+    std::vector<double> turn_ms;
+    std::vector<double> events_per_s; // Per turn
+    std::vector<double> permission_ms;
+    int64_t attempts = 0;  // Chat requests sent
+    int64_t completed = 0; // Turns that ended with a completed event
+    int64_t rejected = 0;  // 429
+    int64_t errors = 0;    // Any other failure
+    int64_t events = 0;
+    int64_t session_errors = 0;
+};
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+// path under the base URL's path ("" or "/" at the root)
+static std::string route(std::string base, const std::string & path) {
+    while (!base.empty() && base.back() == '/') {
+        base.pop_back();
+    }
+    return base + path;
+}
+
+static httplib::Headers make_headers(const loadgen_options & opt, const char * accept) {
+    httplib::Headers headers;
+    headers.emplace("Accept", accept);
+    if (!opt.api_key.empty()) {
+        headers.emplace("Authorization", "Bearer " + opt.api_key);
+    }
+    return headers;
+}
+
+// One chat turn; sets retry_after_s > 0 if the server refused it with 429
+static void run_turn(const loadgen_options & opt, const std::string & session_id, const std::string & prompt,
+                     loadgen_stats & stats, double & retry_after_s) {
+    auto [cli, parts] = common_http_client(opt.url);
+    cli.set_read_timeout(SSE_TIMEOUT_SEC, 0);
+    auto [perm_cli, perm_parts] = common_http_client(opt.url);
+
+    double ttft_ms = -1;
+    int64_t n_events = 0;
+    bool completed = false;
+    bool failed = false;
+    std::vector<double> permission_ms;
+
+    std::string buffer;
+    std::string event_type;
+    const auto t_start = bench_clock::now();
+
+    auto on_event = [&](const std::string & type, const std::string & payload) {
+        n_events++;
+        if (ttft_ms < 0 && (type == "text_delta" || type == "reasoning_delta")) {
+            ttft_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t_start).count();
+        } else if (type == "permission_required") {
+            json data = json::parse(payload, nullptr, false);
+            std::string id = data.is_object() ? data.value("required_id", "") : "";
+            auto t0 = bench_clock::now();
+            auto res = perm_cli.Post(route(perm_parts.path, "/v1/agent/permission/" + id),
+                                     make_headers(opt, "application/json"), json{{"allow", true}}.dump(),
+                                     "application/json");
+            if (!res || res->status != 200) {
+                failed = true;
+            }
+            permission_ms.push_back(std::chrono::duration<double, std::milli>(bench_clock::now() - t0).count());
+        } else if (type == "completed") {
+            completed = true;
+        } else if (type == "error") {
+            failed = true;
+        }
+    };
+
+    auto receiver = [&](const char * data, size_t len) -> bool {
+        buffer.append(data, len);
+        for (size_t pos; (pos = buffer.find('\n')) != std::string::npos;) {
+            std::string line = buffer.substr(0, pos);
+            buffer.erase(0, pos + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.rfind("event: ", 0) == 0) {
+                event_type = line.substr(7);
+            } else if (line.rfind("data: ", 0) == 0) {
+                on_event(event_type, line.substr(6));
+            }
+        }
+        return true;
+    };
+
+    auto res = cli.Post(route(parts.path, "/v1/agent/session/" + session_id + "/chat"),
+                        make_headers(opt, "text/event-stream"), json{{"content", prompt}}.dump(),
+                        "application/json", receiver);
+    const double turn_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t_start).count();
+
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    stats.attempts++;
+    if (res && res->status == 429) {
+        stats.rejected++;
+        retry_after_s = 1.0;
+        try {
+            retry_after_s = std::max(0.1, std::stod(res->get_header_value("Retry-After")));
+        } catch (...) {
+        }
+        return;
+    }
+    stats.events += n_events;
+    stats.permission_ms.insert(stats.permission_ms.end(), permission_ms.begin(), permission_ms.end());
+    if (!res || res->status != 200 || !completed || failed) {
+        stats.errors++;
+        return;
+    }
+    stats.completed++;
+    stats.turn_ms.push_back(turn_ms);
+    if (ttft_ms >= 0) {
+        stats.ttft_ms.push_back(ttft_ms);
+    }
+    stats.events_per_s.push_back(n_events / std::max(turn_ms / 1000.0, 1e-9));
+}
+
+static void run_session(const loadgen_options & opt, int index, bench_clock::time_point deadline,
+                        loadgen_stats & stats) {
+    auto [cli, parts] = common_http_client(opt.url);
+    auto res = cli.Post(route(parts.path, "/v1/agent/session"), make_headers(opt, "application/json"),
+                        json{{"yolo", opt.yolo}}.dump(), "application/json");
+    json body = res ? json::parse(res->body, nullptr, false) : json();
+    if (!res || res->status != 201 || !body.is_object() || !body.contains("session_id")) {
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        stats.session_errors++;
+        return;
+    }
+    const std::string session_id = body["session_id"].get<std::string>();
+
+    for (int turn = 0;; turn++) {
+        if (opt.duration_s > 0 ? bench_clock::now() >= deadline : turn >= opt.turns) {
+            break;
+        }
+        const std::string & prompt = opt.prompts[(index + turn) % opt.prompts.size()];
+        double retry_after_s = 0;
+        run_turn(opt, session_id, prompt, stats, retry_after_s);
+        if (retry_after_s > 0) {
+            // Refused, not sent: try the same turn again
+            std::this_thread::sleep_for(std::chrono::duration<double>(retry_after_s));
+            turn--;
+        }
+    }
+
+    cli.Post(route(parts.path, "/v1/agent/session/" + session_id + "/delete"), make_headers(opt, "application/json"),
+             "", "application/json");
+}
+
+int main(int argc, char ** argv) {
+    loadgen_options opt;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--yolo") {
+            opt.yolo = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s requires a value\n", arg.c_str());
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--url") {
+                opt.url = value;
+            } else if (arg == "--api-key") {
+                opt.api_key = value;
+            } else if (arg == "--sessions") {
+                opt.sessions = std::max(1, std::stoi(value));
+            } else if (arg == "--turns") {
+                opt.turns = std::max(1, std::stoi(value));
+            } else if (arg == "--duration") {
+                opt.duration_s = std::max(0.0, std::stod(value));
+            } else if (arg == "--prompts") {
+                // One prompt per line; repeat a line to weight it
+                std::ifstream in(value);
+                if (!in) {
+                    fprintf(stderr, "Cannot read %s\n", value.c_str());
+                    return 1;
+                }
+                opt.prompts.clear();
+                for (std::string line; std::getline(in, line);) {
+                    if (!line.empty()) {
+                        opt.prompts.push_back(line);
+                    }
+                }
+                if (opt.prompts.empty()) {
+                    fprintf(stderr, "%s has no prompts\n", value.c_str());
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+                return 1;
+            }
+        } catch (...) {
+            fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+            return 1;
+        }
+    }
+
+    loadgen_stats stats;
+    const auto t_start = bench_clock::now();
+    const auto deadline = t_start + std::chrono::duration_cast<bench_clock::duration>(
+                                        std::chrono::duration<double>(opt.duration_s));
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < opt.sessions; i++) {
+        workers.emplace_back(run_session, std::cref(opt), i, deadline, std::ref(stats));
+    }
+    for (auto & w : workers) {
+        w.join();
+    }
+    const double wall_s = std::chrono::duration<double>(bench_clock::now() - t_start).count();
+
+    const double attempts = std::max<int64_t>(1, stats.attempts);
+    printf("%d sessions, %lld turns in %.1f s (%lld completed), %.1f events/s overall\n",
+           opt.sessions, (long long)stats.attempts, wall_s, (long long)stats.completed,
+           stats.events / std::max(wall_s, 1e-9));
+    printf("429 rate %.2f%%, error rate %.2f%%, sessions not created %lld\n",
+           100.0 * stats.rejected / attempts, 100.0 * stats.errors / attempts, (long long)stats.session_errors);
+    printf("%-16s %10s %10s %10s %10s\n", "", "p50", "p95", "p99", "samples");
+    auto row = [](const char * name, const std::vector<double> & v) {
+        printf("%-16s %10.1f %10.1f %10.1f %10zu\n", name, percentile(v, 0.50), percentile(v, 0.95),
+               percentile(v, 0.99), v.size());
+    };
+    row("ttft_ms", stats.ttft_ms);
+    row("turn_ms", stats.turn_ms);
+    row("events/s", stats.events_per_s);
+    row("permission_ms", stats.permission_ms);
+
+    return stats.errors > 0 || stats.session_errors > 0 ? 1 : 0;
+}
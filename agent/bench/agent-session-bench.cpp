@@ -0,0 +1,268 @@
+// Session table under load: lookups while listing and churning
+//
+// Fills a table with --sessions entries, then for --seconds runs --threads
+// threads that look sessions up and touch them (what every chat, status and
+// permission request does), one thread that lists all sessions the way
+// GET /v1/agent/sessions does, and one that creates and deletes sessions.
+// Runs the sharded session_table and, for comparison, the single map behind
+// one mutex that agent_session_manager used before, where listing held the
+// lock while it read every session.
+//
+// usage: llama-agent-session-bench [--sessions 1000,10000,50000] [--seconds 2] [--threads N]
+
+#include "server/session-table.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+// Stand-in for agent_session: info() copies a few fields under its lock
+struct fake_session {
+    struct info_t {
+        std::string id;
+        bench_clock::time_point last_activity;
+        int64_t messages = 0;
+        int64_t tokens[4] = {};
+    };
+
+    explicit fake_session(std::string id) { info_.id = std::move(id); }
+
+    void touch() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        info_.last_activity = bench_clock::now();
+        info_.messages++;
+    }
+
+    info_t info() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return info_;
+    }
+
+    mutable std::mutex mutex_;
+    info_t info_;
+};
+
+using session_ptr = std::shared_ptr<fake_session>;
+
+// The previous layout: one ordered map, one mutex, listing under the lock
+class locked_map {
+public:
+    void insert(const std::string & id, session_ptr s) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        items_[id] = std::move(s);
+    }
+
+    session_ptr find(const std::string & id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = items_.find(id);
+        return it != items_.end() ? it->second : nullptr;
+    }
+
+    void erase(const std::string & id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        items_.erase(id);
+    }
+
+    std::vector<fake_session::info_t> list() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<fake_session::info_t> out;
+        out.reserve(items_.size());
+        for (const auto & item : items_) {
+            out.push_back(item.second->info());
+        }
+        return out;
+    }
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, session_ptr> items_;
+};
+
+// session_table the way agent_session_manager uses it
+class sharded {
+public:
+    void insert(const std::string & id, session_ptr s) { table_.insert(id, std::move(s)); }
+
+    session_ptr find(const std::string & id) { return table_.find(id); }
+
+    void erase(const std::string & id) { table_.erase(id); }
+
+    std::vector<fake_session::info_t> list() {
+        auto sessions = table_.snapshot();
+        std::vector<fake_session::info_t> out;
+        out.reserve(sessions.size());
+        for (const auto & s : sessions) {
+            out.push_back(s->info());
+        }
+        std::sort(out.begin(), out.end(), [](const auto & a, const auto & b) { return a.id < b.id; });
+        return out;
+    }
+
+private:
+    session_table<fake_session> table_;
+};
+
+static std::string session_id(uint64_t n) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "sess_%08llx", (unsigned long long)n);
+    return buf;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+struct bench_result {
+    double create_per_s  = 0; // Filling the table, one thread
+    double lookups_per_s = 0;
+    double lookup_p99_us = 0;
+    double lookup_max_us = 0;
+    double list_p50_ms   = 0;
+    double churn_per_s   = 0; // Create + delete pairs
+};
+
+template <typename Table>
+static bench_result run(int n_sessions, double seconds, int n_threads) {
+    bench_result r;
+    Table table;
+
+    auto t0 = bench_clock::now();
+    for (int i = 0; i < n_sessions; i++) {
+        std::string id = session_id(i);
+        table.insert(id, std::make_shared<fake_session>(id));
+    }
+    r.create_per_s = n_sessions / std::max(std::chrono::duration<double>(bench_clock::now() - t0).count(), 1e-9);
+
+    std::atomic<bool> stop{false};
+    std::atomic<int64_t> lookups{0};
+    std::atomic<int64_t> churned{0};
+    std::mutex samples_mutex;
+    std::vector<double> lookup_us;
+    std::vector<double> list_ms;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 rng(t + 1);
+            std::uniform_int_distribution<int> pick(0, n_sessions - 1);
+            std::vector<double> samples;
+            int64_t n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                std::string id = session_id(pick(rng));
+                auto start = bench_clock::now();
+                if (auto s = table.find(id)) {
+                    s->touch();
+                }
+                // Every 16th lookup is timed to keep clock reads off the path
+                if (n++ % 16 == 0) {
+                    samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+                }
+            }
+            lookups += n;
+            std::lock_guard<std::mutex> lock(samples_mutex);
+            lookup_us.insert(lookup_us.end(), samples.begin(), samples.end());
+        });
+    }
+    threads.emplace_back([&]() {
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto start = bench_clock::now();
+            auto infos = table.list();
+            list_ms.push_back(std::chrono::duration<double, std::milli>(bench_clock::now() - start).count());
+        }
+    });
+    threads.emplace_back([&]() {
+        // Ids above the initial ones, so lookups keep finding sessions
+        for (uint64_t n = n_sessions; !stop.load(std::memory_order_relaxed); n++) {
+            std::string id = session_id(n);
+            table.insert(id, std::make_shared<fake_session>(id));
+            table.erase(id);
+            churned++;
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    r.lookups_per_s = lookups / seconds;
+    r.lookup_p99_us = percentile(lookup_us, 0.99);
+    r.lookup_max_us = lookup_us.empty() ? 0.0 : *std::max_element(lookup_us.begin(), lookup_us.end());
+    r.list_p50_ms   = percentile(list_ms, 0.50);
+    r.churn_per_s   = churned / seconds;
+    return r;
+}
+
+static void print_row(const char * name, int n_sessions, const bench_result & r) {
+    printf("%-8s %9d %11.0f %12.0f %12.2f %12.1f %11.2f %10.0f\n", name, n_sessions, r.create_per_s,
+           r.lookups_per_s, r.lookup_p99_us, r.lookup_max_us, r.list_p50_ms, r.churn_per_s);
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+    std::vector<int> session_counts = {1000, 10000, 50000};
+    double seconds = 2.0;
+    int threads = (int)std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "%s requires a value\n", arg.c_str());
+            return 1;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--sessions") {
+                session_counts.clear();
+                std::stringstream ss(value);
+                for (std::string item; std::getline(ss, item, ',');) {
+                    if (std::stoi(item) > 0) {
+                        session_counts.push_back(std::stoi(item));
+                    }
+                }
+            } else if (arg == "--seconds") {
+                seconds = std::max(0.1, std::stod(value));
+            } else if (arg == "--threads") {
+                threads = std::max(1, std::stoi(value));
+            } else {
+                fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+                return 1;
+            }
+        } catch (...) {
+            fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+            return 1;
+        }
+    }
+
+    if (session_counts.empty()) {
+        fprintf(stderr, "--sessions must contain at least one positive count\n");
+        return 1;
+    }
+
+    printf("%d lookup threads, 1 listing, 1 churning, %.1f s per run\n", threads, seconds);
+    printf("%-8s %9s %11s %12s %12s %12s %11s %10s\n",
+           "table", "sessions", "create/s", "lookups/s", "lookup_p99", "lookup_max", "list_ms", "churn/s");
+    for (int n : session_counts) {
+        print_row("mutex", n, run<locked_map>(n, seconds, threads));
+        print_row("sharded", n, run<sharded>(n, seconds, threads));
+    }
+
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Time-to-first-token vs. concurrent session count
+//
+// Runs N agent loops against one shared server_context, all starting at the
+// same moment, and reports how long each waits for its first streamed token.
+// The measured interval includes prompt rendering/tokenization and task
+// posting, so it shows whether sessions still block each other before they
+// reach a slot.
+//
+// usage: llama-agent-ttft-bench -m model.gguf -np 16 [--sessions 1,2,4,8,16]
+//                               [--reps 3] [--bench-prompt "..."]
+
+#include "common.h"
+#include "arg.h"
+#include "llama.h"
+#include "log.h"
+
+#include "agent-loop.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+using bench_clock = std::chrono::steady_clock;
+
+static std::vector<int> parse_session_counts(const std::string & value) {
+    std::vector<int> counts;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int n = std::stoi(item);
+        if (n > 0) {
+            counts.push_back(n);
+        }
+    }
+    return counts;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+// Run n_sessions agent loops concurrently, return TTFT per session in ms
+// (negative if the session produced no token)
+static std::vector<double> run_round(server_context & ctx_server, const common_params & params,
+                                     const agent_config & config, const std::string & prompt,
+                                     int n_sessions, int round) {
+    std::vector<double> ttft_ms(n_sessions, -1.0);
+    std::vector<std::thread> workers;
+
+    std::mutex start_mutex;
+    std::condition_variable start_cv;
+    bool started = false;
+    bench_clock::time_point t_start;
+
+    for (int i = 0; i < n_sessions; i++) {
+        workers.emplace_back([&, i]() {
+            std::atomic<bool> interrupted{false};
+            agent_loop loop(ctx_server, params, config, interrupted);
+
+            {
+                std::unique_lock<std::mutex> lock(start_mutex);
+                start_cv.wait(lock, [&] { return started; });
+            }
+
+            // Unique user prompt per session so slots cannot share the reply
+            std::string user_prompt = "[session " + std::to_string(round) + "." +
+                                      std::to_string(i) + "] " + prompt;
+
+            std::atomic<bool> got_token{false};
+            auto on_event = [&](const agent_event & event) {
+                if (got_token.load()) {
+                    return;
+                }
+                if (event.type == agent_event_type::TEXT_DELTA ||
+                    event.type == agent_event_type::REASONING_DELTA) {
+                    ttft_ms[i] = std::chrono::duration<double, std::milli>(
+                                     bench_clock::now() - t_start).count();
+                    got_token = true;
+                }
+            };
+            // Stop as soon as the first token arrived; only TTFT is measured
+            auto should_stop = [&]() { return got_token.load(); };
+
+            loop.run_streaming(user_prompt, on_event, should_stop);
+        });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(start_mutex);
+        t_start = bench_clock::now();
+        started = true;
+    }
+    start_cv.notify_all();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+    return ttft_ms;
+}
+
+int main(int argc, char ** argv) {
+    common_params params;
+
+    params.verbosity = LOG_LEVEL_ERROR;
+
+    std::vector<int> session_counts = {1, 2, 4, 8, 16};
+    int reps = 3;
+    std::string prompt = "List the files in the current directory and summarize what this project does.";
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sessions" || arg == "--reps" || arg == "--bench-prompt") {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "%s requires a value\n", arg.c_str());
+                return 1;
+            }
+            try {
+                if (arg == "--sessions") {
+                    session_counts = parse_session_counts(argv[i + 1]);
+                } else if (arg == "--reps") {
+                    reps = std::max(1, std::stoi(argv[i + 1]));
+                } else {
+                    prompt = argv[i + 1];
+                }
+            } catch (...) {
+                fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), argv[i + 1]);
+                return 1;
+            }
+            // Remove both the flag and its value
+            for (int j = i; j < argc - 2; j++) {
+                argv[j] = argv[j + 2];
+            }
+            argc -= 2;
+            i--;  // Re-check this position
+        }
+    }
+
+    if (session_counts.empty()) {
+        fprintf(stderr, "--sessions must contain at least one positive count\n");
+        return 1;
+    }
+
+    if (!common_params_parse(argc, argv, params, LLAMA_EXAMPLE_SERVER)) {
+        return 1;
+    }
+
+    common_init();
+    common_log_set_verbosity_thold(params.verbosity);
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    int max_sessions = *std::max_element(session_counts.begin(), session_counts.end());
+    if (params.n_parallel < max_sessions) {
+        fprintf(stderr, "note: -np %d < %d sessions, some sessions will wait for a slot\n",
+                params.n_parallel, max_sessions);
+    }
+
+    server_context ctx_server;
+    if (!ctx_server.load_model(params)) {
+        fprintf(stderr, "Failed to load the model\n");
+        return 1;
+    }
+
+    std::thread inference_thread([&ctx_server]() {
+        ctx_server.start_loop();
+    });
+
+    agent_config config;
+    config.working_dir = fs::current_path().string();
+    config.max_iterations = 1;
+    config.yolo_mode = true;
+    config.enable_skills = false;
+    config.enable_agents_md = false;
+
+    // Warm up the model (first decode allocates compute buffers)
+    run_round(ctx_server, params, config, prompt, 1, -1);
+
+    printf("%8s %6s %10s %10s %10s %10s %8s\n",
+           "sessions", "reps", "mean_ms", "p50_ms", "p95_ms", "max_ms", "missed");
+
+    for (int n_sessions : session_counts) {
+        std::vector<double> samples;
+        int missed = 0;
+        for (int r = 0; r < reps; r++) {
+            for (double ms : run_round(ctx_server, params, config, prompt, n_sessions, r)) {
+                if (ms < 0) {
+                    missed++;
+                } else {
+                    samples.push_back(ms);
+                }
+            }
+        }
+
+        double mean = 0.0;
+        for (double ms : samples) {
+            mean += ms;
+        }
+        mean = samples.empty() ? 0.0 : mean / samples.size();
+
+        printf("%8d %6d %10.1f %10.1f %10.1f %10.1f %8d\n",
+               n_sessions, reps, mean, percentile(samples, 0.50),
+               percentile(samples, 0.95), percentile(samples, 1.0), missed);
+        fflush(stdout);
+    }
+
+    ctx_server.terminate();
+    inference_thread.join();
+
+    return 0;
+}
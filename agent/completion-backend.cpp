@@ -0,0 +1,39 @@
+#include "completion-backend.h"
+
+namespace {
+
+class server_completion_stream : public completion_stream {
+public:
+  explicit server_completion_stream(server_context &server_ctx)
+      : rd_(server_ctx.get_response_reader()) {}
+
+  void post(server_task &&task) override {
+    task.id = rd_.get_new_id();
+    rd_.post_task(std::move(task));
+  }
+
+  server_task_result_ptr
+  next(const std::function<bool()> &should_stop) override {
+    return rd_.next(should_stop);
+  }
+
+private:
+  server_response_reader rd_;
+};
+
+} // namespace
+
+server_completion_backend::server_completion_backend(server_context &server_ctx)
+    : server_ctx_(server_ctx), meta_(server_ctx.get_meta()) {}
+
+const server_chat_params &server_completion_backend::chat_params() {
+  return meta_.chat_params;
+}
+
+llama_context *server_completion_backend::llama_ctx() {
+  return server_ctx_.get_llama_context();
+}
+
+std::unique_ptr<completion_stream> server_completion_backend::open() {
+  return std::make_unique<server_completion_stream>(server_ctx_);
+}
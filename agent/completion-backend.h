@@ -0,0 +1,53 @@
+#pragma once
+
+#include "server-context.h"
+#include "server-task.h"
+
+#include <functional>
+#include <memory>
+
+struct llama_context;
+
+// One completion: post its task, then read results until the final one
+// (or null once should_stop returned true)
+class completion_stream {
+public:
+  virtual ~completion_stream() = default;
+
+  // Assigns the task id
+  virtual void post(server_task &&task) = 0;
+
+  virtual server_task_result_ptr
+  next(const std::function<bool()> &should_stop) = 0;
+};
+
+// What an agent_loop needs from the model: the chat template settings, the
+// tokenizer and completions
+//
+// By default loops talk to the server_context they were built with (see
+// server_completion_backend). llama-agent-bench plugs in a scripted model
+// instead, so the same loop code runs without weights.
+class completion_backend {
+public:
+  virtual ~completion_backend() = default;
+
+  virtual const server_chat_params &chat_params() = 0;
+
+  // Null = prompts are sent as text and tokenized by the backend
+  virtual llama_context *llama_ctx() = 0;
+
+  virtual std::unique_ptr<completion_stream> open() = 0;
+};
+
+class server_completion_backend : public completion_backend {
+public:
+  explicit server_completion_backend(server_context &server_ctx);
+
+  const server_chat_params &chat_params() override;
+  llama_context *llama_ctx() override;
+  std::unique_ptr<completion_stream> open() override;
+
+private:
+  server_context &server_ctx_;
+  server_context_meta meta_; // Fixed once the model is loaded
+};
@@ -0,0 +1,134 @@
+#include "context-manager.h"
+#include "common.h"
+
+#include <algorithm>
+#include <deque>
+
+// Template markup around each message (role header, end-of-turn, ...)
+static constexpr int32_t MESSAGE_OVERHEAD_TOKENS = 4;
+
+// Text of a content field (string or OpenAI content parts)
+static std::string content_text(const message_store &messages, size_t i) {
+  if (!messages.content_is_parts(i)) {
+    return std::string(messages.content(i));
+  }
+  std::string text;
+  json content = json::parse(messages.content(i), nullptr, false);
+  if (content.is_array()) {
+    for (const auto &part : content) {
+      if (part.is_object() && part.value("type", "") == "text") {
+        text += part.value("text", "");
+      }
+    }
+  }
+  return text;
+}
+
+std::string context_manager::message_text(const message_store &messages,
+                                          size_t i) {
+  std::string text = content_text(messages, i);
+  text += messages.reasoning(i);
+  for (size_t k = 0; k < messages.n_tool_calls(i); k++) {
+    text += messages.call(i, k).name;
+    text += messages.call(i, k).arguments;
+  }
+  return text;
+}
+
+int32_t context_manager::count_message(const message_store &messages,
+                                       size_t i) const {
+  std::string text = message_text(messages, i);
+  int32_t n_text = vocab_ ? static_cast<int32_t>(
+                                common_tokenize(vocab_, text, false, false).size())
+                          : static_cast<int32_t>(text.size() / 4);
+  return n_text + MESSAGE_OVERHEAD_TOKENS;
+}
+
+void context_manager::sync(const message_store &messages,
+                           const llama_vocab *vocab) {
+  vocab_ = vocab;
+  if (messages.size() < counts_.size()) {
+    reset();
+  }
+  for (size_t i = counts_.size(); i < messages.size(); i++) {
+    counts_.push_back(count_message(messages, i));
+    total_ += counts_.back();
+  }
+}
+
+void context_manager::reset() {
+  counts_.clear();
+  total_ = 0;
+}
+
+size_t context_manager::recent_start(const message_store &messages, int keep) {
+  int n_kept = 0;
+  for (size_t i = messages.size(); i > 1; i--) {
+    std::string_view role = messages.role(i - 1);
+    if (role == "user" || role == "assistant") {
+      if (++n_kept >= keep) {
+        return i - 1;
+      }
+    }
+  }
+  return 1;
+}
+
+int context_manager::elide_tool_outputs(message_store &messages, size_t begin,
+                                        size_t end, int32_t min_tokens) {
+  int n_elided = 0;
+  for (size_t i = begin; i < end && i < messages.size(); i++) {
+    if (messages.role(i) != "tool" || count(i) <= min_tokens) {
+      continue;
+    }
+    messages.set_content(
+        i, "[Tool output elided to save context (~" + std::to_string(count(i)) +
+               " tokens). Run the tool again if it is still needed.]");
+    if (i < counts_.size()) {
+      int32_t n_new = count_message(messages, i);
+      total_ += n_new - counts_[i];
+      counts_[i] = n_new;
+    }
+    n_elided++;
+  }
+  return n_elided;
+}
+
+std::string context_manager::transcript(const message_store &messages,
+                                        size_t begin, size_t end,
+                                        size_t max_msg_chars,
+                                        size_t max_total_chars) {
+  std::deque<std::string> entries;
+  size_t n_chars = 0;
+
+  // Walk backwards so the most recent messages survive the budget
+  for (size_t i = std::min(end, messages.size()); i > begin; i--) {
+    std::string role(messages.role(i - 1));
+    std::string text = content_text(messages, i - 1);
+    for (size_t k = 0; k < messages.n_tool_calls(i - 1); k++) {
+      const auto &tc = messages.call(i - 1, k);
+      text += "\n[calls " + std::string(tc.name) + " " +
+              std::string(tc.arguments) + "]";
+    }
+    if (role == "tool") {
+      role = "tool " + std::string(messages.name(i - 1));
+    }
+    if (text.size() > max_msg_chars) {
+      text = text.substr(0, max_msg_chars) + " [...]";
+    }
+
+    std::string entry = "### " + role + "\n" + text + "\n\n";
+    if (n_chars + entry.size() > max_total_chars && !entries.empty()) {
+      entries.push_front("[... earlier messages omitted ...]\n\n");
+      break;
+    }
+    n_chars += entry.size();
+    entries.push_front(std::move(entry));
+  }
+
+  std::string out;
+  for (const auto &e : entries) {
+    out += e;
+  }
+  return out;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "message-store.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct llama_vocab;
+
+// Per-message token accounting and compaction helpers for agent_loop
+//
+// Counts cover the message text (content, reasoning, tool call name and
+// arguments) plus a small allowance for template markup. That is close
+// enough to decide when to compact and how much a compaction saved without
+// rendering the whole conversation.
+class context_manager {
+public:
+  // Count the messages appended since the last call. Call reset() first if
+  // the history was rewritten.
+  void sync(const message_store &messages, const llama_vocab *vocab);
+
+  void reset();
+
+  // Estimated tokens of the whole history
+  int32_t total() const { return total_; }
+
+  // Text of a message as the model sees it (content, reasoning, tool call
+  // names and arguments)
+  static std::string message_text(const message_store &messages, size_t i);
+
+  // Estimated tokens of message i
+  int32_t count(size_t i) const { return i < counts_.size() ? counts_[i] : 0; }
+
+  // Index of the first message kept verbatim: the `keep` most recent
+  // user/assistant messages and everything after them. Never 0 (the system
+  // prompt is always kept), returns 1 if nothing is old enough to compact.
+  static size_t recent_start(const message_store &messages, int keep);
+
+  // Replace tool outputs larger than min_tokens in [begin, end) with a short
+  // marker. Returns the number of elided tool messages.
+  int elide_tool_outputs(message_store &messages, size_t begin, size_t end,
+                         int32_t min_tokens);
+
+  // Plain-text transcript of [begin, end) for the summarizer. Each message is
+  // cut to max_msg_chars; if the result exceeds max_total_chars the oldest
+  // messages are dropped.
+  static std::string transcript(const message_store &messages, size_t begin,
+                                size_t end, size_t max_msg_chars,
+                                size_t max_total_chars);
+
+private:
+  std::vector<int32_t> counts_;
+  int32_t total_ = 0;
+  const llama_vocab *vocab_ = nullptr;
+
+  int32_t count_message(const message_store &messages, size_t i) const;
+};
@@ -0,0 +1,172 @@
+#include "event-encoder.h"
+
+#include <charconv>
+
+const char *agent_event_name(agent_event_type type) {
+  switch (type) {
+  case agent_event_type::TEXT_DELTA:
+    return "text_delta";
+  case agent_event_type::REASONING_DELTA:
+    return "reasoning_delta";
+  case agent_event_type::TOOL_START:
+    return "tool_start";
+  case agent_event_type::TOOL_RESULT:
+    return "tool_result";
+  case agent_event_type::PERMISSION_REQUIRED:
+    return "permission_required";
+  case agent_event_type::PERMISSION_RESOLVED:
+    return "permission_resolved";
+  case agent_event_type::ITERATION_START:
+    return "iteration_start";
+  case agent_event_type::COMPLETED:
+    return "completed";
+  case agent_event_type::ERROR:
+    return "error";
+  }
+  return "unknown";
+}
+
+const char *agent_stop_reason_name(agent_stop_reason reason) {
+  switch (reason) {
+  case agent_stop_reason::COMPLETED:
+    return "completed";
+  case agent_stop_reason::MAX_ITERATIONS:
+    return "max_iterations";
+  case agent_stop_reason::USER_CANCELLED:
+    return "user_cancelled";
+  case agent_stop_reason::AGENT_ERROR:
+    return "error";
+  }
+  return "error";
+}
+
+void append_json_string(std::string &out, std::string_view value) {
+  static const char *hex = "0123456789abcdef";
+  out += '"';
+  size_t plain = 0; // Start of the run that needs no escaping
+  for (size_t i = 0; i < value.size(); i++) {
+    const unsigned char c = static_cast<unsigned char>(value[i]);
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    out.append(value.data() + plain, i - plain);
+    plain = i + 1;
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    }
+  }
+  out.append(value.data() + plain, value.size() - plain);
+  out += '"';
+}
+
+namespace {
+
+// Writes the members of one JSON object
+struct object_writer {
+  std::string &out;
+  bool first = true;
+
+  void key(const char *name) {
+    out += first ? "{\"" : ",\"";
+    first = false;
+    out += name;
+    out += "\":";
+  }
+
+  void string(const char *name, std::string_view value) {
+    key(name);
+    append_json_string(out, value);
+  }
+
+  void boolean(const char *name, bool value) {
+    key(name);
+    out += value ? "true" : "false";
+  }
+
+  void number(const char *name, int64_t value) {
+    key(name);
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, res.ptr);
+  }
+
+  void close() { out += first ? "{}" : "}"; }
+};
+
+} // namespace
+
+void append_event_data(std::string &out, const agent_event &event) {
+  object_writer w{out};
+  switch (event.type) {
+  case agent_event_type::TEXT_DELTA:
+  case agent_event_type::REASONING_DELTA:
+    w.string("content", event.text);
+    break;
+  case agent_event_type::TOOL_START:
+    w.string("name", event.name);
+    w.string("args", event.text);
+    break;
+  case agent_event_type::TOOL_RESULT:
+    w.string("name", event.name);
+    w.boolean("success", event.ok);
+    w.string("output", event.text);
+    w.number("duration_ms", event.value);
+    break;
+  case agent_event_type::PERMISSION_REQUIRED:
+    w.string("required_id", event.id);
+    w.string("tool", event.name);
+    w.string("details", event.text);
+    w.boolean("dangerous", event.ok);
+    break;
+  case agent_event_type::PERMISSION_RESOLVED:
+    w.string("required_id", event.id);
+    w.boolean("allowed", event.ok);
+    break;
+  case agent_event_type::ITERATION_START:
+    w.number("iteration", event.value);
+    w.number("max_iterations", event.limit);
+    break;
+  case agent_event_type::COMPLETED: {
+    w.string("reason", agent_stop_reason_name(event.reason));
+    w.key("stats");
+    object_writer stats{out};
+    const session_stats empty;
+    const session_stats &s = event.stats ? *event.stats : empty;
+    stats.number("input_tokens", s.total_input);
+    stats.number("output_tokens", s.total_output);
+    stats.number("cached_tokens", s.total_cached);
+    stats.close();
+    break;
+  }
+  case agent_event_type::ERROR:
+    w.string("message", event.text);
+    break;
+  }
+  w.close();
+}
+
+void append_event_sse(std::string &out, const agent_event &event) {
+  out += "event: ";
+  out += agent_event_name(event.type);
+  out += "\ndata: ";
+  append_event_data(out, event);
+  out += "\n\n";
+}
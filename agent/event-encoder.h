@@ -0,0 +1,27 @@
+#pragma once
+
+#include "agent-loop.h"
+
+#include <string>
+#include <string_view>
+
+// Wire format of agent events
+//
+// One encoder for every consumer: the server's SSE stream, the benches and
+// anything that logs events. The data object is written by hand into the
+// caller's buffer, so an encode costs the bytes it appends and no DOM.
+
+// "text_delta", "tool_result", ...
+const char *agent_event_name(agent_event_type type);
+
+// "completed", "max_iterations", "user_cancelled" or "error"
+const char *agent_stop_reason_name(agent_stop_reason reason);
+
+// Append value as a JSON string literal (UTF-8 is passed through)
+void append_json_string(std::string &out, std::string_view value);
+
+// Append the event's data object, e.g. {"content":"Hi"}
+void append_event_data(std::string &out, const agent_event &event);
+
+// Append "event: <name>\ndata: <data>\n\n"
+void append_event_sse(std::string &out, const agent_event &event);
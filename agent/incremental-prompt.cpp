@@ -0,0 +1,277 @@
+#include "incremental-prompt.h"
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static bool ends_with(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static common_chat_params render(const std::vector<common_chat_msg> &msgs,
+                                 const std::vector<common_chat_tool> &tools,
+                                 const prompt_render_options &opts,
+                                 bool add_generation_prompt) {
+  common_chat_templates_inputs inputs;
+  inputs.messages = msgs;
+  inputs.tools = tools;
+  inputs.tool_choice = tools.empty() ? COMMON_CHAT_TOOL_CHOICE_NONE
+                                     : COMMON_CHAT_TOOL_CHOICE_AUTO;
+  inputs.json_schema = ""; // TODO
+  inputs.grammar = "";     // TODO
+  inputs.use_jinja = opts.use_jinja;
+  inputs.parallel_tool_calls = opts.parallel_tool_calls;
+  inputs.add_generation_prompt = add_generation_prompt;
+  inputs.reasoning_format = opts.reasoning_format;
+  inputs.enable_thinking = opts.enable_thinking;
+  inputs.chat_template_kwargs = opts.chat_template_kwargs;
+
+  return common_chat_templates_apply(opts.tmpls, inputs);
+}
+
+// Fixed conversation the new messages are rendered after. A user turn is
+// included because several templates (e.g. Qwen3) refuse to render without
+// one.
+static std::vector<common_chat_msg> probe_stubs() {
+  common_chat_msg sys;
+  sys.role = "system";
+  sys.content = "probe";
+  common_chat_msg user;
+  user.role = "user";
+  user.content = "probe";
+  return {sys, user};
+}
+
+// Identifies the template options a tool section render is valid for
+static std::string probe_key(const prompt_render_options &opts) {
+  std::string key = std::to_string(reinterpret_cast<uintptr_t>(opts.tmpls));
+  key += opts.use_jinja ? ":j" : ":-";
+  key += opts.enable_thinking ? "t" : "-";
+  key += opts.parallel_tool_calls ? "p" : "-";
+  key += ":" + std::to_string(static_cast<int>(opts.reasoning_format));
+  for (const auto &[k, v] : opts.chat_template_kwargs) {
+    key += ":" + k + "=" + v;
+  }
+  return key;
+}
+
+void incremental_prompt::reset() {
+  n_seen_ = 0;
+  stable_text_.clear();
+  stable_tokens_.clear();
+  n_stable_ = 0;
+}
+
+bool incremental_prompt::ensure_probe(const tool_schema_snapshot_ptr &tools,
+                                      const prompt_render_options &opts,
+                                      const llama_vocab *vocab) {
+  std::string key = probe_key(opts);
+  if (tools == probe_tools_ && key == probe_key_ && section_) {
+    return true;
+  }
+
+  // Tool schemas are part of the system block, so the cached prefix is stale
+  probe_tools_ = tools;
+  probe_key_ = key;
+  section_.reset();
+  stable_text_.clear();
+  stable_tokens_.clear();
+  n_stable_ = 0;
+
+  try {
+    section_ = tools->get_section(key, [&]() {
+      auto stubs = probe_stubs();
+      tool_prompt_section section;
+      section.text = render(stubs, tools->chat_tools, opts, false).prompt;
+      std::string with_gen = render(stubs, tools->chat_tools, opts, true).prompt;
+      if (!string_starts_with(with_gen, section.text)) {
+        throw std::runtime_error("generation prompt is not appended");
+      }
+      section.gen_suffix = with_gen.substr(section.text.size());
+      if (vocab) {
+        std::string no_tools = render(stubs, {}, opts, false).prompt;
+        section.n_tokens = static_cast<int32_t>(
+            common_tokenize(vocab, section.text, true, true).size() -
+            common_tokenize(vocab, no_tools, true, true).size());
+      }
+      return section;
+    });
+  } catch (const std::exception &e) {
+    LOG_WRN("incremental prompt: probe render failed (%s), using full renders\n",
+            e.what());
+    return false;
+  }
+
+  gen_suffix_tokens_.clear();
+  if (vocab) {
+    gen_suffix_tokens_ =
+        common_tokenize(vocab, section_->gen_suffix, false, true);
+  }
+  return true;
+}
+
+void incremental_prompt::update_stable(const std::string &prompt,
+                                       const llama_tokens &tokens,
+                                       size_t n_messages) {
+  const std::string &gen_suffix = section_->gen_suffix;
+  if (!ends_with(prompt, gen_suffix)) {
+    stable_text_.clear();
+    stable_tokens_.clear();
+    n_stable_ = 0;
+    return;
+  }
+
+  stable_text_ = prompt.substr(0, prompt.size() - gen_suffix.size());
+  n_stable_ = n_messages;
+
+  stable_tokens_.clear();
+  if (tokens.size() >= gen_suffix_tokens_.size() &&
+      std::equal(gen_suffix_tokens_.begin(), gen_suffix_tokens_.end(),
+                 tokens.end() - gen_suffix_tokens_.size())) {
+    stable_tokens_.assign(tokens.begin(),
+                          tokens.end() - gen_suffix_tokens_.size());
+  }
+}
+
+incremental_prompt_result
+incremental_prompt::build_full(const message_store &messages,
+                               const tool_schema_snapshot_ptr &tools,
+                               const prompt_render_options &opts,
+                               const llama_vocab *vocab) {
+  incremental_prompt_result result;
+  result.full_render = true;
+  result.chat_params = render(messages.to_chat_msgs(0, messages.size()),
+                              tools->chat_tools, opts, true);
+
+  if (!append_only_) {
+    // Nothing to reuse next time; let the server tokenize the prompt
+    return result;
+  }
+  adopt_full(result, messages.size(), vocab);
+  return result;
+}
+
+void incremental_prompt::adopt_full(incremental_prompt_result &result,
+                                    size_t n_messages,
+                                    const llama_vocab *vocab) {
+  const std::string &prompt = result.chat_params.prompt;
+  const std::string &gen_suffix = section_->gen_suffix;
+  result.tokens.clear();
+  if (vocab && tokens_append_only_ && ends_with(prompt, gen_suffix)) {
+    // Tokenize the message part and the generation prompt separately so the
+    // next build can keep the message tokens as-is
+    result.tokens = common_tokenize(
+        vocab, prompt.substr(0, prompt.size() - gen_suffix.size()), true, true);
+    result.tokens.insert(result.tokens.end(), gen_suffix_tokens_.begin(),
+                         gen_suffix_tokens_.end());
+  }
+  update_stable(prompt, result.tokens, n_messages);
+}
+
+incremental_prompt_result
+incremental_prompt::build(const message_store &messages,
+                          const tool_schema_snapshot_ptr &tools,
+                          const prompt_render_options &opts,
+                          llama_context *lctx) {
+  const llama_vocab *vocab =
+      lctx ? llama_model_get_vocab(llama_get_model(lctx)) : nullptr;
+
+  if (messages.size() < n_seen_) {
+    reset();
+  }
+  n_seen_ = messages.size();
+
+  if (append_only_ && !ensure_probe(tools, opts, vocab)) {
+    append_only_ = false;
+  }
+  if (!append_only_ || n_stable_ == 0 || n_stable_ > messages.size()) {
+    return build_full(messages, tools, opts, vocab);
+  }
+
+  // Render only the messages appended since the stable prefix
+  std::vector<common_chat_msg> probe = probe_stubs();
+  bool adds_user_turn = false;
+  for (size_t i = n_stable_; i < messages.size(); i++) {
+    probe.push_back(messages.to_chat_msg(i));
+    adds_user_turn |= messages.role(i) == "user";
+  }
+
+  common_chat_params delta_params;
+  try {
+    delta_params = render(probe, tools->chat_tools, opts, true);
+  } catch (const std::exception &e) {
+    LOG_WRN("incremental prompt: delta render failed (%s), using full renders\n",
+            e.what());
+    append_only_ = false;
+    return build_full(messages, tools, opts, vocab);
+  }
+  const tool_prompt_section &section = *section_;
+  if (!string_starts_with(delta_params.prompt, section.text)) {
+    append_only_ = false;
+    return build_full(messages, tools, opts, vocab);
+  }
+  std::string delta = delta_params.prompt.substr(section.text.size());
+
+  incremental_prompt_result result;
+  result.chat_params = std::move(delta_params);
+  result.chat_params.prompt = stable_text_ + delta;
+
+  if (vocab && tokens_append_only_ && !stable_tokens_.empty()) {
+    result.tokens = stable_tokens_;
+    if (ends_with(delta, section.gen_suffix)) {
+      auto body = common_tokenize(
+          vocab, delta.substr(0, delta.size() - section.gen_suffix.size()), false,
+          true);
+      result.tokens.insert(result.tokens.end(), body.begin(), body.end());
+      result.tokens.insert(result.tokens.end(), gen_suffix_tokens_.begin(),
+                           gen_suffix_tokens_.end());
+    } else {
+      auto body = common_tokenize(vocab, delta, false, true);
+      result.tokens.insert(result.tokens.end(), body.begin(), body.end());
+    }
+  }
+
+  bool verify = n_verify_left_ > 0 || adds_user_turn ||
+                ++n_since_verify_ >= VERIFY_INTERVAL;
+  if (verify) {
+    n_verify_left_ = std::max(0, n_verify_left_ - 1);
+    n_since_verify_ = 0;
+    common_chat_params full_params =
+        render(messages.to_chat_msgs(0, messages.size()), tools->chat_tools,
+               opts, true);
+    if (full_params.prompt != result.chat_params.prompt && adds_user_turn) {
+      // The template rewrote earlier turns for the new user message (e.g.
+      // dropped old reasoning); start the stable prefix over from here
+      result.chat_params = std::move(full_params);
+      result.full_render = true;
+      adopt_full(result, messages.size(), vocab);
+      return result;
+    }
+    if (full_params.prompt != result.chat_params.prompt) {
+      // Within one user turn the template must only append
+      LOG_WRN("incremental prompt: chat template is not append-only, "
+              "using full renders\n");
+      append_only_ = false;
+      result.chat_params = std::move(full_params);
+      result.tokens.clear();
+      result.full_render = true;
+      return result;
+    }
+    if (!result.tokens.empty() &&
+        common_tokenize(vocab, full_params.prompt, true, true) != result.tokens) {
+      LOG_WRN("incremental prompt: tokenization is not append-only, "
+              "leaving tokenization to the server\n");
+      tokens_append_only_ = false;
+      result.tokens.clear();
+    }
+  }
+
+  update_stable(result.chat_params.prompt, result.tokens, messages.size());
+  return result;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "chat.h"
+#include "common.h"
+#include "message-store.h"
+#include "tool-registry.h"
+
+#include <nlohmann/json.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+struct llama_context;
+struct llama_vocab;
+
+// Template settings shared by every render of one conversation
+struct prompt_render_options {
+  const common_chat_templates *tmpls = nullptr;
+  bool use_jinja = true;
+  common_reasoning_format reasoning_format = COMMON_REASONING_FORMAT_NONE;
+  bool enable_thinking = true;
+  std::map<std::string, std::string> chat_template_kwargs;
+  bool parallel_tool_calls = false;
+};
+
+// Prompt produced for one completion request
+struct incremental_prompt_result {
+  common_chat_params chat_params; // Prompt text + parser metadata
+  llama_tokens tokens;            // Token ids of chat_params.prompt (empty if
+                                  // tokenization was left to the server)
+  bool full_render = false;       // True if the whole conversation was rendered
+};
+
+// Append-only prompt builder for agent_loop
+//
+// Each agent iteration only appends assistant/tool/user messages, so the
+// rendered prompt of the previous iteration (minus the generation prompt) is
+// a prefix of the next one for most chat templates. This class keeps the
+// rendered text and the token ids of that stable prefix and renders only the
+// new messages on top of a tiny probe conversation:
+//
+//   probe  = [stub system, stub user] + new messages
+//   delta  = render(probe, gen) - render([stub system, stub user])
+//   prompt = stable prefix + delta
+//
+// The stub conversation rendered with the tools is the tool section cached on
+// the tool_schema_snapshot, so it is rendered once per tool set and template
+// and shared by all sessions.
+//
+// The first few incremental builds are verified against a full render. If
+// the template turns out not to be append-only (it raises on the probe, or
+// the outputs differ) the builder falls back to full renders for the rest of
+// the conversation.
+class incremental_prompt {
+public:
+  // Build the prompt for `messages` (append-only between calls unless
+  // reset() was called). If lctx is set, also returns the token ids,
+  // tokenizing only the new text.
+  incremental_prompt_result build(const message_store &messages,
+                                  const tool_schema_snapshot_ptr &tools,
+                                  const prompt_render_options &opts,
+                                  llama_context *lctx);
+
+  // Forget all cached state (call when messages are rewritten or cleared)
+  void reset();
+
+  // False once the template proved not to be append-only
+  bool is_append_only() const { return append_only_; }
+
+  // Number of messages covered by the cached stable prefix
+  size_t stable_message_count() const { return n_stable_; }
+
+  // Prompt tokens taken by the tool definitions (0 if unknown)
+  int32_t tool_section_tokens() const {
+    return section_ ? section_->n_tokens : 0;
+  }
+
+private:
+  // Messages seen by the last build; fewer means the history was rewritten
+  size_t n_seen_ = 0;
+
+  // Rendered prefix shared by the previous and next prompt (no generation
+  // prompt), and its token ids
+  std::string stable_text_;
+  llama_tokens stable_tokens_;
+  size_t n_stable_ = 0;
+
+  // Probe renders, valid for one tool snapshot/template combination. The
+  // rendered section is shared through the snapshot, only the generation
+  // prompt tokens are kept per conversation.
+  tool_schema_snapshot_ptr probe_tools_;
+  std::string probe_key_;
+  std::shared_ptr<const tool_prompt_section> section_;
+  llama_tokens gen_suffix_tokens_;
+
+  bool append_only_ = true;
+  bool tokens_append_only_ = true;
+  // Incremental builds are checked against a full render: the first ones,
+  // every one that adds a user message (some templates rewrite earlier
+  // turns then, e.g. dropping old reasoning, and the full render becomes
+  // the new stable prefix), and every VERIFY_INTERVAL builds in between
+  static constexpr int VERIFY_INTERVAL = 16;
+  int n_verify_left_ = 2;
+  int n_since_verify_ = 0;
+
+  bool ensure_probe(const tool_schema_snapshot_ptr &tools,
+                    const prompt_render_options &opts,
+                    const llama_vocab *vocab);
+
+  incremental_prompt_result build_full(const message_store &messages,
+                                       const tool_schema_snapshot_ptr &tools,
+                                       const prompt_render_options &opts,
+                                       const llama_vocab *vocab);
+
+  // Tokenize a full render into result and make it the stable prefix
+  void adopt_full(incremental_prompt_result &result, size_t n_messages,
+                  const llama_vocab *vocab);
+
+  // Remember `prompt` (minus generation prompt) as the next stable prefix
+  void update_stable(const std::string &prompt, const llama_tokens &tokens,
+                     size_t n_messages);
+};
@@ -159,6 +159,9 @@ std::vector<mcp_tool> mcp_client::list_tools() {
       // Default empty schema
       tool.input_schema = {{"type", "object"}, {"properties", json::object()}};
     }
+    if (tool_json.contains("annotations") && tool_json["annotations"].is_object()) {
+      tool.read_only = tool_json["annotations"].value("readOnlyHint", false);
+    }
     if (!tool.name.empty()) {
       tools.push_back(tool);
     }
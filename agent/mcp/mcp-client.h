@@ -21,6 +21,7 @@ struct mcp_tool {
   std::string name;
   std::string description;
   json input_schema;
+  bool read_only = false; // annotations.readOnlyHint
 };
 
 // Result from calling on MCP tool
@@ -19,6 +19,10 @@ void register_mcp_tools(mcp_server_manager &manager) {
     } else {
         wrapper.parameters = R"({"type": "object", "properties": {}})";
     }
+    // A server connection handles one request at a time, so calls to the
+    // same server ("mcp__<server>__<tool>") are serialized
+    wrapper.read_only = mcp_tool.read_only;
+    wrapper.concurrency_group = qualified_name.substr(0, qualified_name.rfind("__"));
     // Capture manager pointer and tool name for execution
     // Note: Manager must outlive these tool registrations
     mcp_server_manager *mgt_ptr = &manager;
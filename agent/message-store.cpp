@@ -0,0 +1,367 @@
+#include "message-store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+
+// Arena blocks grow from the first to the last size; longer text gets a
+// block of its own
+static constexpr size_t FIRST_BLOCK_BYTES = 4096;
+static constexpr size_t MAX_BLOCK_BYTES = 65536;
+
+// Distinct strings the pool accepts before leaving new ones to the arenas
+// (tool names come from the model and are not bounded)
+static constexpr size_t MAX_INTERNED = 4096;
+
+// Interned copy of text, or an empty view if the pool is full
+static std::string_view intern_string(std::string_view text) {
+  static constexpr std::string_view common[] = {"system", "user", "assistant",
+                                                "tool"};
+  for (std::string_view s : common) {
+    if (s == text) {
+      return s;
+    }
+  }
+
+  static std::mutex mutex;
+  static std::unordered_set<std::string> pool;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pool.find(std::string(text));
+  if (it != pool.end()) {
+    return *it;
+  }
+  if (pool.size() >= MAX_INTERNED) {
+    return {};
+  }
+  // Set nodes never move, so the view stays valid
+  return *pool.emplace(text).first;
+}
+
+// Allocation behind a shared string made by std::make_shared: the control
+// block with the string object in it, and the string's buffer
+static size_t shared_footprint(const std::string &text) {
+  return 2 * sizeof(void *) + sizeof(std::string) + text.capacity() + 1;
+}
+
+message_store::message_store(message_store &&other) noexcept {
+  *this = std::move(other);
+}
+
+message_store &message_store::operator=(message_store &&other) noexcept {
+  records_ = std::move(other.records_);
+  calls_ = std::move(other.calls_);
+  blocks_ = std::move(other.blocks_);
+  block_pos_ = other.block_pos_;
+  block_free_ = other.block_free_;
+  next_block_ = other.next_block_;
+  arena_bytes_ = other.arena_bytes_;
+  shared_ = std::move(other.shared_);
+  shared_bytes_ = other.shared_bytes_;
+  other.clear();
+  return *this;
+}
+
+std::string_view message_store::copy(std::string_view text) {
+  if (text.empty()) {
+    return {};
+  }
+  if (text.size() > block_free_) {
+    size_t size = std::max(next_block_, FIRST_BLOCK_BYTES);
+    if (text.size() > size) {
+      // Own block; the current one keeps taking short text
+      blocks_.push_back({std::make_unique<char[]>(text.size()), text.size()});
+      arena_bytes_ += text.size();
+      std::memcpy(blocks_.back().data.get(), text.data(), text.size());
+      return {blocks_.back().data.get(), text.size()};
+    }
+    blocks_.push_back({std::make_unique<char[]>(size), size});
+    arena_bytes_ += size;
+    block_pos_ = blocks_.back().data.get();
+    block_free_ = size;
+    next_block_ = std::min(size * 2, MAX_BLOCK_BYTES);
+  }
+  std::memcpy(block_pos_, text.data(), text.size());
+  std::string_view view(block_pos_, text.size());
+  block_pos_ += text.size();
+  block_free_ -= text.size();
+  return view;
+}
+
+std::string_view message_store::intern(std::string_view text) {
+  if (text.empty()) {
+    return {};
+  }
+  std::string_view view = intern_string(text);
+  return view.data() ? view : copy(text);
+}
+
+void message_store::set_shared(record &r,
+                               std::shared_ptr<const std::string> text) {
+  r.content = *text;
+  shared_bytes_ += shared_footprint(*text);
+  shared_.push_back(std::move(text));
+  r.shared = static_cast<uint32_t>(shared_.size());
+}
+
+void message_store::store_content(record &r, std::string_view text) {
+  if (text.size() >= SHARED_MIN_BYTES) {
+    set_shared(r, std::make_shared<const std::string>(text));
+  } else {
+    r.content = copy(text);
+  }
+  r.flags |= HAS_CONTENT;
+}
+
+void message_store::store_content(record &r, std::string &&text) {
+  if (text.size() >= SHARED_MIN_BYTES) {
+    set_shared(r, std::make_shared<const std::string>(std::move(text)));
+  } else {
+    r.content = copy(text);
+  }
+  r.flags |= HAS_CONTENT;
+}
+
+void message_store::release_content(record &r) {
+  if (r.shared > 0) {
+    auto &text = shared_[r.shared - 1];
+    shared_bytes_ -= shared_footprint(*text);
+    text.reset();
+    r.shared = 0;
+  }
+  r.content = {};
+  r.flags &= ~(HAS_CONTENT | CONTENT_PARTS);
+}
+
+void message_store::push_back(const json &msg) {
+  record r;
+  r.role = intern(msg.value("role", ""));
+  r.first_call = static_cast<uint32_t>(calls_.size());
+
+  auto content = msg.find("content");
+  if (content != msg.end() && content->is_string()) {
+    store_content(r, std::string_view(content->get_ref<const std::string &>()));
+  } else if (content != msg.end() && !content->is_null()) {
+    store_content(r, content->dump());
+    r.flags |= CONTENT_PARTS;
+  }
+  auto reasoning = msg.find("reasoning_content");
+  if (reasoning != msg.end() && reasoning->is_string()) {
+    r.reasoning = copy(reasoning->get_ref<const std::string &>());
+    r.flags |= HAS_REASONING;
+  }
+  auto name = msg.find("name");
+  if (name != msg.end() && name->is_string()) {
+    r.name = intern(name->get_ref<const std::string &>());
+    r.flags |= HAS_NAME;
+  }
+  auto call_id = msg.find("tool_call_id");
+  if (call_id != msg.end() && call_id->is_string()) {
+    r.tool_call_id = copy(call_id->get_ref<const std::string &>());
+    r.flags |= HAS_TOOL_CALL_ID;
+  }
+  records_.push_back(r);
+
+  auto tool_calls = msg.find("tool_calls");
+  if (tool_calls != msg.end() && tool_calls->is_array()) {
+    for (const auto &tc : *tool_calls) {
+      auto fn = tc.find("function");
+      if (fn == tc.end() || !fn->is_object()) {
+        continue;
+      }
+      auto args = fn->find("arguments");
+      std::string args_text;
+      if (args != fn->end()) {
+        args_text = args->is_string() ? args->get<std::string>() : args->dump();
+      }
+      add_tool_call(tc.value("id", ""), fn->value("name", ""), args_text);
+    }
+  }
+}
+
+void message_store::push_text(std::string_view role, std::string content) {
+  record r;
+  r.role = intern(role);
+  r.first_call = static_cast<uint32_t>(calls_.size());
+  store_content(r, std::move(content));
+  records_.push_back(r);
+}
+
+void message_store::push_tool_result(std::string_view call_id,
+                                     std::string_view tool_name,
+                                     std::string content) {
+  record r;
+  r.role = intern("tool");
+  r.tool_call_id = copy(call_id);
+  r.name = intern(tool_name);
+  r.flags = HAS_TOOL_CALL_ID | HAS_NAME;
+  r.first_call = static_cast<uint32_t>(calls_.size());
+  store_content(r, std::move(content));
+  records_.push_back(r);
+}
+
+void message_store::add_tool_call(std::string_view id, std::string_view name,
+                                  std::string_view arguments) {
+  // Calls of a message are contiguous: only the last message gets new ones
+  record &r = records_.back();
+  if (r.n_calls == 0) {
+    r.first_call = static_cast<uint32_t>(calls_.size());
+  }
+  calls_.push_back({copy(id), intern(name), copy(arguments)});
+  r.n_calls++;
+}
+
+void message_store::append_from(const message_store &other, size_t i) {
+  const record &src = other.records_[i];
+  record r;
+  r.role = intern(src.role);
+  r.name = intern(src.name);
+  r.reasoning = copy(src.reasoning);
+  r.tool_call_id = copy(src.tool_call_id);
+  r.flags = src.flags;
+  r.first_call = static_cast<uint32_t>(calls_.size());
+  if (src.shared > 0) {
+    set_shared(r, other.shared_[src.shared - 1]);
+  } else {
+    r.content = copy(src.content);
+  }
+  records_.push_back(r);
+
+  for (size_t k = 0; k < src.n_calls; k++) {
+    const tool_call &tc = other.call(i, k);
+    add_tool_call(tc.id, tc.name, tc.arguments);
+  }
+}
+
+void message_store::assign(const json &messages) {
+  clear();
+  if (!messages.is_array()) {
+    return;
+  }
+  records_.reserve(messages.size());
+  for (const auto &msg : messages) {
+    if (msg.is_object()) {
+      push_back(msg);
+    }
+  }
+}
+
+void message_store::clear() {
+  records_.clear();
+  records_.shrink_to_fit();
+  calls_.clear();
+  calls_.shrink_to_fit();
+  blocks_.clear();
+  blocks_.shrink_to_fit();
+  block_pos_ = nullptr;
+  block_free_ = 0;
+  next_block_ = 0;
+  arena_bytes_ = 0;
+  shared_.clear();
+  shared_.shrink_to_fit();
+  shared_bytes_ = 0;
+}
+
+void message_store::set_content(size_t i, std::string content) {
+  record &r = records_[i];
+  release_content(r);
+  store_content(r, std::move(content));
+}
+
+void message_store::shrink_to_fit() {
+  message_store compacted;
+  compacted.records_.reserve(records_.size());
+  compacted.calls_.reserve(calls_.size());
+  for (size_t i = 0; i < records_.size(); i++) {
+    compacted.append_from(*this, i);
+  }
+  *this = std::move(compacted);
+}
+
+json message_store::to_json(size_t i) const {
+  const record &r = records_[i];
+  json msg = json::object();
+  msg["role"] = std::string(r.role);
+  if (r.flags & CONTENT_PARTS) {
+    msg["content"] = json::parse(r.content);
+  } else if (r.flags & HAS_CONTENT) {
+    msg["content"] = std::string(r.content);
+  }
+  if (r.flags & HAS_REASONING) {
+    msg["reasoning_content"] = std::string(r.reasoning);
+  }
+  if (r.n_calls > 0) {
+    json tool_calls = json::array();
+    for (size_t k = 0; k < r.n_calls; k++) {
+      const tool_call &tc = call(i, k);
+      json entry;
+      if (!tc.id.empty()) {
+        entry["id"] = std::string(tc.id);
+      }
+      entry["type"] = "function";
+      entry["function"] = {{"name", std::string(tc.name)},
+                           {"arguments", std::string(tc.arguments)}};
+      tool_calls.push_back(std::move(entry));
+    }
+    msg["tool_calls"] = std::move(tool_calls);
+  }
+  if (r.flags & HAS_TOOL_CALL_ID) {
+    msg["tool_call_id"] = std::string(r.tool_call_id);
+  }
+  if (r.flags & HAS_NAME) {
+    msg["name"] = std::string(r.name);
+  }
+  return msg;
+}
+
+json message_store::to_json() const {
+  json messages = json::array();
+  for (size_t i = 0; i < records_.size(); i++) {
+    messages.push_back(to_json(i));
+  }
+  return messages;
+}
+
+common_chat_msg message_store::to_chat_msg(size_t i) const {
+  const record &r = records_[i];
+  if (r.flags & CONTENT_PARTS) {
+    // Rare (multimodal input); let the OpenAI parser handle the parts
+    json messages = json::array();
+    messages.push_back(to_json(i));
+    return common_chat_msgs_parse_oaicompat(messages).front();
+  }
+
+  common_chat_msg msg;
+  msg.role = r.role;
+  msg.content = r.content;
+  msg.reasoning_content = r.reasoning;
+  msg.tool_name = r.name;
+  msg.tool_call_id = r.tool_call_id;
+  msg.tool_calls.reserve(r.n_calls);
+  for (size_t k = 0; k < r.n_calls; k++) {
+    const tool_call &tc = call(i, k);
+    common_chat_tool_call out;
+    out.name = tc.name;
+    out.arguments = tc.arguments;
+    out.id = tc.id;
+    msg.tool_calls.push_back(std::move(out));
+  }
+  return msg;
+}
+
+std::vector<common_chat_msg> message_store::to_chat_msgs(size_t begin,
+                                                         size_t end) const {
+  std::vector<common_chat_msg> msgs;
+  end = std::min(end, records_.size());
+  for (size_t i = begin; i < end; i++) {
+    msgs.push_back(to_chat_msg(i));
+  }
+  return msgs;
+}
+
+size_t message_store::bytes() const {
+  return records_.capacity() * sizeof(record) +
+         calls_.capacity() * sizeof(tool_call) +
+         blocks_.capacity() * sizeof(block) + arena_bytes_ +
+         shared_.capacity() * sizeof(shared_.front()) + shared_bytes_;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "chat.h"
+
+#include <nlohmann/json.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+// Conversation history of one agent_loop
+//
+// A JSON history costs a heap-allocated ordered map per message, with its own
+// copy of every key ("role", "content", "tool_call_id", ...), and the prompt
+// builder used to keep a parsed copy of all of it on top. Here each message
+// is a fixed-size record of views:
+//
+//  - roles and tool names point into a process-wide pool of interned strings
+//  - short text is copied into the store's arena, a few growing blocks that
+//    are only released as a whole
+//  - content of SHARED_MIN_BYTES or more (tool outputs, pasted files) is a
+//    shared string, moved in without a copy and shared with the stores built
+//    from this one (see append_from)
+//
+// Only role, content, reasoning_content, name, tool_call_id and tool_calls
+// are kept; other keys of a pushed JSON message are dropped. Content that is
+// not a string (OpenAI content parts) is kept as its JSON text.
+class message_store {
+public:
+  static constexpr size_t SHARED_MIN_BYTES = 2048;
+
+  struct tool_call {
+    std::string_view id;
+    std::string_view name; // Interned
+    std::string_view arguments;
+  };
+
+  message_store() = default;
+  message_store(message_store &&other) noexcept;
+  message_store &operator=(message_store &&other) noexcept;
+  message_store(const message_store &) = delete;
+  message_store &operator=(const message_store &) = delete;
+
+  size_t size() const { return records_.size(); }
+  bool empty() const { return records_.empty(); }
+
+  // Append an OpenAI-format message
+  void push_back(const json &msg);
+
+  // Append a message with plain text content
+  void push_text(std::string_view role, std::string content);
+
+  // Append a tool result
+  void push_tool_result(std::string_view call_id, std::string_view tool_name,
+                        std::string content);
+
+  // Append a tool call to the last message
+  void add_tool_call(std::string_view id, std::string_view name,
+                     std::string_view arguments);
+
+  // Copy message i of other, sharing its large content
+  void append_from(const message_store &other, size_t i);
+
+  // Replace the history with a JSON array of messages
+  void assign(const json &messages);
+
+  void clear();
+
+  // Replace the content of message i with plain text. The old text stays in
+  // the arena until shrink_to_fit().
+  void set_content(size_t i, std::string content);
+
+  // Rebuild the arena with only the text still referenced
+  void shrink_to_fit();
+
+  std::string_view role(size_t i) const { return records_[i].role; }
+  std::string_view name(size_t i) const { return records_[i].name; }
+  std::string_view content(size_t i) const { return records_[i].content; }
+  std::string_view reasoning(size_t i) const { return records_[i].reasoning; }
+  std::string_view tool_call_id(size_t i) const { return records_[i].tool_call_id; }
+
+  // True if content(i) is the JSON text of a content part array
+  bool content_is_parts(size_t i) const {
+    return records_[i].flags & CONTENT_PARTS;
+  }
+
+  size_t n_tool_calls(size_t i) const { return records_[i].n_calls; }
+  const tool_call &call(size_t i, size_t k) const {
+    return calls_[records_[i].first_call + k];
+  }
+
+  json to_json(size_t i) const;
+  json to_json() const;
+
+  common_chat_msg to_chat_msg(size_t i) const;
+  std::vector<common_chat_msg> to_chat_msgs(size_t begin, size_t end) const;
+
+  // Heap bytes held by this store: records, tool calls, arena blocks and
+  // shared content (allocation sizes, without allocator overhead). Interned
+  // strings belong to the process and are not counted; content shared with
+  // another store is counted by both.
+  size_t bytes() const;
+
+private:
+  enum : uint8_t {
+    HAS_CONTENT = 1,
+    CONTENT_PARTS = 2,
+    HAS_REASONING = 4,
+    HAS_NAME = 8,
+    HAS_TOOL_CALL_ID = 16,
+  };
+
+  struct record {
+    std::string_view role;
+    std::string_view name;
+    std::string_view content;
+    std::string_view reasoning;
+    std::string_view tool_call_id;
+    uint32_t first_call = 0;
+    uint32_t n_calls = 0;
+    uint32_t shared = 0; // 1-based index of content in shared_, 0 = arena
+    uint8_t flags = 0;
+  };
+
+  struct block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  std::vector<record> records_;
+  std::vector<tool_call> calls_;
+
+  std::vector<block> blocks_;
+  char *block_pos_ = nullptr;
+  size_t block_free_ = 0;
+  size_t next_block_ = 0;
+  size_t arena_bytes_ = 0;
+
+  // Large content; released entries are null
+  std::vector<std::shared_ptr<const std::string>> shared_;
+  size_t shared_bytes_ = 0;
+
+  std::string_view copy(std::string_view text);
+  std::string_view intern(std::string_view text);
+
+  void store_content(record &r, std::string_view text);
+  void store_content(record &r, std::string &&text);
+  void set_shared(record &r, std::shared_ptr<const std::string> text);
+  void release_content(record &r);
+};
@@ -7,6 +7,39 @@
 
 namespace fs = std::filesystem;
 
+static const char *REQUEST_ID_PREFIX = "perm_";
+
+permission_request_index &permission_request_index::instance() {
+  static permission_request_index index;
+  return index;
+}
+
+void permission_request_index::add(const std::string &request_id,
+                                   const std::string &owner) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  owners_[request_id] = owner;
+}
+
+void permission_request_index::remove(const std::string &request_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  owners_.erase(request_id);
+}
+
+std::optional<std::string>
+permission_request_index::owner_of(const std::string &request_id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = owners_.find(request_id);
+  if (it == owners_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+size_t permission_request_index::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return owners_.size();
+}
+
 permission_manager_async::permission_manager_async() {
   // Set default permissions (same as sync version)
   defaults_[permission_type::BASH] = permission_state::ASK;
@@ -44,18 +77,43 @@ permission_manager_async::permission_manager_async() {
                     "type ",   "file "};
 }
 
+permission_manager_async::~permission_manager_async() {
+  auto &index = permission_request_index::instance();
+  for (const auto &[id, req] : pending_requests_) {
+    index.remove(id);
+  }
+}
+
 void permission_manager_async::set_project_root(const std::string &path) {
   std::lock_guard<std::mutex> lock(mutex_);
   project_root_ = fs::absolute(path).string();
 }
 
+// "perm_<owner>_<n>", or "perm_<n>" without an owner
 std::string permission_manager_async::generate_request_id() {
   uint64_t counter = request_counter_.fetch_add(1);
   std::stringstream ss;
-  ss << "perm_" << std::hex << std::setfill('0') << std::setw(8) << counter;
+  ss << REQUEST_ID_PREFIX;
+  if (!owner_.empty()) {
+    ss << owner_ << '_';
+  }
+  ss << std::hex << std::setfill('0') << std::setw(8) << counter;
   return ss.str();
 }
 
+std::string
+permission_manager_async::request_owner(const std::string &request_id) {
+  const size_t prefix = std::char_traits<char>::length(REQUEST_ID_PREFIX);
+  if (request_id.compare(0, prefix, REQUEST_ID_PREFIX) != 0) {
+    return "";
+  }
+  size_t sep = request_id.rfind('_');
+  if (sep == std::string::npos || sep <= prefix) {
+    return "";
+  }
+  return request_id.substr(prefix, sep - prefix);
+}
+
 bool permission_manager_async::matches_pattern(
     const std::string &cmd, const std::vector<std::string> &patterns) const {
   for (const auto &pattern : patterns) {
@@ -133,6 +191,7 @@ std::string permission_manager_async::request_permission(
   {
     std::lock_guard<std::mutex> lock(mutex_);
     pending_requests_[id] = async_req;
+    permission_request_index::instance().add(id, owner_);
   }
 
   // Notify callback if set (outside lock to avoid deadlock)
@@ -143,40 +202,86 @@ std::string permission_manager_async::request_permission(
   return id;
 }
 
+std::vector<std::function<void()>>
+permission_manager_async::take_waiters(const std::string &request_id) {
+  std::vector<std::function<void()>> waiters;
+  auto it = settle_waiters_.find(request_id);
+  if (it != settle_waiters_.end()) {
+    waiters = std::move(it->second);
+    settle_waiters_.erase(it);
+  }
+  return waiters;
+}
+
 bool permission_manager_async::respond(const std::string &request_id,
                                        bool allowed, permission_scope scope) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::function<void()>> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
 
-  // Check if request exists
-  auto it = pending_requests_.find(request_id);
-  if (it == pending_requests_.end()) {
-    return false; // Request not found or already responded
-  }
+    // Check if request exists
+    auto it = pending_requests_.find(request_id);
+    if (it == pending_requests_.end()) {
+      return false; // Request not found or already responded
+    }
 
-  // Store response
-  permission_response_async response;
-  response.request_id = request_id;
-  response.allowed = allowed;
-  response.scope = scope;
-  responses_[request_id] = response;
-
-  // Handle session scope
-  if (scope == permission_scope::SESSION) {
-    const auto &req = it->second.request;
-    std::string key = req.tool_name + ":" + req.details;
-    session_overrides_[key] = allowed ? permission_state::ALLOW_SESSION
-                                      : permission_state::DENY_SESSION;
-  }
+    // Store response
+    permission_response_async response;
+    response.request_id = request_id;
+    response.allowed = allowed;
+    response.scope = scope;
+    responses_[request_id] = response;
+
+    // Handle session scope
+    if (scope == permission_scope::SESSION) {
+      const auto &req = it->second.request;
+      std::string key = req.tool_name + ":" + req.details;
+      session_overrides_[key] = allowed ? permission_state::ALLOW_SESSION
+                                        : permission_state::DENY_SESSION;
+    }
 
-  // Remove from pending
-  pending_requests_.erase(it);
+    // Remove from pending
+    pending_requests_.erase(it);
+    permission_request_index::instance().remove(request_id);
 
-  // Wake up any waiting threads
-  cv_.notify_all();
+    // Wake up any waiting threads
+    cv_.notify_all();
+    waiters = take_waiters(request_id);
+  }
 
+  // Outside the lock, a waiter may call back into this manager
+  for (auto &notify : waiters) {
+    notify();
+  }
   return true;
 }
 
+bool permission_manager_async::take_response(
+    const std::string &request_id,
+    std::optional<permission_response_async> &response) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = responses_.find(request_id);
+  if (it != responses_.end()) {
+    response = it->second;
+    responses_.erase(it); // Consume the response
+    return true;
+  }
+  response.reset();
+  return pending_requests_.find(request_id) == pending_requests_.end();
+}
+
+void permission_manager_async::notify_when_settled(
+    const std::string &request_id, std::function<void()> notify) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_requests_.count(request_id)) {
+      settle_waiters_[request_id].push_back(std::move(notify));
+      return;
+    }
+  }
+  notify();
+}
+
 std::optional<permission_response_async>
 permission_manager_async::wait_for_response(const std::string &request_id,
                                             int timeout_ms) {
@@ -224,13 +329,21 @@ bool permission_manager_async::is_pending(const std::string &request_id) const {
 }
 
 bool permission_manager_async::cancel(const std::string &request_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = pending_requests_.find(request_id);
-  if (it == pending_requests_.end()) {
-    return false;
+  std::vector<std::function<void()>> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pending_requests_.find(request_id);
+    if (it == pending_requests_.end()) {
+      return false;
+    }
+    pending_requests_.erase(it);
+    permission_request_index::instance().remove(request_id);
+    cv_.notify_all();
+    waiters = take_waiters(request_id);
+  }
+  for (auto &notify : waiters) {
+    notify();
   }
-  pending_requests_.erase(it);
-  cv_.notify_all();
   return true;
 }
 
@@ -264,12 +377,24 @@ bool permission_manager_async::is_doom_loop(
 }
 
 void permission_manager_async::clear_session() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  session_overrides_.clear();
-  recent_calls_.clear();
-  pending_requests_.clear();
-  responses_.clear();
-  cv_.notify_all();
+  std::map<std::string, std::vector<std::function<void()>>> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_overrides_.clear();
+    recent_calls_.clear();
+    for (const auto &[id, req] : pending_requests_) {
+      permission_request_index::instance().remove(id);
+    }
+    pending_requests_.clear();
+    responses_.clear();
+    cv_.notify_all();
+    waiters.swap(settle_waiters_);
+  }
+  for (auto &[id, notifies] : waiters) {
+    for (auto &notify : notifies) {
+      notify();
+    }
+  }
 }
 
 bool permission_manager_async::is_sensitive_file(const std::string &path) {
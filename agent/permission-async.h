@@ -10,6 +10,8 @@
 #include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 // Async permission request with unique ID
 struct permission_request_async {
@@ -37,12 +39,40 @@ struct permission_response_async {
 using permission_callback =
     std::function<void(const permission_request_async &)>;
 
+// Pending permission requests of all managers in the process
+// (request id -> owner), kept up to date by permission_manager_async
+class permission_request_index {
+public:
+  static permission_request_index &instance();
+
+  void add(const std::string &request_id, const std::string &owner);
+  void remove(const std::string &request_id);
+
+  // Owner of a pending request, nullopt if none is pending under that id
+  std::optional<std::string> owner_of(const std::string &request_id) const;
+
+  size_t size() const;
+
+private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::string> owners_;
+};
+
 // Async permission manager for API-based permission handling
 // Instead of blocking on stdin, queues requests and waits for external
 // responses
 class permission_manager_async {
 public:
   permission_manager_async();
+  ~permission_manager_async();
+
+  // Owner of the requests (a session id), encoded into their ids so that
+  // a response finds its manager without a lookup. Set before the first
+  // request.
+  void set_owner(const std::string &owner) { owner_ = owner; }
+
+  // Owner encoded in a request id, empty if it has none
+  static std::string request_owner(const std::string &request_id);
 
   // Set project root for external directory checks
   void set_project_root(const std::string &path);
@@ -69,6 +99,18 @@ public:
   std::optional<permission_response_async>
   wait_for_response(const std::string &request_id, int timeout_ms = 30000);
 
+  // Non-blocking wait_for_response. Returns false while the request is
+  // still pending; once answered `response` holds the (consumed) answer,
+  // once cancelled it stays empty.
+  bool take_response(const std::string &request_id,
+                     std::optional<permission_response_async> &response);
+
+  // Call `notify` once request_id has been answered or cancelled (right away
+  // if it already was). Lets a suspended agent turn resume without a thread
+  // blocked in wait_for_response.
+  void notify_when_settled(const std::string &request_id,
+                           std::function<void()> notify);
+
   // Get all pending permission requests
   std::vector<permission_request_async> pending();
 
@@ -99,6 +141,7 @@ public:
 
 private:
   std::string project_root_;
+  std::string owner_;
   bool yolo_mode_ = false;
   std::atomic<uint64_t> request_counter_{0};
 
@@ -133,6 +176,12 @@ private:
   // Optional callback for new requests
   permission_callback callback_;
 
+  // Waiters registered by notify_when_settled (request_id -> callbacks)
+  std::map<std::string, std::vector<std::function<void()>>> settle_waiters_;
+
+  // Remove and return the waiters of request_id (call with mutex_ held)
+  std::vector<std::function<void()>> take_waiters(const std::string &request_id);
+
   // Helper functions
   bool matches_pattern(const std::string &cmd,
                        const std::vector<std::string> &patterns) const;
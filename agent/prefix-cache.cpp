@@ -0,0 +1,257 @@
+#include "prefix-cache.h"
+#include "server-context.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+kv_prefix_cache::kv_prefix_cache(server_context &server_ctx,
+                                 std::shared_ptr<slot_pool> slots,
+                                 std::string dir, size_t max_entries,
+                                 bool persistent, const std::string &scope)
+    : server_ctx_(server_ctx), slots_(std::move(slots)), dir_(std::move(dir)),
+      max_entries_(std::max<size_t>(max_entries, 1)), persistent_(persistent),
+      scope_(std::hash<std::string>{}(scope)) {
+  std::error_code ec;
+  fs::create_directories(dir_, ec);
+  if (persistent_) {
+    load_entries();
+  }
+  worker_ = std::thread([this]() { worker_loop(); });
+}
+
+std::string kv_prefix_cache::path_for(uint64_t key) const {
+  char name[64];
+  snprintf(name, sizeof(name), "prefix-%016llx-%016llx.kv",
+           static_cast<unsigned long long>(scope_),
+           static_cast<unsigned long long>(key));
+  return (fs::path(dir_) / name).string();
+}
+
+void kv_prefix_cache::load_entries() {
+  char scope_hex[32];
+  snprintf(scope_hex, sizeof(scope_hex), "%016llx",
+           static_cast<unsigned long long>(scope_));
+  const std::string head = std::string("prefix-") + scope_hex + "-";
+
+  // Most recently written files count as most recently used
+  std::vector<std::pair<fs::file_time_type, uint64_t>> found;
+  std::error_code ec;
+  for (const auto &file : fs::directory_iterator(dir_, ec)) {
+    std::string name = file.path().filename().string();
+    if (name.size() != head.size() + 16 + 3 || name.compare(0, head.size(), head) != 0 ||
+        file.path().extension() != ".kv") {
+      continue;
+    }
+    uint64_t key = std::strtoull(name.substr(head.size(), 16).c_str(), nullptr, 16);
+    found.emplace_back(fs::last_write_time(file.path(), ec), key);
+  }
+  std::sort(found.begin(), found.end());
+  for (const auto &[mtime, key] : found) {
+    entries_[key] = {path_for(key), 0, ++clock_};
+  }
+  trim();
+}
+
+kv_prefix_cache::~kv_prefix_cache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+
+  if (persistent_) {
+    return;
+  }
+  std::error_code ec;
+  for (const auto &[key, e] : entries_) {
+    fs::remove(e.path, ec);
+  }
+}
+
+uint64_t kv_prefix_cache::key(const llama_tokens &tokens) {
+  // FNV-1a over the token ids; 0 is reserved for "unknown" in slot_pool
+  uint64_t h = 1469598103934665603ULL;
+  for (llama_token t : tokens) {
+    h ^= static_cast<uint32_t>(t);
+    h *= 1099511628211ULL;
+  }
+  return h == 0 ? 1 : h;
+}
+
+bool kv_prefix_cache::warm(const llama_tokens &prefix) {
+  if (prefix.empty()) {
+    return false;
+  }
+  const uint64_t k = key(prefix);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.count(k)) {
+      return true;
+    }
+  }
+
+  slot_pool::lease slot = slots_->acquire(-1);
+  if (slot.id() < 0) {
+    return false; // Every slot is busy, a later loop will ask again
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  // Prefill only: one token is generated and discarded
+  server_task task(SERVER_TASK_TYPE_COMPLETION);
+  task.index = 0;
+  task.id_slot = slot.id();
+  task.params.stream = false;
+  task.params.n_predict = 1;
+  task.cli = false;
+  task.tokens = server_tokens(prefix, false);
+
+  server_response_reader rd = server_ctx_.get_response_reader();
+  task.id = rd.get_new_id();
+  rd.post_task(std::move(task));
+
+  auto should_stop = [this]() { return stopping_.load(); };
+  bool done = false;
+  for (auto result = rd.next(should_stop); result; result = rd.next(should_stop)) {
+    if (result->is_error()) {
+      return false;
+    }
+    if (result->is_stop()) {
+      done = true;
+      break;
+    }
+  }
+  if (!done) {
+    return false;
+  }
+
+  std::string path = path_for(k);
+  size_t n_tokens = 0;
+  double t_ms = 0;
+  if (!slot_file_action(server_ctx_, SERVER_TASK_TYPE_SLOT_SAVE, slot.id(),
+                        path, n_tokens, t_ms, should_stop)) {
+    return false;
+  }
+  slots_->set_prefix(slot.id(), k);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_[k] = {path, prefix.size(), ++clock_};
+  stats_.warmed++;
+  stats_.warm_ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  trim();
+  return true;
+}
+
+void kv_prefix_cache::warm_async(const llama_tokens &prefix) {
+  if (prefix.empty()) {
+    return;
+  }
+  const uint64_t k = key(prefix);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.count(k) || !queued_.insert(k).second) {
+      return;
+    }
+    queue_.push_back(prefix);
+  }
+  cv_.notify_one();
+}
+
+bool kv_prefix_cache::seed(const llama_tokens &prefix, int slot) {
+  if (prefix.empty() || slot < 0) {
+    return false;
+  }
+  const uint64_t k = key(prefix);
+  if (slots_->prefix(slot) == k) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.already_warm++;
+    return true;
+  }
+
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(k);
+    if (it == entries_.end()) {
+      stats_.misses++;
+    } else {
+      it->second.last_used = ++clock_;
+      path = it->second.path;
+    }
+  }
+  if (path.empty()) {
+    warm_async(prefix);
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t n_tokens = 0;
+  double t_ms = 0;
+  if (!slot_file_action(server_ctx_, SERVER_TASK_TYPE_SLOT_RESTORE, slot, path,
+                        n_tokens, t_ms)) {
+    // Unreadable or written for another context setup: start over
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.erase(k);
+    }
+    std::error_code ec;
+    fs::remove(path, ec);
+    warm_async(prefix);
+    return false;
+  }
+  slots_->set_prefix(slot, k);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.seeded++;
+  stats_.seeded_tokens += static_cast<int64_t>(prefix.size());
+  stats_.seed_ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  return true;
+}
+
+void kv_prefix_cache::worker_loop() {
+  while (true) {
+    llama_tokens prefix;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_.load() || !queue_.empty(); });
+      if (stopping_.load()) {
+        return;
+      }
+      prefix = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    warm(prefix);
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_.erase(key(prefix));
+  }
+}
+
+void kv_prefix_cache::trim() {
+  std::error_code ec;
+  while (entries_.size() > max_entries_) {
+    auto oldest = entries_.begin();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->second.last_used < oldest->second.last_used) {
+        oldest = it;
+      }
+    }
+    fs::remove(oldest->second.path, ec);
+    entries_.erase(oldest);
+  }
+}
+
+prefix_cache_stats kv_prefix_cache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+#include "slot-pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+struct server_context;
+
+struct prefix_cache_stats {
+  int64_t warmed = 0;        // Prefixes prefilled and saved
+  int64_t seeded = 0;        // Slots loaded from a saved prefix
+  int64_t seeded_tokens = 0; // Tokens those loads skipped prefilling
+  int64_t already_warm = 0;  // Slot already started with the prefix
+  int64_t misses = 0;        // Prefix not saved yet (warmed in background)
+  double warm_ms = 0;        // Prefill + save time, in total
+  double seed_ms = 0;        // Restore time, in total
+};
+
+// KV cache of the stable start of agent prompts: the system prompt and the
+// tool definitions, up to where the first user message begins
+//
+// That prefix is the same for every session of a server (and for every
+// subagent of one type) and runs to several thousand tokens. It is
+// prefilled once on an idle slot and saved with SLOT_SAVE; a loop that
+// starts on a slot without it gets it back with SLOT_RESTORE instead of
+// prefilling it again. Prefixes are keyed by their tokens, so a changed tool
+// set or system prompt simply becomes a new entry.
+//
+// A persistent cache keeps its files across runs (e.g. the CLI launched
+// again in the same project); scope names what else the files depend on,
+// such as the model, and files of another scope are ignored.
+class kv_prefix_cache {
+public:
+  // dir: where the prefix states go; max_entries: prefixes kept (LRU)
+  kv_prefix_cache(server_context &server_ctx, std::shared_ptr<slot_pool> slots,
+                  std::string dir, size_t max_entries = 8,
+                  bool persistent = false, const std::string &scope = "");
+  ~kv_prefix_cache();
+
+  // Prefill and save prefix on an idle slot. Blocks; true if it is cached.
+  bool warm(const llama_tokens &prefix);
+
+  // Queue warm(prefix) on the background thread
+  void warm_async(const llama_tokens &prefix);
+
+  // Make slot (held by the caller) start with prefix: nothing to do if it
+  // already does, otherwise restore the saved state. An unknown prefix is
+  // warmed in the background for the next loop. True if the slot now holds
+  // the prefix.
+  bool seed(const llama_tokens &prefix, int slot);
+
+  static uint64_t key(const llama_tokens &tokens);
+
+  prefix_cache_stats stats() const;
+
+private:
+  struct entry {
+    std::string path;
+    size_t n_tokens = 0;
+    uint64_t last_used = 0;
+  };
+
+  server_context &server_ctx_;
+  std::shared_ptr<slot_pool> slots_;
+  std::string dir_;
+  size_t max_entries_;
+  bool persistent_;
+  uint64_t scope_;
+
+  mutable std::mutex mutex_;
+  std::map<uint64_t, entry> entries_;
+  uint64_t clock_ = 0;
+  prefix_cache_stats stats_;
+
+  // Background warming
+  std::condition_variable cv_;
+  std::deque<llama_tokens> queue_;
+  std::set<uint64_t> queued_;
+  std::atomic<bool> stopping_{false};
+  std::thread worker_;
+
+  void worker_loop();
+
+  std::string path_for(uint64_t key) const;
+
+  // Pick up the files of earlier runs (persistent caches)
+  void load_entries();
+
+  // Drop least recently used entries beyond max_entries_ (mutex_ held)
+  void trim();
+};
@@ -0,0 +1,114 @@
+#include "prompt-lookup.h"
+
+#include <algorithm>
+
+prompt_lookup_index::prompt_lookup_index(int ngram_max, size_t max_tokens)
+    : ngram_max_(std::max(2, ngram_max)),
+      max_tokens_(std::max<size_t>(max_tokens, 1024)) {}
+
+uint64_t prompt_lookup_index::hash_ngram(const llama_token *tokens, int n) {
+  // FNV-1a over the token ids, seeded with n so that different orders never
+  // share a key
+  uint64_t h = 1469598103934665603ULL ^ static_cast<uint64_t>(n);
+  for (int i = 0; i < n; i++) {
+    h ^= static_cast<uint32_t>(tokens[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void prompt_lookup_index::index_position(size_t pos) {
+  for (int n = 2; n <= ngram_max_; n++) {
+    if (pos < doc_start_ + n) {
+      break;
+    }
+    next_pos_[hash_ngram(&tokens_[pos - n], n)] = static_cast<uint32_t>(pos);
+  }
+}
+
+void prompt_lookup_index::add(const llama_tokens &tokens) {
+  begin_document();
+  for (llama_token t : tokens) {
+    push(t);
+  }
+}
+
+void prompt_lookup_index::begin_document() { doc_start_ = tokens_.size(); }
+
+void prompt_lookup_index::push(llama_token token) {
+  if (tokens_.size() >= max_tokens_) {
+    trim();
+  }
+  tokens_.push_back(token);
+  index_position(tokens_.size() - 1);
+}
+
+llama_tokens prompt_lookup_index::draft(int n_max) const {
+  llama_tokens out;
+  const size_t end = tokens_.size();
+  for (int n = ngram_max_; n >= 2 && n_max > 0; n--) {
+    if (end < doc_start_ + n) {
+      continue;
+    }
+    auto it = next_pos_.find(hash_ngram(&tokens_[end - n], n));
+    if (it == next_pos_.end() || it->second >= end) {
+      continue;
+    }
+    size_t pos = it->second;
+    size_t n_draft = std::min<size_t>(n_max, end - pos);
+    out.assign(tokens_.begin() + pos, tokens_.begin() + pos + n_draft);
+    break;
+  }
+  return out;
+}
+
+int64_t prompt_lookup_index::replay(const llama_tokens &tokens, int n_max,
+                                    int n_min, int64_t &n_drafted) {
+  int64_t n_accepted = 0;
+  n_drafted = 0;
+  begin_document();
+
+  size_t i = 0;
+  while (i < tokens.size()) {
+    llama_tokens d = draft(n_max);
+    size_t n_ok = 0;
+    if (!d.empty() && static_cast<int>(d.size()) >= n_min) {
+      while (n_ok < d.size() && i + n_ok < tokens.size() &&
+             d[n_ok] == tokens[i + n_ok]) {
+        n_ok++;
+      }
+      n_drafted += d.size();
+      n_accepted += n_ok;
+    }
+    // Accepted tokens plus the one the target model samples after them
+    size_t n_step = std::min(n_ok + 1, tokens.size() - i);
+    for (size_t k = 0; k < n_step; k++) {
+      push(tokens[i + k]);
+    }
+    i += n_step;
+  }
+  return n_accepted;
+}
+
+void prompt_lookup_index::clear() {
+  tokens_.clear();
+  next_pos_.clear();
+  doc_start_ = 0;
+}
+
+void prompt_lookup_index::trim() {
+  const size_t n_drop = tokens_.size() / 2;
+  tokens_.erase(tokens_.begin(), tokens_.begin() + n_drop);
+  size_t doc_start = doc_start_ > n_drop ? doc_start_ - n_drop : 0;
+
+  // Only the current document boundary survives; n-grams may span older ones
+  next_pos_.clear();
+  doc_start_ = 0;
+  for (size_t pos = 1; pos < tokens_.size(); pos++) {
+    if (pos == doc_start) {
+      doc_start_ = doc_start;
+    }
+    index_position(pos);
+  }
+  doc_start_ = doc_start;
+}
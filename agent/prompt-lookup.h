@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Prompt-lookup draft source: an n-gram index over the tokens a session has
+// seen (messages, tool outputs and its own replies)
+//
+// Agent replies copy a lot of text verbatim: edit old_string values come from
+// read output, paths come from glob results, code is echoed back. Looking up
+// the last n generated tokens in this index and proposing whatever followed
+// them last time predicts those spans without a draft model.
+class prompt_lookup_index {
+public:
+  // ngram_max: longest n-gram tried first (down to 2)
+  // max_tokens: tokens kept in the index, the oldest half is dropped beyond
+  explicit prompt_lookup_index(int ngram_max = 3, size_t max_tokens = 65536);
+
+  // Append a document. N-grams never span two documents.
+  void add(const llama_tokens &tokens);
+
+  // Start a new (empty) document, e.g. the reply being generated
+  void begin_document();
+
+  // Append one token to the current document
+  void push(llama_token token);
+
+  // Draft up to n_max tokens continuing the current document
+  llama_tokens draft(int n_max) const;
+
+  // Replay a generated reply as if drafts had been verified against it:
+  // draft, accept the matching prefix, append the accepted tokens plus the
+  // next real token, repeat. The reply ends up in the index.
+  // Returns the number of accepted draft tokens; n_drafted receives the
+  // number of drafted ones.
+  int64_t replay(const llama_tokens &tokens, int n_max, int n_min,
+                 int64_t &n_drafted);
+
+  void clear();
+
+  size_t size() const { return tokens_.size(); }
+
+private:
+  int ngram_max_;
+  size_t max_tokens_;
+
+  llama_tokens tokens_;
+  size_t doc_start_ = 0;
+
+  // Hash of (n, n-gram) -> position of the token that followed it last
+  std::unordered_map<uint64_t, uint32_t> next_pos_;
+
+  static uint64_t hash_ngram(const llama_token *tokens, int n);
+
+  // Register the n-grams ending just before position pos
+  void index_position(size_t pos);
+
+  // Drop the oldest half of the tokens and rebuild the map
+  void trim();
+};
@@ -0,0 +1,170 @@
+#include "scripted-backend.h"
+
+#include "chat.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using json = nlohmann::ordered_json;
+
+static const char *CHATML_TEMPLATE =
+    "{%- for message in messages -%}"
+    "{{ '<|im_start|>' + message.role + '\\n' + message.content + "
+    "'<|im_end|>\\n' }}"
+    "{%- endfor -%}"
+    "{%- if add_generation_prompt -%}{{ '<|im_start|>assistant\\n' }}"
+    "{%- endif -%}";
+
+namespace {
+
+using stream_clock = std::chrono::steady_clock;
+
+// One completion of the script, one token per result
+class scripted_stream : public completion_stream {
+public:
+  scripted_stream(const scripted_model_params &params, int seed,
+                  int64_t completion, std::atomic<int64_t> &tool_calls,
+                  std::atomic<int64_t> &simulated_us)
+      : params_(params), seed_(seed), completion_(completion),
+        tool_calls_(tool_calls), simulated_us_(simulated_us) {}
+
+  void post(server_task &&task) override {
+    prompt_chars_ =
+        task.cli ? task.cli_prompt.size() : task.tokens.size() * 4;
+
+    const int step =
+        static_cast<int>(completion_ % (params_.tool_iterations + 1));
+    if (step < params_.tool_iterations) {
+      add_tool_call(tool_calls_++);
+    } else {
+      for (int i = 0; i < params_.reply_tokens; i++) {
+        add_text(i == 0 ? "Done" : (i % 12 == 0 ? ".\n" : " word"));
+      }
+    }
+    msg_.role = "assistant";
+    started_ = stream_clock::now();
+  }
+
+  server_task_result_ptr
+  next(const std::function<bool()> &should_stop) override {
+    if (should_stop()) {
+      return nullptr;
+    }
+    const double tps = params_.tokens_per_second;
+    if (tps > 0 && pos_ < diffs_.size()) {
+      std::this_thread::sleep_until(
+          started_ + std::chrono::duration_cast<stream_clock::duration>(
+                         std::chrono::duration<double>((pos_ + 1) / tps)));
+    }
+
+    result_timings timings;
+    timings.cache_n = 0;
+    timings.prompt_n = static_cast<int32_t>(prompt_chars_ / 4);
+    timings.prompt_ms = 0;
+    timings.predicted_n =
+        static_cast<int32_t>(std::min(pos_ + 1, diffs_.size()));
+    timings.predicted_ms = tps > 0 ? timings.predicted_n * 1000.0 / tps : 0;
+
+    if (pos_ < diffs_.size()) {
+      auto res = std::make_unique<server_task_result_cmpl_partial>();
+      res->oaicompat_msg_diffs.push_back(diffs_[pos_++]);
+      res->timings = timings;
+      return res;
+    }
+
+    auto res = std::make_unique<server_task_result_cmpl_final>();
+    res->oaicompat_msg = msg_;
+    res->content = msg_.content;
+    res->timings = timings;
+    simulated_us_ += static_cast<int64_t>(timings.predicted_ms * 1000);
+    return res;
+  }
+
+private:
+  const scripted_model_params &params_;
+  int seed_;
+  int64_t completion_;
+  std::atomic<int64_t> &tool_calls_;
+  std::atomic<int64_t> &simulated_us_;
+
+  size_t prompt_chars_ = 0;
+  std::vector<common_chat_msg_diff> diffs_;
+  size_t pos_ = 0;
+  common_chat_msg msg_;
+  stream_clock::time_point started_;
+
+  void add_text(const std::string &token) {
+    common_chat_msg_diff diff;
+    diff.content_delta = token;
+    diffs_.push_back(diff);
+    msg_.content += token;
+  }
+
+  // Consecutive calls always differ, so the doom-loop check never fires
+  void add_tool_call(int64_t n) {
+    common_chat_tool_call call;
+    call.id = "call_" + std::to_string(completion_);
+    json args;
+    if (params_.bash_every > 0 && (n + 1) % params_.bash_every == 0) {
+      call.name = "bash";
+      args = {{"command", "echo scripted " + std::to_string(n)}};
+    } else if (n % 2 == 0 && !params_.read_paths.empty()) {
+      const auto &paths = params_.read_paths;
+      call.name = "read";
+      args = {{"file_path", paths[(seed_ + n) % paths.size()]},
+              {"offset", 1 + n % 50},
+              {"limit", 80}};
+    } else {
+      const auto &patterns = params_.glob_patterns;
+      call.name = "glob";
+      args = {{"pattern", patterns.empty() ? "*" : patterns[n % patterns.size()]}};
+    }
+    call.arguments = args.dump();
+
+    for (const std::string &token : {std::string("Let "), std::string("me "),
+                                     std::string("check "), call.name + "."}) {
+      add_text(token);
+    }
+    common_chat_msg_diff head;
+    head.tool_call_index = 0;
+    head.tool_call_delta.name = call.name;
+    head.tool_call_delta.id = call.id;
+    diffs_.push_back(head);
+    // Arguments arrive in ~4 character tokens
+    for (size_t i = 0; i < call.arguments.size(); i += 4) {
+      common_chat_msg_diff diff;
+      diff.tool_call_index = 0;
+      diff.tool_call_delta.arguments = call.arguments.substr(i, 4);
+      diffs_.push_back(diff);
+    }
+    msg_.tool_calls.push_back(call);
+  }
+};
+
+} // namespace
+
+scripted_model::scripted_model(scripted_model_params params)
+    : params_(std::move(params)) {
+  params_.tool_iterations = std::max(0, params_.tool_iterations);
+  params_.reply_tokens = std::max(1, params_.reply_tokens);
+  chat_params_.use_jinja = true;
+  chat_params_.reasoning_format = COMMON_REASONING_FORMAT_DEEPSEEK;
+  chat_params_.tmpls = common_chat_templates_init(
+      nullptr,
+      params_.chat_template.empty() ? CHATML_TEMPLATE : params_.chat_template);
+}
+
+scripted_backend::scripted_backend(std::shared_ptr<const scripted_model> model,
+                                   int seed)
+    : model_(std::move(model)), seed_(seed) {}
+
+const server_chat_params &scripted_backend::chat_params() {
+  return model_->chat_params();
+}
+
+std::unique_ptr<completion_stream> scripted_backend::open() {
+  return std::make_unique<scripted_stream>(model_->params(), seed_,
+                                           completions_++, tool_calls_,
+                                           simulated_us_);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "completion-backend.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct scripted_model_params {
+  int tool_iterations = 3;  // Tool-calling completions before each answer
+  int reply_tokens = 64;    // Tokens of the answer
+  double tokens_per_second = 0; // Per stream, 0 = as fast as they are read
+  int bash_every = 0; // Every Nth tool call is a bash `echo` (asks for
+                      // permission unless yolo), 0 = never
+
+  // Read/glob targets, relative to the working directory. Without read
+  // paths every non-bash call is a glob.
+  std::vector<std::string> read_paths;
+  std::vector<std::string> glob_patterns = {"*", "*.md", "*/*"};
+
+  std::string chat_template; // Jinja, empty = ChatML
+};
+
+// A stand-in for the model that replays a fixed script
+//
+// Each turn makes tool_iterations completions that call tools, then one that
+// answers in text. Results stream one token per server result, the way the
+// server sends them, so everything downstream (incremental tool starts,
+// events, SSE) runs as with a real model. Used by llama-agent-bench and by
+// `llama-agent-server --mock-model` for load tests without weights.
+class scripted_model {
+public:
+  // Throws if the chat template does not parse
+  explicit scripted_model(scripted_model_params params);
+
+  const scripted_model_params &params() const { return params_; }
+  const server_chat_params &chat_params() const { return chat_params_; }
+
+private:
+  scripted_model_params params_;
+  server_chat_params chat_params_;
+};
+
+// Script position of one session; give every session its own
+class scripted_backend : public completion_backend {
+public:
+  // seed varies the files read between sessions
+  scripted_backend(std::shared_ptr<const scripted_model> model, int seed);
+
+  const server_chat_params &chat_params() override;
+
+  // No tokenizer: prompts are only rendered to text
+  llama_context *llama_ctx() override { return nullptr; }
+
+  std::unique_ptr<completion_stream> open() override;
+
+  // Decode time the streams waited out, in total
+  int64_t simulated_us() const { return simulated_us_.load(); }
+
+private:
+  std::shared_ptr<const scripted_model> model_;
+  int seed_;
+  std::atomic<int64_t> completions_{0};
+  std::atomic<int64_t> tool_calls_{0};
+  std::atomic<int64_t> simulated_us_{0};
+};
@@ -418,7 +418,7 @@ tool_result http_agent_session::execute_tool_call_async(
   }
 
   const auto &registry = tool_registry::instance();
-  const tool_def *tool = registry.get_tool(tool_name);
+  tool_def_ptr tool = registry.get_tool(tool_name);
   if (!tool) {
     return {false, "", "Unknown tool: " + tool_name};
   }
@@ -0,0 +1,202 @@
+#include "agent-metrics.h"
+
+#include "../event-encoder.h"
+#include "../tool-registry.h"
+
+#include <algorithm>
+
+static const char *PREFIX = "llamacpp:agent_";
+
+// Label values may come from MCP tool names
+static std::string escape_label(const std::string &value) {
+  std::string out;
+  out.reserve(value.size());
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+static void header(std::ostringstream &out, const std::string &name,
+                   const char *type, const char *help) {
+  out << "# HELP " << PREFIX << name << " " << help << "\n";
+  out << "# TYPE " << PREFIX << name << " " << type << "\n";
+}
+
+metric_histogram::metric_histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)), counts_(bounds_.size() + 1, 0) {}
+
+void metric_histogram::observe(double value) {
+  size_t i = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+             bounds_.begin();
+  counts_[i]++;
+  sum_ += value;
+  count_++;
+}
+
+void metric_histogram::render(std::ostringstream &out, const std::string &name,
+                              const std::string &labels) const {
+  const std::string sep = labels.empty() ? "" : ",";
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < bounds_.size(); i++) {
+    cumulative += counts_[i];
+    out << PREFIX << name << "_bucket{" << labels << sep << "le=\""
+        << bounds_[i] << "\"} " << cumulative << "\n";
+  }
+  out << PREFIX << name << "_bucket{" << labels << sep << "le=\"+Inf\"} "
+      << count_ << "\n";
+  const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+  out << PREFIX << name << "_sum" << braces << " " << sum_ << "\n";
+  out << PREFIX << name << "_count" << braces << " " << count_ << "\n";
+}
+
+static std::vector<double> tool_buckets() {
+  return {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120};
+}
+
+agent_metrics::agent_metrics()
+    : turn_seconds_({0.5, 1, 2, 5, 10, 20, 30, 60, 120, 300, 600}),
+      turn_iterations_({1, 2, 3, 5, 8, 13, 21, 34, 50}),
+      ttft_seconds_({0.1, 0.25, 0.5, 1, 2, 5, 10, 30, 60}) {}
+
+void agent_metrics::observe(const agent_event &event, agent_turn_probe &probe) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  switch (event.type) {
+  case agent_event_type::TEXT_DELTA:
+  case agent_event_type::REASONING_DELTA:
+    if (!probe.first_token) {
+      probe.first_token = true;
+      ttft_seconds_.observe(std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - probe.started)
+                                .count());
+    }
+    break;
+  case agent_event_type::TOOL_START:
+    if (event.name == "task") {
+      subagent_spawns_++;
+    }
+    break;
+  case agent_event_type::TOOL_RESULT: {
+    // Tool names come from the model; only registered tools get a series of
+    // their own, so hallucinated names cannot grow the label set
+    std::string name(event.name);
+    if (!tool_registry::instance().get_tool(name)) {
+      name = "unknown";
+    }
+    auto it = tool_seconds_.find(name);
+    if (it == tool_seconds_.end()) {
+      it = tool_seconds_.emplace(name, metric_histogram(tool_buckets())).first;
+    }
+    it->second.observe(event.value / 1000.0);
+    if (!event.ok) {
+      tool_failures_[name]++;
+    }
+    break;
+  }
+  case agent_event_type::PERMISSION_REQUIRED:
+    permission_waits_++;
+    break;
+  case agent_event_type::COMPLETED:
+    turns_[agent_stop_reason_name(event.reason)]++;
+    break;
+  default:
+    break;
+  }
+}
+
+void agent_metrics::finish_turn(const agent_turn_probe &probe,
+                                const agent_loop_result &result,
+                                const session_stats &stats) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  turn_seconds_.observe(std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - probe.started)
+                            .count());
+  turn_iterations_.observe(result.iterations);
+  doom_loops_ += std::max(0, stats.doom_loops - probe.doom_loops);
+}
+
+void agent_metrics::session_evicted(const std::string &reason,
+                                    const std::string &action) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  evictions_[{reason, action}]++;
+}
+
+void agent_metrics::restore_failed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  restore_failures_++;
+}
+
+std::string agent_metrics::render(const agent_metrics_gauges &gauges) const {
+  std::ostringstream out;
+
+  header(out, "sessions", "gauge", "Agent sessions in memory.");
+  out << PREFIX << "sessions " << gauges.sessions << "\n";
+  header(out, "sessions_hibernated", "gauge", "Agent sessions parked on disk.");
+  out << PREFIX << "sessions_hibernated " << gauges.hibernated << "\n";
+  header(out, "sessions_running", "gauge", "Sessions with a turn in progress.");
+  out << PREFIX << "sessions_running " << gauges.running << "\n";
+  header(out, "sessions_waiting_permission", "gauge",
+         "Sessions whose turn waits for a permission answer.");
+  out << PREFIX << "sessions_waiting_permission " << gauges.waiting << "\n";
+  header(out, "turns_queued", "gauge", "Turns waiting for a server slot.");
+  out << PREFIX << "turns_queued " << gauges.queued_turns << "\n";
+  header(out, "turns_generating", "gauge", "Turns holding a server slot.");
+  out << PREFIX << "turns_generating " << gauges.generating << "\n";
+  header(out, "session_memory_bytes", "gauge",
+         "Heap memory held by the sessions (history and prompts).");
+  out << PREFIX << "session_memory_bytes " << gauges.memory_bytes << "\n";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  header(out, "turns_total", "counter", "Finished turns by stop reason.");
+  for (const auto &[reason, n] : turns_) {
+    out << PREFIX << "turns_total{reason=\"" << escape_label(reason) << "\"} "
+        << n << "\n";
+  }
+  header(out, "turn_seconds", "histogram",
+         "Turn latency, from the user message to the final answer.");
+  turn_seconds_.render(out, "turn_seconds");
+  header(out, "turn_iterations", "histogram", "Model calls per turn.");
+  turn_iterations_.render(out, "turn_iterations");
+  header(out, "time_to_first_token_seconds", "histogram",
+         "Time from the user message to the first streamed token.");
+  ttft_seconds_.render(out, "time_to_first_token_seconds");
+
+  header(out, "tool_seconds", "histogram", "Tool call latency by tool.");
+  for (const auto &[name, hist] : tool_seconds_) {
+    hist.render(out, "tool_seconds", "tool=\"" + escape_label(name) + "\"");
+  }
+  header(out, "tool_failures_total", "counter", "Failed tool calls by tool.");
+  for (const auto &[name, n] : tool_failures_) {
+    out << PREFIX << "tool_failures_total{tool=\"" << escape_label(name)
+        << "\"} " << n << "\n";
+  }
+
+  header(out, "doom_loops_total", "counter",
+         "Repeated identical tool calls that needed confirmation.");
+  out << PREFIX << "doom_loops_total " << doom_loops_ << "\n";
+  header(out, "permission_waits_total", "counter",
+         "Tool calls that waited for a permission answer.");
+  out << PREFIX << "permission_waits_total " << permission_waits_ << "\n";
+  header(out, "subagent_spawns_total", "counter", "Subagents started.");
+  out << PREFIX << "subagent_spawns_total " << subagent_spawns_ << "\n";
+  header(out, "sessions_evicted_total", "counter",
+         "Sessions removed or hibernated by the reaper, by reason.");
+  for (const auto &[key, n] : evictions_) {
+    out << PREFIX << "sessions_evicted_total{reason=\"" << key.first
+        << "\",action=\"" << key.second << "\"} " << n << "\n";
+  }
+  header(out, "session_restore_failures_total", "counter",
+         "Parked sessions whose history could not be loaded back.");
+  out << PREFIX << "session_restore_failures_total " << restore_failures_
+      << "\n";
+
+  return out.str();
+}
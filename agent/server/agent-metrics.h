@@ -0,0 +1,92 @@
+#pragma once
+
+#include "../agent-loop.h"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Cumulative Prometheus histogram with fixed upper bounds
+class metric_histogram {
+public:
+  explicit metric_histogram(std::vector<double> bounds);
+
+  void observe(double value);
+
+  // Append the _bucket/_sum/_count series; labels is e.g. `tool="read"`
+  void render(std::ostringstream &out, const std::string &name,
+              const std::string &labels = "") const;
+
+private:
+  std::vector<double> bounds_;
+  std::vector<uint64_t> counts_; // Per bound, plus one for +Inf
+  double sum_ = 0;
+  uint64_t count_ = 0;
+};
+
+// Session counts sampled when /metrics is scraped
+struct agent_metrics_gauges {
+  size_t sessions = 0;     // In memory
+  size_t hibernated = 0;   // Parked on disk
+  size_t running = 0;      // Turn in progress (generating or in tools)
+  size_t waiting = 0;      // Turn waiting for a permission answer
+  size_t queued_turns = 0; // Waiting for a server slot
+  int generating = 0;      // Holding a server slot
+  int64_t memory_bytes = 0; // Estimated footprint of the sessions in memory
+};
+
+// What one turn looked like so far, see agent_metrics::observe()
+struct agent_turn_probe {
+  std::chrono::steady_clock::time_point started;
+  bool first_token = false;
+  int32_t doom_loops = 0; // session_stats::doom_loops when it started
+};
+
+// Agent-level metrics, appended to the llama-server counters on /metrics
+//
+// Everything is derived from the turn event stream plus the result of each
+// turn, so the loop itself needs no hooks beyond session_stats.
+class agent_metrics {
+public:
+  agent_metrics();
+
+  // Called for every event a session's turn emits
+  void observe(const agent_event &event, agent_turn_probe &probe);
+
+  // The turn ended; stats are the session's after it
+  void finish_turn(const agent_turn_probe &probe,
+                   const agent_loop_result &result, const session_stats &stats);
+
+  // The reaper removed (or, for memory, hibernated) a session; reason is
+  // "idle_timeout" or "memory_budget", action "deleted" or "hibernated"
+  void session_evicted(const std::string &reason, const std::string &action);
+
+  // A parked session's history could not be loaded back
+  void restore_failed();
+
+  // Prometheus text exposition format
+  std::string render(const agent_metrics_gauges &gauges) const;
+
+private:
+  mutable std::mutex mutex_;
+
+  metric_histogram turn_seconds_;
+  metric_histogram turn_iterations_;
+  metric_histogram ttft_seconds_;
+  std::map<std::string, metric_histogram> tool_seconds_; // By tool name
+
+  std::map<std::string, uint64_t> turns_;         // By stop reason
+  std::map<std::string, uint64_t> tool_failures_; // By tool name
+  uint64_t doom_loops_ = 0;
+  uint64_t permission_waits_ = 0;
+  uint64_t subagent_spawns_ = 0;
+  uint64_t restore_failures_ = 0;
+
+  // By (reason, action)
+  std::map<std::pair<std::string, std::string>, uint64_t> evictions_;
+};
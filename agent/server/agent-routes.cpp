@@ -1,19 +1,23 @@
 #include "agent-routes.h"
 
 #include "../tool-registry.h"
+#include "../tool-result-cache.h"
 #include "../agent-loop.h"
+#include "../event-encoder.h"
 #include "../permission-async.h"
 #include "agent-session.h"
 #include "server-http.h"
 #include "mtmd.h"
 #include "base64.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cmath>
 #include <condition_variable>
 #include <ctime>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <string>
 
 // Helper to create error response
@@ -33,66 +37,140 @@ server_http_res_ptr agent_routes::make_json(const json &data, int status) {
   return res;
 }
 
-// SSE streaming response implementation
+// Token deltas arriving within this window go out as one event
+static constexpr auto SSE_COALESCE_WINDOW = std::chrono::milliseconds(5);
+// ... unless this much text piled up first
+static constexpr size_t SSE_COALESCE_BYTES = 4096;
+// Comment line sent when a stream was quiet this long (tool calls,
+// permission waits)
+static constexpr auto SSE_KEEPALIVE = std::chrono::seconds(10);
+
+// SSE stream of one chat turn
+//
+// The turn appends encoded events to a pending buffer and the HTTP thread
+// sleeps until there is something to send; the two swap buffers, so their
+// capacity is reused for the whole stream. Consecutive text (or reasoning)
+// deltas are merged into one event while they arrive within
+// SSE_COALESCE_WINDOW: a fast model costs an event per window instead of
+// one per token. The first delta of a stream is sent right away.
 struct sse_stream_res : server_http_res {
-  std::queue<std::string> chunks;
+  using clock = std::chrono::steady_clock;
+
   std::mutex mutex;
   std::condition_variable cv;
-  std::atomic<bool> done{false};
+  std::string pending; // Encoded events not handed out yet
+  bool done = false;
+  bool sent = false; // Anything handed out yet
+
+  // Delta being merged (its event is not in pending yet)
+  bool delta_open = false;
+  agent_event_type delta_type = agent_event_type::TEXT_DELTA;
+  std::string delta;
+  clock::time_point delta_since;
 
   sse_stream_res() {
     content_type = "text/event-stream";
     headers["Cache-Control"] = "no-cache";
     headers["Connection"] = "keep-alive";
 
-    next = [this](std::string& output) -> bool {
+    next = [this](std::string &output) -> bool {
       std::unique_lock<std::mutex> lock(mutex);
-
-      // Wait for data or done signal
-      cv.wait_for(lock, std::chrono::milliseconds(100),
-                  [this] { return !chunks.empty() || done.load(); });
-
-      if (!chunks.empty()) {
-        output = chunks.front();
-        chunks.pop();
-        return true;
-      }
-
-      if (done.load()) {
-        return false;
+      const clock::time_point keepalive_at = clock::now() + SSE_KEEPALIVE;
+      for (;;) {
+        const clock::time_point now = clock::now();
+        const bool delta_due =
+            delta_open && (done || !sent || delta.size() >= SSE_COALESCE_BYTES ||
+                           now >= delta_since + SSE_COALESCE_WINDOW);
+        if (delta_due || (!pending.empty() && !delta_open)) {
+          close_delta();
+        }
+        if (!pending.empty()) {
+          output.clear();
+          std::swap(output, pending);
+          sent = true;
+          return true;
+        }
+        if (done) {
+          return false;
+        }
+        if (now >= keepalive_at && !delta_open) {
+          output = ": keep-alive\n\n";
+          return true;
+        }
+        cv.wait_until(lock, delta_open ? std::min(keepalive_at,
+                                                  delta_since + SSE_COALESCE_WINDOW)
+                                       : keepalive_at);
       }
-
-      // Keep alive with empty chunk
-      output = "\n";
-      return true;
     };
   }
 
-  void send(const std::string & event_type, const json &data) {
-    std::string chunk = "event: " + event_type + "\n";
-    chunk += "data: " + data.dump() + "\n\n";
+  void send(const agent_event &event) {
+    bool wake = false;
     {
       std::lock_guard<std::mutex> lock(mutex);
-      chunks.push(chunk);
+      if (event.type == agent_event_type::TEXT_DELTA ||
+          event.type == agent_event_type::REASONING_DELTA) {
+        if (delta_open && delta_type != event.type) {
+          close_delta();
+          wake = true;
+        }
+        if (!delta_open) {
+          // The HTTP thread has to learn the flush deadline
+          delta_open = true;
+          delta_type = event.type;
+          delta_since = clock::now();
+          wake = true;
+        }
+        delta.append(event.text);
+        wake = wake || delta.size() >= SSE_COALESCE_BYTES;
+      } else {
+        close_delta();
+        append_event_sse(pending, event);
+        wake = true;
+      }
+    }
+    if (wake) {
+      cv.notify_one();
     }
-    cv.notify_one();
   }
 
   void finish() {
-    done.store(true);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
     cv.notify_one();
   }
+
+private:
+  // Move the merged delta into pending (mutex held)
+  void close_delta() {
+    if (!delta_open) {
+      return;
+    }
+    pending += "event: ";
+    pending += agent_event_name(delta_type);
+    pending += "\ndata: {\"content\":";
+    append_json_string(pending, delta);
+    pending += "}\n\n";
+    delta.clear();
+    delta_open = false;
+  }
 };
 
 // Wrapper that holds shared_ptr to sse_stream_res to extend its lifetime
 // This ensures the SSE response object lives until both:
 // 1. The HTTP framework is done with it
 // 2. The worker thread callback is done with it
+// It also keeps the session alive while its turn streams, even if the
+// session is deleted or reaped meanwhile
 struct sse_shared_wrapper: server_http_res {
   std::shared_ptr<sse_stream_res> sse;
+  std::shared_ptr<agent_session> session;
 
-  explicit sse_shared_wrapper(std::shared_ptr<sse_stream_res> s)
-      : sse(std::move(s)) {
+  sse_shared_wrapper(std::shared_ptr<sse_stream_res> s,
+                     std::shared_ptr<agent_session> owner)
+      : sse(std::move(s)), session(std::move(owner)) {
     content_type = sse->content_type;
     headers = sse->headers;
     next = [this](std::string &output) -> bool {
@@ -164,7 +242,7 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       return make_error(404, "Missing session ID");
     }
 
-    agent_session * session = session_mgr_.get_session(session_id);
+    auto session = session_mgr_.get_session(session_id);
     if (!session) {
       return make_error(404, "Session not found");
     }
@@ -174,11 +252,15 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       {"session_id", info.id},
       {"state", static_cast<int>(info.state)},
       {"message_count", info.message_count},
+      {"queue_position", info.queue_position},
+      {"queue_wait_ms", info.queue_wait_ms},
+      {"slot", info.slot},
       {
           "stats",
           {{"input_tokens", info.stats.total_input},
            {"output_tokens", info.stats.total_output},
-           {"cached_tokens", info.stats.total_cached}
+           {"cached_tokens", info.stats.total_cached},
+           {"cache_hit_ratio", info.stats.cache_hit_ratio()}
           }
       }};
     return make_json(respond);
@@ -192,7 +274,11 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       response.push_back({
           {"session_id", info.id},
           {"state", static_cast<int>(info.state)},
-          {"message_count", info.message_count} });
+          {"message_count", info.message_count},
+          {"queue_position", info.queue_position},
+          {"queue_wait_ms", info.queue_wait_ms},
+          {"slot", info.slot},
+          {"cache_hit_ratio", info.stats.cache_hit_ratio()} });
     }
         return make_json({{"sessions", response}});
     };
@@ -204,11 +290,24 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       return make_error(404, "Missing session ID");
     }
 
-    agent_session * session = session_mgr_.get_session(session_id);
+    auto session = session_mgr_.get_session(session_id);
     if (!session) {
       return make_error(404, "Session not found");
     }
 
+    // Refuse right away instead of queueing invisibly: 503 if this session
+    // is still busy with a turn, 429 if too many turns wait for a slot
+    double retry_after_ms = 0;
+    if (!session->is_completed()) {
+      return make_error(503, "Session is busy with a previous message");
+    }
+    if (!session_mgr_.accepting_turns(retry_after_ms)) {
+      auto res = make_error(429, "Too many queued agent turns, retry later");
+      res->headers["Retry-After"] = std::to_string(
+          std::max(1, static_cast<int>(std::ceil(retry_after_ms / 1000.0))));
+      return res;
+    }
+
     // Parse message content from body - supports text or multimodal
     json body;
     json user_message;
@@ -307,44 +406,14 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
     // Use multimodal method for both text and multimodal content
     // Pass extracted media files for multimodal processing
     session->send_message_multimodal(user_message, [sse_shared](const agent_event &event) {
-      std::string event_type;
-      switch (event.type) {
-      case agent_event_type::TEXT_DELTA:
-        event_type = "text_delta";
-        break;
-      case agent_event_type::REASONING_DELTA:
-        event_type = "reasoning_delta";
-        break;
-      case agent_event_type::TOOL_START:
-        event_type = "tool_start";
-        break;
-      case agent_event_type::TOOL_RESULT:
-        event_type = "tool_result";
-        break;
-      case agent_event_type::PERMISSION_REQUIRED:
-        event_type = "permission_required";
-        break;
-      case agent_event_type::PERMISSION_RESOLVED:
-        event_type = "permission_resolved";
-        break;
-      case agent_event_type::ITERATION_START:
-        event_type = "iteration_start";
-        break;
-      case agent_event_type::COMPLETED:
-        event_type = "completed";
-        sse_shared->send(event_type, event.data);
-        sse_shared->finish();
-        return;
-      case agent_event_type::ERROR:
-        event_type = "error";
-        sse_shared->send(event_type, event.data);
+      sse_shared->send(event);
+      if (event.type == agent_event_type::COMPLETED ||
+          event.type == agent_event_type::ERROR) {
         sse_shared->finish();
-        return;
       }
-      sse_shared->send(event_type, event.data);
     }, std::move(media_files));
     // Return wrapper that holds shared_ptr reference
-    return std::make_unique<sse_shared_wrapper>(sse_shared);
+    return std::make_unique<sse_shared_wrapper>(sse_shared, session);
   };
 
   // GET /v1/agent/session/:id/message - Get conversation history
@@ -354,7 +423,7 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       return make_error(400, "Missing session ID");
     }
 
-    agent_session * session = session_mgr_.get_session(session_id);
+    auto session = session_mgr_.get_session(session_id);
     if (!session) {
       return make_error(404, "Session not found");
     }
@@ -368,7 +437,7 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       return make_error(400, "Missing session ID");
     }
 
-    agent_session * session = session_mgr_.get_session(session_id);
+    auto session = session_mgr_.get_session(session_id);
     if (!session) {
       return make_error(404, "Session not found");
     }
@@ -410,14 +479,14 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       return make_error(400, std::string("Invalid JSON: ") + e.what());
     }
 
-    // Find the session with this permission request
-    // (In a real implementation, you'd want a permission_id -> session_id
-    // mapping)
-    for (const auto &info : session_mgr_.list_sessions()) {
-      agent_session *session = session_mgr_.get_session(info.id);
-      if (session && session->respond_permission(request_id, allowed, scope)) {
-        return make_json({{"status", "success"}});
-      }
+    // Request ids name their session; the index covers ids without one
+    std::string owner = permission_manager_async::request_owner(request_id);
+    if (owner.empty()) {
+      owner = permission_request_index::instance().owner_of(request_id).value_or("");
+    }
+    auto session = owner.empty() ? nullptr : session_mgr_.get_session(owner);
+    if (session && session->respond_permission(request_id, allowed, scope)) {
+      return make_json({{"status", "success"}});
     }
 
     return make_error(404, "Permission request not found");
@@ -456,7 +525,7 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
       return make_error(400, "Missing session ID");
     }
 
-    agent_session * session = session_mgr_.get_session(session_id);
+    auto session = session_mgr_.get_session(session_id);
     if (!session) {
       return make_error(404, "Session not found");
     }
@@ -466,7 +535,108 @@ agent_routes::agent_routes(agent_session_manager &session_mgr)
         {"output_tokens", stats.total_output},
         {"cached_tokens", stats.total_cached},
         {"prompt_ms", stats.total_prompt_ms},
-        {"predicted_ms", stats.total_predicted_ms}
+        {"predicted_ms", stats.total_predicted_ms},
+        {"compactions", stats.compactions},
+        {"compaction_tokens_saved", stats.compaction_tokens_saved},
+        {"lookup_est_drafted_tokens", stats.lookup_est_drafted},
+        {"lookup_est_accepted_tokens", stats.lookup_est_accepted},
+        {"draft_tokens", stats.draft_n},
+        {"draft_accepted_tokens", stats.draft_accepted},
+        {"completions", stats.completions},
+        {"slot_switches", stats.slot_switches},
+        {"doom_loops", stats.doom_loops},
+        {"cache_hit_ratio", stats.cache_hit_ratio()}
+        });
+  };
+
+  // GET /v1/agent/session/:id/trace?turn=N - Chrome trace-event JSON of a
+  // turn (default: the latest)
+  get_trace = [this](const server_http_req &req) -> server_http_res_ptr {
+    std::string session_id = req.get_param("id");
+    if (session_id.empty()) {
+      return make_error(400, "Missing session ID");
+    }
+    auto session = session_mgr_.get_session(session_id);
+    if (!session) {
+      return make_error(404, "Session not found");
+    }
+    int turn = 0;
+    std::string turn_param = req.get_param("turn");
+    if (!turn_param.empty()) {
+      try {
+        turn = std::stoi(turn_param);
+      } catch (...) {
+        return make_error(400, "Invalid turn: " + turn_param);
+      }
+    }
+    json trace = session->get_trace(turn);
+    if (trace.is_null()) {
+      return make_error(404, "No trace for this turn");
+    }
+    return make_json(trace);
+  };
+
+  // GET /v1/agent/hibernation - Parked sessions and restore vs re-prefill
+  get_hibernation = [this](const server_http_req &) -> server_http_res_ptr {
+    auto stats = session_mgr_.get_hibernation_stats();
+    auto journal = session_mgr_.get_journal_stats();
+    auto avg = [](double total, int64_t n) { return n > 0 ? total / n : 0.0; };
+    return make_json({
+        {"hibernated", stats.hibernated},
+        {"restored", stats.restored},
+        {"kv_saved", stats.kv_saved},
+        {"kv_restored", stats.kv_restored},
+        {"kv_restore_failed", stats.kv_restore_failed},
+        {"kv_evicted", stats.kv_evicted},
+        {"disk_bytes", stats.disk_bytes},
+        {"avg_save_ms", avg(stats.save_ms, stats.hibernated)},
+        {"avg_kv_restore_ms", avg(stats.kv_restore_ms, stats.kv_restored)},
+        {"kv_restored_tokens", stats.kv_restored_tokens},
+        {"avg_prefill_after_kv_restore_ms",
+         avg(stats.prefill_after_kv_ms, stats.prefills_after_kv)},
+        {"avg_prefill_after_kv_restore_tokens",
+         avg(static_cast<double>(stats.prefill_after_kv_tokens), stats.prefills_after_kv)},
+        {"avg_reprefill_ms", avg(stats.reprefill_ms, stats.reprefills)},
+        {"avg_reprefill_tokens",
+         avg(static_cast<double>(stats.reprefill_tokens), stats.reprefills)},
+        {"journal", {
+            {"recovered", journal.recovered},
+            {"appends", journal.appends},
+            {"snapshots", journal.snapshots},
+            {"fsyncs", journal.fsyncs},
+            {"write_errors", journal.write_errors},
+            {"bytes_written", journal.bytes_written}}}
+        });
+  };
+
+  // GET /v1/agent/prefix-cache - Shared system prompt + tools KV prefix
+  get_prefix_cache = [this](const server_http_req &) -> server_http_res_ptr {
+    auto stats = session_mgr_.get_prefix_cache_stats();
+    return make_json({
+        {"warmed", stats.warmed},
+        {"seeded", stats.seeded},
+        {"seeded_tokens", stats.seeded_tokens},
+        {"already_warm", stats.already_warm},
+        {"misses", stats.misses},
+        {"avg_warm_ms", stats.warmed > 0 ? stats.warm_ms / stats.warmed : 0.0},
+        {"avg_seed_ms", stats.seeded > 0 ? stats.seed_ms / stats.seeded : 0.0}
+        });
+  };
+
+  // GET /v1/agent/tool-cache - read/glob results shared by all sessions
+  get_tool_cache = [](const server_http_req &) -> server_http_res_ptr {
+    auto stats = tool_result_cache::instance().stats();
+    int64_t lookups = stats.hits + stats.misses;
+    return make_json({
+        {"hits", stats.hits},
+        {"misses", stats.misses},
+        {"stale", stats.stale},
+        {"invalidations", stats.invalidations},
+        {"evictions", stats.evictions},
+        {"entries", stats.entries},
+        {"bytes", stats.bytes},
+        {"budget_bytes", stats.budget_bytes},
+        {"hit_ratio", lookups > 0 ? static_cast<double>(stats.hits) / lookups : 0.0}
         });
   };
 }
@@ -490,4 +660,8 @@ void register_agent_routes(server_http_context &ctx, agent_routes &routes) {
   ctx.get("/v1/agent/tools", routes.get_tools);
   ctx.get("/v1/models", routes.get_models);
   ctx.get("/v1/agent/session/:id/stats", routes.get_stats);
+  ctx.get("/v1/agent/session/:id/trace", routes.get_trace);
+  ctx.get("/v1/agent/hibernation", routes.get_hibernation);
+  ctx.get("/v1/agent/prefix-cache", routes.get_prefix_cache);
+  ctx.get("/v1/agent/tool-cache", routes.get_tool_cache);
 }
@@ -42,6 +42,10 @@ struct agent_routes {
 
   // Statistics
   handler_t get_stats; // GET /v1/agent/session/:id/stats - Get session stats
+  handler_t get_hibernation; // GET /v1/agent/hibernation - Hibernation stats
+  handler_t get_prefix_cache; // GET /v1/agent/prefix-cache - Prefix cache stats
+  handler_t get_tool_cache; // GET /v1/agent/tool-cache - read/glob cache stats
+  handler_t get_trace; // GET /v1/agent/session/:id/trace - Chrome trace of a turn
 
   // Constructor: set up all handlers
   agent_routes(agent_session_manager &session_mgr);
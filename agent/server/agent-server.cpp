@@ -6,7 +6,9 @@
 #include "server-http.h"
 #include "server-models.h"
 #include "../tool-registry.h"
+#include "../tool-result-cache.h"
 #include "../agent-loop.h"
+#include "../scripted-backend.h"
 
 
 #include "arg.h"
@@ -107,6 +109,13 @@ int main(int argc, char *argv[]) {
 
   // Parse custom flag before common_params_parse
   int max_subagent_depth = 0; // Default: subagent disabled
+  int max_queued_turns = -1;  // Default: 4 per slot
+  hibernation_config hibernation; // Default: sessions stay in memory
+  session_reaper_config reaper;   // Default: sessions live until deleted
+  journal_config journal;         // Default: sessions are lost on restart
+  bool prefix_cache = true;       // Default: share the prompt prefix KV
+  bool mock_model = false;        // Default: serve the loaded model
+  scripted_model_params mock;
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
     if (arg == "--subagent") {
@@ -147,6 +156,168 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "--max-subagent-depth requires a value\n");
       return 1;
     }
+    } else if (arg == "--no-prefix-cache") {
+      prefix_cache = false;
+      for (int j = i; j < argc; j++) {
+        argv[j] = argv[j + 1];
+      }
+      argc--;
+      i--;
+    } else if (arg == "--tool-cache-mb") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "--tool-cache-mb requires a value\n");
+        return 1;
+      }
+      try {
+        tool_result_cache::instance().set_budget(
+            static_cast<size_t>(std::max(0, std::stoi(argv[i + 1]))) << 20);
+      } catch (...) {
+        fprintf(stderr, "Invalid --tool-cache-mb value: %s\n", argv[i + 1]);
+        return 1;
+      }
+      // Remove both the flag and its value
+      for (int j = i; j < argc - 2; j++) {
+        argv[j] = argv[j + 2];
+      }
+      argc -= 2;
+      i--;
+    } else if (arg == "--max-queued-turns") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "--max-queued-turns requires a value\n");
+        return 1;
+      }
+      try {
+        max_queued_turns = std::max(0, std::stoi(argv[i + 1]));
+      } catch (...) {
+        fprintf(stderr, "Invalid --max-queued-turns value: %s\n", argv[i + 1]);
+        return 1;
+      }
+      // Remove both the flag and its value
+      for (int j = i; j < argc - 2; j++) {
+        argv[j] = argv[j + 2];
+      }
+      argc -= 2;
+      i--;
+    } else if (arg == "--mock-model") {
+      mock_model = true;
+      for (int j = i; j < argc; j++) {
+        argv[j] = argv[j + 1];
+      }
+      argc--;
+      i--;
+    } else if (arg == "--mock-tps" || arg == "--mock-tool-iterations" ||
+               arg == "--mock-reply-tokens" || arg == "--mock-bash-every") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "%s requires a value\n", arg.c_str());
+        return 1;
+      }
+      std::string value = argv[i + 1];
+      try {
+        if (arg == "--mock-tps") {
+          mock.tokens_per_second = std::max(0.0, std::stod(value));
+        } else if (arg == "--mock-tool-iterations") {
+          mock.tool_iterations = std::max(0, std::stoi(value));
+        } else if (arg == "--mock-reply-tokens") {
+          mock.reply_tokens = std::max(1, std::stoi(value));
+        } else {
+          mock.bash_every = std::max(0, std::stoi(value));
+        }
+      } catch (...) {
+        fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+        return 1;
+      }
+      // Remove both the flag and its value
+      for (int j = i; j < argc - 2; j++) {
+        argv[j] = argv[j + 2];
+      }
+      argc -= 2;
+      i--;
+    } else if (arg == "--hibernate-after" || arg == "--hibernate-dir" ||
+               arg == "--hibernate-budget-mb" || arg == "--hibernate-evict") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "%s requires a value\n", arg.c_str());
+        return 1;
+      }
+      std::string value = argv[i + 1];
+      try {
+        if (arg == "--hibernate-after") {
+          hibernation.idle_seconds = std::max(0, std::stoi(value));
+        } else if (arg == "--hibernate-dir") {
+          hibernation.dir = value;
+        } else if (arg == "--hibernate-budget-mb") {
+          hibernation.disk_budget_bytes =
+              static_cast<uint64_t>(std::max(0, std::stoi(value))) << 20;
+        } else if (value == "oldest") {
+          hibernation.eviction = hibernation_eviction::OLDEST;
+        } else if (value == "largest") {
+          hibernation.eviction = hibernation_eviction::LARGEST;
+        } else {
+          throw std::invalid_argument(value);
+        }
+      } catch (...) {
+        fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+        return 1;
+      }
+      // Remove both the flag and its value
+      for (int j = i; j < argc - 2; j++) {
+        argv[j] = argv[j + 2];
+      }
+      argc -= 2;
+      i--;
+    } else if (arg == "--session-ttl" || arg == "--session-memory-mb") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "%s requires a value\n", arg.c_str());
+        return 1;
+      }
+      std::string value = argv[i + 1];
+      try {
+        if (arg == "--session-ttl") {
+          reaper.idle_seconds = std::max(0, std::stoi(value));
+        } else {
+          reaper.memory_budget_bytes =
+              static_cast<uint64_t>(std::max(0, std::stoi(value))) << 20;
+        }
+      } catch (...) {
+        fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+        return 1;
+      }
+      // Remove both the flag and its value
+      for (int j = i; j < argc - 2; j++) {
+        argv[j] = argv[j + 2];
+      }
+      argc -= 2;
+      i--;
+    } else if (arg == "--session-journal" || arg == "--journal-sync" ||
+               arg == "--journal-sync-ms") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "%s requires a value\n", arg.c_str());
+        return 1;
+      }
+      std::string value = argv[i + 1];
+      try {
+        if (arg == "--session-journal") {
+          journal.dir = value;
+        } else if (arg == "--journal-sync-ms") {
+          journal.sync_interval_ms = std::max(1, std::stoi(value));
+        } else if (value == "turn") {
+          journal.sync = journal_sync::TURN;
+        } else if (value == "batch") {
+          journal.sync = journal_sync::BATCH;
+        } else if (value == "none") {
+          journal.sync = journal_sync::NONE;
+        } else {
+          throw std::invalid_argument(value);
+        }
+      } catch (...) {
+        fprintf(stderr, "Invalid %s value: %s\n", arg.c_str(), value.c_str());
+        return 1;
+      }
+      // Remove both the flag and its value
+      for (int j = i; j < argc - 2; j++) {
+        argv[j] = argv[j + 2];
+      }
+      argc -= 2;
+      i--;
     } else if (arg == "--asr-model") {
       if (i + 1 < argc) {
         g_asr_model_path = argv[i + 1];
@@ -255,7 +426,7 @@ int main(int argc, char *argv[]) {
   // Llama-server compatible routes (OpenAI-compatible /v1/*, /health, etc.)
   server_routes server_api(params, ctx_server);
 
-  const bool is_router_server = params.model.path.empty();
+  const bool is_router_server = params.model.path.empty() && !mock_model;
   std::optional<server_models_routes> models_routes;
 
   std::unique_ptr<agent_session_manager> session_mgr;
@@ -296,13 +467,59 @@ int main(int argc, char *argv[]) {
     ctx_http.post("/models/load", ex_wrapper(models_routes->post_router_models_load));
     ctx_http.post("/models/unload", ex_wrapper(models_routes->post_router_models_unload));
   } else {
-    session_mgr = std::make_unique<agent_session_manager>(ctx_server, params);
+    if (hibernation.dir.empty()) {
+      hibernation.dir = params.slot_save_path;
+    }
+    std::shared_ptr<const scripted_model> scripted;
+    if (mock_model) {
+      // Nothing runs the inference loop: slot KV files cannot be written
+      if (hibernation.idle_seconds > 0) {
+        LOG_WRN("--mock-model: hibernation disabled\n");
+      }
+      hibernation.idle_seconds = 0;
+      prefix_cache = false;
+      try {
+        scripted = std::make_shared<scripted_model>(mock);
+      } catch (const std::exception &e) {
+        LOG_ERR("Failed to set up the mock model: %s\n", e.what());
+        return 1;
+      }
+    }
+    session_mgr = std::make_unique<agent_session_manager>(
+        ctx_server, params, max_queued_turns, hibernation, prefix_cache,
+        reaper, journal);
+    if (scripted) {
+      auto seed = std::make_shared<std::atomic<int>>(0);
+      session_mgr->set_backend_factory([scripted, seed](const std::string &) {
+        return std::make_shared<scripted_backend>(scripted, (*seed)++);
+      });
+    }
+    if (!journal.dir.empty()) {
+      size_t n_recovered = session_mgr->recover_sessions();
+      LOG_INF("%s: recovered %zu sessions from %s\n", __func__, n_recovered,
+              journal.dir.c_str());
+    }
     agent_api = std::make_unique<agent_routes>(*session_mgr);
   }
 
   ctx_http.get("/health",              ex_wrapper(server_api.get_health));
   ctx_http.get("/v1/health",           ex_wrapper(server_api.get_health));
-  ctx_http.get("/metrics",             ex_wrapper(server_api.get_metrics));
+  // Agent metrics follow the llama-server ones (enabled with --metrics)
+  ctx_http.get("/metrics", ex_wrapper([&](const server_http_req &req) {
+    if (mock_model) {
+      // No inference loop to ask for the llama-server counters
+      auto res = std::make_unique<server_http_res>();
+      res->status = 200;
+      res->content_type = "text/plain; version=0.0.4";
+      res->data = session_mgr->render_metrics();
+      return res;
+    }
+    auto res = server_api.get_metrics(req);
+    if (session_mgr && res->status == 200) {
+      res->data += session_mgr->render_metrics();
+    }
+    return res;
+  }));
   ctx_http.get("/props",               ex_wrapper(server_api.get_props));
   ctx_http.post("/props",              ex_wrapper(server_api.post_props));
   // ctx_http.post("/api/show",           ex_wrapper(server_api.get_api_show));
@@ -347,6 +564,10 @@ int main(int argc, char *argv[]) {
     ctx_http.post("/v1/agent/permission/:id", ex_wrapper(agent_api->post_permission));
     ctx_http.get("/v1/agent/tools", ex_wrapper(agent_api->get_tools));
     ctx_http.get("/v1/agent/session/:id/stats", ex_wrapper(agent_api->get_stats));
+    ctx_http.get("/v1/agent/session/:id/trace", ex_wrapper(agent_api->get_trace));
+    ctx_http.get("/v1/agent/hibernation", ex_wrapper(agent_api->get_hibernation));
+    ctx_http.get("/v1/agent/prefix-cache", ex_wrapper(agent_api->get_prefix_cache));
+    ctx_http.get("/v1/agent/tool-cache", ex_wrapper(agent_api->get_tool_cache));
   } else {
     auto proxy_agent_get = [&models_routes](const server_http_req & req) -> server_http_res_ptr {
       if (!models_routes.has_value()) {
@@ -517,7 +738,7 @@ int main(int argc, char *argv[]) {
   }
 
   shutdown_handler = [&](int) {
-    if (is_router_server) {
+    if (is_router_server || mock_model) {
       ctx_http.stop();
     } else {
       ctx_server.terminate();
@@ -599,20 +820,28 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  // load the model
-  LOG_INF("Loading model...\n");
+  if (mock_model) {
+    // Agent routes only; the llama-server routes need a loaded model
+    ctx_http.is_ready.store(true);
+    LOG_INF("Serving a scripted mock model: %d tool calls per turn, %.0f "
+            "tok/s (0 = unpaced)\n",
+            mock.tool_iterations, mock.tokens_per_second);
+  } else {
+    // load the model
+    LOG_INF("Loading model...\n");
 
-  if (!ctx_server.load_model(params)) {
-    clean_up();
-    if (ctx_http.thread.joinable()) {
-      ctx_http.thread.join();
+    if (!ctx_server.load_model(params)) {
+      clean_up();
+      if (ctx_http.thread.joinable()) {
+        ctx_http.thread.join();
+      }
+      LOG_ERR("Failed to load model\n");
+      return 1;
     }
-    LOG_ERR("Failed to load model\n");
-    return 1;
+    server_api.update_meta(ctx_server);
+    ctx_http.is_ready.store(true);
+    LOG_INF("Modle loaded successfully\n");
   }
-  server_api.update_meta(ctx_server);
-  ctx_http.is_ready.store(true);
-  LOG_INF("Modle loaded successfully\n");
 
   // Initialize ASR (Automatic Speech Recognition)
   if (g_asr_enabled && !g_asr_model_path.empty()) {
@@ -701,6 +930,11 @@ int main(int argc, char *argv[]) {
       "  POST /v1/agent/session/:id/chat  - Send message (streaming SSE)\n");
   LOG_INF("  GET  /v1/agent/session/:id/messages - Get Conversation history\n");
   LOG_INF("  GET  /v1/agent/tools                - List available tools\n");
+  LOG_INF("  GET  /v1/agent/session/:id/trace    - Chrome trace of a turn\n");
+  LOG_INF("  GET  /v1/agent/hibernation          - Hibernated session stats\n");
+  LOG_INF("  GET  /v1/agent/prefix-cache         - Prompt prefix cache stats\n");
+  LOG_INF("  GET  /v1/agent/tool-cache           - read/glob result cache stats\n");
+  LOG_INF("  GET  /metrics                       - Prometheus metrics (--metrics)\n");
   LOG_INF("  GET  /health                        - Health check\n");
   
   if (g_asr_enabled) {
@@ -713,8 +947,20 @@ int main(int argc, char *argv[]) {
     LOG_INF("  POST /v1/audio/speech              - Generate speech from text\n");
   };
 
-  // Start the main inference loop
-  ctx_server.start_loop();
+  // Served as soon as the inference loop below is running
+  if (session_mgr) {
+    session_mgr->prewarm_prefix();
+  }
+
+  if (mock_model) {
+    // No inference loop to run, serve until shut down
+    if (ctx_http.thread.joinable()) {
+      ctx_http.thread.join();
+    }
+  } else {
+    // Start the main inference loop
+    ctx_server.start_loop();
+  }
 
   // Clean up after shutdown
   clean_up();
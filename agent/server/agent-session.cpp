@@ -3,12 +3,16 @@
 #include "../agents-md/agents-md-manager.h"
 #include "../agent-loop.h"
 #include "../permission-async.h"
+#include "../tool-executor.h"
 #include "common.h"
+#include "log.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <filesystem>
 #include <iomanip>  // 提供格式化输入输出操纵符，如 setw、setprecision 等，用于控制数字宽度、精度及对齐方式
 #include <memory>
 #include <mutex>
@@ -33,19 +37,63 @@ static std::string get_config_dir() {
 #endif
 }
 
+// Session config as kept in the journal
+static json config_to_json(const agent_session_config &config) {
+  return {
+      {"allowed_tools", config.allowed_tools},
+      {"yolo_mode", config.yolo_mode},
+      {"max_iterations", config.max_iterations},
+      {"tool_timeout_ms", config.tool_timeout_ms},
+      {"working_dir", config.working_dir},
+      {"system_prompt", config.system_prompt},
+      {"enable_skills", config.enable_skills},
+      {"extra_skills_paths", config.extra_skills_paths},
+      {"enable_agents_md", config.enable_agents_md},
+      {"max_subagent_depth", config.max_subagent_depth},
+  };
+}
+
+static agent_session_config config_from_json(const json &j) {
+  agent_session_config config;
+  config.allowed_tools =
+      j.value("allowed_tools", std::set<std::string>());
+  config.yolo_mode = j.value("yolo_mode", config.yolo_mode);
+  config.max_iterations = j.value("max_iterations", config.max_iterations);
+  config.tool_timeout_ms = j.value("tool_timeout_ms", config.tool_timeout_ms);
+  config.working_dir = j.value("working_dir", config.working_dir);
+  config.system_prompt = j.value("system_prompt", config.system_prompt);
+  config.enable_skills = j.value("enable_skills", config.enable_skills);
+  config.extra_skills_paths =
+      j.value("extra_skills_paths", std::vector<std::string>());
+  config.enable_agents_md = j.value("enable_agents_md", config.enable_agents_md);
+  config.max_subagent_depth =
+      j.value("max_subagent_depth", config.max_subagent_depth);
+  return config;
+}
+
 // agent_session implementation
 agent_session::agent_session(const std::string &id, server_context &server_ctx,
                              const common_params &param,
-                             const agent_session_config &config)
+                             const agent_session_config &config,
+                             session_executor &executor,
+                             turn_admission &admission,
+                             std::shared_ptr<slot_pool> slots,
+                             session_hibernator *hibernator,
+                             std::shared_ptr<kv_prefix_cache> prefix_cache,
+                             agent_metrics *metrics, session_journal *journal)
     : id_(id), server_ctx_(server_ctx), params_(param), config_(config),
+      executor_(executor), admission_(admission), slots_(std::move(slots)),
+      prefix_cache_(std::move(prefix_cache)),
+      hibernator_(hibernator), metrics_(metrics),
       created_at_(std::chrono::steady_clock::now()),
-      last_activity_(created_at_) {
+      last_activity_(created_at_), journal_(journal) {
 
   // Set up permission manager
   if (!config_.working_dir.empty()) {
     permissions_.set_project_root(config_.working_dir);
   }
   permissions_.set_yolo_mode(config_.yolo_mode);
+  permissions_.set_owner(id_);
 
   std::string config_dir = get_config_dir();
 
@@ -83,131 +131,440 @@ agent_session::agent_session(const std::string &id, server_context &server_ctx,
 
 agent_session::~agent_session() {
   cancel();
-  if (worker_thread_.joinable()) {
-    worker_thread_.join();
+  wait_idle();
+  if (hibernator_) {
+    hibernator_->remove(id_);
+  }
+  if (memory_total_) {
+    *memory_total_ -= static_cast<int64_t>(memory_bytes_.load());
+  }
+}
+
+void agent_session::update_memory() {
+  size_t bytes =
+      skills_prompt_section_.size() + agents_md_prompt_section_.size();
+  if (loop_ && !hibernated_.load()) {
+    bytes += loop_->history_bytes();
+  }
+  size_t old = memory_bytes_.exchange(bytes);
+  if (memory_total_) {
+    *memory_total_ += static_cast<int64_t>(bytes) - static_cast<int64_t>(old);
+  }
+}
+
+void agent_session::set_memory_counter(std::atomic<int64_t> *total) {
+  memory_total_ = total;
+  update_memory();
+}
+
+agent_session_state agent_session::state() const {
+  agent_session_state state = state_.load();
+  if (state == agent_session_state::RUNNING) {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    if (turn_ && turn_->waiting_for_permission()) {
+      return agent_session_state::WAITING_PERMISSION;
+    }
   }
+  return state;
 }
 
 agent_session_info agent_session::info() const {
   agent_session_info info;
   info.id = id_;
-  info.state = state_.load();
+  info.state = state();
   info.created_at = created_at_;
   info.last_activity = last_activity_;
-  info.message_count =
-      loop_ ? static_cast<int>(loop_->get_messages().size()) : 0;
-  info.stats = loop_ ? loop_->get_stats() : session_stats{};
+
+  std::lock_guard<std::mutex> lock(turn_mutex_);
+  if (hibernated_.load()) {
+    info.message_count = parked_message_count_;
+    info.stats = parked_stats_;
+  } else {
+    info.message_count =
+        loop_ ? static_cast<int>(loop_->message_count()) : 0;
+    info.stats = loop_ ? loop_->get_stats() : session_stats{};
+    info.slot = loop_ ? loop_->preferred_slot() : -1;
+  }
+  info.queue_position = ticket_ ? admission_.position(ticket_) : 0;
+  info.queue_wait_ms =
+      ticket_ ? std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - queued_at_)
+                    .count()
+              : last_queue_wait_ms_;
   return info;
 }
 
 void agent_session::send_message(const std::string &content,
                                  agent_event_callback on_event) {
-  // Wait for any previous operation to complete
-  if (worker_thread_.joinable()) {
-    worker_thread_.join();
+  start_turn({{"role", "user"}, {"content", content}}, on_event, {});
+}
+
+// Multimodal version of send_message - accepts JSON message with images/audio
+void agent_session::send_message_multimodal(const json &user_message,
+                                             agent_event_callback on_event,
+                                             std::vector<raw_buffer> media_files) {
+  start_turn(user_message, on_event, std::move(media_files));
+}
+
+void agent_session::wait_idle() {
+  std::unique_lock<std::mutex> lock(turn_mutex_);
+  turn_cv_.wait(lock, [this] { return !is_running_.load(); });
+}
+
+agent_config agent_session::make_loop_config() const {
+  agent_config agent_cfg;
+  agent_cfg.max_iterations = config_.max_iterations;
+  agent_cfg.tool_timeout_ms = config_.tool_timeout_ms;
+  agent_cfg.working_dir = config_.working_dir;
+  agent_cfg.yolo_mode = config_.yolo_mode;
+
+  // Skills configuation
+  agent_cfg.enable_skills = config_.enable_skills;
+  agent_cfg.skills_search_paths = config_.extra_skills_paths;
+  agent_cfg.skills_prompt_section = skills_prompt_section_;
+
+  // AGENTS.md configuration
+  agent_cfg.enable_agents_md = config_.enable_agents_md;
+  agent_cfg.agents_md_prompt_section = agents_md_prompt_section_;
+
+  // Subagent configuration
+  agent_cfg.max_subagent_depth = config_.max_subagent_depth;
+
+  // Keep every completion (and the subagents') on a slot of its own
+  agent_cfg.slots = slots_;
+  agent_cfg.prefix_cache = prefix_cache_;
+  agent_cfg.backend = backend_;
+
+  // Subagents generate on a long tool worker, outside the turn's gate
+  agent_cfg.admission_enter = [this]() {
+    return admission_.enter_wait(is_interrupted_);
+  };
+  agent_cfg.admission_leave = [this](double generation_ms) {
+    admission_.leave(generation_ms);
+  };
+  return agent_cfg;
+}
+
+llama_tokens agent_session::prompt_prefix() {
+  agent_loop loop(server_ctx_, params_, make_loop_config(), is_interrupted_);
+  return loop.prompt_prefix_tokens();
+}
+
+bool agent_session::restore() {
+  // The coldest idle slot takes the saved cache; without one the history is
+  // simply prefilled again
+  slot_pool::lease slot =
+      hibernator_ && slots_ ? slots_->acquire(-1) : slot_pool::lease();
+  json state;
+  bool kv_restored = false;
+  bool from_hibernator =
+      hibernator_ && hibernator_->load(id_, state, slot.id(), kv_restored);
+  // Recovered after a restart, or parked without a hibernator
+  bool loaded = from_hibernator || (journal_ && journal_->load(id_, state));
+  if (!loaded) {
+    // Stay parked rather than carry on with an empty history
+    LOG_WRN("session %s: could not restore the parked history\n", id_.c_str());
+    if (metrics_) {
+      metrics_->restore_failed();
+    }
+    return false;
   }
 
-  last_activity_ = std::chrono::steady_clock::now();
-  is_running_.store(true);
-  is_interrupted_.store(false);
-  state_.store(agent_session_state::RUNNING);
+  auto loop = std::make_unique<agent_loop>(server_ctx_, params_,
+                                           make_loop_config(), is_interrupted_);
+  if (state.contains("messages")) {
+    loop->restore(state["messages"],
+                  session_hibernator::stats_from_json(state.value("stats", json())));
+  }
+  if (kv_restored) {
+    loop->adopt_slot(slot);
+  }
 
-  // Create agent_loop if it does not exist
-  if (!loop_) {
-    agent_config agent_cfg;
-    agent_cfg.max_iterations = config_.max_iterations;
-    agent_cfg.tool_timeout_ms = config_.tool_timeout_ms;
-    agent_cfg.working_dir = config_.working_dir;
-    agent_cfg.yolo_mode = config_.yolo_mode;
+  {
+    std::lock_guard<std::mutex> lock(journal_mutex_);
+    journaled_count_ = loop->message_count();
+    journaled_version_ = loop->history_version();
+    if (!from_hibernator) {
+      // Rewrite the journal before appending to it, in case its tail is torn
+      journal_ok_ = false;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(turn_mutex_);
+  loop_ = std::move(loop);
+  hibernated_.store(false);
+  if (from_hibernator) {
+    const auto &stats = loop_->get_stats();
+    prefill_probe_ = true;
+    probe_kv_restored_ = kv_restored;
+    probe_prompt_ms_ = stats.total_prompt_ms;
+    probe_input_ = stats.total_input;
+  }
+  return true;
+}
 
-    // Skills configuation
-    agent_cfg.enable_skills = config_.enable_skills;
-    agent_cfg.skills_search_paths = config_.extra_skills_paths;
-    agent_cfg.skills_prompt_section = skills_prompt_section_;
+bool agent_session::hibernate() {
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    if ((!hibernator_ && !journal_) || hibernated_.load() ||
+        is_running_.load() || !loop_) {
+      return false;
+    }
+    // Keeps new turns out while the files are written
+    is_running_.store(true);
+  }
 
-    // AGENTS.md configuration
-    agent_cfg.enable_agents_md = config_.enable_agents_md;
-    agent_cfg.agents_md_prompt_section = agents_md_prompt_section_;
+  bool saved = false;
+  if (hibernator_) {
+    json state = {
+        {"messages", loop_->get_messages()},
+        {"stats", session_hibernator::stats_to_json(loop_->get_stats())},
+    };
+    // Only save the KV cache if no other completion reused the slot since
+    slot_pool::lease slot;
+    if (slots_) {
+      slot = slots_->acquire_exact(loop_->preferred_slot(), loop_->slot_epoch());
+    }
+    bool kv_saved = false;
+    saved = hibernator_->save(id_, state, slot.id(), kv_saved);
+    if (kv_saved) {
+      slots_->forget(slot.id());
+    }
+    slot.release();
+  } else {
+    // The journal has the history, dropping the loop is enough
+    saved = sync_journal();
+  }
 
-    // Subagent configuration
-    agent_cfg.max_subagent_depth = config_.max_subagent_depth;
+  std::lock_guard<std::mutex> lock(turn_mutex_);
+  if (saved) {
+    parked_message_count_ = static_cast<int>(loop_->message_count());
+    parked_stats_ = loop_->get_stats();
+    loop_.reset();
+    hibernated_.store(true);
+    state_.store(agent_session_state::HIBERNATED);
+    update_memory();
+  }
+  is_running_.store(false);
+  turn_cv_.notify_all();
+  return saved;
+}
 
-    loop_ = std::make_unique<agent_loop>(
-        server_ctx_, params_, agent_cfg, is_interrupted_);
-  }
-  // Run in background thread
-  // Pass permissions_ for aync permission handling (non-blocking)
-  worker_thread_ = std::thread([this, content, on_event]() {
-    auto should_stop = [this]() { return is_interrupted_.load(); };
-
-    // Pass async permission manager to avoid blocking on console prompt
-    agent_loop_result result =
-        loop_->run_streaming(content, on_event, should_stop, &permissions_);
-    {
-        std::lock_guard<std::mutex> lock(result_mutex_);
-        last_result_ = result;
+bool agent_session::sync_journal() {
+  if (!journal_) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(journal_mutex_);
+  if (journal_dropped_ || hibernated_.load()) {
+    return true; // Nothing changed since it was parked
+  }
+
+  bool ok;
+  if (!loop_) {
+    // No message yet: a fresh loop appends its whole history
+    ok = journal_->snapshot(id_, config_to_json(config_), json::array(),
+                            session_stats{});
+    journaled_count_ = 0;
+    journaled_version_ = 0;
+    journal_appends_ = 0;
+  } else {
+    size_t n = loop_->message_count();
+    uint64_t version = loop_->history_version();
+    if (!journal_ok_ || version != journaled_version_ || n < journaled_count_ ||
+        journal_appends_ >= journal_->config().snapshot_turns) {
+      ok = journal_->snapshot(id_, config_to_json(config_),
+                              loop_->get_messages(), loop_->get_stats());
+      journal_appends_ = 0;
+    } else {
+      json messages = json::array();
+      for (size_t i = journaled_count_; i < n; i++) {
+        messages.push_back(loop_->get_message(i));
+      }
+      ok = journal_->append(id_, messages, loop_->get_stats());
+      journal_appends_++;
     }
-  
+    journaled_count_ = n;
+    journaled_version_ = version;
+  }
+  // After a failed write the file's end is unknown
+  journal_ok_ = ok;
+  return ok;
+}
 
-    state_.store(agent_session_state::IDLE);
-    is_running_.store(false);
-    last_activity_ = std::chrono::steady_clock::now();
-});
+void agent_session::park_recovered(size_t message_count,
+                                   const session_stats &stats) {
+  std::lock_guard<std::mutex> lock(turn_mutex_);
+  parked_message_count_ = static_cast<int>(message_count);
+  parked_stats_ = stats;
+  hibernated_.store(true);
+  state_.store(agent_session_state::HIBERNATED);
 }
 
-// Multimodal version of send_message - accepts JSON message with images/audio
-void agent_session::send_message_multimodal(const json &user_message,
-                                             agent_event_callback on_event,
-                                             std::vector<raw_buffer> media_files) {
-  // Wait for any previous operation to complete
-  if (worker_thread_.joinable()) {
-    worker_thread_.join();
+void agent_session::drop_journal() {
+  if (!journal_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(journal_mutex_);
+  journal_dropped_ = true;
+  journal_->remove(id_);
+}
+
+void agent_session::start_turn(const json &user_message,
+                               agent_event_callback on_event,
+                               std::vector<raw_buffer> media_files) {
+  // Wait for any previous operation (or a hibernation) to complete
+  {
+    std::unique_lock<std::mutex> lock(turn_mutex_);
+    turn_cv_.wait(lock, [this] { return !is_running_.load(); });
+    is_running_.store(true);
   }
 
   last_activity_ = std::chrono::steady_clock::now();
-  is_running_.store(true);
   is_interrupted_.store(false);
   state_.store(agent_session_state::RUNNING);
 
+  if (hibernated_.load() && !restore()) {
+    state_.store(agent_session_state::HIBERNATED);
+    on_event(agent_event::error("The session history could not be restored"));
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    is_running_.store(false);
+    turn_cv_.notify_all();
+    return;
+  }
+
   // Create agent_loop if it does not exist
   if (!loop_) {
-    agent_config agent_cfg;
-    agent_cfg.max_iterations = config_.max_iterations;
-    agent_cfg.tool_timeout_ms = config_.tool_timeout_ms;
-    agent_cfg.working_dir = config_.working_dir;
-    agent_cfg.yolo_mode = config_.yolo_mode;
+    loop_ = std::make_unique<agent_loop>(
+        server_ctx_, params_, make_loop_config(), is_interrupted_);
+  }
+
+  auto trace = std::make_shared<turn_trace>();
+  loop_->set_trace(trace);
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    traces_.emplace_back(++turn_count_, trace);
+    if (traces_.size() > MAX_TRACES) {
+      traces_.pop_front();
+    }
+  }
 
-    // Skills configuation
-    agent_cfg.enable_skills = config_.enable_skills;
-    agent_cfg.skills_search_paths = config_.extra_skills_paths;
-    agent_cfg.skills_prompt_section = skills_prompt_section_;
+  if (metrics_) {
+    metrics_probe_ = {last_activity_, false, loop_->get_stats().doom_loops};
+    on_event = [this, on_event](const agent_event &event) {
+      metrics_->observe(event, metrics_probe_);
+      on_event(event);
+    };
+  }
 
-    // AGENTS.md configuration
-    agent_cfg.enable_agents_md = config_.enable_agents_md;
-    agent_cfg.agents_md_prompt_section = agents_md_prompt_section_;
+  // Pass permissions_ for async permission handling: a pending permission
+  // suspends the turn instead of blocking an executor thread
+  auto should_stop = [this]() { return is_interrupted_.load(); };
+  auto turn = loop_->start_turn(user_message, on_event, should_stop,
+                                &permissions_, std::move(media_files));
+
+  std::weak_ptr<agent_turn> weak = turn;
+  turn->set_wake(
+      [this, weak]() {
+        if (auto t = weak.lock()) {
+          executor_.post([this, t]() { drive(t); });
+        }
+      },
+      [this, weak](agent_turn::time_point when) {
+        executor_.post_at(when, [weak]() {
+          if (auto t = weak.lock()) {
+            t->notify();
+          }
+        });
+      });
+
+  // Generations queue for a server slot instead of piling up inside
+  // server_context; a queued turn holds no executor thread
+  turn->set_gate(
+      [this, weak]() {
+        std::lock_guard<std::mutex> lock(turn_mutex_);
+        auto now = std::chrono::steady_clock::now();
+        if (!ticket_) {
+          ticket_ = admission_.enqueue([weak]() {
+            if (auto t = weak.lock()) {
+              t->notify();
+            }
+          });
+          queued_at_ = now;
+        }
+        if (!admission_.try_enter(ticket_)) {
+          return false;
+        }
+        ticket_ = 0;
+        last_queue_wait_ms_ =
+            std::chrono::duration<double, std::milli>(now - queued_at_).count();
+        entered_at_ = now;
+        return true;
+      },
+      [this]() {
+        double generation_ms;
+        {
+          std::lock_guard<std::mutex> lock(turn_mutex_);
+          generation_ms = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - entered_at_)
+                              .count();
+          if (prefill_probe_) {
+            // Restore with the KV cache vs. a full re-prefill
+            const auto &stats = loop_->get_stats();
+            hibernator_->record_prefill(probe_kv_restored_,
+                                        stats.total_prompt_ms - probe_prompt_ms_,
+                                        stats.total_input - probe_input_);
+            prefill_probe_ = false;
+          }
+        }
+        admission_.leave(generation_ms);
+      });
 
-    // Subagent configuration
-    agent_cfg.max_subagent_depth = config_.max_subagent_depth;
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    turn_ = turn;
+  }
+  executor_.post([this, turn]() { drive(turn); });
+}
 
-    loop_ = std::make_unique<agent_loop>(
-        server_ctx_, params_, agent_cfg, is_interrupted_);
-  }
-  // Run in background thread with multimodal content
-  worker_thread_ = std::thread([this, user_message, on_event, media_files = std::move(media_files)]() mutable {
-    auto should_stop = [this]() { return is_interrupted_.load(); };
-
-    // Use multimodal streaming method
-    agent_loop_result result =
-        loop_->run_streaming_multimodal(user_message, on_event, should_stop, &permissions_, std::move(media_files));
-    {
-        std::lock_guard<std::mutex> lock(result_mutex_);
-        last_result_ = result;
-    }
+void agent_session::drive(const std::shared_ptr<agent_turn> &turn) {
+  if (turn->resume() == agent_turn_status::WAITING) {
+    return; // Re-posted by the wake function
+  }
 
-    state_.store(agent_session_state::IDLE);
-    is_running_.store(false);
-    last_activity_ = std::chrono::steady_clock::now();
-  });
+  {
+    std::lock_guard<std::mutex> lock(result_mutex_);
+    last_result_ = turn->result();
+  }
+  if (metrics_) {
+    metrics_->finish_turn(metrics_probe_, turn->result(), loop_->get_stats());
+  }
+  last_activity_ = std::chrono::steady_clock::now();
+  state_.store(agent_session_state::IDLE);
+  update_memory();
+  sync_journal();
+
+  // Last access to this session: the destructor may run once it is idle
+  std::lock_guard<std::mutex> lock(turn_mutex_);
+  if (ticket_) {
+    // Cancelled while queued for a slot
+    admission_.cancel(ticket_);
+    ticket_ = 0;
+  }
+  is_running_.store(false);
+  turn_cv_.notify_all();
+}
+
+json agent_session::get_trace(int turn) const {
+  std::shared_ptr<turn_trace> trace;
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    for (const auto &[n, t] : traces_) {
+      if (turn <= 0 || n == turn) {
+        trace = t; // Without a turn number the last one wins
+      }
+    }
+  }
+  return trace ? trace->to_json() : json();
 }
 
 std::optional<agent_loop_result> agent_session::get_result() {
@@ -215,7 +572,19 @@ std::optional<agent_loop_result> agent_session::get_result() {
   return last_result_;
 }
 
-void agent_session::cancel() { is_interrupted_.store(true); }
+void agent_session::cancel() {
+  is_interrupted_.store(true);
+
+  // A suspended turn has to run once more to notice
+  std::shared_ptr<agent_turn> turn;
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    turn = turn_;
+  }
+  if (turn) {
+    turn->notify();
+  }
+}
 
 std::vector<permission_request_async> agent_session::pending_permissions() {
   return permissions_.pending();
@@ -231,6 +600,17 @@ bool agent_session::respond_permission(const std::string &request_id,
 }
 
 json agent_session::get_messages() const {
+  if (hibernated_.load()) {
+    json state;
+    if (hibernator_ && hibernator_->peek(id_, state) &&
+        state.contains("messages")) {
+      return state["messages"];
+    }
+    if (journal_ && journal_->load(id_, state)) {
+      return state["messages"];
+    }
+    return json::array();
+  }
   if (loop_) {
     return loop_->get_messages();
   }
@@ -238,6 +618,10 @@ json agent_session::get_messages() const {
 }
 
 session_stats agent_session::get_stats() const {
+  std::lock_guard<std::mutex> lock(turn_mutex_);
+  if (hibernated_.load()) {
+    return parked_stats_;
+  }
   if (loop_) {
     return loop_->get_stats();
   }
@@ -245,9 +629,24 @@ session_stats agent_session::get_stats() const {
 }
 
 void agent_session::clear() {
+  {
+    std::lock_guard<std::mutex> lock(turn_mutex_);
+    if (hibernated_.load()) {
+      // Start over with a fresh loop
+      if (hibernator_) {
+        hibernator_->remove(id_);
+      }
+      hibernated_.store(false);
+      parked_message_count_ = 0;
+      parked_stats_ = session_stats{};
+      state_.store(agent_session_state::IDLE);
+    }
+  }
   if (loop_) {
     loop_->clear();
   }
+  update_memory();
+  sync_journal();
   permissions_.clear_session();
   {
     std::lock_guard<std::mutex> lock(result_mutex_);
@@ -257,12 +656,191 @@ void agent_session::clear() {
 
 // agent_session_manager implementation
 agent_session_manager::agent_session_manager(server_context &server_ctx,
-                                             const common_params &params)
-    : server_ctx_(server_ctx), params_(params) {}
+                                             const common_params &params,
+                                             int max_queued_turns,
+                                             hibernation_config hibernation,
+                                             bool prefix_cache,
+                                             session_reaper_config reaper,
+                                             journal_config journal)
+    : server_ctx_(server_ctx), params_(params),
+      // Turns hold a thread only while they generate, a few more threads
+      // than slots keep every slot busy
+      executor_(static_cast<size_t>(std::max(4, 2 * params.n_parallel))),
+      admission_(params.n_parallel),
+      max_queued_turns_(static_cast<size_t>(
+          max_queued_turns >= 0 ? max_queued_turns
+                                : 4 * std::max(1, params.n_parallel))),
+      slots_(std::make_shared<slot_pool>(params.n_parallel)),
+      hibernator_(server_ctx, std::move(hibernation)),
+      journal_(std::move(journal)), reaper_(reaper),
+      // One-second ticks, a lap is a bit over an hour
+      expiry_(std::chrono::seconds(1), 4096),
+      sweep_guard_(std::make_shared<sweep_guard>()) {
+  // Long tool calls (bash, subagents) of all sessions share this many
+  // threads; more wait for one to finish
+  tool_worker_pool::instance().set_long_limit(2 * executor_.size());
+  if (prefix_cache) {
+    std::error_code ec;
+    std::string dir = !params.slot_save_path.empty()
+                          ? params.slot_save_path
+                          : (std::filesystem::temp_directory_path(ec) /
+                             "llama-agent-prefix")
+                                .string();
+    prefix_cache_ = std::make_shared<kv_prefix_cache>(server_ctx, slots_, dir);
+  }
+  if (hibernator_.enabled()) {
+    schedule_hibernation_sweep();
+  }
+  if (reaper_.idle_seconds > 0 || reaper_.memory_budget_bytes > 0) {
+    schedule_reaper();
+  }
+  if (journal_.enabled() && journal_.config().sync == journal_sync::BATCH) {
+    schedule_journal_sync();
+  }
+}
+
+void agent_session_manager::prewarm_prefix() {
+  if (!prefix_cache_) {
+    return;
+  }
+  agent_session_config config; // What a session gets without overrides
+  agent_session session("prewarm", server_ctx_, params_, config, executor_,
+                        admission_, slots_);
+  prefix_cache_->warm_async(session.prompt_prefix());
+}
 
 agent_session_manager::~agent_session_manager() {
-  std::lock_guard<std::mutex> lock(sessions_mutex_);
+  {
+    // Waits for a running sweep, later ones see alive == false
+    std::lock_guard<std::mutex> lock(sweep_guard_->mutex);
+    sweep_guard_->alive = false;
+  }
   sessions_.clear();
+  journal_.sync_pending();
+}
+
+void agent_session_manager::schedule_hibernation_sweep() {
+  // A few sweeps per threshold keep the actual idle time close to it
+  int interval = std::clamp(hibernator_.config().idle_seconds / 4, 1, 30);
+  executor_.post_at(
+      std::chrono::steady_clock::now() + std::chrono::seconds(interval),
+      [this, guard = sweep_guard_]() {
+        std::lock_guard<std::mutex> lock(guard->mutex);
+        if (!guard->alive) {
+          return;
+        }
+        hibernate_idle();
+        schedule_hibernation_sweep();
+      });
+}
+
+void agent_session_manager::hibernate_idle() {
+  if (!hibernator_.enabled()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  auto threshold = std::chrono::seconds(hibernator_.config().idle_seconds);
+
+  for (const auto &session : sessions_.snapshot()) {
+    if (session->is_hibernated() || !session->is_completed()) {
+      continue;
+    }
+    if (now - session->info().last_activity > threshold) {
+      session->hibernate();
+    }
+  }
+}
+
+void agent_session_manager::schedule_reaper() {
+  executor_.post_at(
+      std::chrono::steady_clock::now() + std::chrono::seconds(1),
+      [this, guard = sweep_guard_]() {
+        std::lock_guard<std::mutex> lock(guard->mutex);
+        if (!guard->alive) {
+          return;
+        }
+        reap();
+        schedule_reaper();
+      });
+}
+
+void agent_session_manager::schedule_journal_sync() {
+  executor_.post_at(
+      std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(
+              std::max(1, journal_.config().sync_interval_ms)),
+      [this, guard = sweep_guard_]() {
+        std::lock_guard<std::mutex> lock(guard->mutex);
+        if (!guard->alive) {
+          return;
+        }
+        journal_.sync_pending();
+        schedule_journal_sync();
+      });
+}
+
+void agent_session_manager::reap() {
+  auto now = std::chrono::steady_clock::now();
+
+  if (reaper_.idle_seconds > 0) {
+    auto timeout = std::chrono::seconds(reaper_.idle_seconds);
+    for (const std::string &id : expiry_.advance(now)) {
+      auto session = sessions_.find(id);
+      if (!session) {
+        continue; // Deleted meanwhile
+      }
+      auto info = session->info();
+      bool idle = info.state == agent_session_state::IDLE ||
+                  info.state == agent_session_state::HIBERNATED;
+      if (idle && now - info.last_activity >= timeout) {
+        if (sessions_.erase(id, session.get())) {
+          session->drop_journal();
+          metrics_.session_evicted("idle_timeout", "deleted");
+        }
+      } else {
+        // Used since it was scheduled: look again once it could be due
+        expiry_.schedule(id, idle ? info.last_activity + timeout : now + timeout);
+      }
+    }
+  }
+
+  if (reaper_.memory_budget_bytes > 0 &&
+      memory_bytes_.load() > static_cast<int64_t>(reaper_.memory_budget_bytes)) {
+    evict_for_memory();
+  }
+}
+
+void agent_session_manager::evict_for_memory() {
+  std::vector<std::pair<std::chrono::steady_clock::time_point,
+                        std::shared_ptr<agent_session>>>
+      idle;
+  for (auto &session : sessions_.snapshot()) {
+    if (session->memory_bytes() == 0 || session->is_hibernated()) {
+      continue;
+    }
+    auto info = session->info();
+    if (info.state == agent_session_state::IDLE) {
+      idle.emplace_back(info.last_activity, std::move(session));
+    }
+  }
+  std::sort(idle.begin(), idle.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  const auto budget = static_cast<int64_t>(reaper_.memory_budget_bytes);
+  for (auto &[last_activity, session] : idle) {
+    if (memory_bytes_.load() <= budget) {
+      break;
+    }
+    if (hibernator_.enabled() || journal_.enabled()) {
+      if (session->hibernate()) {
+        metrics_.session_evicted("memory_budget", "hibernated");
+      }
+    } else if (sessions_.erase(session->id(), session.get())) {
+      metrics_.session_evicted("memory_budget", "deleted");
+    }
+    // Destroyed here, when the last reference goes
+    session.reset();
+  }
 }
 
 std::string agent_session_manager::generate_session_id() {
@@ -274,45 +852,128 @@ std::string agent_session_manager::generate_session_id() {
 
 std::string agent_session_manager::create_session(const agent_session_config & config) {
     std::string id = generate_session_id();
-    auto session = std::make_unique<agent_session>(id , server_ctx_, params_, config);
-    sessions_[id] = std::move(session);
+    auto session = std::make_shared<agent_session>(
+        id, server_ctx_, params_, config, executor_, admission_, slots_,
+        hibernator_.enabled() ? &hibernator_ : nullptr, prefix_cache_,
+        &metrics_, journal_.enabled() ? &journal_ : nullptr);
+    if (backend_factory_) {
+      session->set_completion_backend(backend_factory_(id));
+    }
+    session->set_memory_counter(&memory_bytes_);
+    session->sync_journal();
+    if (reaper_.idle_seconds > 0) {
+      expiry_.schedule(id, std::chrono::steady_clock::now() +
+                               std::chrono::seconds(reaper_.idle_seconds));
+    }
+    sessions_.insert(id, std::move(session));
     return id;
 }
 
-agent_session* agent_session_manager::get_session(const std::string &id) {
-  std::lock_guard<std::mutex> lock(sessions_mutex_);
-  auto it = sessions_.find(id);
-  if (it != sessions_.end()) {
-    return it->second.get();
-  }
-  return nullptr;
+std::shared_ptr<agent_session>
+agent_session_manager::get_session(const std::string &id) {
+  return sessions_.find(id);
 }
 
 bool agent_session_manager::delete_session(const std::string &id) {
-  std::lock_guard<std::mutex> lock(sessions_mutex_);
-  auto it = sessions_.find(id);
-  if (it != sessions_.end()) {
-    sessions_.erase(it);
-    return true;
+  // The session is destroyed here, outside the table's locks
+  auto session = sessions_.erase(id);
+  if (!session) {
+    return false;
   }
-  return false;
+  session->drop_journal();
+  return true;
+}
+
+size_t agent_session_manager::recover_sessions() {
+  size_t n_recovered = 0;
+  for (const auto &found : journal_.scan()) {
+    if (sessions_.find(found.id)) {
+      continue;
+    }
+    auto session = std::make_shared<agent_session>(
+        found.id, server_ctx_, params_, config_from_json(found.config),
+        executor_, admission_, slots_,
+        hibernator_.enabled() ? &hibernator_ : nullptr, prefix_cache_,
+        &metrics_, &journal_);
+    if (backend_factory_) {
+      session->set_completion_backend(backend_factory_(found.id));
+    }
+    session->park_recovered(found.message_count, found.stats);
+    session->set_memory_counter(&memory_bytes_);
+    if (reaper_.idle_seconds > 0) {
+      expiry_.schedule(found.id, std::chrono::steady_clock::now() +
+                                     std::chrono::seconds(reaper_.idle_seconds));
+    }
+    sessions_.insert(found.id, std::move(session));
+    n_recovered++;
+
+    // New ids continue after the recovered ones
+    if (found.id.rfind("sess_", 0) == 0) {
+      uint64_t next = std::strtoull(found.id.c_str() + 5, nullptr, 16) + 1;
+      if (next > session_counter_.load()) {
+        session_counter_.store(next);
+      }
+    }
+  }
+  return n_recovered;
 }
 
 std::vector<agent_session_info> agent_session_manager::list_sessions() const {
-  std::lock_guard<std::mutex> lock(sessions_mutex_);
+  // info() takes each session's own lock, so it runs on a snapshot rather
+  // than under the table's
+  auto sessions = sessions_.snapshot();
   std::vector<agent_session_info> result;
-  result.reserve(sessions_.size());
-  for (const auto &[id, session] : sessions_) {
-    result.push_back({ session->info()});
+  result.reserve(sessions.size());
+  for (const auto &session : sessions) {
+    result.push_back(session->info());
   }
+  // Ids are a hex counter, so this lists sessions in creation order
+  std::sort(result.begin(), result.end(),
+            [](const agent_session_info &a, const agent_session_info &b) {
+              return a.id < b.id;
+            });
   return result;
 }
 
 size_t agent_session_manager::session_count() const {
-  std::lock_guard<std::mutex> lock(sessions_mutex_);
   return sessions_.size();
 }
 
+std::string agent_session_manager::render_metrics() const {
+  agent_metrics_gauges gauges;
+  for (const auto &session : sessions_.snapshot()) {
+    if (session->is_hibernated()) {
+      gauges.hibernated++;
+      continue;
+    }
+    gauges.sessions++;
+    switch (session->state()) {
+    case agent_session_state::RUNNING:
+      gauges.running++;
+      break;
+    case agent_session_state::WAITING_PERMISSION:
+      gauges.running++;
+      gauges.waiting++;
+      break;
+    default:
+      break;
+    }
+  }
+  gauges.memory_bytes = memory_bytes_.load();
+  gauges.queued_turns = admission_.queued();
+  gauges.generating = admission_.active();
+  return metrics_.render(gauges);
+}
+
+bool agent_session_manager::accepting_turns(double &retry_after_ms) const {
+  if (admission_.queued() < max_queued_turns_) {
+    retry_after_ms = 0;
+    return true;
+  }
+  retry_after_ms = admission_.estimated_wait_ms();
+  return false;
+}
+
 std::string agent_session_manager::get_model_name() const {
   // Return model alias if set, otherwise extract filename from model path
   if (!params_.model_alias.empty()) {
@@ -334,14 +995,15 @@ void agent_session_manager::cleanup(int idle_timeout_seconds) {
   auto now = std::chrono::steady_clock::now();
   auto timeout = std::chrono::seconds(idle_timeout_seconds);
 
-  std::lock_guard<std::mutex> lock(sessions_mutex_);
-  for (auto it = sessions_.begin(); it != sessions_.end();) {
-    auto info = it->second->info();
+  for (const auto &session : sessions_.snapshot()) {
+    auto info = session->info();
     auto idle_duration = now - info.last_activity;
-    if (idle_duration > timeout && info.state == agent_session_state::IDLE) {
-      it = sessions_.erase(it);
-    } else {
-      ++it;
+    if (idle_duration > timeout &&
+        (info.state == agent_session_state::IDLE ||
+         info.state == agent_session_state::HIBERNATED)) {
+      if (sessions_.erase(info.id, session.get())) {
+        session->drop_journal();
+      }
     }
   }
 }
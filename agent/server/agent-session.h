@@ -8,15 +8,24 @@
 #include <memory>
 #include "common.h"
 #include "../permission-async.h"
+#include "../agent-turn.h"
+#include "agent-metrics.h"
+#include "session-executor.h"
+#include "session-hibernation.h"
+#include "session-journal.h"
+#include "session-table.h"
+#include "timer-wheel.h"
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
 #include <mutex>
 #include <optional>
 #include <set>
 #include <string>
-#include <thread>
 #include <vector>
 
 // Forward declarations
@@ -48,7 +57,14 @@ enum class agent_session_state {
   RUNNING,            // Processing a prompt
   WAITING_PERMISSION, // Waiting for permission response
   COMPLETED,          // Session ended normally
-  ERROR               // Session ended with error
+  ERROR,              // Session ended with error
+  HIBERNATED          // Parked on disk, restored by the next message
+};
+
+// Background reaping of sessions, see agent_session_manager::reap()
+struct session_reaper_config {
+  int idle_seconds = 0;              // Delete sessions idle this long, 0 = never
+  uint64_t memory_budget_bytes = 0;  // Evict idle sessions beyond this, 0 = no limit
 };
 
 // Information about a session (for listing)
@@ -59,6 +75,9 @@ struct agent_session_info {
   std::chrono::steady_clock::time_point last_activity;
   int message_count;
   session_stats stats;
+  size_t queue_position = 0; // 1-based place in the slot queue, 0 = not queued
+  double queue_wait_ms = 0;  // Current wait if queued, else the last one
+  int slot = -1;             // Slot holding the session's cache, -1 = none yet
 };
 
 // An individual agent session
@@ -66,14 +85,20 @@ class agent_session {
 public:
   agent_session(const std::string &id, server_context &server_ctx,
                 const common_params &params,
-                const agent_session_config &config);
+                const agent_session_config &config,
+                session_executor &executor, turn_admission &admission,
+                std::shared_ptr<slot_pool> slots,
+                session_hibernator *hibernator = nullptr,
+                std::shared_ptr<kv_prefix_cache> prefix_cache = nullptr,
+                agent_metrics *metrics = nullptr,
+                session_journal *journal = nullptr);
   ~agent_session();
 
   // Get session ID
   const std::string &id() const { return id_; }
 
   // Get current state
-  agent_session_state state() const { return state_.load(); }
+  agent_session_state state() const;
 
   // Get session info
   agent_session_info info() const;
@@ -116,11 +141,54 @@ public:
   // Clear conversation history
   void clear();
 
+  // Park the idle session on disk (history and, if its slot still holds
+  // it, the KV cache) and drop its loop. The next message restores it.
+  // Without a hibernator the journal holds the history and only the loop is
+  // dropped. False if the session is busy, already parked or could not be
+  // written.
+  bool hibernate();
+
+  // Bring the journal up to date with the history: the messages added since
+  // the last call, or a snapshot if the history was rewritten. True without
+  // a journal.
+  bool sync_journal();
+
+  // Take over a session found in the journal: parked until its next message
+  void park_recovered(size_t message_count, const session_stats &stats);
+
+  // Delete the journal for good (the session is being deleted, not just
+  // destroyed on shutdown)
+  void drop_journal();
+
+  bool is_hibernated() const { return hibernated_.load(); }
+
+  // Tokens a new loop of this session starts its prompt with (system prompt
+  // and tools), for pre-warming the prefix cache
+  llama_tokens prompt_prefix();
+
+  // Chrome trace-event JSON of turn (1-based; 0 = the latest), null if it
+  // is no longer kept
+  json get_trace(int turn) const;
+
+  // Heap footprint: the history (agent_loop::history_bytes()) and the
+  // cached prompt sections. Updated when a turn ends, cleared while
+  // hibernated.
+  size_t memory_bytes() const { return memory_bytes_.load(); }
+
+  // Keep *total up to date with memory_bytes() (the manager's sum)
+  void set_memory_counter(std::atomic<int64_t> *total);
+
+  // Where this session's completions go, null = the server. Set before the
+  // first message.
+  void set_completion_backend(std::shared_ptr<completion_backend> backend) {
+    backend_ = std::move(backend);
+  }
+
 private:
   std::string id_;
   server_context &server_ctx_;
   const common_params &params_;
-  const agent_session_config &config_;
+  const agent_session_config config_;
 
   std::unique_ptr<agent_loop> loop_;
   permission_manager_async permissions_;
@@ -132,8 +200,47 @@ private:
   std::optional<agent_loop_result> last_result_;
   mutable std::mutex result_mutex_;
 
-  // Background processing thread
-  std::thread worker_thread_;
+  // The running turn, driven on the shared executor
+  session_executor &executor_;
+  std::shared_ptr<agent_turn> turn_;
+  mutable std::mutex turn_mutex_;
+  std::condition_variable turn_cv_; // Signaled when is_running_ drops
+
+  // Slot admission of the turn's generations (guarded by turn_mutex_)
+  turn_admission &admission_;
+  turn_admission::ticket ticket_ = 0; // Queued ticket, 0 = not queued
+  std::chrono::steady_clock::time_point queued_at_;
+  std::chrono::steady_clock::time_point entered_at_;
+  double last_queue_wait_ms_ = 0;
+
+  // Slots shared with all sessions and their subagents
+  std::shared_ptr<slot_pool> slots_;
+  std::shared_ptr<kv_prefix_cache> prefix_cache_;
+  std::shared_ptr<completion_backend> backend_;
+
+  // Hibernation (null = disabled). While parked, loop_ is null and the
+  // listing uses the copies below.
+  session_hibernator *hibernator_;
+  std::atomic<bool> hibernated_{false};
+  int parked_message_count_ = 0;
+  session_stats parked_stats_;
+
+  // First prefill after a restore, reported to the hibernator (guarded by
+  // turn_mutex_)
+  bool prefill_probe_ = false;
+  bool probe_kv_restored_ = false;
+  double probe_prompt_ms_ = 0;
+  int64_t probe_input_ = 0;
+
+  // Process-wide metrics (null = not collected) and the running turn's
+  // share of them (only touched by whoever drives the turn)
+  agent_metrics *metrics_;
+  agent_turn_probe metrics_probe_;
+
+  // Traces of the latest turns, by turn number (guarded by turn_mutex_)
+  static constexpr size_t MAX_TRACES = 8;
+  int turn_count_ = 0;
+  std::deque<std::pair<int, std::shared_ptr<turn_trace>>> traces_;
 
   // Timestamps
   std::chrono::steady_clock::time_point created_at_;
@@ -142,21 +249,60 @@ private:
   // Discovery Skills and AGENTS.md content (cached at session creation)
   std::string skills_prompt_section_;
   std::string agents_md_prompt_section_;
+
+  // Journal (null = disabled) and how far it covers the loop's history
+  session_journal *journal_ = nullptr;
+  std::mutex journal_mutex_;
+  bool journal_dropped_ = false;
+  bool journal_ok_ = false; // False = write a snapshot next
+  size_t journaled_count_ = 0;
+  uint64_t journaled_version_ = 0;
+  int journal_appends_ = 0; // Since the last snapshot
+
+  // Memory accounting, see memory_bytes()
+  std::atomic<size_t> memory_bytes_{0};
+  std::atomic<int64_t> *memory_total_ = nullptr;
+
+  agent_config make_loop_config() const;
+
+  // Recompute memory_bytes() (when loop_ is not being run)
+  void update_memory();
+
+  // Load a parked session back into a new loop (is_running_ held)
+  bool restore();
+
+  // Create the loop if needed and post a new turn to the executor
+  void start_turn(const json &user_message, agent_event_callback on_event,
+                  std::vector<raw_buffer> media_files);
+
+  // Advance the turn; on completion store the result and go idle
+  void drive(const std::shared_ptr<agent_turn> &turn);
+
+  // Block until the previous turn finished
+  void wait_idle();
 };
 
 // Manages multiple agent sessions
 class agent_session_manager {
 public:
+  // max_queued_turns: turns waiting for a slot before new chat requests
+  // are refused, -1 = 4 per slot
   agent_session_manager(server_context &server_ctx,
-                        const common_params &params);
+                        const common_params &params,
+                        int max_queued_turns = -1,
+                        hibernation_config hibernation = {},
+                        bool prefix_cache = true,
+                        session_reaper_config reaper = {},
+                        journal_config journal = {});
   ~agent_session_manager();
 
   // Create a new session with the given configuration
   // Returns session ID
   std::string create_session(const agent_session_config &config = {});
 
-  // Get a session by ID (nullptr if not found)
-  agent_session *get_session(const std::string &id);
+  // Get a session by ID (nullptr if not found). Callers hold the reference
+  // while they use the session: the reaper may drop it from the table.
+  std::shared_ptr<agent_session> get_session(const std::string &id);
 
   // Delete a session by ID
   bool delete_session(const std::string &id);
@@ -167,19 +313,98 @@ public:
   // Get session count
   size_t session_count() const;
 
+  // Rebuild the sessions of a previous run from the journal. They come back
+  // parked and load their history on their next message. Call once at
+  // startup, after set_backend_factory(). Returns the number recovered.
+  size_t recover_sessions();
+
+  // False if the slot queue is too long to accept another turn;
+  // retry_after_ms then estimates when it will have drained enough
+  bool accepting_turns(double &retry_after_ms) const;
+
   // Get model information
   std::string get_model_name() const;
 
   // Clean up expired/idle sessions (optional TTL in sec)
   void cleanup(int idle_timeout_seconds = 3600);
 
+  // Hibernate sessions idle longer than the configured threshold. Runs
+  // periodically on the executor when hibernation is enabled.
+  void hibernate_idle();
+
+  // Delete sessions idle past the reaper's timeout, then evict the least
+  // recently used idle sessions while their memory is over budget (by
+  // hibernating them if hibernation is enabled). Runs every second on the
+  // executor when the reaper is configured.
+  void reap();
+
+  // Memory of all sessions, see agent_session::memory_bytes()
+  int64_t memory_bytes() const { return memory_bytes_.load(); }
+
+  hibernation_stats get_hibernation_stats() const {
+    return hibernator_.stats();
+  }
+
+  journal_stats get_journal_stats() const { return journal_.stats(); }
+
+  // Prefill the prompt prefix of a default session in the background, so
+  // that the first sessions already find it in the prefix cache
+  void prewarm_prefix();
+
+  prefix_cache_stats get_prefix_cache_stats() const {
+    return prefix_cache_ ? prefix_cache_->stats() : prefix_cache_stats{};
+  }
+
+  // Agent metrics in Prometheus text format, for /metrics
+  std::string render_metrics() const;
+
+  // Gives each new session a completion backend of its own instead of the
+  // server (e.g. a scripted model for load tests)
+  using backend_factory =
+      std::function<std::shared_ptr<completion_backend>(const std::string &id)>;
+  void set_backend_factory(backend_factory factory) {
+    backend_factory_ = std::move(factory);
+  }
+
 private:
   server_context &server_ctx_;
   const common_params &params_;
 
-  mutable std::mutex sessions_mutex_;
-  std::map<std::string, std::unique_ptr<agent_session>> sessions_;
+  // Declared before sessions_: sessions finish their turns on it while they
+  // are destroyed
+  session_executor executor_;
+  turn_admission admission_;
+  size_t max_queued_turns_;
+  std::shared_ptr<slot_pool> slots_;
+  std::shared_ptr<kv_prefix_cache> prefix_cache_; // Null = disabled
+  backend_factory backend_factory_;                // Null = the server
+  session_hibernator hibernator_;
+  session_journal journal_;
+  agent_metrics metrics_;
+
+  // Reaper: idle deadlines by session id, and the sessions' memory sum
+  session_reaper_config reaper_;
+  timer_wheel expiry_;
+  std::atomic<int64_t> memory_bytes_{0};
+
+  // Lets a pending sweep timer see that the manager is gone
+  struct sweep_guard {
+    std::mutex mutex;
+    bool alive = true;
+  };
+  std::shared_ptr<sweep_guard> sweep_guard_;
+
+  // Shared so that a sweep can hibernate a session while it is being
+  // deleted
+  session_table<agent_session> sessions_;
   std::atomic<uint64_t> session_counter_{0};
 
   std::string generate_session_id();
+
+  void schedule_hibernation_sweep();
+  void schedule_reaper();
+  void schedule_journal_sync();
+
+  // Evict idle sessions, least recently used first, until within budget
+  void evict_for_memory();
 };
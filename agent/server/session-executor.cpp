@@ -0,0 +1,249 @@
+#include "session-executor.h"
+
+#include <algorithm>
+
+// Index of the executor worker running on this thread
+static thread_local const session_executor *tl_executor = nullptr;
+static thread_local size_t tl_worker = 0;
+
+session_executor::session_executor(size_t n_threads) {
+  n_threads = std::max<size_t>(n_threads, 1);
+  for (size_t i = 0; i < n_threads; i++) {
+    workers_.push_back(std::make_unique<worker>());
+  }
+  for (size_t i = 0; i < n_threads; i++) {
+    workers_[i]->thread = std::thread([this, i]() { worker_loop(i); });
+  }
+}
+
+session_executor::~session_executor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto &w : workers_) {
+    w->thread.join();
+  }
+}
+
+void session_executor::push(size_t index, std::function<void()> job) {
+  // Counted before it is published, a thief may pop it right away
+  n_pending_++;
+  {
+    std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+    workers_[index]->jobs.push_back(std::move(job));
+  }
+  // Taking the lock orders the increment with a worker about to sleep
+  { std::lock_guard<std::mutex> lock(mutex_); }
+  cv_.notify_one();
+}
+
+void session_executor::post(std::function<void()> job) {
+  size_t index = tl_executor == this
+                     ? tl_worker
+                     : next_worker_.fetch_add(1) % workers_.size();
+  push(index, std::move(job));
+}
+
+void session_executor::post_at(time_point when, std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timers_.push({when, std::move(job)});
+  }
+  // The new timer may be due before the one a worker sleeps on
+  cv_.notify_all();
+}
+
+bool session_executor::pop(size_t index, std::function<void()> &job) {
+  const size_t n = workers_.size();
+  for (size_t k = 0; k < n; k++) {
+    worker &w = *workers_[(index + k) % n];
+    std::lock_guard<std::mutex> lock(w.mutex);
+    if (w.jobs.empty()) {
+      continue;
+    }
+    if (k == 0) {
+      job = std::move(w.jobs.front());
+      w.jobs.pop_front();
+    } else {
+      job = std::move(w.jobs.back());
+      w.jobs.pop_back();
+    }
+    n_pending_--;
+    return true;
+  }
+  return false;
+}
+
+void session_executor::fire_timers() {
+  std::vector<std::function<void()>> due;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    while (!timers_.empty() && timers_.top().when <= now) {
+      due.push_back(std::move(const_cast<timer &>(timers_.top()).job));
+      timers_.pop();
+    }
+  }
+  for (auto &job : due) {
+    post(std::move(job));
+  }
+}
+
+void session_executor::worker_loop(size_t index) {
+  tl_executor = this;
+  tl_worker = index;
+
+  while (true) {
+    fire_timers();
+
+    std::function<void()> job;
+    if (pop(index, job)) {
+      job();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stopping_) {
+      return;
+    }
+    if (n_pending_.load() > 0) {
+      continue;
+    }
+    if (timers_.empty()) {
+      cv_.wait(lock);
+    } else if (timers_.top().when > std::chrono::steady_clock::now()) {
+      cv_.wait_until(lock, timers_.top().when);
+    }
+  }
+}
+
+turn_admission::turn_admission(int max_active)
+    : max_active_(std::max(1, max_active)) {}
+
+std::function<void()> turn_admission::head_notify() const {
+  if (queue_.empty() || active_ >= max_active_) {
+    return nullptr;
+  }
+  return queue_.front().notify;
+}
+
+turn_admission::ticket turn_admission::enqueue(std::function<void()> notify) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ticket t = next_ticket_++;
+  queue_.push_back({t, std::move(notify)});
+  return t;
+}
+
+bool turn_admission::try_enter(ticket t) {
+  std::function<void()> notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_ >= max_active_ || queue_.empty() || queue_.front().id != t) {
+      return false;
+    }
+    queue_.pop_front();
+    active_++;
+    // Several slots may have freed up, pass the turn on
+    notify = head_notify();
+  }
+  if (notify) {
+    notify();
+  }
+  return true;
+}
+
+void turn_admission::leave(double generation_ms) {
+  std::function<void()> notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_--;
+    avg_generation_ms_ = avg_generation_ms_ == 0.0
+                             ? generation_ms
+                             : 0.9 * avg_generation_ms_ + 0.1 * generation_ms;
+    notify = head_notify();
+  }
+  if (notify) {
+    notify();
+  }
+}
+
+void turn_admission::cancel(ticket t) {
+  std::function<void()> notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(queue_.begin(), queue_.end(),
+                           [t](const entry &e) { return e.id == t; });
+    if (it == queue_.end()) {
+      return;
+    }
+    bool was_head = it == queue_.begin();
+    queue_.erase(it);
+    if (was_head) {
+      notify = head_notify();
+    }
+  }
+  if (notify) {
+    notify();
+  }
+}
+
+bool turn_admission::enter_wait(const std::atomic<bool> &stop) {
+  // Shared with the notify function, which may still run after we return
+  struct waiter {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool woken = false;
+  };
+  auto w = std::make_shared<waiter>();
+  ticket t = enqueue([w]() {
+    {
+      std::lock_guard<std::mutex> lock(w->mutex);
+      w->woken = true;
+    }
+    w->cv.notify_one();
+  });
+  while (!try_enter(t)) {
+    if (stop.load()) {
+      cancel(t);
+      return false;
+    }
+    // Polls stop now and then, nothing notifies on it
+    std::unique_lock<std::mutex> lock(w->mutex);
+    w->cv.wait_for(lock, std::chrono::milliseconds(100),
+                   [&] { return w->woken; });
+    w->woken = false;
+  }
+  return true;
+}
+
+size_t turn_admission::position(ticket t) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < queue_.size(); i++) {
+    if (queue_[i].id == t) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+size_t turn_admission::queued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+int turn_admission::active() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return active_;
+}
+
+double turn_admission::estimated_wait_ms() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (active_ < max_active_ && queue_.empty()) {
+    return 0.0;
+  }
+  // Every max_active_ generations that finish admit as many queued turns
+  double rounds = static_cast<double>(queue_.size() + 1) / max_active_;
+  return rounds * avg_generation_ms_;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads that drive the agent turns of all server sessions
+//
+// A turn only occupies a thread while it generates; while it waits for a
+// permission answer or a tool batch it is suspended (see agent_turn) and
+// re-posted here when the wait is over. Hundreds of idle or waiting
+// sessions therefore cost no threads.
+//
+// Each worker has its own run queue. Jobs posted from a worker stay on that
+// worker, others are spread round-robin, and an idle worker steals from the
+// back of a busy worker's queue.
+class session_executor {
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  explicit session_executor(size_t n_threads);
+  ~session_executor();
+
+  // Run job on a worker as soon as one is free
+  void post(std::function<void()> job);
+
+  // Run job on a worker once `when` has passed (e.g. permission timeouts)
+  void post_at(time_point when, std::function<void()> job);
+
+  size_t size() const { return workers_.size(); }
+
+  // Jobs posted but not started yet
+  size_t pending() const { return n_pending_.load(); }
+
+private:
+  struct timer {
+    time_point when;
+    std::function<void()> job;
+    bool operator>(const timer &other) const { return when > other.when; }
+  };
+
+  struct worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> jobs;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<worker>> workers_;
+  std::atomic<size_t> next_worker_{0};
+  std::atomic<size_t> n_pending_{0};
+
+  // Sleeping, timers and shutdown
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers_;
+  bool stopping_ = false;
+
+  void push(size_t index, std::function<void()> job);
+
+  // Own queue first (front), then steal from the others (back)
+  bool pop(size_t index, std::function<void()> &job);
+
+  // Move due timers into the run queues
+  void fire_timers();
+
+  void worker_loop(size_t index);
+};
+
+// FIFO admission of turn generations to the server slots
+//
+// At most max_active turns generate at the same time, one per slot; the
+// rest wait in arrival order without holding an executor thread, instead of
+// queueing invisibly inside server_context.
+class turn_admission {
+public:
+  using ticket = uint64_t;
+
+  explicit turn_admission(int max_active);
+
+  // Queue a turn. notify is called (outside any lock) whenever the turn
+  // may be able to enter.
+  ticket enqueue(std::function<void()> notify);
+
+  // Enter if the ticket is at the head of the queue and a slot is free
+  bool try_enter(ticket t);
+
+  // A generation that entered has finished
+  void leave(double generation_ms);
+
+  // Drop a queued ticket (e.g. the turn was cancelled)
+  void cancel(ticket t);
+
+  // Queue and block until entered, for callers that own their thread
+  // (subagents). False, and no longer queued, once stop is set.
+  bool enter_wait(const std::atomic<bool> &stop);
+
+  // 1-based position in the queue, 0 if not queued
+  size_t position(ticket t) const;
+
+  size_t queued() const;
+  int active() const;
+  int max_active() const { return max_active_; }
+
+  // Rough wait of a turn queued now, from the recent generation times
+  double estimated_wait_ms() const;
+
+private:
+  struct entry {
+    ticket id;
+    std::function<void()> notify;
+  };
+
+  const int max_active_;
+  mutable std::mutex mutex_;
+  std::deque<entry> queue_;
+  ticket next_ticket_ = 1;
+  int active_ = 0;
+  double avg_generation_ms_ = 0.0;
+
+  // Callback of the head entry if it can enter now (call with mutex_ held)
+  std::function<void()> head_notify() const;
+};
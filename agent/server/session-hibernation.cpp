@@ -0,0 +1,275 @@
+#include "session-hibernation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static const char *STATE_SUFFIX = ".session.json";
+static const char *KV_SUFFIX = ".session.kv";
+
+static bool ends_with(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static uint64_t file_size_or_zero(const std::string &path) {
+  std::error_code ec;
+  auto size = fs::file_size(path, ec);
+  return ec ? 0 : static_cast<uint64_t>(size);
+}
+
+session_hibernator::session_hibernator(server_context &server_ctx,
+                                       hibernation_config config)
+    : server_ctx_(server_ctx), config_(std::move(config)) {
+  if (!enabled()) {
+    return;
+  }
+  std::error_code ec;
+  if (config_.dir.empty()) {
+    config_.dir = (fs::temp_directory_path(ec) / "llama-agent-sessions").string();
+  }
+  fs::create_directories(config_.dir, ec);
+
+  // Sessions only live in memory, files of a previous run are unreachable
+  for (const auto &file : fs::directory_iterator(config_.dir, ec)) {
+    std::string name = file.path().filename().string();
+    if (ends_with(name, STATE_SUFFIX) || ends_with(name, KV_SUFFIX)) {
+      fs::remove(file.path(), ec);
+    }
+  }
+}
+
+std::string session_hibernator::state_path(const std::string &id) const {
+  return (fs::path(config_.dir) / (id + STATE_SUFFIX)).string();
+}
+
+std::string session_hibernator::kv_path(const std::string &id) const {
+  return (fs::path(config_.dir) / (id + KV_SUFFIX)).string();
+}
+
+bool session_hibernator::save(const std::string &id, const json &state,
+                              int kv_slot, bool &kv_saved) {
+  kv_saved = false;
+  auto start = std::chrono::steady_clock::now();
+
+  // Write to a temporary name first so a crash never leaves half a state
+  std::string path = state_path(id);
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      return false;
+    }
+    out << state.dump();
+    if (!out.good()) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    fs::remove(tmp, ec);
+    return false;
+  }
+
+  entry e;
+  e.state_bytes = file_size_or_zero(path);
+  if (kv_slot >= 0) {
+    size_t n_tokens = 0;
+    double t_ms = 0;
+    if (slot_file_action(server_ctx_, SERVER_TASK_TYPE_SLOT_SAVE, kv_slot,
+                         kv_path(id), n_tokens, t_ms)) {
+      e.kv_bytes = file_size_or_zero(kv_path(id));
+      kv_saved = e.kv_bytes > 0;
+      // The slot is free for others now, its cache is on disk
+      slot_file_action(server_ctx_, SERVER_TASK_TYPE_SLOT_ERASE, kv_slot, "",
+                       n_tokens, t_ms);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto old = entries_.find(id);
+  if (old != entries_.end()) {
+    stats_.disk_bytes -= old->second.state_bytes + old->second.kv_bytes;
+  }
+  e.seq = ++seq_;
+  entries_[id] = e;
+  stats_.disk_bytes += e.state_bytes + e.kv_bytes;
+  stats_.hibernated++;
+  stats_.kv_saved += kv_saved ? 1 : 0;
+  stats_.save_ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  enforce_budget();
+  return true;
+}
+
+bool session_hibernator::peek(const std::string &id, json &state) const {
+  std::ifstream in(state_path(id), std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  state = json::parse(buffer.str(), nullptr, false);
+  return !state.is_discarded();
+}
+
+bool session_hibernator::load(const std::string &id, json &state, int kv_slot,
+                              bool &kv_restored) {
+  kv_restored = false;
+  bool has_kv = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return false;
+    }
+    has_kv = it->second.kv_bytes > 0;
+  }
+
+  bool ok = peek(id, state);
+  size_t n_tokens = 0;
+  double t_ms = 0;
+  if (ok && has_kv && kv_slot >= 0) {
+    auto start = std::chrono::steady_clock::now();
+    kv_restored =
+        slot_file_action(server_ctx_, SERVER_TASK_TYPE_SLOT_RESTORE, kv_slot,
+                         kv_path(id), n_tokens, t_ms);
+    t_ms = std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+               .count();
+  }
+  remove(id);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ok) {
+    stats_.restored++;
+  }
+  if (kv_restored) {
+    stats_.kv_restored++;
+    stats_.kv_restore_ms += t_ms;
+    stats_.kv_restored_tokens += static_cast<int64_t>(n_tokens);
+  } else if (ok && has_kv) {
+    stats_.kv_restore_failed++;
+  }
+  return ok;
+}
+
+void session_hibernator::remove(const std::string &id) {
+  std::error_code ec;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return;
+    }
+    stats_.disk_bytes -= it->second.state_bytes + it->second.kv_bytes;
+    entries_.erase(it);
+  }
+  fs::remove(state_path(id), ec);
+  fs::remove(kv_path(id), ec);
+}
+
+void session_hibernator::enforce_budget() {
+  if (stats_.disk_bytes <= config_.disk_budget_bytes) {
+    return;
+  }
+  std::vector<std::map<std::string, entry>::iterator> kv_entries;
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->second.kv_bytes > 0) {
+      kv_entries.push_back(it);
+    }
+  }
+  std::sort(kv_entries.begin(), kv_entries.end(),
+            [this](const auto &a, const auto &b) {
+              if (config_.eviction == hibernation_eviction::LARGEST) {
+                return a->second.kv_bytes > b->second.kv_bytes;
+              }
+              return a->second.seq < b->second.seq;
+            });
+
+  std::error_code ec;
+  for (auto &it : kv_entries) {
+    if (stats_.disk_bytes <= config_.disk_budget_bytes) {
+      break;
+    }
+    fs::remove(kv_path(it->first), ec);
+    stats_.disk_bytes -= it->second.kv_bytes;
+    it->second.kv_bytes = 0;
+    stats_.kv_evicted++;
+  }
+}
+
+void session_hibernator::record_prefill(bool kv_restored, double prompt_ms,
+                                        int64_t n_tokens) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (kv_restored) {
+    stats_.prefills_after_kv++;
+    stats_.prefill_after_kv_ms += prompt_ms;
+    stats_.prefill_after_kv_tokens += n_tokens;
+  } else {
+    stats_.reprefills++;
+    stats_.reprefill_ms += prompt_ms;
+    stats_.reprefill_tokens += n_tokens;
+  }
+}
+
+hibernation_stats session_hibernator::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+json session_hibernator::stats_to_json(const session_stats &stats) {
+  return {
+      {"total_input", stats.total_input},
+      {"total_output", stats.total_output},
+      {"total_cached", stats.total_cached},
+      {"total_prompt_ms", stats.total_prompt_ms},
+      {"total_predicted_ms", stats.total_predicted_ms},
+      {"subagent_input", stats.subagent_input},
+      {"subagent_output", stats.subagent_output},
+      {"subagent_cached", stats.subagent_cached},
+      {"subagent_count", stats.subagent_count},
+      {"compactions", stats.compactions},
+      {"compaction_tokens_saved", stats.compaction_tokens_saved},
+      {"lookup_est_drafted", stats.lookup_est_drafted},
+      {"lookup_est_accepted", stats.lookup_est_accepted},
+      {"draft_n", stats.draft_n},
+      {"draft_accepted", stats.draft_accepted},
+      {"completions", stats.completions},
+      {"slot_switches", stats.slot_switches},
+      {"doom_loops", stats.doom_loops},
+  };
+}
+
+session_stats session_hibernator::stats_from_json(const json &j) {
+  session_stats stats;
+  if (!j.is_object()) {
+    return stats;
+  }
+  stats.total_input = j.value("total_input", 0);
+  stats.total_output = j.value("total_output", 0);
+  stats.total_cached = j.value("total_cached", 0);
+  stats.total_prompt_ms = j.value("total_prompt_ms", 0.0);
+  stats.total_predicted_ms = j.value("total_predicted_ms", 0.0);
+  stats.subagent_input = j.value("subagent_input", 0);
+  stats.subagent_output = j.value("subagent_output", 0);
+  stats.subagent_cached = j.value("subagent_cached", 0);
+  stats.subagent_count = j.value("subagent_count", 0);
+  stats.compactions = j.value("compactions", 0);
+  stats.compaction_tokens_saved = j.value("compaction_tokens_saved", 0);
+  stats.lookup_est_drafted = j.value("lookup_est_drafted", int64_t(0));
+  stats.lookup_est_accepted = j.value("lookup_est_accepted", int64_t(0));
+  stats.draft_n = j.value("draft_n", int64_t(0));
+  stats.draft_accepted = j.value("draft_accepted", int64_t(0));
+  stats.completions = j.value("completions", 0);
+  stats.slot_switches = j.value("slot_switches", 0);
+  stats.doom_loops = j.value("doom_loops", 0);
+  return stats;
+}
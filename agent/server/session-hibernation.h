@@ -0,0 +1,105 @@
+#pragma once
+
+#include "../agent-loop.h"
+#include "server-context.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Which KV files go first when the hibernation directory is over budget
+enum class hibernation_eviction {
+  OLDEST,  // Hibernated longest ago
+  LARGEST, // Biggest KV file
+};
+
+struct hibernation_config {
+  int idle_seconds = 0; // Hibernate sessions idle this long, 0 = never
+  std::string dir;      // Session files, empty = <tmp>/llama-agent-sessions
+  uint64_t disk_budget_bytes = 4ull << 30; // KV files beyond this are evicted
+  hibernation_eviction eviction = hibernation_eviction::OLDEST;
+};
+
+struct hibernation_stats {
+  int64_t hibernated = 0;        // Sessions written to disk
+  int64_t restored = 0;          // Sessions read back
+  int64_t kv_saved = 0;          // ... hibernated with their slot KV cache
+  int64_t kv_restored = 0;       // ... restored with it
+  int64_t kv_restore_failed = 0; // KV file present but not loaded
+  int64_t kv_evicted = 0;        // KV files dropped for the disk budget
+  uint64_t disk_bytes = 0;       // Current size of all session files
+  double save_ms = 0;            // Time spent hibernating, in total
+  double kv_restore_ms = 0;      // Time spent loading KV files, in total
+  int64_t kv_restored_tokens = 0;
+
+  // First prefill after a restore, with the KV cache loaded and without
+  // (a full re-prefill of the history)
+  int64_t prefills_after_kv = 0;
+  double prefill_after_kv_ms = 0;
+  int64_t prefill_after_kv_tokens = 0;
+  int64_t reprefills = 0;
+  double reprefill_ms = 0;
+  int64_t reprefill_tokens = 0;
+};
+
+// Parks idle sessions on local disk
+//
+// A hibernated session is a small JSON file (history and stats) plus,
+// when its slot still held its cache, the slot KV state written by the
+// server (SLOT_SAVE). Restoring loads the KV state into a free slot
+// (SLOT_RESTORE), so the next turn only prefills the new message. KV files
+// are evicted to stay within the disk budget; the history is always kept
+// and such a session restores with a full prefill.
+class session_hibernator {
+public:
+  session_hibernator(server_context &server_ctx, hibernation_config config);
+
+  bool enabled() const { return config_.idle_seconds > 0; }
+  const hibernation_config &config() const { return config_; }
+
+  // Write a session's state. kv_slot >= 0 is an idle slot (held by the
+  // caller) with the session's cache: it is saved too, then erased.
+  // Returns false if nothing was written.
+  bool save(const std::string &id, const json &state, int kv_slot,
+            bool &kv_saved);
+
+  // Read a session back and delete its files. If kv_slot >= 0 (an idle slot
+  // held by the caller) and a KV file exists, it is loaded into that slot.
+  bool load(const std::string &id, json &state, int kv_slot,
+            bool &kv_restored);
+
+  // Read the state without restoring (e.g. history of a parked session)
+  bool peek(const std::string &id, json &state) const;
+
+  void remove(const std::string &id);
+
+  // The first completion after a restore prefilled n_tokens in prompt_ms
+  void record_prefill(bool kv_restored, double prompt_ms, int64_t n_tokens);
+
+  hibernation_stats stats() const;
+
+  static json stats_to_json(const session_stats &stats);
+  static session_stats stats_from_json(const json &j);
+
+private:
+  struct entry {
+    uint64_t state_bytes = 0;
+    uint64_t kv_bytes = 0; // 0 = no KV file
+    uint64_t seq = 0;      // Hibernation order
+  };
+
+  server_context &server_ctx_;
+  hibernation_config config_;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, entry> entries_;
+  uint64_t seq_ = 0;
+  hibernation_stats stats_;
+
+  std::string state_path(const std::string &id) const;
+  std::string kv_path(const std::string &id) const;
+
+  // Evict KV files until the directory fits the budget (mutex_ held)
+  void enforce_budget();
+};
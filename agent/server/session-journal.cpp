@@ -0,0 +1,391 @@
+#include "session-journal.h"
+#include "session-hibernation.h"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <sstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static const char *JOURNAL_SUFFIX = ".journal";
+static const char JOURNAL_MAGIC[8] = {'L', 'A', 'J', 'O', 'U', 'R', 'N', '1'};
+
+enum : uint8_t {
+  RECORD_CONFIG = 1,   // Session config
+  RECORD_SNAPSHOT = 2, // Whole history, replaces what came before
+  RECORD_MESSAGES = 3, // Messages appended by a turn
+  RECORD_STATS = 4,    // Session stats, the last one wins
+};
+
+struct record_header {
+  uint32_t size;     // Payload bytes
+  uint32_t checksum; // Of the payload
+  uint32_t count;    // Messages in the payload
+  uint8_t type;
+  uint8_t reserved[3];
+};
+static_assert(sizeof(record_header) == 16, "journal record header layout");
+
+// FNV-1a; catches torn and partly written records, not tampering
+static uint32_t checksum(const char *data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+  }
+  return hash;
+}
+
+static bool ends_with(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Read-only view of a whole file, memory-mapped where possible
+class mapped_file {
+public:
+  explicit mapped_file(const std::string &path) {
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary);
+    if (in) {
+      std::stringstream buffer;
+      buffer << in.rdbuf();
+      buffer_ = buffer.str();
+      data_ = buffer_.data();
+      size_ = buffer_.size();
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        addr_ = addr;
+        data_ = static_cast<const char *>(addr);
+        size_ = static_cast<size_t>(st.st_size);
+      }
+    }
+    ::close(fd);
+#endif
+  }
+
+  ~mapped_file() {
+#ifndef _WIN32
+    if (addr_) {
+      munmap(addr_, size_);
+    }
+#endif
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  bool has_magic() const {
+    return size_ >= sizeof(JOURNAL_MAGIC) &&
+           std::memcmp(data_, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0;
+  }
+
+private:
+#ifdef _WIN32
+  std::string buffer_;
+#else
+  void *addr_ = nullptr;
+#endif
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Call fn(header, payload) for each record. Stops at the first one that
+// runs past the end of the file or, with verify, fails its checksum.
+template <typename F>
+static void walk_records(const mapped_file &file, bool verify, F &&fn) {
+  size_t pos = sizeof(JOURNAL_MAGIC);
+  while (file.size() - pos >= sizeof(record_header)) {
+    record_header h;
+    std::memcpy(&h, file.data() + pos, sizeof(h));
+    pos += sizeof(h);
+    if (h.size > file.size() - pos) {
+      return;
+    }
+    const char *payload = file.data() + pos;
+    if (verify && checksum(payload, h.size) != h.checksum) {
+      return;
+    }
+    fn(h, payload);
+    pos += h.size;
+  }
+}
+
+static json parse_payload(const record_header &h, const char *payload) {
+  if (checksum(payload, h.size) != h.checksum) {
+    return json();
+  }
+  return json::parse(payload, payload + h.size, nullptr, false);
+}
+
+static bool write_file(const std::string &path, const std::string &buf,
+                       bool append, bool sync) {
+#ifdef _WIN32
+  std::ofstream out(path, std::ios::binary |
+                              (append ? std::ios::app : std::ios::trunc));
+  out.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+  out.flush();
+  (void)sync;
+  return out.good();
+#else
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  int fd = ::open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  // One write per append, so a crash tears at most the last record
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    done += static_cast<size_t>(n);
+  }
+  bool ok = done == buf.size() && (!sync || ::fsync(fd) == 0);
+  ::close(fd);
+  return ok;
+#endif
+}
+
+// fsync an existing file (or directory, for renames in it)
+static bool sync_path(const std::string &path) {
+#ifdef _WIN32
+  (void)path;
+  return true;
+#else
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+#endif
+}
+
+session_journal::session_journal(journal_config config)
+    : config_(std::move(config)) {
+  if (enabled()) {
+    std::error_code ec;
+    fs::create_directories(config_.dir, ec);
+  }
+}
+
+std::string session_journal::path(const std::string &id) const {
+  return (fs::path(config_.dir) / (id + JOURNAL_SUFFIX)).string();
+}
+
+void session_journal::put_record(std::string &buf, uint8_t type,
+                                 uint32_t count, const std::string &payload) {
+  record_header h = {};
+  h.size = static_cast<uint32_t>(payload.size());
+  h.checksum = checksum(payload.data(), payload.size());
+  h.count = count;
+  h.type = type;
+  buf.append(reinterpret_cast<const char *>(&h), sizeof(h));
+  buf.append(payload);
+}
+
+bool session_journal::snapshot(const std::string &id, const json &config,
+                               const json &messages,
+                               const session_stats &stats) {
+  std::string buf(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  put_record(buf, RECORD_CONFIG, 0, config.dump());
+  put_record(buf, RECORD_SNAPSHOT, static_cast<uint32_t>(messages.size()),
+             messages.dump());
+  put_record(buf, RECORD_STATS, 0,
+             session_hibernator::stats_to_json(stats).dump());
+
+  // Written next to the journal and renamed over it, so a crash leaves
+  // either the old journal or the new one
+  const bool sync = config_.sync != journal_sync::NONE;
+  std::string target = path(id);
+  std::string tmp = target + ".tmp";
+  std::error_code ec;
+  bool ok = write_file(tmp, buf, false, sync);
+  if (ok) {
+    fs::rename(tmp, target, ec);
+    ok = !ec;
+  }
+  if (!ok) {
+    fs::remove(tmp, ec);
+  } else if (config_.sync == journal_sync::TURN) {
+    sync_path(config_.dir);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok) {
+    stats_.write_errors++;
+    return false;
+  }
+  if (sync) {
+    unsynced_.erase(id);
+  }
+  stats_.snapshots++;
+  stats_.bytes_written += buf.size();
+  stats_.fsyncs += sync ? 1 : 0;
+  return true;
+}
+
+bool session_journal::append(const std::string &id, const json &messages,
+                             const session_stats &stats) {
+  std::string buf;
+  if (!messages.empty()) {
+    put_record(buf, RECORD_MESSAGES, static_cast<uint32_t>(messages.size()),
+               messages.dump());
+  }
+  put_record(buf, RECORD_STATS, 0,
+             session_hibernator::stats_to_json(stats).dump());
+
+  const bool sync = config_.sync == journal_sync::TURN;
+  bool ok = write_file(path(id), buf, true, sync);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ok) {
+    stats_.write_errors++;
+    return false;
+  }
+  if (config_.sync == journal_sync::BATCH) {
+    unsynced_.insert(id);
+  }
+  stats_.appends++;
+  stats_.bytes_written += buf.size();
+  stats_.fsyncs += sync ? 1 : 0;
+  return true;
+}
+
+bool session_journal::load(const std::string &id, json &state) const {
+  mapped_file file(path(id));
+  if (!file.has_magic()) {
+    return false;
+  }
+  json config;
+  json messages = json::array();
+  json stats;
+  walk_records(file, true, [&](const record_header &h, const char *payload) {
+    json value = json::parse(payload, payload + h.size, nullptr, false);
+    if (h.type == RECORD_CONFIG) {
+      config = std::move(value);
+    } else if (h.type == RECORD_SNAPSHOT && value.is_array()) {
+      messages = std::move(value);
+    } else if (h.type == RECORD_MESSAGES && value.is_array()) {
+      for (auto &msg : value) {
+        messages.push_back(std::move(msg));
+      }
+    } else if (h.type == RECORD_STATS) {
+      stats = std::move(value);
+    }
+  });
+  if (!config.is_object()) {
+    return false;
+  }
+  state = {
+      {"config", std::move(config)},
+      {"messages", std::move(messages)},
+      {"stats", std::move(stats)},
+  };
+  return true;
+}
+
+void session_journal::remove(const std::string &id) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unsynced_.erase(id);
+  }
+  std::error_code ec;
+  fs::remove(path(id), ec);
+}
+
+std::vector<journal_session> session_journal::scan() {
+  std::vector<journal_session> sessions;
+  if (!enabled()) {
+    return sessions;
+  }
+  std::error_code ec;
+  for (const auto &file : fs::directory_iterator(config_.dir, ec)) {
+    std::string name = file.path().filename().string();
+    if (!ends_with(name, JOURNAL_SUFFIX)) {
+      continue;
+    }
+    mapped_file mapped(file.path().string());
+    if (!mapped.has_magic()) {
+      continue;
+    }
+
+    // Only the headers are read here; the history stays unparsed (and
+    // mostly unread) until load()
+    journal_session session;
+    session.id = name.substr(0, name.size() - strlen(JOURNAL_SUFFIX));
+    const char *stats_payload = nullptr;
+    record_header stats_header = {};
+    walk_records(mapped, false,
+                 [&](const record_header &h, const char *payload) {
+                   if (h.type == RECORD_CONFIG && session.config.is_null()) {
+                     session.config = parse_payload(h, payload);
+                   } else if (h.type == RECORD_SNAPSHOT) {
+                     session.message_count = h.count;
+                   } else if (h.type == RECORD_MESSAGES) {
+                     session.message_count += h.count;
+                   } else if (h.type == RECORD_STATS) {
+                     stats_header = h;
+                     stats_payload = payload;
+                   }
+                 });
+    if (!session.config.is_object()) {
+      continue;
+    }
+    if (stats_payload) {
+      session.stats = session_hibernator::stats_from_json(
+          parse_payload(stats_header, stats_payload));
+    }
+    sessions.push_back(std::move(session));
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.recovered += static_cast<int64_t>(sessions.size());
+  return sessions;
+}
+
+void session_journal::sync_pending() {
+  std::set<std::string> ids;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ids.swap(unsynced_);
+  }
+  int64_t n_synced = 0;
+  for (const auto &id : ids) {
+    n_synced += sync_path(path(id)) ? 1 : 0;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.fsyncs += n_synced;
+}
+
+journal_stats session_journal::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../agent-loop.h"
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// When appended journal records are flushed to the disk
+enum class journal_sync {
+  NONE,  // Left to the OS; a crash of the machine loses recent turns
+  BATCH, // fsync of the journals written since, every sync_interval_ms
+  TURN,  // fsync after every turn
+};
+
+struct journal_config {
+  std::string dir; // Journal files, empty = no journal
+  journal_sync sync = journal_sync::BATCH;
+  int sync_interval_ms = 1000;
+  int snapshot_turns = 64; // Rewrite a journal as one snapshot after this many appends
+};
+
+// A session found in the journal directory, see session_journal::scan()
+struct journal_session {
+  std::string id;
+  json config;
+  size_t message_count = 0;
+  session_stats stats;
+};
+
+struct journal_stats {
+  int64_t recovered = 0;     // Sessions found on startup
+  int64_t appends = 0;       // Turns appended
+  int64_t snapshots = 0;     // Journals rewritten as a snapshot
+  int64_t fsyncs = 0;
+  int64_t write_errors = 0;
+  uint64_t bytes_written = 0;
+};
+
+// Write-ahead journal of the sessions, one file per session
+//
+// A journal is a sequence of checksummed records: the session config, a
+// snapshot of the history, then per turn the messages it added and the
+// stats. A history rewrite (compaction, clear) or snapshot_turns appends
+// replace the file with a new snapshot, written next to it and renamed.
+//
+// On startup scan() only walks the record headers of the memory-mapped
+// files and reads the config and the last stats, so the sessions are listed
+// again quickly; load() reads a history when the session is next used. A
+// torn record at the end (a crash during an append) and everything after it
+// is ignored.
+class session_journal {
+public:
+  explicit session_journal(journal_config config);
+
+  bool enabled() const { return !config_.dir.empty(); }
+  const journal_config &config() const { return config_; }
+
+  // Replace the journal with the whole state of a session
+  bool snapshot(const std::string &id, const json &config,
+                const json &messages, const session_stats &stats);
+
+  // Append the messages of one turn (a JSON array, may be empty) and the
+  // stats after it
+  bool append(const std::string &id, const json &messages,
+              const session_stats &stats);
+
+  // Read a session back: {"config", "messages", "stats"}
+  bool load(const std::string &id, json &state) const;
+
+  void remove(const std::string &id);
+
+  // Sessions with a journal in the directory
+  std::vector<journal_session> scan();
+
+  // fsync the journals appended to since the last call (journal_sync::BATCH)
+  void sync_pending();
+
+  journal_stats stats() const;
+
+private:
+  journal_config config_;
+
+  mutable std::mutex mutex_;
+  std::set<std::string> unsynced_;
+  journal_stats stats_;
+
+  std::string path(const std::string &id) const;
+
+  // Append a record to buf
+  static void put_record(std::string &buf, uint8_t type, uint32_t count,
+                         const std::string &payload);
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Concurrent hash table of sessions keyed by id
+//
+// Ids hash to one of N_SHARDS shards, each a hash map behind its own mutex,
+// so lookup, insert and erase take one short lock and chat requests for
+// different sessions rarely meet. Values are shared_ptrs: snapshot() copies
+// them out shard by shard and the caller walks the copy without holding
+// anything, and erased values are destroyed after the lock is released
+// (a session waits for its running turn when destroyed).
+template <typename T, size_t N_SHARDS = 64> class session_table {
+  static_assert((N_SHARDS & (N_SHARDS - 1)) == 0,
+                "N_SHARDS must be a power of two");
+
+public:
+  using value_ptr = std::shared_ptr<T>;
+
+  // False if the id is taken
+  bool insert(const std::string &id, value_ptr value) {
+    shard &s = shard_for(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (!s.items.emplace(id, std::move(value)).second) {
+      return false;
+    }
+    size_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  value_ptr find(const std::string &id) const {
+    const shard &s = shard_for(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.items.find(id);
+    return it != s.items.end() ? it->second : nullptr;
+  }
+
+  // Remove id if it still maps to expected (any value if expected is
+  // null); returns the removed value
+  value_ptr erase(const std::string &id, const T *expected = nullptr) {
+    shard &s = shard_for(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.items.find(id);
+    if (it == s.items.end() || (expected && it->second.get() != expected)) {
+      return nullptr;
+    }
+    value_ptr removed = std::move(it->second);
+    s.items.erase(it);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    return removed;
+  }
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  // All values at about this moment; a value inserted or erased during the
+  // call may or may not be included
+  std::vector<value_ptr> snapshot() const {
+    std::vector<value_ptr> out;
+    out.reserve(size() + N_SHARDS);
+    for (const shard &s : shards_) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      for (const auto &item : s.items) {
+        out.push_back(item.second);
+      }
+    }
+    return out;
+  }
+
+  // Remove everything; values are destroyed by the caller's copy
+  std::vector<value_ptr> clear() {
+    std::vector<value_ptr> out;
+    for (shard &s : shards_) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      for (auto &item : s.items) {
+        out.push_back(std::move(item.second));
+      }
+      size_.fetch_sub(s.items.size(), std::memory_order_relaxed);
+      s.items.clear();
+    }
+    return out;
+  }
+
+private:
+  // Padded to a cache line so neighbouring shard locks do not share one
+  struct alignas(64) shard {
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, value_ptr> items;
+  };
+
+  std::array<shard, N_SHARDS> shards_;
+  std::atomic<size_t> size_{0};
+
+  shard &shard_for(const std::string &id) {
+    return shards_[std::hash<std::string>{}(id) & (N_SHARDS - 1)];
+  }
+  const shard &shard_for(const std::string &id) const {
+    return shards_[std::hash<std::string>{}(id) & (N_SHARDS - 1)];
+  }
+};
@@ -0,0 +1,44 @@
+#include "timer-wheel.h"
+
+#include <algorithm>
+
+timer_wheel::timer_wheel(clock::duration tick, size_t n_slots)
+    : tick_(tick), start_(clock::now()), slots_(std::max<size_t>(1, n_slots)) {}
+
+int64_t timer_wheel::tick_of(clock::time_point t) const {
+  return t <= start_ ? 0 : static_cast<int64_t>((t - start_) / tick_);
+}
+
+void timer_wheel::schedule(const std::string &key, clock::time_point when) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Past deadlines go into the next tick advanced
+  int64_t tick = std::max(tick_of(when), current_ + 1);
+  slots_[tick % slots_.size()].push_back({key, tick});
+  size_++;
+}
+
+std::vector<std::string> timer_wheel::advance(clock::time_point now) {
+  std::vector<std::string> due;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const int64_t target = tick_of(now);
+  // After a long pause every slot is visited once
+  const int64_t first =
+      std::max(current_ + 1, target - static_cast<int64_t>(slots_.size()) + 1);
+  for (int64_t t = first; t <= target; t++) {
+    auto &slot = slots_[t % slots_.size()];
+    auto keep = std::partition(slot.begin(), slot.end(),
+                               [target](const entry &e) { return e.tick > target; });
+    for (auto it = keep; it != slot.end(); ++it) {
+      due.push_back(std::move(it->key));
+    }
+    size_ -= slot.end() - keep;
+    slot.erase(keep, slot.end());
+  }
+  current_ = std::max(current_, target);
+  return due;
+}
+
+size_t timer_wheel::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hashed timer wheel of string keys (e.g. session ids)
+//
+// A key goes into the slot of its deadline's tick, so scheduling is O(1)
+// and advancing only visits the slots of the ticks that passed, costing
+// the keys due there plus the few parked in them for a later lap. Keys are
+// never cancelled: whoever gets a key back checks whether it is really due
+// and schedules it again if not.
+class timer_wheel {
+public:
+  using clock = std::chrono::steady_clock;
+
+  timer_wheel(clock::duration tick, size_t n_slots);
+
+  void schedule(const std::string &key, clock::time_point when);
+
+  // Keys whose deadline passed by now, removed from the wheel
+  std::vector<std::string> advance(clock::time_point now);
+
+  size_t size() const;
+
+private:
+  struct entry {
+    std::string key;
+    int64_t tick;
+  };
+
+  const clock::duration tick_;
+  const clock::time_point start_;
+  mutable std::mutex mutex_;
+  std::vector<std::vector<entry>> slots_;
+  int64_t current_ = 0; // Last tick advanced past
+  size_t size_ = 0;
+
+  int64_t tick_of(clock::time_point t) const;
+};
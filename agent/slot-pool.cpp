@@ -0,0 +1,121 @@
+#include "slot-pool.h"
+#include "server-context.h"
+
+#include <algorithm>
+#include <filesystem>
+
+slot_pool::lease::lease(lease &&other) noexcept
+    : pool_(other.pool_), id_(other.id_), epoch_(other.epoch_) {
+  other.pool_ = nullptr;
+  other.id_ = -1;
+}
+
+slot_pool::lease &slot_pool::lease::operator=(lease &&other) noexcept {
+  if (this != &other) {
+    release();
+    pool_ = other.pool_;
+    id_ = other.id_;
+    epoch_ = other.epoch_;
+    other.pool_ = nullptr;
+    other.id_ = -1;
+  }
+  return *this;
+}
+
+void slot_pool::lease::release() {
+  if (pool_ && id_ >= 0) {
+    pool_->release(id_);
+  }
+  pool_ = nullptr;
+  id_ = -1;
+}
+
+slot_pool::slot_pool(int n_slots)
+    : busy_(static_cast<size_t>(std::max(1, n_slots)), false),
+      last_used_(busy_.size(), 0), prefix_(busy_.size(), 0) {}
+
+slot_pool::lease slot_pool::acquire(int preferred) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int id = -1;
+  if (preferred >= 0 && preferred < size() && !busy_[preferred]) {
+    id = preferred;
+  } else {
+    for (int i = 0; i < size(); i++) {
+      if (!busy_[i] && (id < 0 || last_used_[i] < last_used_[id])) {
+        id = i;
+      }
+    }
+  }
+  if (id < 0) {
+    return lease(); // All busy, let the server queue it
+  }
+  busy_[id] = true;
+  last_used_[id] = ++clock_;
+  return lease(this, id, clock_);
+}
+
+slot_pool::lease slot_pool::acquire_exact(int id, uint64_t epoch) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id < 0 || id >= size() || busy_[id] || epoch == 0 ||
+      last_used_[id] != epoch) {
+    return lease();
+  }
+  busy_[id] = true;
+  return lease(this, id, epoch);
+}
+
+bool slot_pool::holds(int id, uint64_t epoch) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return id >= 0 && id < size() && epoch != 0 && last_used_[id] == epoch;
+}
+
+void slot_pool::forget(int id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id >= 0 && id < size()) {
+    last_used_[id] = 0;
+    prefix_[id] = 0;
+  }
+}
+
+void slot_pool::set_prefix(int id, uint64_t key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id >= 0 && id < size()) {
+    prefix_[id] = key;
+  }
+}
+
+uint64_t slot_pool::prefix(int id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return id >= 0 && id < size() ? prefix_[id] : 0;
+}
+
+bool slot_file_action(server_context &server_ctx, server_task_type type,
+                      int slot, const std::string &path, size_t &n_tokens,
+                      double &t_ms,
+                      const std::function<bool()> &should_stop) {
+  server_task task(type);
+  task.id_slot = slot;
+  task.slot_action.slot_id = slot;
+  task.slot_action.filename = std::filesystem::path(path).filename().string();
+  task.slot_action.filepath = path;
+
+  server_response_reader rd = server_ctx.get_response_reader();
+  task.id = rd.get_new_id();
+  rd.post_task(std::move(task));
+
+  auto result = rd.next(should_stop ? should_stop : []() { return false; });
+  if (!result || result->is_error()) {
+    return false;
+  }
+  auto *res = dynamic_cast<server_task_result_slot_save_load *>(result.get());
+  if (res) {
+    n_tokens = res->n_tokens;
+    t_ms = res->t_ms;
+  }
+  return true;
+}
+
+void slot_pool::release(int id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  busy_[id] = false;
+}
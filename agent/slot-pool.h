@@ -0,0 +1,88 @@
+#pragma once
+
+#include "server-task.h"
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct server_context;
+
+// Server slots shared by the agent loops of one process (server sessions and
+// their subagents)
+//
+// A slot keeps the KV cache of the last prompt it processed. Sending every
+// completion of a loop to the same slot lets the next iteration reuse its
+// whole history instead of re-prefilling it after another session took the
+// slot. A loop asks for its preferred slot; if another completion is
+// running there it gets the idle slot that was used least recently (the
+// coldest cache), and if none is idle the server picks one as before.
+class slot_pool {
+public:
+  // Claim on one slot for the duration of a completion
+  class lease {
+  public:
+    lease() = default;
+    lease(slot_pool *pool, int id, uint64_t epoch)
+        : pool_(pool), id_(id), epoch_(epoch) {}
+    lease(lease &&other) noexcept;
+    lease &operator=(lease &&other) noexcept;
+    lease(const lease &) = delete;
+    lease &operator=(const lease &) = delete;
+    ~lease() { release(); }
+
+    // Slot id for server_task::id_slot, -1 = any slot
+    int id() const { return id_; }
+
+    // Stamp of this use of the slot, see holds()
+    uint64_t epoch() const { return epoch_; }
+
+    void release();
+
+  private:
+    slot_pool *pool_ = nullptr;
+    int id_ = -1;
+    uint64_t epoch_ = 0;
+  };
+
+  explicit slot_pool(int n_slots);
+
+  // preferred: slot the caller used last, -1 if none
+  lease acquire(int preferred);
+
+  // Claim slot id only if it is idle and nobody used it since the lease
+  // stamped epoch (e.g. to save the KV cache it still holds)
+  lease acquire_exact(int id, uint64_t epoch);
+
+  // True if slot id was last used by the lease stamped epoch
+  bool holds(int id, uint64_t epoch);
+
+  // The slot's cache was dropped; make it the first choice for fallbacks
+  void forget(int id);
+
+  // Key of the prompt prefix the slot's cache starts with (see
+  // kv_prefix_cache), 0 = unknown
+  void set_prefix(int id, uint64_t key);
+  uint64_t prefix(int id);
+
+  int size() const { return static_cast<int>(busy_.size()); }
+
+private:
+  std::mutex mutex_;
+  std::vector<bool> busy_;
+  std::vector<uint64_t> last_used_; // Epoch of the last lease, 0 = empty
+  std::vector<uint64_t> prefix_;
+  uint64_t clock_ = 0;
+
+  void release(int id);
+};
+
+// Save, restore or erase the KV state of a slot (SLOT_SAVE/RESTORE/ERASE)
+// and wait for the server. path is the state file (unused for erase).
+// n_tokens and t_ms receive the server's figures for save/restore.
+bool slot_file_action(server_context &server_ctx, server_task_type type,
+                      int slot, const std::string &path, size_t &n_tokens,
+                      double &t_ms,
+                      const std::function<bool()> &should_stop = nullptr);
@@ -198,8 +198,13 @@ subagent_result subagent_runner::run_internal(const subagent_params &params,
                       type_config.allowed_tools, bash_patterns, system_prompt,
                       new_depth, tool_callback);
 
-  // Run the subagent
-  agent_loop_result loop_result = subagent.run(params.prompt);
+  // Run the subagent (its spans nest under the parent's task call)
+  agent_loop_result loop_result;
+  {
+    trace_span span("subagent:" + type_config.name, "subagent",
+                    {{"depth", new_depth}});
+    loop_result = subagent.run(params.prompt);
+  }
 
   auto end_time = std::chrono::steady_clock::now();
   auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
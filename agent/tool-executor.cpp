@@ -0,0 +1,353 @@
+#include "tool-executor.h"
+#include "turn-trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+static std::string normalize_path(const std::string &path,
+                                  const std::string &working_dir) {
+  fs::path p(path);
+  if (p.is_relative()) {
+    p = fs::path(working_dir) / p;
+  }
+  return p.lexically_normal().string();
+}
+
+tool_access tool_access::of(const tool_def &tool, const json &args,
+                            const std::string &working_dir) {
+  tool_access access;
+  access.group = tool.concurrency_group;
+
+  if (tool.name == "write" || tool.name == "edit") {
+    std::string file_path = args.value("file_path", "");
+    access.kind = file_path.empty() ? EXCLUSIVE : WRITE;
+    if (!file_path.empty()) {
+      access.path = normalize_path(file_path, working_dir);
+    }
+  } else if (tool.read_only) {
+    access.kind = READ;
+    std::string file_path = args.value("file_path", "");
+    if (!file_path.empty()) {
+      access.path = normalize_path(file_path, working_dir);
+    }
+  }
+  return access;
+}
+
+bool tool_access::conflicts_with(const tool_access &later) const {
+  if (kind == EXCLUSIVE || later.kind == EXCLUSIVE) {
+    return true;
+  }
+  if (!group.empty() && group == later.group) {
+    return true;
+  }
+  if (kind == READ && later.kind == READ) {
+    return false;
+  }
+  // At least one side writes: conflict on the same file, or if either side
+  // has no single path (e.g. glob scans a directory tree)
+  return path.empty() || later.path.empty() || path == later.path;
+}
+
+tool_worker_pool &tool_worker_pool::instance() {
+  static tool_worker_pool pool(
+      std::clamp<size_t>(std::thread::hardware_concurrency(), 2, 8));
+  return pool;
+}
+
+// How long an idle long worker waits for a job before it stops
+static constexpr std::chrono::seconds LONG_IDLE_TIMEOUT{30};
+
+tool_worker_pool::tool_worker_pool(size_t n_threads)
+    : max_long_(4 * n_threads) {
+  for (size_t i = 0; i < n_threads; i++) {
+    workers_.emplace_back([this]() { work(); });
+  }
+}
+
+tool_worker_pool::~tool_worker_pool() {
+  std::map<std::thread::id, std::thread> long_workers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    long_workers.swap(long_workers_);
+  }
+  cv_.notify_all();
+  long_cv_.notify_all();
+  for (auto &w : workers_) {
+    w.join();
+  }
+  for (auto &[id, w] : long_workers) {
+    w.join();
+  }
+}
+
+void tool_worker_pool::work() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    job();
+  }
+}
+
+void tool_worker_pool::work_long() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    n_long_idle_++;
+    long_cv_.wait_for(lock, LONG_IDLE_TIMEOUT,
+                      [this] { return stopping_ || !long_queue_.empty(); });
+    n_long_idle_--;
+    if (long_queue_.empty()) {
+      if (!stopping_) {
+        long_exited_.push_back(std::this_thread::get_id());
+      }
+      return;
+    }
+    std::function<void()> job = std::move(long_queue_.front());
+    long_queue_.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+}
+
+// The job's spans go to the submitter's trace, on a row of their own
+static std::function<void()> traced(std::function<void()> job) {
+  if (auto trace = turn_trace::current()) {
+    return [trace, job = std::move(job)]() {
+      trace_scope scope(trace, trace->new_lane("tools"));
+      job();
+    };
+  }
+  return job;
+}
+
+void tool_worker_pool::submit(std::function<void()> job) {
+  job = traced(std::move(job));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(job));
+  }
+  cv_.notify_one();
+}
+
+void tool_worker_pool::submit_long(std::function<void()> job) {
+  job = traced(std::move(job));
+  std::vector<std::thread> exited;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::thread::id id : long_exited_) {
+      auto it = long_workers_.find(id);
+      exited.push_back(std::move(it->second));
+      long_workers_.erase(it);
+    }
+    long_exited_.clear();
+
+    long_queue_.push_back(std::move(job));
+    if (long_queue_.size() > n_long_idle_ &&
+        long_workers_.size() < max_long_ && !stopping_) {
+      std::thread worker([this]() { work_long(); });
+      long_workers_.emplace(worker.get_id(), std::move(worker));
+    }
+  }
+  long_cv_.notify_one();
+  // Already returned or about to, without the lock
+  for (auto &w : exited) {
+    w.join();
+  }
+}
+
+void tool_worker_pool::set_long_limit(size_t n) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_long_ = std::max<size_t>(1, n);
+}
+
+std::vector<tool_result>
+run_tool_batch(const std::vector<tool_access> &accesses,
+               const std::function<tool_result(size_t)> &run) {
+  const size_t n = accesses.size();
+  std::vector<tool_result> results(n);
+  if (n == 0) {
+    return results;
+  }
+
+  // Build the dependency graph (earlier conflicting call -> later call)
+  std::vector<std::vector<size_t>> dependents(n);
+  std::vector<size_t> n_pending(n, 0);
+  bool all_serial = true;
+  for (size_t j = 1; j < n; j++) {
+    for (size_t i = 0; i < j; i++) {
+      if (accesses[i].conflicts_with(accesses[j])) {
+        dependents[i].push_back(j);
+        n_pending[j]++;
+      }
+    }
+    all_serial = all_serial && n_pending[j] == j;
+  }
+
+  // Nothing to overlap, run inline on the calling thread
+  if (all_serial) {
+    for (size_t i = 0; i < n; i++) {
+      results[i] = run(i);
+    }
+    return results;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<size_t> finished;
+
+  auto execute = [&](size_t i) {
+    tool_result res;
+    try {
+      res = run(i);
+    } catch (const std::exception &e) {
+      res = {false, "", std::string("Tool execution error: ") + e.what()};
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    results[i] = std::move(res);
+    finished.push_back(i);
+    cv.notify_one();
+  };
+
+  // Exclusive calls (bash, subagents) run alone anyway; keep them on the
+  // calling thread so a subagent's own tool batch never waits for a pool
+  // worker held by its parent
+  auto &pool = tool_worker_pool::instance();
+  auto submit = [&](size_t i) {
+    if (accesses[i].kind == tool_access::EXCLUSIVE) {
+      execute(i);
+    } else {
+      pool.submit([&execute, i]() { execute(i); });
+    }
+  };
+
+  for (size_t i = 0; i < n; i++) {
+    if (n_pending[i] == 0) {
+      submit(i);
+    }
+  }
+
+  // Release dependents as their prerequisites finish
+  for (size_t n_done = 0; n_done < n; n_done++) {
+    size_t done;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return !finished.empty(); });
+      done = finished.front();
+      finished.pop_front();
+    }
+    for (size_t j : dependents[done]) {
+      if (--n_pending[j] == 0) {
+        submit(j);
+      }
+    }
+  }
+  return results;
+}
+
+namespace {
+
+struct async_batch {
+  std::function<tool_result(size_t)> run;
+  std::function<void(std::vector<tool_result>)> done;
+  std::vector<bool> exclusive;
+  std::vector<std::vector<size_t>> dependents;
+  std::vector<size_t> n_pending;
+  std::vector<tool_result> results;
+  size_t n_left = 0;
+  std::mutex mutex;
+};
+
+void submit_async(const std::shared_ptr<async_batch> &batch, size_t i) {
+  auto job = [batch, i]() {
+    tool_result res;
+    try {
+      res = batch->run(i);
+    } catch (const std::exception &e) {
+      res = {false, "", std::string("Tool execution error: ") + e.what()};
+    }
+
+    std::vector<size_t> ready;
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(batch->mutex);
+      batch->results[i] = std::move(res);
+      for (size_t j : batch->dependents[i]) {
+        if (--batch->n_pending[j] == 0) {
+          ready.push_back(j);
+        }
+      }
+      last = --batch->n_left == 0;
+    }
+    for (size_t j : ready) {
+      submit_async(batch, j);
+    }
+    if (last) {
+      batch->done(std::move(batch->results));
+    }
+  };
+  // Exclusive calls may run for minutes (bash); keep them off the shared
+  // workers that the short calls of every session go through
+  auto &pool = tool_worker_pool::instance();
+  if (batch->exclusive[i]) {
+    pool.submit_long(std::move(job));
+  } else {
+    pool.submit(std::move(job));
+  }
+}
+
+} // namespace
+
+void run_tool_batch_async(
+    const std::vector<tool_access> &accesses,
+    std::function<tool_result(size_t)> run,
+    std::function<void(std::vector<tool_result>)> done) {
+  const size_t n = accesses.size();
+  if (n == 0) {
+    done({});
+    return;
+  }
+
+  auto batch = std::make_shared<async_batch>();
+  batch->run = std::move(run);
+  batch->done = std::move(done);
+  batch->exclusive.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    batch->exclusive[i] = accesses[i].kind == tool_access::EXCLUSIVE;
+  }
+  batch->dependents.resize(n);
+  batch->n_pending.assign(n, 0);
+  batch->results.resize(n);
+  batch->n_left = n;
+  for (size_t j = 1; j < n; j++) {
+    for (size_t i = 0; i < j; i++) {
+      if (accesses[i].conflicts_with(accesses[j])) {
+        batch->dependents[i].push_back(j);
+        batch->n_pending[j]++;
+      }
+    }
+  }
+
+  // Collect the roots first, a fast call may already release dependents
+  std::vector<size_t> roots;
+  for (size_t i = 0; i < n; i++) {
+    if (batch->n_pending[i] == 0) {
+      roots.push_back(i);
+    }
+  }
+  for (size_t i : roots) {
+    submit_async(batch, i);
+  }
+}
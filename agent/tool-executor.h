@@ -0,0 +1,95 @@
+#pragma once
+
+#include "tool-registry.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How a tool call touches the workspace, used to decide which calls of one
+// assistant turn may run at the same time
+struct tool_access {
+  enum access_kind {
+    READ,      // No side effects
+    WRITE,     // Modifies `path`
+    EXCLUSIVE, // Unknown side effects (bash, subagents, ...)
+  };
+
+  access_kind kind = EXCLUSIVE;
+  std::string path;  // Normalized absolute path (empty = whole workspace)
+  std::string group; // Tool concurrency group (e.g. one MCP connection)
+
+  // Derive the access of a call from the tool definition and its arguments
+  static tool_access of(const tool_def &tool, const json &args,
+                        const std::string &working_dir);
+
+  // True if `later` must wait for this (earlier) call
+  bool conflicts_with(const tool_access &later) const;
+};
+
+// Process-wide worker pool for tool calls. Short calls (reads, file
+// writes) share a fixed set of workers. Long ones (bash, subagents) get
+// workers of their own, so they never hold up the short calls of other
+// sessions: started on demand up to a limit (further calls queue), and
+// stopped again after a while without work.
+class tool_worker_pool {
+public:
+  static tool_worker_pool &instance();
+
+  ~tool_worker_pool();
+
+  void submit(std::function<void()> job);
+
+  // Run a job that may take long on a worker outside the fixed set
+  void submit_long(std::function<void()> job);
+
+  // Most long jobs running at once (default: 4x the fixed workers)
+  void set_long_limit(size_t n);
+
+  size_t size() const { return workers_.size(); }
+
+private:
+  explicit tool_worker_pool(size_t n_threads);
+
+  void work();
+  void work_long();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> queue_;
+  std::condition_variable cv_;
+
+  // Long workers by thread id; idle ones that timed out list themselves in
+  // long_exited_ and are joined by the next submit_long()
+  std::map<std::thread::id, std::thread> long_workers_;
+  std::vector<std::thread::id> long_exited_;
+  std::deque<std::function<void()>> long_queue_;
+  std::condition_variable long_cv_;
+  size_t n_long_idle_ = 0;
+  size_t max_long_;
+
+  std::mutex mutex_;
+  bool stopping_ = false;
+};
+
+// Run a batch of tool calls on the worker pool. Call i waits for every
+// earlier call it conflicts with; independent calls run concurrently.
+// Results are returned in call order. run(i) must be safe to call from a
+// worker thread.
+std::vector<tool_result>
+run_tool_batch(const std::vector<tool_access> &accesses,
+               const std::function<tool_result(size_t)> &run);
+
+// Same ordering as run_tool_batch, but every call runs on the worker pool
+// (exclusive ones with submit_long()) and the caller does not wait. done(results) is
+// called on the worker that finishes the last call. run(i) must stay valid
+// until then, and must not start tool batches of its own (no subagents).
+void run_tool_batch_async(
+    const std::vector<tool_access> &accesses,
+    std::function<tool_result(size_t)> run,
+    std::function<void(std::vector<tool_result>)> done);
@@ -8,47 +8,84 @@ tool_registry &tool_registry::instance() {
   return instance;
 }
 
+std::shared_ptr<const tool_prompt_section> tool_schema_snapshot::get_section(
+    const std::string &key,
+    const std::function<tool_prompt_section()> &render) const {
+  {
+    std::lock_guard<std::mutex> lock(sections_mutex_);
+    auto it = sections_.find(key);
+    if (it != sections_.end()) {
+      return it->second;
+    }
+  }
+
+  // Render outside the lock; concurrent first uses may render twice
+  auto section = std::make_shared<const tool_prompt_section>(render());
+
+  std::lock_guard<std::mutex> lock(sections_mutex_);
+  return sections_.emplace(key, section).first->second;
+}
+
 void tool_registry::register_tool(const tool_def &tool) {
-  tools_[tool.name] = tool;
+  std::lock_guard<std::mutex> lock(mutex_);
+  tools_[tool.name] = std::make_shared<const tool_def>(tool);
+  snapshots_.clear();
+  version_++;
 }
 
-const tool_def *tool_registry::get_tool(const std::string &name) const {
+tool_schema_snapshot_ptr
+tool_registry::snapshot(const std::set<std::string> &allowed_tools) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = snapshots_.find(allowed_tools);
+  if (it != snapshots_.end()) {
+    return it->second;
+  }
+
+  auto snap = std::make_shared<tool_schema_snapshot>();
+  snap->version = version_.load();
+  snap->allowed_tools = allowed_tools;
+  for (const auto &[name, tool] : tools_) {
+    if (allowed_tools.empty() || allowed_tools.count(name)) {
+      snap->chat_tools.push_back(tool->to_chat_tool());
+    }
+  }
+  snapshots_[allowed_tools] = snap;
+  return snap;
+}
+
+tool_def_ptr tool_registry::get_tool(const std::string &name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto it = tools_.find(name);
   if (it != tools_.end()) {
-    return &it->second;
+    return it->second;
   }
   return nullptr;
 }
 
-std::vector<const tool_def*> tool_registry::get_all_tools() const {
-  std::vector<const tool_def*> all_tools;
+std::vector<tool_def_ptr> tool_registry::get_all_tools() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<tool_def_ptr> all_tools;
   for (const auto &[name, tool] : tools_) {
-    all_tools.push_back(&tool);
+    all_tools.push_back(tool);
   }
   return all_tools;
 }
 
 std::vector<common_chat_tool> tool_registry::to_chat_tools() const {
-  std::vector<common_chat_tool> result;
-  for (const auto & [name, tool] : tools_) {
-    result.push_back(tool.to_chat_tool());
-  }
-  return result;
+  return snapshot()->chat_tools;
 }
 
 std::vector<common_chat_tool> tool_registry::to_chat_tools_filtered(
     const std::set<std::string> &allowed_tools) const {
-  std::vector<common_chat_tool> result;
-  for (const auto &[name, tool] : tools_) {
-    if (allowed_tools.count(name)) {
-      result.push_back(tool.to_chat_tool());
-    }
+  if (allowed_tools.empty()) {
+    return {};
   }
-  return result;
+  return snapshot(allowed_tools)->chat_tools;
 }
+
 tool_result tool_registry::execute(const std::string &name, const json &args,
                        const tool_context &ctx) const {
-  const tool_def *tool = get_tool(name);
+  tool_def_ptr tool = get_tool(name);
   if (!tool) {
     return {false, "", "Unknown tool: " + name};
   }
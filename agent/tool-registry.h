@@ -6,8 +6,11 @@
 #include <atomic>
 #include <nlohmann/json.hpp>
 
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
@@ -48,6 +51,10 @@ struct tool_def {
 
   std::function<tool_result(const json &, const tool_context &)> execute;
 
+  // Concurrency hints for parallel tool calls
+  bool read_only = false;        // No side effects, may overlap other calls
+  std::string concurrency_group = ""; // Calls sharing a group never overlap
+
   // Convert to common_chat_tool for llama.cpp infrastructure
   // common_chat_tool is "chat.h"
   common_chat_tool to_chat_tool() const {
@@ -55,20 +62,61 @@ struct tool_def {
   }
 };
 
+// Registered tools are immutable and shared, so a lookup stays valid while a
+// call runs even if the tool is registered again meanwhile
+using tool_def_ptr = std::shared_ptr<const tool_def>;
+
+// Tool definitions as rendered by one chat template
+struct tool_prompt_section {
+  std::string text;       // Minimal conversation rendered with the tools
+  std::string gen_suffix; // Generation prompt appended by the template
+  int32_t n_tokens = 0;   // Tokens the tool definitions add to a prompt
+};
+
+// Immutable view of the registry for one allowed-tool set. A new snapshot is
+// published whenever a tool is registered, so holders can reuse it (and
+// everything derived from it) while version matches.
+class tool_schema_snapshot {
+public:
+  uint64_t version = 0;                 // Registry version it was built from
+  std::set<std::string> allowed_tools;  // Empty = all tools
+  std::vector<common_chat_tool> chat_tools;
+
+  // Rendered tool section for a template/options key, rendered with
+  // `render` on first use and shared by every session afterwards
+  std::shared_ptr<const tool_prompt_section>
+  get_section(const std::string &key,
+              const std::function<tool_prompt_section()> &render) const;
+
+private:
+  mutable std::mutex sections_mutex_;
+  mutable std::map<std::string, std::shared_ptr<const tool_prompt_section>>
+      sections_;
+};
+
+using tool_schema_snapshot_ptr = std::shared_ptr<const tool_schema_snapshot>;
+
 class tool_registry {
 public:
   static tool_registry &instance();
 
-  // Register a tool
+  // Register a tool (replaces a tool with the same name)
   void register_tool(const tool_def &tool);
 
+  // Incremented on every registration
+  uint64_t version() const { return version_.load(); }
+
+  // Current snapshot for an allowed-tool set (empty = all tools)
+  tool_schema_snapshot_ptr
+  snapshot(const std::set<std::string> &allowed_tools = {}) const;
+
   // Get tool by name
-  const tool_def *get_tool(const std::string &name) const;
+  tool_def_ptr get_tool(const std::string &name) const;
 
   // Get all registered tools
-  std::vector<const tool_def *> get_all_tools() const;
+  std::vector<tool_def_ptr> get_all_tools() const;
 
-  // Convert all tools to common_chat_tool format
+  // Convert all tools to common_chat_tool format (copy of snapshot()->chat_tools)
   std::vector<common_chat_tool> to_chat_tools() const;
 
   // Convert filtered subset of tools to common_chat_tool format
@@ -86,7 +134,12 @@ public:
 
 private:
   tool_registry() = default;
-  std::map<std::string, tool_def> tools_;
+  std::map<std::string, tool_def_ptr> tools_;
+
+  mutable std::mutex mutex_;
+  std::atomic<uint64_t> version_{1};
+  // Snapshots built for the current version, by allowed-tool set
+  mutable std::map<std::set<std::string>, tool_schema_snapshot_ptr> snapshots_;
 };
 
 // Helper macro for tool auto-registration
@@ -0,0 +1,214 @@
+#include "tool-result-cache.h"
+
+#include <filesystem>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+file_identity file_identity::of(const std::string &path) {
+  file_identity id;
+#ifndef _WIN32
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) {
+    return id;
+  }
+  id.exists = true;
+  id.dev = static_cast<uint64_t>(st.st_dev);
+  id.ino = static_cast<uint64_t>(st.st_ino);
+  id.size = static_cast<uint64_t>(st.st_size);
+#if defined(__APPLE__)
+  id.mtime_ns = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 +
+                st.st_mtimespec.tv_nsec;
+#else
+  id.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                st.st_mtim.tv_nsec;
+#endif
+#else
+  std::error_code ec;
+  auto status = fs::status(path, ec);
+  if (ec || !fs::exists(status)) {
+    return id;
+  }
+  id.exists = true;
+  if (fs::is_regular_file(status)) {
+    id.size = static_cast<uint64_t>(fs::file_size(path, ec));
+  }
+  id.mtime_ns = static_cast<int64_t>(
+      fs::last_write_time(path, ec).time_since_epoch().count());
+#endif
+  return id;
+}
+
+tool_result_cache &tool_result_cache::instance() {
+  static tool_result_cache cache;
+  return cache;
+}
+
+std::string tool_result_cache::normalize_path(const std::string &path,
+                                              const std::string &working_dir) {
+  fs::path p(path);
+  if (p.is_relative()) {
+    p = fs::path(working_dir) / p;
+  }
+  std::string s = p.lexically_normal().string();
+  while (s.size() > 1 && (s.back() == '/' || s.back() == '\\')) {
+    s.pop_back();
+  }
+  return s;
+}
+
+void tool_result_cache::set_budget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ = bytes;
+  while (!lru_.empty() && stats_.bytes > budget_) {
+    erase(entries_.find(lru_.back()));
+    stats_.evictions++;
+  }
+}
+
+bool tool_result_cache::enabled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return budget_ > 0;
+}
+
+std::optional<tool_result> tool_result_cache::lookup(const std::string &key) {
+  std::vector<dependency> deps;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (budget_ == 0) {
+      return std::nullopt;
+    }
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      stats_.misses++;
+      return std::nullopt;
+    }
+    deps = it->second.deps;
+  }
+
+  // stat() outside the lock, other sessions keep going meanwhile
+  bool fresh = true;
+  for (const auto &dep : deps) {
+    if (file_identity::of(dep.path) != dep.id) {
+      fresh = false;
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    stats_.misses++; // Invalidated while we were checking
+    return std::nullopt;
+  }
+  if (!fresh) {
+    erase(it);
+    stats_.stale++;
+    stats_.misses++;
+    return std::nullopt;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  stats_.hits++;
+  return it->second.result;
+}
+
+void tool_result_cache::store(const std::string &key, const tool_result &result,
+                              std::vector<dependency> deps) {
+  if (!result.success || deps.empty()) {
+    return;
+  }
+  size_t bytes = key.size() + result.output.size() + result.error.size();
+  for (const auto &dep : deps) {
+    bytes += dep.path.size() + sizeof(dependency);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (bytes > budget_ / 4) {
+    return; // Not worth pushing out everything else
+  }
+  auto old = entries_.find(key);
+  if (old != entries_.end()) {
+    erase(old);
+  }
+
+  lru_.push_front(key);
+  entry &e = entries_[key];
+  e.result = result;
+  e.deps = std::move(deps);
+  e.bytes = bytes;
+  e.lru = lru_.begin();
+  for (const auto &dep : e.deps) {
+    by_path_.emplace(dep.path, key);
+  }
+  stats_.bytes += bytes;
+  stats_.entries = entries_.size();
+
+  while (stats_.bytes > budget_ && lru_.size() > 1) {
+    erase(entries_.find(lru_.back()));
+    stats_.evictions++;
+  }
+}
+
+void tool_result_cache::invalidate(const std::string &path) {
+  // A written file changes its own reads and the listings of its directory
+  std::vector<std::string> paths = {path};
+  fs::path parent = fs::path(path).parent_path();
+  if (!parent.empty() && parent.string() != path) {
+    paths.push_back(parent.string());
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &p : paths) {
+    auto range = by_path_.equal_range(p);
+    std::vector<std::string> keys;
+    for (auto it = range.first; it != range.second; ++it) {
+      keys.push_back(it->second);
+    }
+    for (const auto &key : keys) {
+      auto it = entries_.find(key);
+      if (it != entries_.end()) {
+        erase(it);
+        stats_.invalidations++;
+      }
+    }
+  }
+}
+
+void tool_result_cache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  lru_.clear();
+  by_path_.clear();
+  stats_.bytes = 0;
+  stats_.entries = 0;
+}
+
+tool_cache_stats tool_result_cache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tool_cache_stats stats = stats_;
+  stats.budget_bytes = budget_;
+  return stats;
+}
+
+void tool_result_cache::erase(
+    std::unordered_map<std::string, entry>::iterator it) {
+  if (it == entries_.end()) {
+    return;
+  }
+  for (const auto &dep : it->second.deps) {
+    auto range = by_path_.equal_range(dep.path);
+    for (auto p = range.first; p != range.second; ++p) {
+      if (p->second == it->first) {
+        by_path_.erase(p);
+        break;
+      }
+    }
+  }
+  lru_.erase(it->second.lru);
+  stats_.bytes -= it->second.bytes;
+  entries_.erase(it);
+  stats_.entries = entries_.size();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "tool-registry.h"
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// What a file or directory looked like when a result was computed
+struct file_identity {
+  bool exists = false;
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+
+  static file_identity of(const std::string &path);
+
+  bool operator==(const file_identity &other) const {
+    return exists == other.exists && dev == other.dev && ino == other.ino &&
+           size == other.size && mtime_ns == other.mtime_ns;
+  }
+  bool operator!=(const file_identity &other) const { return !(*this == other); }
+};
+
+struct tool_cache_stats {
+  int64_t hits = 0;
+  int64_t misses = 0;        // Not cached (or stale, see below)
+  int64_t stale = 0;         // Cached but a file changed since
+  int64_t invalidations = 0; // Entries dropped by write/edit
+  int64_t evictions = 0;     // Entries dropped for the byte budget
+  uint64_t entries = 0;
+  uint64_t bytes = 0;
+  uint64_t budget_bytes = 0;
+};
+
+// Process-wide cache of read-only tool results (read, glob)
+//
+// Entries are keyed by the tool name and its normalized arguments and carry
+// the identity (inode, size, mtime) of every file and directory the output
+// was built from. A lookup re-checks those identities, so edits made by
+// anything outside the agent are noticed; write/edit calls in any session
+// drop the affected entries right away. Least recently used entries go first
+// once the byte budget is exceeded.
+class tool_result_cache {
+public:
+  struct dependency {
+    std::string path; // Normalized absolute path
+    file_identity id;
+  };
+
+  static tool_result_cache &instance();
+
+  // 0 disables the cache (and drops every entry)
+  void set_budget(size_t bytes);
+  bool enabled() const;
+
+  // Cached result for key, if all of its dependencies are unchanged
+  std::optional<tool_result> lookup(const std::string &key);
+
+  // Remember a result; deps must be captured before the output was built
+  void store(const std::string &key, const tool_result &result,
+             std::vector<dependency> deps);
+
+  // path (a file) was modified: drop results that depend on it or list its
+  // directory
+  void invalidate(const std::string &path);
+
+  void clear();
+
+  tool_cache_stats stats() const;
+
+  static std::string normalize_path(const std::string &path,
+                                    const std::string &working_dir);
+
+private:
+  tool_result_cache() = default;
+
+  struct entry {
+    tool_result result;
+    std::vector<dependency> deps;
+    size_t bytes = 0;
+    std::list<std::string>::iterator lru; // Position in lru_
+  };
+
+  mutable std::mutex mutex_;
+  size_t budget_ = 64ull << 20;
+  std::unordered_map<std::string, entry> entries_;
+  std::list<std::string> lru_; // Most recently used first
+  std::multimap<std::string, std::string> by_path_; // Dependency -> key
+  tool_cache_stats stats_;
+
+  // Drop one entry (mutex_ held)
+  void erase(std::unordered_map<std::string, entry>::iterator it);
+};
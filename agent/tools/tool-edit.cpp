@@ -1,5 +1,6 @@
 #include "../permission.h"
 #include "../tool-registry.h"
+#include "../tool-result-cache.h"
 
 #include <algorithm>
 #include <filesystem>
@@ -153,7 +154,10 @@ static tool_result edit_execute(const json &args, const tool_context &ctx) {
   }
 
   // Write file
-  if (!write_file(path, new_content)) {
+  bool written = write_file(path, new_content);
+  tool_result_cache::instance().invalidate(
+      tool_result_cache::normalize_path(path.string(), ctx.working_dir));
+  if (!written) {
     return {false, "", "Failed to write changes to file"};
   }
 
@@ -1,4 +1,5 @@
 #include "../tool-registry.h"
+#include "../tool-result-cache.h"
 #include "server-common.h"
 
 #include <cstddef>
@@ -91,6 +92,21 @@ static tool_result glob_execute(const json &args, const tool_context &ctx) {
     return {false, "", "Not a directory: " + base_path.string()};
   }
 
+  // Same pattern over an unchanged tree (any session): reuse the listing.
+  // Every directory walked is a dependency, so added or removed files show.
+  auto &cache = tool_result_cache::instance();
+  std::string key;
+  std::vector<tool_result_cache::dependency> deps;
+  if (cache.enabled()) {
+    std::string normalized = tool_result_cache::normalize_path(base_path.string(), ctx.working_dir);
+    key = "glob\n" + normalized + "\n" + pattern;
+    if (auto cached = cache.lookup(key)) {
+      return *cached;
+    }
+    deps.push_back({normalized, file_identity::of(normalized)});
+  }
+  const size_t max_deps = 4096;
+
   // Convert glob pattern to regex
   std::string regex_pattern = glob_to_regex(pattern);
   std::regex pattern_regex;
@@ -106,6 +122,14 @@ static tool_result glob_execute(const json &args, const tool_context &ctx) {
 
   try {
     for (const auto &entry : fs::recursive_directory_iterator(base_path, fs::directory_options::skip_permission_denied)) {
+      if (!key.empty() && entry.is_directory()) {
+        if (deps.size() < max_deps) {
+          std::string dir = entry.path().lexically_normal().string();
+          deps.push_back({dir, file_identity::of(dir)});
+        } else {
+          key.clear(); // Too large a tree to check cheaply
+        }
+      }
       if (!entry.is_regular_file())
         continue;
 
@@ -122,6 +146,11 @@ static tool_result glob_execute(const json &args, const tool_context &ctx) {
 
       if (std::regex_match(to_match, pattern_regex)) {
         matches.emplace_back(entry.path(), entry.last_write_time());
+        if (!key.empty()) {
+          // Results are ordered by mtime, so edits to matches count too
+          std::string file = entry.path().lexically_normal().string();
+          deps.push_back({file, file_identity::of(file)});
+        }
         if ((int)matches.size() >= limit) {
           break;
         }
@@ -129,6 +158,7 @@ static tool_result glob_execute(const json &args, const tool_context &ctx) {
     }
   } catch (const fs::filesystem_error &e) {
     // Continue with what we have
+    key.clear();
   }
 
   // Sort by modigication time (most recent first)
@@ -152,7 +182,11 @@ static tool_result glob_execute(const json &args, const tool_context &ctx) {
       output << "\n[ " << matches.size() << " file(s) found.]";
     }
   }
-  return {true, output.str(), ""};
+  tool_result result = {true, output.str(), ""};
+  if (!key.empty()) {
+    cache.store(key, result, std::move(deps));
+  }
+  return result;
 }
 
 static tool_def glob_tool = {
@@ -174,7 +208,8 @@ static tool_def glob_tool = {
         },
         "required": ["pattern"]
     })json",
-    glob_execute
+    glob_execute,
+    true // read_only
 };
 
 REGISTER_TOOL(glob, glob_tool);
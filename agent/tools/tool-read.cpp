@@ -1,5 +1,6 @@
 #include "../tool-registry.h"
 #include "../permission.h"
+#include "../tool-result-cache.h"
 
 #include <cstddef>
 #include <fstream>
@@ -44,6 +45,19 @@ static tool_result read_execute(const json &args, const tool_context &ctx) {
     return {false, "" , "Cannot read sensitive file (contains credentials/secrets): " + path.string()};
   }
 
+  // Same file unchanged since an earlier read (any session): reuse it
+  auto &cache = tool_result_cache::instance();
+  std::string key;
+  std::vector<tool_result_cache::dependency> deps;
+  if (cache.enabled()) {
+    std::string normalized = tool_result_cache::normalize_path(path.string(), ctx.working_dir);
+    key = "read\n" + normalized + "\n" + std::to_string(offset) + "\n" + std::to_string(limit);
+    if (auto cached = cache.lookup(key)) {
+      return *cached;
+    }
+    deps.push_back({normalized, file_identity::of(normalized)});
+  }
+
   // Open file
   std::ifstream file(path);
   if (!file.is_open()) {
@@ -89,7 +103,11 @@ static tool_result read_execute(const json &args, const tool_context &ctx) {
       output << " Use offset=" << (offset + lines.size()) << " to read more.";
     }
   }
-  return {true, output.str(), ""};
+  tool_result result = {true, output.str(), ""};
+  if (!key.empty()) {
+    cache.store(key, result, std::move(deps));
+  }
+  return result;
 }
 
 static tool_def read_tool = {
@@ -114,6 +132,7 @@ static tool_def read_tool = {
         },
         "required": ["file_path"]
     })json",
-    read_execute};
+    read_execute,
+    true}; // read_only
 
 REGISTER_TOOL(read, read_tool);
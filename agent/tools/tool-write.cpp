@@ -1,5 +1,6 @@
 #include "../tool-registry.h"
 #include "../permission.h"
+#include "../tool-result-cache.h"
 
 #include <fstream>
 #include <filesystem>
@@ -45,6 +46,8 @@ static tool_result write_execute(const json &args, const tool_context &ctx) {
   }
   file << content;
   file.close();
+  tool_result_cache::instance().invalidate(
+      tool_result_cache::normalize_path(path.string(), ctx.working_dir));
 
   if (file.fail()) {
     return {false, "" , "Error writing to file: " + path.string()};
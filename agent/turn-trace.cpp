@@ -0,0 +1,92 @@
+#include "turn-trace.h"
+
+// Long sessions with many tool calls stay bounded
+static const size_t MAX_SPANS = 100000;
+
+static thread_local std::shared_ptr<turn_trace> tl_trace;
+static thread_local int tl_lane = 0;
+
+turn_trace::turn_trace() : origin_(clock::now()), lanes_({"turn"}) {}
+
+void turn_trace::add_span(const std::string &name, const char *category,
+                          int lane, clock::time_point start,
+                          clock::time_point end, json args) {
+  using us = std::chrono::duration<double, std::micro>;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (spans_.size() >= MAX_SPANS) {
+    dropped_++;
+    return;
+  }
+  spans_.push_back({name, category, lane, us(start - origin_).count(),
+                    us(end - start).count(), std::move(args)});
+}
+
+int turn_trace::new_lane(const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lanes_.push_back(name + " #" + std::to_string(lanes_.size()));
+  return static_cast<int>(lanes_.size()) - 1;
+}
+
+json turn_trace::to_json() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  json events = json::array();
+  for (size_t i = 0; i < lanes_.size(); i++) {
+    events.push_back({{"name", "thread_name"},
+                      {"ph", "M"},
+                      {"pid", 1},
+                      {"tid", i},
+                      {"args", {{"name", lanes_[i]}}}});
+  }
+  for (const auto &s : spans_) {
+    json e = {{"name", s.name}, {"cat", s.category}, {"ph", "X"},
+              {"ts", s.ts_us},  {"dur", s.dur_us},   {"pid", 1},
+              {"tid", s.lane}};
+    if (!s.args.is_null()) {
+      e["args"] = s.args;
+    }
+    events.push_back(std::move(e));
+  }
+  json out = {{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+  if (dropped_ > 0) {
+    out["otherData"] = {{"dropped_spans", dropped_}};
+  }
+  return out;
+}
+
+std::shared_ptr<turn_trace> turn_trace::current() { return tl_trace; }
+
+int turn_trace::current_lane() { return tl_lane; }
+
+trace_scope::trace_scope(std::shared_ptr<turn_trace> trace, int lane) {
+  if (!trace) {
+    return;
+  }
+  active_ = true;
+  prev_trace_ = std::move(tl_trace);
+  prev_lane_ = tl_lane;
+  tl_trace = std::move(trace);
+  tl_lane = lane;
+}
+
+trace_scope::~trace_scope() {
+  if (active_) {
+    tl_trace = std::move(prev_trace_);
+    tl_lane = prev_lane_;
+  }
+}
+
+trace_span::trace_span(std::string name, const char *category, json args)
+    : trace_(tl_trace), lane_(tl_lane), category_(category) {
+  if (trace_) {
+    name_ = std::move(name);
+    args_ = std::move(args);
+    start_ = turn_trace::clock::now();
+  }
+}
+
+trace_span::~trace_span() {
+  if (trace_) {
+    trace_->add_span(name_, category_, lane_, start_,
+                     turn_trace::clock::now(), std::move(args_));
+  }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "nlohmann/json.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+// Spans of one or more agent turns, exported as Chrome trace-event JSON
+// (chrome://tracing, Perfetto)
+//
+// Spans are recorded into the trace that is current on the recording
+// thread (see trace_scope), so code deep inside the loop needs no trace
+// argument. Jobs on the tool worker pool inherit the trace of the thread
+// that submitted them, each on a lane (trace row) of its own, and
+// subagents run inside their parent's tool call: their spans nest under it.
+class turn_trace {
+public:
+  using clock = std::chrono::steady_clock;
+
+  turn_trace();
+
+  // A finished span ("ph": "X") on lane
+  void add_span(const std::string &name, const char *category, int lane,
+                clock::time_point start, clock::time_point end,
+                json args = json());
+
+  // A new row, shown under name
+  int new_lane(const std::string &name);
+
+  // {"traceEvents": [...]}; timestamps are relative to the construction
+  json to_json() const;
+
+  // Trace and lane of the calling thread (null/0 outside any trace_scope)
+  static std::shared_ptr<turn_trace> current();
+  static int current_lane();
+
+private:
+  struct span {
+    std::string name;
+    const char *category;
+    int lane;
+    double ts_us;
+    double dur_us;
+    json args;
+  };
+
+  clock::time_point origin_;
+  mutable std::mutex mutex_;
+  std::vector<span> spans_;
+  std::vector<std::string> lanes_; // Row names, by lane id
+  size_t dropped_ = 0;             // Spans beyond the size limit
+};
+
+// Makes trace current on this thread until destroyed. A null trace keeps
+// whatever is current (e.g. a subagent loop inside a traced parent).
+class trace_scope {
+public:
+  explicit trace_scope(std::shared_ptr<turn_trace> trace, int lane = 0);
+  ~trace_scope();
+
+  trace_scope(const trace_scope &) = delete;
+  trace_scope &operator=(const trace_scope &) = delete;
+
+private:
+  bool active_ = false;
+  std::shared_ptr<turn_trace> prev_trace_;
+  int prev_lane_ = 0;
+};
+
+// Records its own lifetime into the current trace, if any
+class trace_span {
+public:
+  trace_span(std::string name, const char *category, json args = json());
+  ~trace_span();
+
+  trace_span(const trace_span &) = delete;
+  trace_span &operator=(const trace_span &) = delete;
+
+private:
+  std::shared_ptr<turn_trace> trace_;
+  int lane_ = 0;
+  std::string name_;
+  const char *category_;
+  json args_;
+  turn_trace::clock::time_point start_;
+};